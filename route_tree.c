@@ -1,15 +1,19 @@
-#include "route_tree.h"
+#include "route_tree_internal.h"
 #include <arpa/inet.h>
+#include <sched.h>
+#include <endian.h>
 
-static RouteTreeNodeV4 **v4_nodes_pool;
-static size_t v4_nodes_pool_total;
-static size_t v4_nodes_pool_front;
-static size_t v4_nodes_pool_rear;
+typedef struct {
+    // last epoch seen at a quiescent state, 0 if not registered
+    uint64_t epoch;
+} __attribute__((aligned(64))) RouteTreeRcuReader;
 
-static RouteTreeNodeV6 **v6_nodes_pool;
-static size_t v6_nodes_pool_total;
-static size_t v6_nodes_pool_front;
-static size_t v6_nodes_pool_rear;
+static RouteTreeRcuReader rcu_readers[ROUTE_TREE_RCU_MAX_READERS];
+static uint32_t rcu_readers_used;
+static uint64_t rcu_epoch = 1;
+
+// source of RouteTreeHeadNode generation, shared so a value is never seen twice
+static uint64_t route_generation;
 
 enum RouteTreeReturnStatue {
     ROUTE_TREE_FAILED,
@@ -23,7 +27,7 @@ enum RouteTreeReturnStatue {
  * Formula: total_nodes = 2 * max_routes - n_vrf
  * Ignore the number of VRF, so just minus 1.
  */
-#define N_ROUTES_TO_N_NODES(n_routes) (2 * (n_routes) - 1)
+#define N_ROUTES_TO_N_NODES(n_routes) ((n_routes) ? 2 * (n_routes) - 1 : 0)
 
 #define GET_BIT_U32(u32, bit) ((u32) >> (bit) & 0x1)
 #define GET_BIT_U64_PTR(u64_ptr, bit) \
@@ -32,26 +36,29 @@ enum RouteTreeReturnStatue {
 #define GET_KEY_32(u32, bit_offset, bit_len) \
                 (0 == bit_len ? \
                 0 : ((u32) >> (32-((bit_offset)+(bit_len)))) << (32-(bit_len)))
-#define GET_KEY_64(u64, bit_offset, bit_len) \
-                (0 == bit_len ? \
-                0 : ((u64) >> (64-((bit_offset)+(bit_len)))) << (64-(bit_len)))
 
 #define U8_PTR_TO_CPU_IPV6(ipv6, be_u8_ptr) \
                 do { \
-                    ipv6.u8[15] = be_u8_ptr[0]; ipv6.u8[14] = be_u8_ptr[1]; ipv6.u8[13] = be_u8_ptr[2]; ipv6.u8[12] = be_u8_ptr[3]; \
-                    ipv6.u8[11] = be_u8_ptr[4]; ipv6.u8[10] = be_u8_ptr[5]; ipv6.u8[9] = be_u8_ptr[6]; ipv6.u8[8] = be_u8_ptr[7]; \
-                    ipv6.u8[7] = be_u8_ptr[8]; ipv6.u8[6] = be_u8_ptr[9]; ipv6.u8[5] = be_u8_ptr[10]; ipv6.u8[4] = be_u8_ptr[11]; \
-                    ipv6.u8[3] = be_u8_ptr[12]; ipv6.u8[2] = be_u8_ptr[13]; ipv6.u8[1] = be_u8_ptr[14]; ipv6.u8[0] = be_u8_ptr[15]; \
+                    uint64_t _be_u64[2]; \
+                    memcpy(_be_u64, be_u8_ptr, sizeof(_be_u64)); \
+                    ipv6.u64[1] = be64toh(_be_u64[0]); \
+                    ipv6.u64[0] = be64toh(_be_u64[1]); \
                 } while (0);
 
-#define GET_PARENT_TARGET(node, head_node) \
-                ((node)->parent ? \
-                    ((node)->parent->next_bit_0 == (node) ? \
-                        (void*)(&(node)->parent->next_bit_0) : (void*)(&(node)->parent->next_bit_1)) \
-                    : \
-                    ((head_node)->first_bit_0 == (node) ? \
-                        (void*)(&(head_node)->first_bit_0) : (void*)(&(head_node)->first_bit_1)))
+// prefix of the default route
+static const RouteTreeIPV6 ipv6_any;
+
+
+static inline uint32_t clz_u128(RouteTreeU128 u128)
+{
+    const uint64_t hi = (uint64_t)(u128 >> 64);
+    const uint64_t lo = (uint64_t)u128;
 
+    if (hi) {
+        return __builtin_clzll(hi);
+    }
+    return lo ? 64 + __builtin_clzll(lo) : 128;
+}
 
 static void get_key_ipv6(const RouteTreeIPV6 *ipv6, uint8_t bit_offset, uint8_t bit_len, RouteTreeIPV6 *ipv6_key)
 {
@@ -60,106 +67,617 @@ static void get_key_ipv6(const RouteTreeIPV6 *ipv6, uint8_t bit_offset, uint8_t
         ipv6_key->u64[0] = 0;
     }
     else {
-        if (bit_offset >= 64) {
-            ipv6_key->u64[1] = GET_KEY_64(ipv6->u64[0], bit_offset - 64, bit_len);
-            ipv6_key->u64[0] = 0;
+        const RouteTreeU128 key = ipv6_to_u128(ipv6) << bit_offset;
+        u128_to_ipv6(key >> (128 - bit_len) << (128 - bit_len), ipv6_key);
+    }
+}
+
+// the bit_len bits of ipv6 from bit_offset equal key
+static inline bool match_key_ipv6(const RouteTreeIPV6 *key,
+                                const RouteTreeIPV6 *ipv6,
+                                uint8_t bit_offset,
+                                uint8_t bit_len)
+{
+    if (0 == bit_len) {
+        return true;
+    }
+
+    const RouteTreeU128 diff = (ipv6_to_u128(ipv6) << bit_offset) ^ ipv6_to_u128(key);
+    return 0 == (diff >> (128 - bit_len));
+}
+
+/*
+ * SSE kernels for the lookup paths, picked at run time when the CPU has
+ * SSSE3 and SSE4.1: pshufb byte-swaps the address, ptest checks the masked
+ * key. The writer paths always use the scalar kernels.
+ */
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define IPV6_SIMD_TARGET __attribute__((target("ssse3,sse4.1")))
+
+// ipv6_prefix_mask[n] has the n high bits set
+static RouteTreeIPV6 ipv6_prefix_mask[129] __attribute__((aligned(16)));
+static bool ipv6_simd;
+
+__attribute__((constructor)) static void ipv6_simd_init(void)
+{
+    uint32_t i;
+    for (i = 0; i <= 128; ++i) {
+        u128_to_ipv6(i ? ~(RouteTreeU128)0 << (128 - i) : 0, &ipv6_prefix_mask[i]);
+    }
+
+    __builtin_cpu_init();
+    ipv6_simd = __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1");
+}
+
+static inline IPV6_SIMD_TARGET void be_ipv6_to_cpu_simd(const uint8_t *be_ipv6_u8ptr, RouteTreeIPV6 *ipv6)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    _mm_storeu_si128((__m128i *)ipv6->u8,
+                    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)be_ipv6_u8ptr), reverse));
+}
+
+static inline IPV6_SIMD_TARGET bool match_key_ipv6_simd(const RouteTreeIPV6 *key,
+                                                    const RouteTreeIPV6 *ipv6,
+                                                    uint8_t bit_offset,
+                                                    uint8_t bit_len)
+{
+    if (0 == bit_len) {
+        return true;
+    }
+
+    const RouteTreeU128 shifted = ipv6_to_u128(ipv6) << bit_offset;
+    const __m128i diff = _mm_xor_si128(_mm_set_epi64x((int64_t)(shifted >> 64), (int64_t)shifted),
+                                    _mm_loadu_si128((const __m128i *)key->u8));
+    return _mm_testz_si128(diff, _mm_load_si128((const __m128i *)ipv6_prefix_mask[bit_len].u8));
+}
+#else
+#define IPV6_SIMD_TARGET
+#define ipv6_simd false
+#define be_ipv6_to_cpu_simd(be_ipv6_u8ptr, ipv6) U8_PTR_TO_CPU_IPV6((*(ipv6)), (be_ipv6_u8ptr))
+#define match_key_ipv6_simd match_key_ipv6
+#endif
+
+#define PTR_ADD(ptr, x) ((void*)((uintptr_t)(ptr) + (x)))
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+#define PREFETCH_NODE(node) __builtin_prefetch((node), 0, 3)
+
+/*
+ * Number of addresses walked together by the bulk lookup, one bit of the
+ * active/hit masks per lane.
+ */
+#define BULK_LOOKUP_LANES 64
+
+
+
+/*
+ * Node allocator. The free nodes of a family are on intrusive lists linked
+ * through next_bit_0: one shared by the writers under a lock, and one cache
+ * per writer id that updates take from and give back to without a lock.
+ * v4 and v6 only differ by the node size, so the code below works on the
+ * node array as 32-bit words.
+ */
+#define POOL_CACHE_BATCH 64
+#define POOL_GROWABLE_ALIGN (2UL << 20)
+
+typedef uint32_t __attribute__((may_alias)) PoolWord;
+
+typedef struct {
+    PoolWord *nodes;
+    uint32_t node_words;
+    // word of a free node holding the next one, and the info word
+    uint32_t link_word;
+    uint32_t info_word;
+    size_t *total;
+    size_t max;
+    uint32_t *lock;
+    uint32_t *free;
+    size_t *free_count;
+    RouteTreePoolCache *cache;
+} PoolFamily;
+
+#define POOL_WORD(f, index, word) ((f)->nodes[(size_t)(index) * (f)->node_words + (word)])
+#define POOL_LINK(f, index) POOL_WORD(f, index, (f)->link_word)
+
+static uint32_t pool_writers;
+static __thread int pool_writer_id = -1;
+
+typedef struct {
+    uint32_t *index;
+    size_t n;
+    size_t max;
+} BatchIndexList;
+
+// nodes taken by the batch commit in progress on this thread, see batch_commit
+static __thread BatchIndexList *pool_taken;
+
+static inline PoolFamily pool_v4(const RouteTreePool *pool)
+{
+    RouteTreePool *p = (RouteTreePool *)pool;
+    PoolFamily f = {
+        .nodes = (PoolWord *)p->v4_nodes,
+        .node_words = sizeof(RouteTreeNodeV4) / sizeof(PoolWord),
+        .link_word = offsetof(RouteTreeNodeV4, next_bit_0) / sizeof(PoolWord),
+        .info_word = offsetof(RouteTreeNodeV4, info) / sizeof(PoolWord),
+        .total = &p->v4_nodes_pool_total,
+        .max = p->v4_nodes_pool_max,
+        .lock = &p->v4_nodes_lock,
+        .free = &p->v4_nodes_free,
+        .free_count = &p->v4_nodes_free_count,
+        .cache = p->v4_nodes_cache,
+    };
+    return f;
+}
+
+static inline PoolFamily pool_v6(const RouteTreePool *pool)
+{
+    RouteTreePool *p = (RouteTreePool *)pool;
+    PoolFamily f = {
+        .nodes = (PoolWord *)p->v6_nodes,
+        .node_words = sizeof(RouteTreeNodeV6) / sizeof(PoolWord),
+        .link_word = offsetof(RouteTreeNodeV6, next_bit_0) / sizeof(PoolWord),
+        .info_word = offsetof(RouteTreeNodeV6, info) / sizeof(PoolWord),
+        .total = &p->v6_nodes_pool_total,
+        .max = p->v6_nodes_pool_max,
+        .lock = &p->v6_nodes_lock,
+        .free = &p->v6_nodes_free,
+        .free_count = &p->v6_nodes_free_count,
+        .cache = p->v6_nodes_cache,
+    };
+    return f;
+}
+
+static inline int batch_index_reserve(BatchIndexList *list, size_t count)
+{
+    if (list->n + count > list->max) {
+        size_t max = list->max ? 2 * list->max : 256;
+        while (max < list->n + count) {
+            max *= 2;
         }
-        else {
-            if (bit_len > 64) {
-                const uint8_t u64_1_bit_len = 64 - bit_offset;
-                const uint8_t u64_0_bit_len = bit_len - u64_1_bit_len;
-                const uint64_t split_key = u64_1_bit_len < 64 ? (GET_KEY_64(ipv6->u64[0], 0, u64_0_bit_len) >> u64_1_bit_len) : 0;
-                ipv6_key->u64[1] = GET_KEY_64(ipv6->u64[1], bit_offset, u64_1_bit_len)
-                                        | split_key;
-                ipv6_key->u64[0] = GET_KEY_64(ipv6->u64[0], bit_offset, bit_len - 64);
+        uint32_t *index = realloc(list->index, sizeof(*index) * max);
+        if (NULL == index) {
+            return -1;
+        }
+        list->index = index;
+        list->max = max;
+    }
+    return 0;
+}
+
+static inline int batch_index_push(BatchIndexList *list, uint32_t index)
+{
+    if (batch_index_reserve(list, 1)) {
+        return -1;
+    }
+    list->index[list->n++] = index;
+    return 0;
+}
+
+static void pool_lock(uint32_t *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            sched_yield();
+        }
+    }
+}
+
+static inline void pool_unlock(uint32_t *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// cache of the calling thread, NULL if every writer id is taken
+static inline RouteTreePoolCache *pool_cache(const PoolFamily *f)
+{
+    if (__builtin_expect(pool_writer_id < 0, 0) && compressed_route_tree_writer_register() < 0) {
+        return NULL;
+    }
+    return &f->cache[pool_writer_id];
+}
+
+static inline void pool_cache_push(const PoolFamily *f, RouteTreePoolCache *cache, uint32_t index)
+{
+    POOL_LINK(f, index) = cache->free_head;
+    cache->free_head = index;
+    cache->n_free++;
+}
+
+static inline uint32_t pool_cache_pop(const PoolFamily *f, RouteTreePoolCache *cache)
+{
+    const uint32_t index = cache->free_head;
+    cache->free_head = POOL_LINK(f, index);
+    cache->n_free--;
+    return index;
+}
+
+// last of the n nodes linked from first
+static uint32_t pool_chain_last(const PoolFamily *f, uint32_t first, size_t n)
+{
+    while (--n) {
+        first = POOL_LINK(f, first);
+    }
+    return first;
+}
+
+// move up to n shared nodes to the cache, with the lock held
+static void pool_take_shared(const PoolFamily *f, RouteTreePoolCache *cache, size_t n)
+{
+    if (n > *f->free_count) {
+        n = *f->free_count;
+    }
+    if (0 == n) {
+        return;
+    }
+
+    const uint32_t first = *f->free;
+    const uint32_t last = pool_chain_last(f, first, n);
+    *f->free = POOL_LINK(f, last);
+    *f->free_count -= n;
+    POOL_LINK(f, last) = cache->free_head;
+    cache->free_head = first;
+    cache->n_free += n;
+}
+
+// give the cache nodes beyond the keep first ones back to the shared list
+static void pool_cache_trim(const PoolFamily *f, RouteTreePoolCache *cache, size_t keep)
+{
+    if (cache->n_free <= keep) {
+        return;
+    }
+
+    const uint32_t kept = keep ? pool_chain_last(f, cache->free_head, keep) : 0;
+    const uint32_t first = kept ? POOL_LINK(f, kept) : cache->free_head;
+    const uint32_t last = pool_chain_last(f, first, cache->n_free - keep);
+
+    pool_lock(f->lock);
+    POOL_LINK(f, last) = *f->free;
+    *f->free = first;
+    *f->free_count += cache->n_free - keep;
+    pool_unlock(f->lock);
+
+    if (kept) {
+        POOL_LINK(f, kept) = 0;
+    }
+    else {
+        cache->free_head = 0;
+    }
+    cache->n_free = keep;
+}
+
+// put node index [begin, end) on the shared list, the lowest on top
+static void pool_add_nodes(const PoolFamily *f, size_t begin, size_t end)
+{
+    size_t i;
+
+    for (i = end; i-- > begin;) {
+        memset(&POOL_WORD(f, i, 0), 0, sizeof(PoolWord) * f->node_words);
+        POOL_WORD(f, i, f->info_word) = NODE_INFO(0, -1);
+        POOL_LINK(f, i) = *f->free;
+        *f->free = i;
+    }
+    *f->free_count += end - begin;
+}
+
+static void pool_init(const PoolFamily *f, size_t total)
+{
+    memset(f->cache, 0, sizeof(*f->cache) * ROUTE_TREE_POOL_MAX_WRITERS);
+    *f->lock = 0;
+    *f->free = 0;
+    *f->free_count = 0;
+    *f->total = 0;
+
+    // a family given no node memory has no node, not even node 0
+    if (NULL == f->nodes) {
+        return;
+    }
+    memset(&POOL_WORD(f, 0, 0), 0, sizeof(PoolWord) * f->node_words);
+    pool_add_nodes(f, 1, total);
+    *f->total = total;
+}
+
+static void pool_set_used(const PoolFamily *f, const uint8_t *used)
+{
+    size_t i;
+
+    memset(f->cache, 0, sizeof(*f->cache) * ROUTE_TREE_POOL_MAX_WRITERS);
+    *f->lock = 0;
+    *f->free = 0;
+    *f->free_count = 0;
+    for (i = *f->total; i-- > 1;) {
+        if (!(used[i / 8] & (1U << (i % 8)))) {
+            POOL_LINK(f, i) = *f->free;
+            *f->free = i;
+            (*f->free_count)++;
+        }
+    }
+}
+
+static inline size_t pool_grow_total(size_t total, size_t max, size_t count)
+{
+    const size_t new_total = (total + count + ROUTE_TREE_POOL_SLAB_NODES - 1) / ROUTE_TREE_POOL_SLAB_NODES * ROUTE_TREE_POOL_SLAB_NODES;
+    return new_total < max ? new_total : max;
+}
+
+// growable pools, with the lock held; see compressed_route_tree_init_nodes_growable
+static int pool_grow(const PoolFamily *f, size_t count)
+{
+    const size_t total = *f->total;
+    const size_t new_total = pool_grow_total(total, f->max, count);
+
+    if (new_total < total + count) {
+        return -1;
+    }
+
+    pool_add_nodes(f, total, new_total);
+    *f->total = new_total;
+
+    return 0;
+}
+
+/*
+ * A limbo block holds the next block in word 0 and freed node index in the
+ * others, 0 is an unused entry. It is taken from the cache, the nodes it
+ * holds may still be read.
+ */
+static void pool_limbo_add(const PoolFamily *f, RouteTreePoolCache *cache, uint32_t index)
+{
+    if (0 == cache->limbo_pending || cache->limbo_used == f->node_words - 1) {
+        if (0 == cache->n_free) {
+            pool_lock(f->lock);
+            if (0 == *f->free_count) {
+                pool_grow(f, POOL_CACHE_BATCH);
             }
-            else {
-                if (bit_offset + bit_len > 64) {
-                    const uint8_t u64_1_bit_len = 64 - bit_offset;
-                    const uint8_t u64_0_bit_len = bit_len - u64_1_bit_len;
-                    const uint64_t split_key = u64_1_bit_len < 64 ? (GET_KEY_64(ipv6->u64[0], 0, u64_0_bit_len) >> u64_1_bit_len) : 0;
-                    ipv6_key->u64[1] = GET_KEY_64(ipv6->u64[1], bit_offset, u64_1_bit_len)
-                                            | split_key;
-                    ipv6_key->u64[0] = 0;
-                }
-                else {
-                    ipv6_key->u64[1] = GET_KEY_64(ipv6->u64[1], bit_offset, bit_len);
-                    ipv6_key->u64[0] = 0;
-                }
+            pool_take_shared(f, cache, POOL_CACHE_BATCH);
+            pool_unlock(f->lock);
+        }
+        if (0 == cache->n_free) {
+            // full pool, no room to keep it, wait for the readers instead
+            compressed_route_tree_rcu_synchronize();
+            pool_cache_push(f, cache, index);
+            return;
+        }
+
+        const uint32_t block = pool_cache_pop(f, cache);
+        memset(&POOL_WORD(f, block, 0), 0, sizeof(PoolWord) * f->node_words);
+        POOL_WORD(f, block, 0) = cache->limbo_pending;
+        cache->limbo_pending = block;
+        cache->limbo_used = 0;
+    }
+
+    POOL_WORD(f, cache->limbo_pending, 1 + cache->limbo_used++) = index;
+}
+
+static void pool_limbo_release(const PoolFamily *f, RouteTreePoolCache *cache, uint32_t block)
+{
+    uint32_t i;
+
+    while (block) {
+        const uint32_t next = POOL_WORD(f, block, 0);
+        for (i = 1; i < f->node_words; ++i) {
+            if (POOL_WORD(f, block, i)) {
+                pool_cache_push(f, cache, POOL_WORD(f, block, i));
             }
         }
+        pool_cache_push(f, cache, block);
+        block = next;
     }
 }
 
-#define PTR_ADD(ptr, x) ((void*)((uintptr_t)(ptr) + (x)))
-#define MOVE_FRONT_REAR(v, total) (((v) + 1) % (total))
+static void pool_reclaim(const PoolFamily *f, RouteTreePoolCache *cache)
+{
+    if (cache->limbo_waiting) {
+        if (!route_tree_rcu_grace_period_done(cache->limbo_epoch)) {
+            return;
+        }
+
+        pool_limbo_release(f, cache, cache->limbo_waiting);
+        cache->limbo_waiting = 0;
+    }
+
+    if (cache->limbo_pending) {
+        cache->limbo_waiting = cache->limbo_pending;
+        cache->limbo_pending = 0;
+        cache->limbo_used = 0;
+        cache->limbo_epoch = route_tree_rcu_start_grace_period();
+    }
+}
+
+// make count nodes ready in the cache: recycle, then take shared ones, then grow
+static RouteTreePoolCache *pool_reserve(const PoolFamily *f, size_t count)
+{
+    RouteTreePoolCache *cache = pool_cache(f);
+
+    if (NULL == cache || (pool_taken && batch_index_reserve(pool_taken, count))) {
+        return NULL;
+    }
+    if (cache->n_free >= count) {
+        return cache;
+    }
 
+    pool_reclaim(f, cache);
+    if (cache->n_free < count) {
+        const size_t short_count = count - cache->n_free;
+
+        pool_lock(f->lock);
+        if (*f->free_count < short_count) {
+            pool_grow(f, short_count - *f->free_count);
+        }
+        pool_take_shared(f, cache, short_count + POOL_CACHE_BATCH);
+        pool_unlock(f->lock);
+    }
 
+    return cache->n_free >= count ? cache : NULL;
+}
 
-static inline int _free_node_v4(const RouteTreeNodeV4 *free_node)
+static void pool_free(const PoolFamily *f, uint32_t index)
 {
-    if (MOVE_FRONT_REAR(v4_nodes_pool_rear, v4_nodes_pool_total) == v4_nodes_pool_front) {
-        // full, should not happen
-        printf("total=%zu front=%zu rear=%zu\n", v4_nodes_pool_total, v4_nodes_pool_front, v4_nodes_pool_rear);
-        abort();
+    RouteTreePoolCache *cache = pool_cache(f);
+
+    if (__builtin_expect(NULL == cache, 0)) {
+        compressed_route_tree_rcu_synchronize();
+        pool_lock(f->lock);
+        POOL_LINK(f, index) = *f->free;
+        *f->free = index;
+        (*f->free_count)++;
+        pool_unlock(f->lock);
+        return;
     }
 
-    v4_nodes_pool[v4_nodes_pool_rear] = free_node;
-    v4_nodes_pool_rear = MOVE_FRONT_REAR(v4_nodes_pool_rear, v4_nodes_pool_total);
+    // queued as pending, see pool_reclaim
+    pool_limbo_add(f, cache, index);
+}
+
+static void pool_writer_reclaim(const PoolFamily *f)
+{
+    RouteTreePoolCache *cache = pool_cache(f);
 
-    return 0;
+    if (cache) {
+        pool_reclaim(f, cache);
+        // the hot ones are enough, the others may serve another writer
+        if (cache->n_free > 2 * POOL_CACHE_BATCH) {
+            pool_cache_trim(f, cache, POOL_CACHE_BATCH);
+        }
+    }
 }
 
-static inline int _free_node_v6(const RouteTreeNodeV6 *free_node)
+/*
+ * Drop the slabs at the end whose nodes are all on the shared list, then
+ * relink it in index order so the next allocations fill the lowest slabs.
+ */
+static size_t pool_shrink(const PoolFamily *f)
 {
-    if (MOVE_FRONT_REAR(v6_nodes_pool_rear, v6_nodes_pool_total) == v6_nodes_pool_front) {
-        // full, should not happen
-        printf("total=%zu front=%zu rear=%zu\n", v6_nodes_pool_total, v6_nodes_pool_front, v6_nodes_pool_rear);
-        abort();
+    RouteTreePoolCache *cache = pool_cache(f);
+    size_t new_total;
+    size_t total;
+    size_t i;
+
+    if (0 == f->max) {
+        return 0;
     }
 
-    v6_nodes_pool[v6_nodes_pool_rear] = free_node;
-    v6_nodes_pool_rear = MOVE_FRONT_REAR(v6_nodes_pool_rear, v6_nodes_pool_total);
+    if (cache) {
+        pool_reclaim(f, cache);
+        pool_cache_trim(f, cache, 0);
+    }
 
-    return 0;
+    pool_lock(f->lock);
+    total = *f->total;
+    uint64_t *free_map = calloc((total + 63) / 64, sizeof(uint64_t));
+    if (NULL == free_map) {
+        pool_unlock(f->lock);
+        return 0;
+    }
+    for (i = *f->free; i; i = POOL_LINK(f, i)) {
+        free_map[i / 64] |= 1ULL << (i % 64);
+    }
+
+    // the first slab is kept, it has node 0
+    new_total = total;
+    while (new_total > ROUTE_TREE_POOL_SLAB_NODES) {
+        const size_t slab = (new_total - 1) / ROUTE_TREE_POOL_SLAB_NODES * ROUTE_TREE_POOL_SLAB_NODES;
+        for (i = slab; i < new_total && (free_map[i / 64] >> (i % 64) & 1); ++i) {
+        }
+        if (i != new_total) {
+            break;
+        }
+        new_total = slab;
+    }
+
+    *f->free = 0;
+    *f->free_count = 0;
+    for (i = new_total; i-- > 1;) {
+        if (free_map[i / 64] >> (i % 64) & 1) {
+            POOL_LINK(f, i) = *f->free;
+            *f->free = i;
+            (*f->free_count)++;
+        }
+    }
+    *f->total = new_total;
+    pool_unlock(f->lock);
+    free(free_map);
+
+    if (new_total != total) {
+        route_tree_mem_discard(&POOL_WORD(f, new_total, 0), sizeof(PoolWord) * f->node_words * (total - new_total));
+    }
+    return total - new_total;
+}
+
+static size_t pool_free_count(const PoolFamily *f)
+{
+    size_t count = __atomic_load_n(f->free_count, __ATOMIC_RELAXED);
+    uint32_t i;
+
+    for (i = 0; i < ROUTE_TREE_POOL_MAX_WRITERS; ++i) {
+        count += __atomic_load_n(&f->cache[i].n_free, __ATOMIC_RELAXED);
+    }
+    return count;
 }
 
-static inline int free_node_v4(RouteTreeHeadNode *head_node_v4, const RouteTreeNodeV4 *free_node)
+static inline int free_node_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, RouteTreeNodeV4 *free_node)
 {
-    _free_node_v4(free_node);
+    const PoolFamily f = pool_v4(pool);
+    pool_free(&f, route_tree_node_index_v4(pool, free_node));
 
     head_node_v4->total_nodes--;
 
     return 0;
 }
 
-static inline int free_node_v6(RouteTreeHeadNode *head_node_v6, const RouteTreeNodeV6 *free_node)
+static inline int free_node_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6, RouteTreeNodeV6 *free_node)
 {
-    _free_node_v6(free_node);
+    const PoolFamily f = pool_v6(pool);
+    pool_free(&f, route_tree_node_index_v6(pool, free_node));
 
     head_node_v6->total_nodes--;
 
     return 0;
 }
 
-static inline int alloc_node_bulk_v4(RouteTreeHeadNode *head_node_v4,
+static void reclaim_node_v4(RouteTreePool *pool)
+{
+    const PoolFamily f = pool_v4(pool);
+    pool_writer_reclaim(&f);
+}
+
+static void reclaim_node_v6(RouteTreePool *pool)
+{
+    const PoolFamily f = pool_v6(pool);
+    pool_writer_reclaim(&f);
+}
+
+static int reserve_node_v4(RouteTreePool *pool, size_t count)
+{
+    const PoolFamily f = pool_v4(pool);
+    return pool_reserve(&f, count) ? 0 : -1;
+}
+
+static int reserve_node_v6(RouteTreePool *pool, size_t count)
+{
+    const PoolFamily f = pool_v6(pool);
+    return pool_reserve(&f, count) ? 0 : -1;
+}
+
+static inline int alloc_node_bulk_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
                                 RouteTreeNodeV4 **new_node,
                                 size_t count)
 {
+    const PoolFamily f = pool_v4(pool);
+    RouteTreePoolCache *cache = pool_reserve(&f, count);
     size_t i;
+
+    if (NULL == cache) {
+        return -1;
+    }
+
     for (i = 0; i < count; ++i) {
-        if (v4_nodes_pool_front == v4_nodes_pool_rear) {
-            // empty
-            size_t has_alloc;
-            for (has_alloc = 0; has_alloc < i; ++has_alloc) {
-                _free_node_v4(new_node[has_alloc]);
-                new_node[has_alloc] = NULL;
-            }
-            return -1;
+        const uint32_t index = pool_cache_pop(&f, cache);
+        if (pool_taken) {
+            pool_taken->index[pool_taken->n++] = index;
         }
-
-        new_node[i] = v4_nodes_pool[v4_nodes_pool_front];
-        v4_nodes_pool_front = MOVE_FRONT_REAR(v4_nodes_pool_front, v4_nodes_pool_total);
+        new_node[i] = route_tree_node_v4(pool, index);
     }
 
     head_node_v4->total_nodes += count;
@@ -167,24 +685,24 @@ static inline int alloc_node_bulk_v4(RouteTreeHeadNode *head_node_v4,
     return 0;
 }
 
-static inline int alloc_node_bulk_v6(RouteTreeHeadNode *head_node_v6,
+static inline int alloc_node_bulk_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
                                 RouteTreeNodeV6 **new_node,
                                 size_t count)
 {
+    const PoolFamily f = pool_v6(pool);
+    RouteTreePoolCache *cache = pool_reserve(&f, count);
     size_t i;
+
+    if (NULL == cache) {
+        return -1;
+    }
+
     for (i = 0; i < count; ++i) {
-        if (v6_nodes_pool_front == v6_nodes_pool_rear) {
-            // empty
-            size_t has_alloc;
-            for (has_alloc = 0; has_alloc < i; ++has_alloc) {
-                _free_node_v6(new_node[has_alloc]);
-                new_node[has_alloc] = NULL;
-            }
-            return -1;
+        const uint32_t index = pool_cache_pop(&f, cache);
+        if (pool_taken) {
+            pool_taken->index[pool_taken->n++] = index;
         }
-
-        new_node[i] = v6_nodes_pool[v6_nodes_pool_front];
-        v6_nodes_pool_front = MOVE_FRONT_REAR(v6_nodes_pool_front, v6_nodes_pool_total);
+        new_node[i] = route_tree_node_v6(pool, index);
     }
 
     head_node_v6->total_nodes += count;
@@ -192,10 +710,11 @@ static inline int alloc_node_bulk_v6(RouteTreeHeadNode *head_node_v6,
     return 0;
 }
 
-static inline enum RouteTreeReturnStatue lookup_subtree_v4(RouteTreeNodeV4 *node_v4,
+static inline enum RouteTreeReturnStatue lookup_subtree_v4(const RouteTreePool *pool,
+                                                RouteTreeNodeV4 *node_v4,
                                                 RouteTreeNodeV4 **next_node_v4,
                                                 RouteTreeNodeV4 **parent_node_v4,
-                                                RouteTreeNodeV4 ***target_node_v4,
+                                                uint32_t **target_node_v4,
                                                 uint32_t ipv4,
                                                 uint8_t depth_len,
                                                 uint8_t *bit_offset,
@@ -203,23 +722,26 @@ static inline enum RouteTreeReturnStatue lookup_subtree_v4(RouteTreeNodeV4 *node
 {
     enum RouteTreeReturnStatue ret = ROUTE_TREE_FAILED;
 
-    if (node_v4->key_bit_len > (depth_len - *bit_offset)) {
+    const uint32_t info = RCU_LOAD(node_v4->info);
+    const uint8_t key_bit_len = INFO_KEY_BIT_LEN(info);
+    if (key_bit_len > (depth_len - *bit_offset)) {
         // new key is shorter, do not match
         return ret;
     }
 
-    const uint32_t key = GET_KEY_32(ipv4, *bit_offset, node_v4->key_bit_len);
+    const uint32_t key = GET_KEY_32(ipv4, *bit_offset, key_bit_len);
     if (key != node_v4->key) {
         return ret;
     }
 
     // match success
-    if (node_v4->next_hop >= 0) {
-        *next_hop = node_v4->next_hop;
+    const int32_t node_next_hop = INFO_NEXT_HOP(info);
+    if (node_next_hop >= 0) {
+        *next_hop = node_next_hop;
         ret = ROUTE_TREE_SUCCESS;
     }
 
-    *bit_offset += node_v4->key_bit_len;
+    *bit_offset += key_bit_len;
     if (*bit_offset == depth_len) {
         // match done
         return ret;
@@ -232,13 +754,13 @@ static inline enum RouteTreeReturnStatue lookup_subtree_v4(RouteTreeNodeV4 *node
         if (target_node_v4) {
             *target_node_v4 = &node_v4->next_bit_1;
         }
-        *next_node_v4 = node_v4->next_bit_1;
+        *next_node_v4 = route_tree_node_v4(pool, RCU_LOAD(node_v4->next_bit_1));
     }
     else {
         if (target_node_v4) {
             *target_node_v4 = &node_v4->next_bit_0;
         }
-        *next_node_v4 = node_v4->next_bit_0;
+        *next_node_v4 = route_tree_node_v4(pool, RCU_LOAD(node_v4->next_bit_0));
     }
     if (NULL == *next_node_v4) {
         return ret;
@@ -253,35 +775,39 @@ static inline enum RouteTreeReturnStatue lookup_subtree_v4(RouteTreeNodeV4 *node
     return ret;
 }
 
-static inline enum RouteTreeReturnStatue lookup_subtree_v6(RouteTreeNodeV6 *node_v6,
+static inline __attribute__((always_inline)) enum RouteTreeReturnStatue lookup_subtree_v6(const RouteTreePool *pool,
+                                                RouteTreeNodeV6 *node_v6,
                                                 RouteTreeNodeV6 **next_node_v6,
                                                 RouteTreeNodeV6 **parent_node_v6,
-                                                RouteTreeNodeV6 ***target_node_v6,
+                                                uint32_t **target_node_v6,
                                                 const RouteTreeIPV6 *ipv6,
                                                 uint8_t depth_len,
                                                 uint8_t *bit_offset,
-                                                uint32_t *next_hop)
+                                                uint32_t *next_hop,
+                                                const bool simd)
 {
     enum RouteTreeReturnStatue ret = ROUTE_TREE_FAILED;
 
-    if (node_v6->key_bit_len > (depth_len - *bit_offset)) {
+    const uint32_t info = RCU_LOAD(node_v6->info);
+    const uint8_t key_bit_len = INFO_KEY_BIT_LEN(info);
+    if (key_bit_len > (depth_len - *bit_offset)) {
         // new key is shorter, do not match
         return ret;
     }
 
-    RouteTreeIPV6 key;
-    get_key_ipv6(ipv6, *bit_offset, node_v6->key_bit_len, &key);
-    if (memcmp(node_v6->key.u8, key.u8, sizeof(node_v6->key.u8))) {
+    if (simd ? !match_key_ipv6_simd(&node_v6->key, ipv6, *bit_offset, key_bit_len)
+                : !match_key_ipv6(&node_v6->key, ipv6, *bit_offset, key_bit_len)) {
         return ret;
     }
 
     // match success
-    if (node_v6->next_hop >= 0) {
-        *next_hop = node_v6->next_hop;
+    const int32_t node_next_hop = INFO_NEXT_HOP(info);
+    if (node_next_hop >= 0) {
+        *next_hop = node_next_hop;
         ret = ROUTE_TREE_SUCCESS;
     }
 
-    *bit_offset += node_v6->key_bit_len;
+    *bit_offset += key_bit_len;
     if (*bit_offset == depth_len) {
         // match done
         return ret;
@@ -294,13 +820,13 @@ static inline enum RouteTreeReturnStatue lookup_subtree_v6(RouteTreeNodeV6 *node
         if (target_node_v6) {
             *target_node_v6 = &node_v6->next_bit_1;
         }
-        *next_node_v6 = node_v6->next_bit_1;
+        *next_node_v6 = route_tree_node_v6(pool, RCU_LOAD(node_v6->next_bit_1));
     }
     else {
         if (target_node_v6) {
             *target_node_v6 = &node_v6->next_bit_0;
         }
-        *next_node_v6 = node_v6->next_bit_0;
+        *next_node_v6 = route_tree_node_v6(pool, RCU_LOAD(node_v6->next_bit_0));
     }
     if (NULL == *next_node_v6) {
         return ret;
@@ -337,81 +863,56 @@ static inline uint32_t get_diff_bit_v6(const RouteTreeNodeV6 *node_v6,
                                 uint8_t bit_offset,
                                 uint8_t match_len)
 {
-    uint32_t match_bit;
-
-    for (match_bit = 0; match_bit < match_len; ++match_bit) {
-        if (GET_BIT_U64_PTR(node_v6->key.u64, 127-match_bit)
-                    != GET_BIT_U64_PTR(ipv6->u64, 127-(bit_offset + match_bit))) {
-            break;
-        }
-    }
+    const RouteTreeU128 diff = (ipv6_to_u128(ipv6) << bit_offset) ^ ipv6_to_u128(&node_v6->key);
+    const uint32_t match_bit = clz_u128(diff);
 
-    return match_bit;
+    return match_bit < match_len ? match_bit : match_len;
 }
 
 static inline void fill_node_v4(RouteTreeNodeV4 *node_v4,
                             uint8_t key_bit_len,
                             uint32_t key,
                             int32_t next_hop,
-                            RouteTreeNodeV4 *parent,
-                            RouteTreeNodeV4 *next_bit_0,
-                            RouteTreeNodeV4 *next_bit_1)
+                            uint32_t next_bit_0,
+                            uint32_t next_bit_1)
 {
-    node_v4->key_bit_len = key_bit_len;
     node_v4->key = key;
-    node_v4->next_hop = next_hop;
-    node_v4->parent = parent;
     node_v4->next_bit_0 = next_bit_0;
     node_v4->next_bit_1 = next_bit_1;
-
-    if (next_bit_0) {
-        next_bit_0->parent = node_v4;
-    }
-    if (next_bit_1) {
-        next_bit_1->parent = node_v4;
-    }
+    node_v4->info = NODE_INFO(key_bit_len, next_hop);
 }
 
 static inline void fill_node_v6(RouteTreeNodeV6 *node_v6,
                             uint8_t key_bit_len,
                             const RouteTreeIPV6 *key,
                             int32_t next_hop,
-                            RouteTreeNodeV6 *parent,
-                            RouteTreeNodeV6 *next_bit_0,
-                            RouteTreeNodeV6 *next_bit_1)
+                            uint32_t next_bit_0,
+                            uint32_t next_bit_1)
 {
-    node_v6->key_bit_len = key_bit_len;
     memcpy(node_v6->key.u8, key->u8, sizeof(node_v6->key));
-    node_v6->next_hop = next_hop;
-    node_v6->parent = parent;
     node_v6->next_bit_0 = next_bit_0;
     node_v6->next_bit_1 = next_bit_1;
-
-    if (next_bit_0) {
-        next_bit_0->parent = node_v6;
-    }
-    if (next_bit_1) {
-        next_bit_1->parent = node_v6;
-    }
+    node_v6->info = NODE_INFO(key_bit_len, next_hop);
 }
 
-static inline int handle_mismatch_node_v4(RouteTreeHeadNode *head_node_v4,
+static inline int handle_mismatch_node_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
                                 RouteTreeNodeV4 *node_v4,
                                 uint32_t ipv4,
                                 uint8_t depth_len,
                                 uint8_t bit_offset,
                                 uint32_t next_hop,
-                                RouteTreeNodeV4 **target_node_v4)
+                                uint32_t *target_node_v4)
 {
     RouteTreeNodeV4 *new_node[3];
-    if (alloc_node_bulk_v4(head_node_v4, new_node, 3)) {
+    if (alloc_node_bulk_v4(pool, head_node_v4, new_node, 3)) {
         return -1;
     }
 
-    uint32_t match_bit = get_diff_bit_v4(node_v4, ipv4, bit_offset, node_v4->key_bit_len);
+    const uint8_t key_bit_len = NODE_KEY_BIT_LEN(node_v4);
+    uint32_t match_bit = get_diff_bit_v4(node_v4, ipv4, bit_offset, key_bit_len);
 
     fill_node_v4(new_node[0], match_bit, GET_KEY_32(node_v4->key, 0, match_bit),
-            -1, node_v4->parent, new_node[1], new_node[2]);
+            -1, route_tree_node_index_v4(pool, new_node[1]), route_tree_node_index_v4(pool, new_node[2]));
 
     RouteTreeNodeV4 *ori_node_p2;
     RouteTreeNodeV4 *new_route_node;
@@ -425,40 +926,41 @@ static inline int handle_mismatch_node_v4(RouteTreeHeadNode *head_node_v4,
     }
 
     fill_node_v4(ori_node_p2,
-            node_v4->key_bit_len - match_bit,
-            GET_KEY_32(node_v4->key, match_bit, node_v4->key_bit_len - match_bit),
-            node_v4->next_hop, new_node[0], node_v4->next_bit_0, node_v4->next_bit_1);
+            key_bit_len - match_bit,
+            GET_KEY_32(node_v4->key, match_bit, key_bit_len - match_bit),
+            NODE_NEXT_HOP(node_v4), node_v4->next_bit_0, node_v4->next_bit_1);
 
     fill_node_v4(new_route_node,
             depth_len - (bit_offset + match_bit),
             GET_KEY_32(ipv4, (bit_offset + match_bit), depth_len - (bit_offset + match_bit)),
-            next_hop, new_node[0], NULL, NULL);
+            next_hop, 0, 0);
 
-    *target_node_v4 = new_node[0];
-    free_node_v4(head_node_v4, node_v4);
+    RCU_STORE(*target_node_v4, route_tree_node_index_v4(pool, new_node[0]));
+    free_node_v4(pool, head_node_v4, node_v4);
 
     return 0;
 }
 
-static inline int handle_mismatch_node_v6(RouteTreeHeadNode *head_node_v6,
+static inline int handle_mismatch_node_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
                                 RouteTreeNodeV6 *node_v6,
                                 const RouteTreeIPV6 *ipv6,
                                 uint8_t depth_len,
                                 uint8_t bit_offset,
                                 uint32_t next_hop,
-                                RouteTreeNodeV6 **target_node_v6)
+                                uint32_t *target_node_v6)
 {
     RouteTreeNodeV6 *new_node[3];
-    if (alloc_node_bulk_v6(head_node_v6, new_node, 3)) {
+    if (alloc_node_bulk_v6(pool, head_node_v6, new_node, 3)) {
         return -1;
     }
 
-    uint32_t match_bit = get_diff_bit_v6(node_v6, ipv6, bit_offset, node_v6->key_bit_len);
+    const uint8_t key_bit_len = NODE_KEY_BIT_LEN(node_v6);
+    uint32_t match_bit = get_diff_bit_v6(node_v6, ipv6, bit_offset, key_bit_len);
 
     RouteTreeIPV6 ipv6_key;
     get_key_ipv6(&node_v6->key, 0, match_bit, &ipv6_key);
     fill_node_v6(new_node[0], match_bit, &ipv6_key,
-            -1, node_v6->parent, new_node[1], new_node[2]);
+            -1, route_tree_node_index_v6(pool, new_node[1]), route_tree_node_index_v6(pool, new_node[2]));
 
     RouteTreeNodeV6 *ori_node_p2;
     RouteTreeNodeV6 *new_route_node;
@@ -471,48 +973,47 @@ static inline int handle_mismatch_node_v6(RouteTreeHeadNode *head_node_v6,
         new_route_node = new_node[2];
     }
 
-    get_key_ipv6(&node_v6->key, match_bit, node_v6->key_bit_len - match_bit, &ipv6_key);
+    get_key_ipv6(&node_v6->key, match_bit, key_bit_len - match_bit, &ipv6_key);
     fill_node_v6(ori_node_p2,
-            node_v6->key_bit_len - match_bit,
+            key_bit_len - match_bit,
             &ipv6_key,
-            node_v6->next_hop, new_node[0], node_v6->next_bit_0, node_v6->next_bit_1);
+            NODE_NEXT_HOP(node_v6), node_v6->next_bit_0, node_v6->next_bit_1);
 
     get_key_ipv6(ipv6, (bit_offset + match_bit), depth_len - (bit_offset + match_bit), &ipv6_key);
     fill_node_v6(new_route_node,
             depth_len - (bit_offset + match_bit),
             &ipv6_key,
-            next_hop, new_node[0], NULL, NULL);
+            next_hop, 0, 0);
 
-    *target_node_v6 = new_node[0];
-    free_node_v6(head_node_v6, node_v6);
+    RCU_STORE(*target_node_v6, route_tree_node_index_v6(pool, new_node[0]));
+    free_node_v6(pool, head_node_v6, node_v6);
 
     return 0;
 }
 
-static inline int handle_merge_node_v4(RouteTreeHeadNode *head_node_v4,
+static inline int handle_merge_node_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
                         RouteTreeNodeV4 *parent_node_v4,
                         RouteTreeNodeV4 *child_node_v4,
-                        RouteTreeNodeV4 **target_node_v4)
+                        uint32_t *target_node_v4)
 {
     RouteTreeNodeV4 *new_node;
-    if (alloc_node_bulk_v4(head_node_v4, &new_node, 1)) {
+    if (alloc_node_bulk_v4(pool, head_node_v4, &new_node, 1)) {
         return -1;
     }
 
-    const uint32_t key = parent_node_v4->key | (child_node_v4->key >> parent_node_v4->key_bit_len);
+    const uint32_t key = parent_node_v4->key | (child_node_v4->key >> NODE_KEY_BIT_LEN(parent_node_v4));
 
     fill_node_v4(new_node,
-                parent_node_v4->key_bit_len + child_node_v4->key_bit_len,
+                NODE_KEY_BIT_LEN(parent_node_v4) + NODE_KEY_BIT_LEN(child_node_v4),
                 key,
-                child_node_v4->next_hop,
-                parent_node_v4->parent,
+                NODE_NEXT_HOP(child_node_v4),
                 child_node_v4->next_bit_0,
                 child_node_v4->next_bit_1);
 
-    *target_node_v4 = new_node;
+    RCU_STORE(*target_node_v4, route_tree_node_index_v4(pool, new_node));
 
-    free_node_v4(head_node_v4, parent_node_v4);
-    free_node_v4(head_node_v4, child_node_v4);
+    free_node_v4(pool, head_node_v4, parent_node_v4);
+    free_node_v4(pool, head_node_v4, child_node_v4);
 
     return 0;
 }
@@ -537,763 +1038,2713 @@ static inline void _merge_ipv6_key(uint8_t dst_bit_len,
     }
 }
 
-static inline int handle_merge_node_v6(RouteTreeHeadNode *head_node_v6,
+static inline int handle_merge_node_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
                         RouteTreeNodeV6 *parent_node_v6,
                         RouteTreeNodeV6 *child_node_v6,
-                        RouteTreeNodeV6 **target_node_v6)
+                        uint32_t *target_node_v6)
 {
     RouteTreeNodeV6 *new_node;
-    if (alloc_node_bulk_v6(head_node_v6, &new_node, 1)) {
+    if (alloc_node_bulk_v6(pool, head_node_v6, &new_node, 1)) {
         return -1;
     }
 
     RouteTreeIPV6 key = parent_node_v6->key;
-    _merge_ipv6_key(parent_node_v6->key_bit_len, &key, &child_node_v6->key);
+    _merge_ipv6_key(NODE_KEY_BIT_LEN(parent_node_v6), &key, &child_node_v6->key);
 
     fill_node_v6(new_node,
-                parent_node_v6->key_bit_len + child_node_v6->key_bit_len,
+                NODE_KEY_BIT_LEN(parent_node_v6) + NODE_KEY_BIT_LEN(child_node_v6),
                 &key,
-                child_node_v6->next_hop,
-                parent_node_v6->parent,
+                NODE_NEXT_HOP(child_node_v6),
                 child_node_v6->next_bit_0,
                 child_node_v6->next_bit_1);
 
-    *target_node_v6 = new_node;
+    RCU_STORE(*target_node_v6, route_tree_node_index_v6(pool, new_node));
 
-    free_node_v6(head_node_v6, parent_node_v6);
-    free_node_v6(head_node_v6, child_node_v6);
+    free_node_v6(pool, head_node_v6, parent_node_v6);
+    free_node_v6(pool, head_node_v6, child_node_v6);
 
     return 0;
 }
 
-static char _tree_iterate_str[128];
-
-static void _compressed_route_tree_iterate_v4(RouteTreeHeadNode *head_node_v4,
-                                        const RouteTreeNodeV4 *node_v4,
-                                        uint32_t ipv4,
-                                        uint8_t bit_offset,
-                                        uint32_t print_prefix,
-                                        bool print_tree,
-                                        bool reset)
+/*
+ * Find the longest route strictly shorter than depth_len covering ipv4,
+ * next_hop is -1 if there is none.
+ */
+static inline void lookup_cover_v4(const RouteTreePool *pool,
+                                const RouteTreeHeadNode *head_node_v4,
+                                uint32_t ipv4,
+                                uint8_t depth_len,
+                                int32_t *next_hop,
+                                uint8_t *cover_depth_len)
 {
-    ipv4 |= (node_v4->key >> bit_offset);
-    bit_offset += node_v4->key_bit_len;
+    *next_hop = -1;
+    *cover_depth_len = 0;
 
-    const uint8_t *p8 = (uint8_t *)&ipv4;
-    print_prefix += snprintf(_tree_iterate_str, sizeof(_tree_iterate_str),
-                            "%u.%u.%u.%u/%u next_hop=%d",
-                            p8[3], p8[2], p8[1], p8[0], bit_offset,
-                            node_v4->next_hop);
-    if (print_tree) {
-        printf("%s", _tree_iterate_str);
+    RouteTreeNodeV4 *node_v4;
+    if (GET_BIT_U32(ipv4, 31)) {
+        node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_1);
     }
-    if (node_v4->next_hop < 0
-            && (NULL == node_v4->next_bit_0 || NULL == node_v4->next_bit_1)) {
-        printf("%s is invalid node", _tree_iterate_str);
-        if (!print_tree) {
-            printf("\n");
-        }
+    else {
+        node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_0);
+    }
+    if (NULL == node_v4 || depth_len <= 1) {
+        return;
     }
 
-    const RouteTreeNodeV4 *next_node_v4;
-
-    next_node_v4 = node_v4->next_bit_0;
-    if (next_node_v4) {
-        if (print_tree) {
-            if (next_node_v4->parent != node_v4) {
-                printf(" -? ");
-            }
-            else {
-                printf(" -- ");
-            }
+    uint8_t bit_offset = 0;
+    uint32_t cover_next_hop;
+    enum RouteTreeReturnStatue status;
+    do {
+        status = lookup_subtree_v4(pool, node_v4, &node_v4, NULL, NULL, ipv4, depth_len - 1, &bit_offset, &cover_next_hop);
+        if (ROUTE_TREE_SUCCESS == status || ROUTE_TREE_SUCCESS_CONTINUE == status) {
+            *next_hop = cover_next_hop;
+            *cover_depth_len = bit_offset;
         }
-        _compressed_route_tree_iterate_v4(head_node_v4, next_node_v4,
-                ipv4, bit_offset, print_prefix + 4, print_tree, reset);
-    }
+    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+}
 
-    next_node_v4 = node_v4->next_bit_1;
-    if (next_node_v4) {
-        if (print_tree) {
-            printf("\n");
-            uint32_t i;
-            for (i = 0; i < print_prefix; ++i) {
-                printf(" ");
-            }
+/*
+ * Bulk load: routes in CPU order, masked, sorted by prefix then depth_len,
+ * which is the depth-first order of the tree.
+ */
+typedef struct {
+    // prefix << 8 | depth_len
+    uint64_t key;
+    uint32_t next_hop;
+    // batch ops: change of the route count the op made
+    int8_t route_delta;
+} BulkRouteV4;
+
+typedef struct {
+    RouteTreeIPV6 prefix;
+    uint32_t next_hop;
+    uint8_t depth_len;
+} BulkRouteV6;
+
+#define BULK_V4_PREFIX(route) ((uint32_t)((route)->key >> 8))
+#define BULK_V4_DEPTH_LEN(route) ((uint8_t)((route)->key & 0xff))
+
+// LSD radix sort, one byte per pass, stable so the last duplicate stays last
+static void bulk_sort_v4(BulkRouteV4 *routes, BulkRouteV4 *tmp, size_t n)
+{
+    BulkRouteV4 *src = routes;
+    BulkRouteV4 *dst = tmp;
+    uint32_t shift;
+
+    for (shift = 0; shift < 40; shift += 8) {
+        size_t count[256] = {0};
+        size_t i;
+        for (i = 0; i < n; ++i) {
+            count[(src[i].key >> shift) & 0xff]++;
+        }
+        if (count[(src[0].key >> shift) & 0xff] == n) {
+            // same byte everywhere
+            continue;
+        }
 
-            if (next_node_v4->parent != node_v4) {
-                printf(" |? ");
-            }
-            else {
-                printf(" |- ");
-            }
+        size_t pos = 0;
+        for (i = 0; i < 256; ++i) {
+            const size_t c = count[i];
+            count[i] = pos;
+            pos += c;
         }
-        _compressed_route_tree_iterate_v4(head_node_v4, next_node_v4,
-                ipv4, bit_offset, print_prefix + 4, print_tree, reset);
+        for (i = 0; i < n; ++i) {
+            dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+        }
+
+        BulkRouteV4 *swap = src;
+        src = dst;
+        dst = swap;
     }
 
-    if (reset) {
-        free_node_v4(head_node_v4, node_v4);
+    if (src != routes) {
+        memcpy(routes, src, sizeof(*routes) * n);
     }
 }
 
-static void _compressed_route_tree_iterate_v6(RouteTreeHeadNode *head_node_v6,
-                                        const RouteTreeNodeV6 *node_v6,
-                                        RouteTreeIPV6 *_ipv6,
-                                        uint8_t bit_offset,
-                                        uint32_t print_prefix,
-                                        bool print_tree,
-                                        bool reset)
+static inline uint8_t bulk_byte_v6(const BulkRouteV6 *route, uint32_t byte)
 {
-    RouteTreeIPV6 ipv6 = *_ipv6;
-    _merge_ipv6_key(bit_offset, &ipv6, &node_v6->key);
-    bit_offset += node_v6->key_bit_len;
+    return byte ? route->prefix.u8[byte - 1] : route->depth_len;
+}
 
-    print_prefix += snprintf(_tree_iterate_str, sizeof(_tree_iterate_str),
-                            "%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x/%u next_hop=%d",
-                            ipv6.u8[15], ipv6.u8[14], ipv6.u8[13], ipv6.u8[12],
-                            ipv6.u8[11], ipv6.u8[10], ipv6.u8[9], ipv6.u8[8],
-                            ipv6.u8[7], ipv6.u8[6], ipv6.u8[5], ipv6.u8[4],
-                            ipv6.u8[3], ipv6.u8[2], ipv6.u8[1], ipv6.u8[0],
-                            bit_offset,
-                            node_v6->next_hop);
-    if (print_tree) {
-        printf("%s", _tree_iterate_str);
-    }
-    if (node_v6->next_hop < 0
-            && (NULL == node_v6->next_bit_0 || NULL == node_v6->next_bit_1)) {
-        printf("%s is invalid node", _tree_iterate_str);
-        if (!print_tree) {
-            printf("\n");
+static void bulk_sort_v6(BulkRouteV6 *routes, BulkRouteV6 *tmp, size_t n)
+{
+    BulkRouteV6 *src = routes;
+    BulkRouteV6 *dst = tmp;
+    uint32_t byte;
+
+    // depth_len, then prefix from the lowest byte
+    for (byte = 0; byte <= sizeof(routes->prefix.u8); ++byte) {
+        size_t count[256] = {0};
+        size_t i;
+        for (i = 0; i < n; ++i) {
+            count[bulk_byte_v6(&src[i], byte)]++;
         }
+        if (count[bulk_byte_v6(&src[0], byte)] == n) {
+            // same byte everywhere
+            continue;
+        }
+
+        size_t pos = 0;
+        for (i = 0; i < 256; ++i) {
+            const size_t c = count[i];
+            count[i] = pos;
+            pos += c;
+        }
+        for (i = 0; i < n; ++i) {
+            dst[count[bulk_byte_v6(&src[i], byte)]++] = src[i];
+        }
+
+        BulkRouteV6 *swap = src;
+        src = dst;
+        dst = swap;
     }
 
-    const RouteTreeNodeV6 *next_node_v6;
+    if (src != routes) {
+        memcpy(routes, src, sizeof(*routes) * n);
+    }
+}
 
-    next_node_v6 = node_v6->next_bit_0;
-    if (next_node_v6) {
-        if (print_tree) {
-            if (next_node_v6->parent != node_v6) {
-                printf(" -? ");
-            }
-            else {
-                printf(" -- ");
-            }
+// first of routes[lo, hi) going below next_bit_1 at bit
+static inline size_t bulk_first_bit_1_v4(const BulkRouteV4 *routes, size_t lo, size_t hi, uint8_t bit)
+{
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (GET_BIT_U32(BULK_V4_PREFIX(&routes[mid]), 31 - bit)) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
         }
-        _compressed_route_tree_iterate_v6(head_node_v6, next_node_v6,
-                &ipv6, bit_offset, print_prefix + 4, print_tree, reset);
     }
+    return lo;
+}
 
-    next_node_v6 = node_v6->next_bit_1;
-    if (next_node_v6) {
-        if (print_tree) {
-            printf("\n");
-            uint32_t i;
-            for (i = 0; i < print_prefix; ++i) {
-                printf(" ");
-            }
-
-            if (next_node_v6->parent != node_v6) {
-                printf(" |? ");
-            }
-            else {
-                printf(" |- ");
-            }
+static inline size_t bulk_first_bit_1_v6(const BulkRouteV6 *routes, size_t lo, size_t hi, uint8_t bit)
+{
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (GET_BIT_U64_PTR(routes[mid].prefix.u64, 127 - bit)) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
         }
-        _compressed_route_tree_iterate_v6(head_node_v6, next_node_v6,
-                &ipv6, bit_offset, print_prefix + 4, print_tree, reset);
     }
+    return lo;
+}
 
-    if (reset) {
-        free_node_v6(head_node_v6, node_v6);
+/*
+ * routes[0, n) are sorted, unique, longer than bit_offset and share their
+ * first bit_offset + 1 bits, they form one node. Get where its key ends,
+ * whether routes[0] is the route of the node, and the first route going
+ * below next_bit_1.
+ * routes[0] has the shortest depth_len of any route ending before the last
+ * common bit, so the key end only needs the first and last routes.
+ */
+static inline void bulk_split_v4(const BulkRouteV4 *routes, size_t n,
+                                uint8_t *key_end,
+                                bool *has_route,
+                                size_t *split)
+{
+    const uint32_t first = BULK_V4_PREFIX(&routes[0]);
+    const uint32_t last = BULK_V4_PREFIX(&routes[n - 1]);
+    uint8_t end = first == last ? 32 : __builtin_clz(first ^ last);
+    if (end > BULK_V4_DEPTH_LEN(&routes[0])) {
+        end = BULK_V4_DEPTH_LEN(&routes[0]);
     }
+
+    *key_end = end;
+    *has_route = BULK_V4_DEPTH_LEN(&routes[0]) == end;
+
+    *split = bulk_first_bit_1_v4(routes, *has_route ? 1 : 0, n, end);
 }
 
+static inline void bulk_split_v6(const BulkRouteV6 *routes, size_t n,
+                                uint8_t *key_end,
+                                bool *has_route,
+                                size_t *split)
+{
+    uint32_t end = clz_u128(ipv6_to_u128(&routes[0].prefix) ^ ipv6_to_u128(&routes[n - 1].prefix));
+    if (end > routes[0].depth_len) {
+        end = routes[0].depth_len;
+    }
 
-// Public API:
+    *key_end = end;
+    *has_route = routes[0].depth_len == end;
 
+    *split = bulk_first_bit_1_v6(routes, *has_route ? 1 : 0, n, end);
+}
 
-size_t compressed_route_tree_get_memory_footprint_v4(const size_t v4_max_routes)
+static size_t bulk_count_v4(const BulkRouteV4 *routes, size_t n)
 {
-    // Circular queue need one extra space to distinguish queue empty/full.
-    return sizeof(**v4_nodes_pool) * N_ROUTES_TO_N_NODES(v4_max_routes)
-                + sizeof(*v4_nodes_pool) * (N_ROUTES_TO_N_NODES(v4_max_routes) + 1);
+    uint8_t key_end;
+    bool has_route;
+    size_t split;
+    bulk_split_v4(routes, n, &key_end, &has_route, &split);
+
+    const size_t rest = has_route ? 1 : 0;
+    size_t n_nodes = 1;
+    if (split > rest) {
+        n_nodes += bulk_count_v4(&routes[rest], split - rest);
+    }
+    if (n > split) {
+        n_nodes += bulk_count_v4(&routes[split], n - split);
+    }
+
+    return n_nodes;
 }
 
-size_t compressed_route_tree_get_memory_footprint_v6(const size_t v6_max_routes)
+static size_t bulk_count_v6(const BulkRouteV6 *routes, size_t n)
 {
-    // Circular queue need one extra space to distinguish queue empty/full.
-    return sizeof(**v6_nodes_pool) * N_ROUTES_TO_N_NODES(v6_max_routes)
-                + sizeof(*v6_nodes_pool) * (N_ROUTES_TO_N_NODES(v6_max_routes) + 1);
+    uint8_t key_end;
+    bool has_route;
+    size_t split;
+    bulk_split_v6(routes, n, &key_end, &has_route, &split);
+
+    const size_t rest = has_route ? 1 : 0;
+    size_t n_nodes = 1;
+    if (split > rest) {
+        n_nodes += bulk_count_v6(&routes[rest], split - rest);
+    }
+    if (n > split) {
+        n_nodes += bulk_count_v6(&routes[split], n - split);
+    }
+
+    return n_nodes;
 }
 
-int compressed_route_tree_init_nodes(void * const v4_nodes_pool_ptr,
-                                    const size_t v4_max_routes,
-                                    void * const v6_nodes_pool_ptr,
-                                    const size_t v6_max_routes)
+// fill node_v4, already taken from the pool, and build below it
+static void bulk_build_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                        RouteTreeNodeV4 *node_v4,
+                        const BulkRouteV4 *routes,
+                        size_t n,
+                        uint8_t bit_offset)
 {
-    v4_nodes_pool = (RouteTreeNodeV4 **)PTR_ADD(v4_nodes_pool_ptr, sizeof(**v4_nodes_pool) * N_ROUTES_TO_N_NODES(v4_max_routes));
-    // Circular queue need one extra space to distinguish queue empty/full.
-    v4_nodes_pool_total = N_ROUTES_TO_N_NODES(v4_max_routes) + 1;
-    v4_nodes_pool_front = 0;
-    v4_nodes_pool_rear  = 0;
+    uint8_t key_end;
+    bool has_route;
+    size_t split;
+    bulk_split_v4(routes, n, &key_end, &has_route, &split);
 
-    v6_nodes_pool = (RouteTreeNodeV6 **)PTR_ADD(v6_nodes_pool_ptr, sizeof(**v6_nodes_pool) * N_ROUTES_TO_N_NODES(v6_max_routes));
-    // Circular queue need one extra space to distinguish queue empty/full.
-    v6_nodes_pool_total = N_ROUTES_TO_N_NODES(v6_max_routes) + 1;
-    v6_nodes_pool_front = 0;
-    v6_nodes_pool_rear  = 0;
+    const size_t rest = has_route ? 1 : 0;
+    const size_t n_0 = split - rest;
+    const size_t n_1 = n - split;
 
-    size_t i;
-    for (i = 0; i < N_ROUTES_TO_N_NODES(v4_max_routes); ++i) {
-        RouteTreeNodeV4 *free_node = &((RouteTreeNodeV4 *)v4_nodes_pool_ptr)[i];
-        free_node->next_hop = -1;
-        if (_free_node_v4(free_node)) {
-            return -1;
-        }
+    // siblings are taken together so they sit next to each other
+    RouteTreeNodeV4 *child[2] = {NULL, NULL};
+    alloc_node_bulk_v4(pool, head_node_v4, child, (n_0 ? 1 : 0) + (n_1 ? 1 : 0));
+    if (0 == n_0) {
+        child[1] = child[0];
+        child[0] = NULL;
     }
-    for (i = 0; i < N_ROUTES_TO_N_NODES(v6_max_routes); ++i) {
-        RouteTreeNodeV6 *free_node = &((RouteTreeNodeV6 *)v6_nodes_pool_ptr)[i];
-        free_node->next_hop = -1;
-        if (_free_node_v6(free_node)) {
-            return -1;
-        }
+
+    fill_node_v4(node_v4, key_end - bit_offset,
+                GET_KEY_32(BULK_V4_PREFIX(&routes[0]), bit_offset, key_end - bit_offset),
+                has_route ? (int32_t)routes[0].next_hop : -1,
+                route_tree_node_index_v4(pool, child[0]),
+                route_tree_node_index_v4(pool, child[1]));
+
+    if (n_0) {
+        bulk_build_v4(pool, head_node_v4, child[0], &routes[rest], n_0, key_end);
     }
+    if (n_1) {
+        bulk_build_v4(pool, head_node_v4, child[1], &routes[split], n_1, key_end);
+    }
+}
 
-    return 0;
+static void bulk_build_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                        RouteTreeNodeV6 *node_v6,
+                        const BulkRouteV6 *routes,
+                        size_t n,
+                        uint8_t bit_offset)
+{
+    uint8_t key_end;
+    bool has_route;
+    size_t split;
+    bulk_split_v6(routes, n, &key_end, &has_route, &split);
+
+    const size_t rest = has_route ? 1 : 0;
+    const size_t n_0 = split - rest;
+    const size_t n_1 = n - split;
+
+    // siblings are taken together so they sit next to each other
+    RouteTreeNodeV6 *child[2] = {NULL, NULL};
+    alloc_node_bulk_v6(pool, head_node_v6, child, (n_0 ? 1 : 0) + (n_1 ? 1 : 0));
+    if (0 == n_0) {
+        child[1] = child[0];
+        child[0] = NULL;
+    }
+
+    RouteTreeIPV6 key;
+    get_key_ipv6(&routes[0].prefix, bit_offset, key_end - bit_offset, &key);
+    fill_node_v6(node_v6, key_end - bit_offset, &key,
+                has_route ? (int32_t)routes[0].next_hop : -1,
+                route_tree_node_index_v6(pool, child[0]),
+                route_tree_node_index_v6(pool, child[1]));
+
+    if (n_0) {
+        bulk_build_v6(pool, head_node_v6, child[0], &routes[rest], n_0, key_end);
+    }
+    if (n_1) {
+        bulk_build_v6(pool, head_node_v6, child[1], &routes[split], n_1, key_end);
+    }
 }
 
-void compressed_route_tree_reset_head(RouteTreeHeadNode *head_node)
+/*
+ * Batch commit: ops are BulkRouteV4/V6 sorted like a bulk load, a del has
+ * next_hop BATCH_DEL_NEXT_HOP. Nodes replaced by the shadow copies stay
+ * reachable by readers until the roots are swapped, so they are only queued
+ * in retired and freed after it; a failed commit just puts back what it took.
+ */
+#define BATCH_DEL_NEXT_HOP 0xffffffffU
+
+typedef struct {
+    RouteTreePool *pool;
+    RouteTreeHeadNode *head_node;
+
+    BatchIndexList retired;
+    // every node taken, to put them back if the commit fails
+    BatchIndexList taken;
+
+    size_t add_count;
+    size_t del_count;
+    bool failed;
+} BatchCommit;
+
+static inline void batch_retire(BatchCommit *commit, uint32_t index)
 {
-    memset(head_node, 0, sizeof(*head_node));
-    head_node->default_next_hop = -1;
+    if (batch_index_push(&commit->retired, index)) {
+        commit->failed = true;
+    }
 }
 
-size_t compressed_route_tree_pool_free_count_v4()
+// nodes of a failed commit, none was published
+static void batch_put_back(const PoolFamily *f, BatchCommit *commit)
 {
-    return (v4_nodes_pool_rear - v4_nodes_pool_front + v4_nodes_pool_total) % v4_nodes_pool_total;
+    RouteTreePoolCache *cache = pool_cache(f);
+    size_t i;
+
+    for (i = commit->taken.n; cache && i-- > 0;) {
+        pool_cache_push(f, cache, commit->taken.index[i]);
+    }
+    free(commit->taken.index);
+    free(commit->retired.index);
 }
 
-size_t compressed_route_tree_pool_count_v4()
+// next hop of a node after op
+static inline int32_t batch_apply(BatchCommit *commit, int32_t next_hop, uint32_t op_next_hop)
 {
-    // Circular queue need one extra space to distinguish queue empty/full.
-    return v4_nodes_pool_total - compressed_route_tree_pool_free_count_v4() - 1;
+    if (BATCH_DEL_NEXT_HOP == op_next_hop) {
+        if (next_hop >= 0) {
+            commit->del_count++;
+        }
+        return -1;
+    }
+
+    if (next_hop < 0) {
+        commit->add_count++;
+    }
+    return op_next_hop;
 }
 
-size_t compressed_route_tree_pool_free_count_v6()
+static inline RouteTreeNodeV4 *batch_alloc_v4(BatchCommit *commit)
 {
-    return (v6_nodes_pool_rear - v6_nodes_pool_front + v6_nodes_pool_total) % v6_nodes_pool_total;
+    RouteTreeNodeV4 *new_node;
+    if (alloc_node_bulk_v4(commit->pool, commit->head_node, &new_node, 1)) {
+        commit->failed = true;
+        return NULL;
+    }
+    return new_node;
 }
 
-size_t compressed_route_tree_pool_count_v6()
+static inline RouteTreeNodeV6 *batch_alloc_v6(BatchCommit *commit)
 {
-    // Circular queue need one extra space to distinguish queue empty/full.
-    return v6_nodes_pool_total - compressed_route_tree_pool_free_count_v6() - 1;
+    RouteTreeNodeV6 *new_node;
+    if (alloc_node_bulk_v6(commit->pool, commit->head_node, &new_node, 1)) {
+        commit->failed = true;
+        return NULL;
+    }
+    return new_node;
 }
 
-int compressed_route_tree_lookup_v4(const RouteTreeHeadNode *head_node_v4,
-                                uint32_t be_ipv4,
-                                uint32_t *next_hop)
+// new subtree from the adds of ops[0, n), there is no node below bit_offset
+static uint32_t batch_build_v4(BatchCommit *commit,
+                            BulkRouteV4 *ops,
+                            BulkRouteV4 *tmp,
+                            size_t n,
+                            uint8_t bit_offset)
 {
-    int ret = -1;
+    size_t n_adds = 0;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        ops[i].route_delta = 0;
+        if (BATCH_DEL_NEXT_HOP != ops[i].next_hop) {
+            ops[i].route_delta = 1;
+            tmp[n_adds++] = ops[i];
+        }
+    }
+    if (0 == n_adds) {
+        return 0;
+    }
 
-    if (head_node_v4->default_next_hop >= 0) {
-        *next_hop = head_node_v4->default_next_hop;
-        ret = 0;
+    RouteTreePool *pool = commit->pool;
+    const size_t n_nodes = bulk_count_v4(tmp, n_adds);
+    if (reserve_node_v4(pool, n_nodes)) {
+        commit->failed = true;
+        return 0;
     }
 
-    uint32_t ipv4 = ntohl(be_ipv4);
+    RouteTreeNodeV4 *new_node = NULL;
+    alloc_node_bulk_v4(pool, commit->head_node, &new_node, 1);
+    bulk_build_v4(pool, commit->head_node, new_node, tmp, n_adds, bit_offset);
+    commit->add_count += n_adds;
 
-    RouteTreeNodeV4 *node_v4;
-    if (GET_BIT_U32(ipv4, 31)) {
-        node_v4 = (RouteTreeNodeV4 *)head_node_v4->first_bit_1;
+    return route_tree_node_index_v4(pool, new_node);
+}
+
+static uint32_t batch_build_v6(BatchCommit *commit,
+                            const BulkRouteV6 *ops,
+                            BulkRouteV6 *tmp,
+                            size_t n,
+                            uint8_t bit_offset)
+{
+    size_t n_adds = 0;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (BATCH_DEL_NEXT_HOP != ops[i].next_hop) {
+            tmp[n_adds++] = ops[i];
+        }
     }
-    else {
-        node_v4 = (RouteTreeNodeV4 *)head_node_v4->first_bit_0;
+    if (0 == n_adds) {
+        return 0;
     }
-    if (NULL == node_v4) {
-        goto ret;
+
+    RouteTreePool *pool = commit->pool;
+    const size_t n_nodes = bulk_count_v6(tmp, n_adds);
+    if (reserve_node_v6(pool, n_nodes)) {
+        commit->failed = true;
+        return 0;
     }
 
-    uint8_t bit_offset = 0;
-    enum RouteTreeReturnStatue status;
-    do {
-        status = lookup_subtree_v4(node_v4, &node_v4, NULL, NULL, ipv4, 32, &bit_offset, next_hop);
-        if (ROUTE_TREE_SUCCESS == status || ROUTE_TREE_SUCCESS_CONTINUE == status) {
-            ret = 0;
-        }
-    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+    RouteTreeNodeV6 *new_node = NULL;
+    alloc_node_bulk_v6(pool, commit->head_node, &new_node, 1);
+    bulk_build_v6(pool, commit->head_node, new_node, tmp, n_adds, bit_offset);
+    commit->add_count += n_adds;
 
-ret:
-    return ret;
+    return route_tree_node_index_v6(pool, new_node);
 }
 
-int compressed_route_tree_lookup_v6(const RouteTreeHeadNode *head_node_v6,
-                                const uint8_t *be_ipv6_u8ptr,
-                                uint32_t *next_hop)
+/*
+ * New node made of key, next_hop and two subtrees. Without a route it is
+ * not kept: nothing if it has no child, merged into its child if it has one.
+ * A child not fresh from this commit is shared with the published tree, so
+ * it is copied rather than changed.
+ */
+static uint32_t batch_join_v4(BatchCommit *commit,
+                            uint8_t key_bit_len,
+                            uint32_t key,
+                            int32_t next_hop,
+                            uint32_t next_bit_0,
+                            uint32_t next_bit_1,
+                            bool fresh_0,
+                            bool fresh_1)
 {
-    int ret = -1;
+    RouteTreePool *pool = commit->pool;
+    RouteTreeNodeV4 *new_node;
 
-    if (head_node_v6->default_next_hop >= 0) {
-        *next_hop = head_node_v6->default_next_hop;
-        ret = 0;
-    }
+    if (next_hop < 0 && !(next_bit_0 && next_bit_1)) {
+        if (0 == next_bit_0 && 0 == next_bit_1) {
+            return 0;
+        }
 
-    RouteTreeIPV6 ipv6;
-    U8_PTR_TO_CPU_IPV6(ipv6, be_ipv6_u8ptr);
+        const uint32_t child = next_bit_0 ? next_bit_0 : next_bit_1;
+        const bool fresh = next_bit_0 ? fresh_0 : fresh_1;
+        RouteTreeNodeV4 *child_node_v4 = route_tree_node_v4(pool, child);
 
-    RouteTreeNodeV6 *node_v6;
-    if (GET_BIT_U64_PTR(ipv6.u64, 127)) {
-        node_v6 = (RouteTreeNodeV6 *)head_node_v6->first_bit_1;
-    }
-    else {
-        node_v6 = (RouteTreeNodeV6 *)head_node_v6->first_bit_0;
-    }
-    if (NULL == node_v6) {
-        goto ret;
-    }
+        new_node = fresh ? child_node_v4 : batch_alloc_v4(commit);
+        if (NULL == new_node) {
+            return 0;
+        }
 
-    uint8_t bit_offset = 0;
-    enum RouteTreeReturnStatue status;
-    do {
-        status = lookup_subtree_v6(node_v6, &node_v6, NULL, NULL, &ipv6, 128, &bit_offset, next_hop);
-        if (ROUTE_TREE_SUCCESS == status || ROUTE_TREE_SUCCESS_CONTINUE == status) {
-            ret = 0;
+        fill_node_v4(new_node,
+                    key_bit_len + NODE_KEY_BIT_LEN(child_node_v4),
+                    key | (child_node_v4->key >> key_bit_len),
+                    NODE_NEXT_HOP(child_node_v4),
+                    child_node_v4->next_bit_0,
+                    child_node_v4->next_bit_1);
+        if (!fresh) {
+            batch_retire(commit, child);
         }
-    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+        return route_tree_node_index_v4(pool, new_node);
+    }
 
-ret:
-    return ret;
+    new_node = batch_alloc_v4(commit);
+    if (NULL == new_node) {
+        return 0;
+    }
+    fill_node_v4(new_node, key_bit_len, key, next_hop, next_bit_0, next_bit_1);
+
+    return route_tree_node_index_v4(pool, new_node);
 }
 
-int compressed_route_tree_add_v4(RouteTreeHeadNode *head_node_v4,
-                            uint32_t be_ipv4,
-                            uint8_t depth_len,
-                            uint32_t next_hop)
+static uint32_t batch_join_v6(BatchCommit *commit,
+                            uint8_t key_bit_len,
+                            RouteTreeU128 key,
+                            int32_t next_hop,
+                            uint32_t next_bit_0,
+                            uint32_t next_bit_1,
+                            bool fresh_0,
+                            bool fresh_1)
 {
-    if (depth_len > 32) {
-        return -1;
+    RouteTreePool *pool = commit->pool;
+    RouteTreeNodeV6 *new_node;
+    RouteTreeIPV6 ipv6_key;
+
+    if (next_hop < 0 && !(next_bit_0 && next_bit_1)) {
+        if (0 == next_bit_0 && 0 == next_bit_1) {
+            return 0;
+        }
+
+        const uint32_t child = next_bit_0 ? next_bit_0 : next_bit_1;
+        const bool fresh = next_bit_0 ? fresh_0 : fresh_1;
+        RouteTreeNodeV6 *child_node_v6 = route_tree_node_v6(pool, child);
+
+        new_node = fresh ? child_node_v6 : batch_alloc_v6(commit);
+        if (NULL == new_node) {
+            return 0;
+        }
+
+        u128_to_ipv6(key | (ipv6_to_u128(&child_node_v6->key) >> key_bit_len), &ipv6_key);
+        fill_node_v6(new_node,
+                    key_bit_len + NODE_KEY_BIT_LEN(child_node_v6),
+                    &ipv6_key,
+                    NODE_NEXT_HOP(child_node_v6),
+                    child_node_v6->next_bit_0,
+                    child_node_v6->next_bit_1);
+        if (!fresh) {
+            batch_retire(commit, child);
+        }
+        return route_tree_node_index_v6(pool, new_node);
     }
 
-    if (0 == depth_len) {
-        head_node_v4->default_next_hop = next_hop;
+    new_node = batch_alloc_v6(commit);
+    if (NULL == new_node) {
         return 0;
     }
+    u128_to_ipv6(key, &ipv6_key);
+    fill_node_v6(new_node, key_bit_len, &ipv6_key, next_hop, next_bit_0, next_bit_1);
 
-    uint32_t ipv4 = ntohl(be_ipv4);
+    return route_tree_node_index_v6(pool, new_node);
+}
+
+/*
+ * Merge ops[0, n), sorted, unique, longer than bit_offset and sharing their
+ * first bit_offset + 1 bits, into the subtree of node index, whose key is
+ * taken from bit skip on when a new node has been put above it.
+ * Return the root of the merged subtree: index itself if nothing changed,
+ * otherwise a fresh node, index then being retired.
+ */
+static uint32_t batch_merge_v4(BatchCommit *commit,
+                            uint32_t index,
+                            uint8_t skip,
+                            BulkRouteV4 *ops,
+                            BulkRouteV4 *tmp,
+                            size_t n,
+                            uint8_t bit_offset)
+{
+    if (commit->failed) {
+        return 0;
+    }
+    if (0 == index) {
+        return batch_build_v4(commit, ops, tmp, n, bit_offset);
+    }
+
+    const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(commit->pool, index);
+    const uint8_t key_bit_len = NODE_KEY_BIT_LEN(node_v4) - skip;
+    const uint32_t key = node_v4->key << skip;
+    const uint8_t key_end = bit_offset + key_bit_len;
+
+    if (0 == n) {
+        if (0 == skip) {
+            return index;
+        }
+
+        // cut at skip
+        batch_retire(commit, index);
+        return batch_join_v4(commit, key_bit_len, key, NODE_NEXT_HOP(node_v4),
+                            node_v4->next_bit_0, node_v4->next_bit_1, false, false);
+    }
+
+    // where the ops leave the key, as in bulk_split_v4 with the node key as one more route
+    const uint32_t prefix = GET_KEY_32(BULK_V4_PREFIX(&ops[0]), 0, bit_offset) | (key >> bit_offset);
+    const uint32_t diff_first = BULK_V4_PREFIX(&ops[0]) ^ prefix;
+    const uint32_t diff_last = BULK_V4_PREFIX(&ops[n - 1]) ^ prefix;
+    uint8_t end = key_end;
+    if (diff_first && __builtin_clz(diff_first) < end) {
+        end = __builtin_clz(diff_first);
+    }
+    if (diff_last && __builtin_clz(diff_last) < end) {
+        end = __builtin_clz(diff_last);
+    }
+    if (BULK_V4_DEPTH_LEN(&ops[0]) < end) {
+        end = BULK_V4_DEPTH_LEN(&ops[0]);
+    }
+
+    int32_t next_hop = end == key_end ? NODE_NEXT_HOP(node_v4) : -1;
+    size_t rest = 0;
+    if (BULK_V4_DEPTH_LEN(&ops[0]) == end) {
+        const int32_t old_next_hop = next_hop;
+        next_hop = batch_apply(commit, next_hop, ops[0].next_hop);
+        ops[0].route_delta = (next_hop >= 0) - (old_next_hop >= 0);
+        rest = 1;
+    }
+    const size_t split = bulk_first_bit_1_v4(ops, rest, n, end);
+
+    if (end == key_end) {
+        // the ops go through the node
+        const uint32_t next_bit_0 = batch_merge_v4(commit, node_v4->next_bit_0, 0,
+                                                &ops[rest], &tmp[rest], split - rest, end);
+        const uint32_t next_bit_1 = batch_merge_v4(commit, node_v4->next_bit_1, 0,
+                                                &ops[split], &tmp[split], n - split, end);
+        if (0 == skip && next_hop == NODE_NEXT_HOP(node_v4)
+                && next_bit_0 == node_v4->next_bit_0 && next_bit_1 == node_v4->next_bit_1) {
+            return index;
+        }
+
+        batch_retire(commit, index);
+        return batch_join_v4(commit, key_bit_len, key, next_hop, next_bit_0, next_bit_1,
+                            next_bit_0 != node_v4->next_bit_0, next_bit_1 != node_v4->next_bit_1);
+    }
+
+    // the ops leave the key before its end: new node above the node cut at end
+    const uint8_t cut = end - bit_offset;
+    uint32_t next_bit[2];
+    if (GET_BIT_U32(key, 31 - cut)) {
+        next_bit[0] = batch_merge_v4(commit, 0, 0, &ops[rest], &tmp[rest], split - rest, end);
+        next_bit[1] = batch_merge_v4(commit, index, skip + cut, &ops[split], &tmp[split], n - split, end);
+    }
+    else {
+        next_bit[0] = batch_merge_v4(commit, index, skip + cut, &ops[rest], &tmp[rest], split - rest, end);
+        next_bit[1] = batch_merge_v4(commit, 0, 0, &ops[split], &tmp[split], n - split, end);
+    }
+
+    return batch_join_v4(commit, cut, GET_KEY_32(key, 0, cut), next_hop, next_bit[0], next_bit[1], true, true);
+}
+
+static uint32_t batch_merge_v6(BatchCommit *commit,
+                            uint32_t index,
+                            uint8_t skip,
+                            const BulkRouteV6 *ops,
+                            BulkRouteV6 *tmp,
+                            size_t n,
+                            uint8_t bit_offset)
+{
+    if (commit->failed) {
+        return 0;
+    }
+    if (0 == index) {
+        return batch_build_v6(commit, ops, tmp, n, bit_offset);
+    }
+
+    const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(commit->pool, index);
+    const uint8_t key_bit_len = NODE_KEY_BIT_LEN(node_v6) - skip;
+    const RouteTreeU128 key = ipv6_to_u128(&node_v6->key) << skip;
+    const uint8_t key_end = bit_offset + key_bit_len;
+
+    if (0 == n) {
+        if (0 == skip) {
+            return index;
+        }
+
+        // cut at skip
+        batch_retire(commit, index);
+        return batch_join_v6(commit, key_bit_len, key, NODE_NEXT_HOP(node_v6),
+                            node_v6->next_bit_0, node_v6->next_bit_1, false, false);
+    }
+
+    // where the ops leave the key, as in bulk_split_v6 with the node key as one more route
+    const RouteTreeU128 first = ipv6_to_u128(&ops[0].prefix);
+    const RouteTreeU128 prefix = (bit_offset ? first >> (128 - bit_offset) << (128 - bit_offset) : 0)
+                                    | (key >> bit_offset);
+    uint32_t end = key_end;
+    uint32_t diff_bit = clz_u128(first ^ prefix);
+    if (diff_bit < end) {
+        end = diff_bit;
+    }
+    diff_bit = clz_u128(ipv6_to_u128(&ops[n - 1].prefix) ^ prefix);
+    if (diff_bit < end) {
+        end = diff_bit;
+    }
+    if (ops[0].depth_len < end) {
+        end = ops[0].depth_len;
+    }
+
+    int32_t next_hop = end == key_end ? NODE_NEXT_HOP(node_v6) : -1;
+    size_t rest = 0;
+    if (ops[0].depth_len == end) {
+        next_hop = batch_apply(commit, next_hop, ops[0].next_hop);
+        rest = 1;
+    }
+    const size_t split = bulk_first_bit_1_v6(ops, rest, n, end);
+
+    if (end == key_end) {
+        // the ops go through the node
+        const uint32_t next_bit_0 = batch_merge_v6(commit, node_v6->next_bit_0, 0,
+                                                &ops[rest], &tmp[rest], split - rest, end);
+        const uint32_t next_bit_1 = batch_merge_v6(commit, node_v6->next_bit_1, 0,
+                                                &ops[split], &tmp[split], n - split, end);
+        if (0 == skip && next_hop == NODE_NEXT_HOP(node_v6)
+                && next_bit_0 == node_v6->next_bit_0 && next_bit_1 == node_v6->next_bit_1) {
+            return index;
+        }
+
+        batch_retire(commit, index);
+        return batch_join_v6(commit, key_bit_len, key, next_hop, next_bit_0, next_bit_1,
+                            next_bit_0 != node_v6->next_bit_0, next_bit_1 != node_v6->next_bit_1);
+    }
+
+    // the ops leave the key before its end: new node above the node cut at end
+    const uint8_t cut = end - bit_offset;
+    uint32_t next_bit[2];
+    if ((key >> (127 - cut)) & 0x1) {
+        next_bit[0] = batch_merge_v6(commit, 0, 0, &ops[rest], &tmp[rest], split - rest, end);
+        next_bit[1] = batch_merge_v6(commit, index, skip + cut, &ops[split], &tmp[split], n - split, end);
+    }
+    else {
+        next_bit[0] = batch_merge_v6(commit, index, skip + cut, &ops[rest], &tmp[rest], split - rest, end);
+        next_bit[1] = batch_merge_v6(commit, 0, 0, &ops[split], &tmp[split], n - split, end);
+    }
+
+    return batch_join_v6(commit, cut, key >> (128 - cut) << (128 - cut), next_hop, next_bit[0], next_bit[1], true, true);
+}
+
+static char _tree_iterate_str[128];
+
+static void _compressed_route_tree_iterate_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                        const RouteTreeNodeV4 *node_v4,
+                                        uint32_t ipv4,
+                                        uint8_t bit_offset,
+                                        uint32_t print_prefix,
+                                        bool print_tree,
+                                        bool reset)
+{
+    ipv4 |= (node_v4->key >> bit_offset);
+    bit_offset += NODE_KEY_BIT_LEN(node_v4);
+
+    const uint8_t *p8 = (uint8_t *)&ipv4;
+    print_prefix += snprintf(_tree_iterate_str, sizeof(_tree_iterate_str),
+                            "%u.%u.%u.%u/%u next_hop=%d",
+                            p8[3], p8[2], p8[1], p8[0], bit_offset,
+                            NODE_NEXT_HOP(node_v4));
+    if (print_tree) {
+        printf("%s", _tree_iterate_str);
+    }
+    if (NODE_NEXT_HOP(node_v4) < 0
+            && (0 == node_v4->next_bit_0 || 0 == node_v4->next_bit_1)) {
+        printf("%s is invalid node", _tree_iterate_str);
+        if (!print_tree) {
+            printf("\n");
+        }
+    }
+
+    const RouteTreeNodeV4 *next_node_v4;
+
+    next_node_v4 = route_tree_node_v4(pool, node_v4->next_bit_0);
+    if (next_node_v4) {
+        if (print_tree) {
+            printf(" -- ");
+        }
+        _compressed_route_tree_iterate_v4(pool, head_node_v4, next_node_v4,
+                ipv4, bit_offset, print_prefix + 4, print_tree, reset);
+    }
+
+    next_node_v4 = route_tree_node_v4(pool, node_v4->next_bit_1);
+    if (next_node_v4) {
+        if (print_tree) {
+            printf("\n");
+            uint32_t i;
+            for (i = 0; i < print_prefix; ++i) {
+                printf(" ");
+            }
+
+            printf(" |- ");
+        }
+        _compressed_route_tree_iterate_v4(pool, head_node_v4, next_node_v4,
+                ipv4, bit_offset, print_prefix + 4, print_tree, reset);
+    }
+
+    if (reset) {
+        free_node_v4(pool, head_node_v4, (RouteTreeNodeV4 *)node_v4);
+    }
+}
+
+static void _compressed_route_tree_iterate_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                        const RouteTreeNodeV6 *node_v6,
+                                        RouteTreeIPV6 *_ipv6,
+                                        uint8_t bit_offset,
+                                        uint32_t print_prefix,
+                                        bool print_tree,
+                                        bool reset)
+{
+    RouteTreeIPV6 ipv6 = *_ipv6;
+    _merge_ipv6_key(bit_offset, &ipv6, &node_v6->key);
+    bit_offset += NODE_KEY_BIT_LEN(node_v6);
+
+    print_prefix += snprintf(_tree_iterate_str, sizeof(_tree_iterate_str),
+                            "%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x/%u next_hop=%d",
+                            ipv6.u8[15], ipv6.u8[14], ipv6.u8[13], ipv6.u8[12],
+                            ipv6.u8[11], ipv6.u8[10], ipv6.u8[9], ipv6.u8[8],
+                            ipv6.u8[7], ipv6.u8[6], ipv6.u8[5], ipv6.u8[4],
+                            ipv6.u8[3], ipv6.u8[2], ipv6.u8[1], ipv6.u8[0],
+                            bit_offset,
+                            NODE_NEXT_HOP(node_v6));
+    if (print_tree) {
+        printf("%s", _tree_iterate_str);
+    }
+    if (NODE_NEXT_HOP(node_v6) < 0
+            && (0 == node_v6->next_bit_0 || 0 == node_v6->next_bit_1)) {
+        printf("%s is invalid node", _tree_iterate_str);
+        if (!print_tree) {
+            printf("\n");
+        }
+    }
+
+    const RouteTreeNodeV6 *next_node_v6;
+
+    next_node_v6 = route_tree_node_v6(pool, node_v6->next_bit_0);
+    if (next_node_v6) {
+        if (print_tree) {
+            printf(" -- ");
+        }
+        _compressed_route_tree_iterate_v6(pool, head_node_v6, next_node_v6,
+                &ipv6, bit_offset, print_prefix + 4, print_tree, reset);
+    }
+
+    next_node_v6 = route_tree_node_v6(pool, node_v6->next_bit_1);
+    if (next_node_v6) {
+        if (print_tree) {
+            printf("\n");
+            uint32_t i;
+            for (i = 0; i < print_prefix; ++i) {
+                printf(" ");
+            }
+
+            printf(" |- ");
+        }
+        _compressed_route_tree_iterate_v6(pool, head_node_v6, next_node_v6,
+                &ipv6, bit_offset, print_prefix + 4, print_tree, reset);
+    }
+
+    if (reset) {
+        free_node_v6(pool, head_node_v6, (RouteTreeNodeV6 *)node_v6);
+    }
+}
+
+
+// Internal hooks:
+
+
+uint64_t route_tree_rcu_start_grace_period(void)
+{
+    // everything unlinked so far is invisible to a reader which has seen the new epoch
+    return __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+bool route_tree_rcu_grace_period_done(uint64_t epoch)
+{
+    const uint32_t used = __atomic_load_n(&rcu_readers_used, __ATOMIC_ACQUIRE);
+    uint32_t i;
+    for (i = 0; i < used; ++i) {
+        const uint64_t reader_epoch = __atomic_load_n(&rcu_readers[i].epoch, __ATOMIC_ACQUIRE);
+        if (reader_epoch && reader_epoch < epoch) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t route_tree_pool_growable_layout(RouteTreePool *pool, void *nodes_ptr)
+{
+    // sections on huge page boundaries, each grows from its start
+    const size_t v6_nodes_offset = ALIGN_UP(sizeof(RouteTreeNodeV4) * pool->v4_nodes_pool_max, POOL_GROWABLE_ALIGN);
+
+    if (nodes_ptr) {
+        pool->v4_nodes = (RouteTreeNodeV4 *)nodes_ptr;
+        pool->v6_nodes = (RouteTreeNodeV6 *)PTR_ADD(nodes_ptr, v6_nodes_offset);
+    }
+    return v6_nodes_offset + sizeof(RouteTreeNodeV6) * pool->v6_nodes_pool_max;
+}
+
+void route_tree_pool_set_used_v4(RouteTreePool *pool, const uint8_t *used)
+{
+    const PoolFamily f = pool_v4(pool);
+    pool_set_used(&f, used);
+}
+
+void route_tree_pool_set_used_v6(RouteTreePool *pool, const uint8_t *used)
+{
+    const PoolFamily f = pool_v6(pool);
+    pool_set_used(&f, used);
+}
+
+void route_tree_bump_generation(RouteTreeHeadNode *head_node)
+{
+    // after the change is published, a reader seeing the new value sees the change
+    RCU_STORE(head_node->generation, __atomic_add_fetch(&route_generation, 1, __ATOMIC_RELAXED));
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_get_memory_footprint_v4(const size_t v4_max_routes)
+{
+    // Node index 0 is reserved as no node.
+    return sizeof(RouteTreeNodeV4) * (N_ROUTES_TO_N_NODES(v4_max_routes) + 1);
+}
+
+size_t compressed_route_tree_get_memory_footprint_v6(const size_t v6_max_routes)
+{
+    // Node index 0 is reserved as no node.
+    return sizeof(RouteTreeNodeV6) * (N_ROUTES_TO_N_NODES(v6_max_routes) + 1);
+}
+
+int compressed_route_tree_init_nodes(RouteTreePool *pool,
+                                    void * const v4_nodes_pool_ptr,
+                                    const size_t v4_max_routes,
+                                    void * const v6_nodes_pool_ptr,
+                                    const size_t v6_max_routes)
+{
+    // node index must fit in 32 bits
+    if (N_ROUTES_TO_N_NODES(v4_max_routes) >= UINT32_MAX || N_ROUTES_TO_N_NODES(v6_max_routes) >= UINT32_MAX) {
+        return -1;
+    }
+
+    pool->v4_nodes = (RouteTreeNodeV4 *)v4_nodes_pool_ptr;
+    pool->v6_nodes = (RouteTreeNodeV6 *)v6_nodes_pool_ptr;
+    pool->v4_nodes_pool_max = 0;
+    pool->v6_nodes_pool_max = 0;
+
+    const PoolFamily v4 = pool_v4(pool);
+    const PoolFamily v6 = pool_v6(pool);
+    pool_init(&v4, N_ROUTES_TO_N_NODES(v4_max_routes) + 1);
+    pool_init(&v6, N_ROUTES_TO_N_NODES(v6_max_routes) + 1);
+
+    return 0;
+}
+
+size_t compressed_route_tree_get_memory_footprint_growable(const size_t v4_max_routes, const size_t v6_max_routes)
+{
+    RouteTreePool pool = {
+        .v4_nodes_pool_max = N_ROUTES_TO_N_NODES(v4_max_routes) + 1,
+        .v6_nodes_pool_max = N_ROUTES_TO_N_NODES(v6_max_routes) + 1,
+    };
+    return route_tree_pool_growable_layout(&pool, NULL);
+}
+
+int compressed_route_tree_init_nodes_growable(RouteTreePool *pool,
+                                            void * const nodes_ptr,
+                                            const size_t v4_max_routes,
+                                            const size_t v6_max_routes)
+{
+    // node index must fit in 32 bits
+    if (N_ROUTES_TO_N_NODES(v4_max_routes) >= UINT32_MAX || N_ROUTES_TO_N_NODES(v6_max_routes) >= UINT32_MAX) {
+        return -1;
+    }
+
+    pool->v4_nodes_pool_max = N_ROUTES_TO_N_NODES(v4_max_routes) + 1;
+    pool->v6_nodes_pool_max = N_ROUTES_TO_N_NODES(v6_max_routes) + 1;
+    route_tree_pool_growable_layout(pool, nodes_ptr);
+
+    // one slab each to start with
+    const PoolFamily v4 = pool_v4(pool);
+    const PoolFamily v6 = pool_v6(pool);
+    pool_init(&v4, pool_grow_total(0, pool->v4_nodes_pool_max, 1));
+    pool_init(&v6, pool_grow_total(0, pool->v6_nodes_pool_max, 1));
+
+    return 0;
+}
+
+size_t compressed_route_tree_pool_shrink_v4(RouteTreePool *pool)
+{
+    const PoolFamily f = pool_v4(pool);
+    return pool_shrink(&f);
+}
+
+size_t compressed_route_tree_pool_shrink_v6(RouteTreePool *pool)
+{
+    const PoolFamily f = pool_v6(pool);
+    return pool_shrink(&f);
+}
+
+void compressed_route_tree_reset_head(RouteTreeHeadNode *head_node)
+{
+    memset(head_node, 0, sizeof(*head_node));
+    head_node->default_next_hop = -1;
+    route_tree_bump_generation(head_node);
+}
+
+size_t compressed_route_tree_pool_free_count_v4(const RouteTreePool *pool)
+{
+    const PoolFamily f = pool_v4(pool);
+    return pool_free_count(&f);
+}
+
+size_t compressed_route_tree_pool_count_v4(const RouteTreePool *pool)
+{
+    // Node index 0 is reserved as no node.
+    if (0 == pool->v4_nodes_pool_total) {
+        return 0;
+    }
+    return pool->v4_nodes_pool_total - compressed_route_tree_pool_free_count_v4(pool) - 1;
+}
+
+size_t compressed_route_tree_pool_free_count_v6(const RouteTreePool *pool)
+{
+    const PoolFamily f = pool_v6(pool);
+    return pool_free_count(&f);
+}
+
+size_t compressed_route_tree_pool_count_v6(const RouteTreePool *pool)
+{
+    // Node index 0 is reserved as no node.
+    if (0 == pool->v6_nodes_pool_total) {
+        return 0;
+    }
+    return pool->v6_nodes_pool_total - compressed_route_tree_pool_free_count_v6(pool) - 1;
+}
+
+/*
+ * result, if not NULL, also gets the node and depth_len of the route found,
+ * the LC-trie copy does not know them so the tree is walked.
+ */
+static inline __attribute__((always_inline)) int _lookup_v4(const RouteTreePool *pool,
+                                const RouteTreeHeadNode *head_node_v4,
+                                uint32_t be_ipv4,
+                                uint32_t *next_hop,
+                                RouteTreeLookupResult *result)
+{
+    int ret = -1;
+    uint32_t n_visited = 0;
+    bool tree_hit = false;
+
+    const int32_t default_next_hop = RCU_LOAD(head_node_v4->default_next_hop);
+    if (default_next_hop >= 0) {
+        *next_hop = default_next_hop;
+        ret = 0;
+    }
+    if (result) {
+        result->handle = 0;
+        result->depth_len = 0;
+    }
+
+    uint32_t ipv4 = ntohl(be_ipv4);
+
+    const void *lc_v4 = result ? NULL : RCU_LOAD(head_node_v4->lc_v4);
+    if (lc_v4) {
+        if (0 == route_tree_lc_v4_lookup(lc_v4, ipv4, next_hop, &n_visited)) {
+            tree_hit = true;
+            ret = 0;
+        }
+        goto ret;
+    }
+
+    // handles and lengths are those of the routes of the head
+    const RouteTreeHeadNode *tree_v4 = result ? head_node_v4 : route_tree_lookup_tree(head_node_v4);
+    RouteTreeNodeV4 *node_v4;
+    if (GET_BIT_U32(ipv4, 31)) {
+        node_v4 = route_tree_node_v4(pool, RCU_LOAD(tree_v4->first_bit_1));
+    }
+    else {
+        node_v4 = route_tree_node_v4(pool, RCU_LOAD(tree_v4->first_bit_0));
+    }
+    if (NULL == node_v4) {
+        goto ret;
+    }
+
+    uint8_t bit_offset = 0;
+    enum RouteTreeReturnStatue status;
+    do {
+        const RouteTreeNodeV4 *matched_node_v4 = node_v4;
+        status = lookup_subtree_v4(pool, node_v4, &node_v4, NULL, NULL, ipv4, 32, &bit_offset, next_hop);
+        n_visited++;
+        if (ROUTE_TREE_SUCCESS == status || ROUTE_TREE_SUCCESS_CONTINUE == status) {
+            tree_hit = true;
+            ret = 0;
+            if (result) {
+                result->handle = route_tree_node_index_v4(pool, matched_node_v4);
+                result->depth_len = bit_offset;
+            }
+        }
+    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+
+ret:
+    ROUTE_TREE_STATS_LOOKUP(v4, n_visited, tree_hit, 0 == ret);
+    return ret;
+}
+
+int compressed_route_tree_lookup_v4(const RouteTreePool *pool,
+                                const RouteTreeHeadNode *head_node_v4,
+                                uint32_t be_ipv4,
+                                uint32_t *next_hop)
+{
+    return _lookup_v4(pool, head_node_v4, be_ipv4, next_hop, NULL);
+}
+
+int compressed_route_tree_lookup_ext_v4(const RouteTreePool *pool,
+                                    const RouteTreeHeadNode *head_node_v4,
+                                    uint32_t be_ipv4,
+                                    RouteTreeLookupResult *result)
+{
+    return _lookup_v4(pool, head_node_v4, be_ipv4, &result->next_hop, result);
+}
+
+static inline __attribute__((always_inline)) int _lookup_v6(const RouteTreePool *pool,
+                                const RouteTreeHeadNode *head_node_v6,
+                                const uint8_t *be_ipv6_u8ptr,
+                                uint32_t *next_hop,
+                                RouteTreeLookupResult *result,
+                                const bool simd)
+{
+    int ret = -1;
+    uint32_t n_visited = 0;
+    bool tree_hit = false;
+
+    const int32_t default_next_hop = RCU_LOAD(head_node_v6->default_next_hop);
+    if (default_next_hop >= 0) {
+        *next_hop = default_next_hop;
+        ret = 0;
+    }
+    if (result) {
+        result->handle = 0;
+        result->depth_len = 0;
+    }
+
+    RouteTreeIPV6 ipv6;
+    if (simd) {
+        be_ipv6_to_cpu_simd(be_ipv6_u8ptr, &ipv6);
+    }
+    else {
+        U8_PTR_TO_CPU_IPV6(ipv6, be_ipv6_u8ptr);
+    }
+
+    const void *bsl_v6 = result ? NULL : RCU_LOAD(head_node_v6->bsl_v6);
+    if (bsl_v6) {
+        if (0 == route_tree_bsl_v6_lookup(bsl_v6, &ipv6, next_hop, &n_visited)) {
+            tree_hit = true;
+            ret = 0;
+        }
+        goto ret;
+    }
+
+    const void *v6_64 = result ? NULL : RCU_LOAD(head_node_v6->v6_64);
+    if (v6_64) {
+        const int found = route_tree_v6_64_lookup(v6_64, &ipv6, next_hop, &n_visited);
+        if (0 == found) {
+            tree_hit = true;
+            ret = 0;
+        }
+        if (found <= 0) {
+            goto ret;
+        }
+        // routes longer than /64 below the address
+    }
+
+    // handles and lengths are those of the routes of the head
+    const RouteTreeHeadNode *tree_v6 = result ? head_node_v6 : route_tree_lookup_tree(head_node_v6);
+    RouteTreeNodeV6 *node_v6;
+    if (GET_BIT_U64_PTR(ipv6.u64, 127)) {
+        node_v6 = route_tree_node_v6(pool, RCU_LOAD(tree_v6->first_bit_1));
+    }
+    else {
+        node_v6 = route_tree_node_v6(pool, RCU_LOAD(tree_v6->first_bit_0));
+    }
+    if (NULL == node_v6) {
+        goto ret;
+    }
+
+    uint8_t bit_offset = 0;
+    enum RouteTreeReturnStatue status;
+    do {
+        const RouteTreeNodeV6 *matched_node_v6 = node_v6;
+        status = lookup_subtree_v6(pool, node_v6, &node_v6, NULL, NULL, &ipv6, 128, &bit_offset, next_hop, simd);
+        n_visited++;
+        if (ROUTE_TREE_SUCCESS == status || ROUTE_TREE_SUCCESS_CONTINUE == status) {
+            tree_hit = true;
+            ret = 0;
+            if (result) {
+                result->handle = route_tree_node_index_v6(pool, matched_node_v6);
+                result->depth_len = bit_offset;
+            }
+        }
+    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+
+ret:
+    ROUTE_TREE_STATS_LOOKUP(v6, n_visited, tree_hit, 0 == ret);
+    return ret;
+}
+
+static IPV6_SIMD_TARGET int _lookup_v6_simd(const RouteTreePool *pool,
+                                        const RouteTreeHeadNode *head_node_v6,
+                                        const uint8_t *be_ipv6_u8ptr,
+                                        uint32_t *next_hop)
+{
+    return _lookup_v6(pool, head_node_v6, be_ipv6_u8ptr, next_hop, NULL, true);
+}
+
+static IPV6_SIMD_TARGET int _lookup_ext_v6_simd(const RouteTreePool *pool,
+                                            const RouteTreeHeadNode *head_node_v6,
+                                            const uint8_t *be_ipv6_u8ptr,
+                                            RouteTreeLookupResult *result)
+{
+    return _lookup_v6(pool, head_node_v6, be_ipv6_u8ptr, &result->next_hop, result, true);
+}
+
+int compressed_route_tree_lookup_v6(const RouteTreePool *pool,
+                                const RouteTreeHeadNode *head_node_v6,
+                                const uint8_t *be_ipv6_u8ptr,
+                                uint32_t *next_hop)
+{
+    if (ipv6_simd) {
+        return _lookup_v6_simd(pool, head_node_v6, be_ipv6_u8ptr, next_hop);
+    }
+    return _lookup_v6(pool, head_node_v6, be_ipv6_u8ptr, next_hop, NULL, false);
+}
+
+int compressed_route_tree_lookup_ext_v6(const RouteTreePool *pool,
+                                    const RouteTreeHeadNode *head_node_v6,
+                                    const uint8_t *be_ipv6_u8ptr,
+                                    RouteTreeLookupResult *result)
+{
+    if (ipv6_simd) {
+        return _lookup_ext_v6_simd(pool, head_node_v6, be_ipv6_u8ptr, result);
+    }
+    return _lookup_v6(pool, head_node_v6, be_ipv6_u8ptr, &result->next_hop, result, false);
+}
+
+uint32_t compressed_route_tree_route_handle_v4(const RouteTreePool *pool,
+                                            const RouteTreeHeadNode *head_node_v4,
+                                            uint32_t be_ipv4,
+                                            uint8_t depth_len)
+{
+    if (0 == depth_len || depth_len > 32) {
+        return 0;
+    }
+
+    const uint32_t ipv4 = ntohl(be_ipv4);
+    RouteTreeNodeV4 *node_v4;
+    if (GET_BIT_U32(ipv4, 31)) {
+        node_v4 = route_tree_node_v4(pool, RCU_LOAD(head_node_v4->first_bit_1));
+    }
+    else {
+        node_v4 = route_tree_node_v4(pool, RCU_LOAD(head_node_v4->first_bit_0));
+    }
+    if (NULL == node_v4) {
+        return 0;
+    }
+
+    uint8_t bit_offset = 0;
+    uint32_t next_hop;
+    enum RouteTreeReturnStatue status;
+    do {
+        status = lookup_subtree_v4(pool, node_v4, &node_v4, NULL, NULL, ipv4, depth_len, &bit_offset, &next_hop);
+    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+
+    if (ROUTE_TREE_SUCCESS == status && bit_offset == depth_len) {
+        return route_tree_node_index_v4(pool, node_v4);
+    }
+    return 0;
+}
+
+uint32_t compressed_route_tree_route_handle_v6(const RouteTreePool *pool,
+                                            const RouteTreeHeadNode *head_node_v6,
+                                            const uint8_t *be_ipv6_u8ptr,
+                                            uint8_t depth_len)
+{
+    if (0 == depth_len || depth_len > 128) {
+        return 0;
+    }
+
+    RouteTreeIPV6 ipv6;
+    U8_PTR_TO_CPU_IPV6(ipv6, be_ipv6_u8ptr);
+
+    RouteTreeNodeV6 *node_v6;
+    if (GET_BIT_U64_PTR(ipv6.u64, 127)) {
+        node_v6 = route_tree_node_v6(pool, RCU_LOAD(head_node_v6->first_bit_1));
+    }
+    else {
+        node_v6 = route_tree_node_v6(pool, RCU_LOAD(head_node_v6->first_bit_0));
+    }
+    if (NULL == node_v6) {
+        return 0;
+    }
+
+    uint8_t bit_offset = 0;
+    uint32_t next_hop;
+    enum RouteTreeReturnStatue status;
+    do {
+        status = lookup_subtree_v6(pool, node_v6, &node_v6, NULL, NULL, &ipv6, depth_len, &bit_offset, &next_hop, false);
+    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+
+    if (ROUTE_TREE_SUCCESS == status && bit_offset == depth_len) {
+        return route_tree_node_index_v6(pool, node_v6);
+    }
+    return 0;
+}
+
+/*
+ * head_nodes, if not NULL, gives the head of each lane instead of
+ * head_node, NULL for a lane without one; lanes in a row with the same
+ * head load it once.
+ */
+static inline __attribute__((always_inline)) size_t _lookup_bulk_v4(const RouteTreePool *pool,
+                            const RouteTreeHeadNode *head_node_v4,
+                            const RouteTreeHeadNode * const *head_nodes,
+                            const uint32_t *be_ipv4,
+                            size_t n,
+                            uint32_t *next_hop,
+                            uint64_t *hit_mask)
+{
+    RouteTreeNodeV4 *node_v4[BULK_LOOKUP_LANES];
+    uint32_t ipv4[BULK_LOOKUP_LANES];
+    uint8_t bit_offset[BULK_LOOKUP_LANES];
+    uint8_t n_visited[BULK_LOOKUP_LANES];
+    uint64_t active = 0;
+    uint64_t hit = 0;
+    uint64_t tree_hit = 0;
+    size_t i;
+
+    const RouteTreeHeadNode *head = NULL;
+    int32_t default_next_hop = -1;
+    RouteTreeNodeV4 *first_bit_0 = NULL;
+    RouteTreeNodeV4 *first_bit_1 = NULL;
+    for (i = 0; i < n; ++i) {
+        if (0 == i || (head_nodes && head_nodes[i] != head)) {
+            head = head_nodes ? head_nodes[i] : head_node_v4;
+            const RouteTreeHeadNode *tree = head ? route_tree_lookup_tree(head) : NULL;
+            default_next_hop = head ? RCU_LOAD(head->default_next_hop) : -1;
+            first_bit_0 = tree ? route_tree_node_v4(pool, RCU_LOAD(tree->first_bit_0)) : NULL;
+            first_bit_1 = tree ? route_tree_node_v4(pool, RCU_LOAD(tree->first_bit_1)) : NULL;
+        }
+
+        if (default_next_hop >= 0) {
+            next_hop[i] = default_next_hop;
+            hit |= 1ULL << i;
+        }
+
+        ipv4[i] = ntohl(be_ipv4[i]);
+        bit_offset[i] = 0;
+        n_visited[i] = 0;
+        if (GET_BIT_U32(ipv4[i], 31)) {
+            node_v4[i] = first_bit_1;
+        }
+        else {
+            node_v4[i] = first_bit_0;
+        }
+        if (node_v4[i]) {
+            PREFETCH_NODE(node_v4[i]);
+            active |= 1ULL << i;
+        }
+    }
+
+    // advance every unfinished lane by one node per round, so the loads of a round overlap
+    while (active) {
+        uint64_t lanes = active;
+        do {
+            i = __builtin_ctzll(lanes);
+            lanes &= lanes - 1;
+
+            enum RouteTreeReturnStatue status = lookup_subtree_v4(pool, node_v4[i], &node_v4[i], NULL, NULL,
+                                                            ipv4[i], 32, &bit_offset[i], &next_hop[i]);
+            n_visited[i]++;
+            if (ROUTE_TREE_SUCCESS == status || ROUTE_TREE_SUCCESS_CONTINUE == status) {
+                tree_hit |= 1ULL << i;
+            }
+            if (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status) {
+                PREFETCH_NODE(node_v4[i]);
+            }
+            else {
+                active &= ~(1ULL << i);
+            }
+        } while (lanes);
+    }
+
+    hit |= tree_hit;
+    for (i = 0; i < n; ++i) {
+        ROUTE_TREE_STATS_LOOKUP(v4, n_visited[i], tree_hit >> i & 0x1, hit >> i & 0x1);
+    }
+
+    *hit_mask = hit;
+    return __builtin_popcountll(hit);
+}
+
+static inline __attribute__((always_inline)) size_t _lookup_bulk_v6(const RouteTreePool *pool,
+                            const RouteTreeHeadNode *head_node_v6,
+                            const RouteTreeHeadNode * const *head_nodes,
+                            const uint8_t * const *be_ipv6_u8ptr,
+                            size_t n,
+                            uint32_t *next_hop,
+                            uint64_t *hit_mask,
+                            const bool simd)
+{
+    RouteTreeNodeV6 *node_v6[BULK_LOOKUP_LANES];
+    RouteTreeIPV6 ipv6[BULK_LOOKUP_LANES];
+    uint8_t bit_offset[BULK_LOOKUP_LANES];
+    uint8_t n_visited[BULK_LOOKUP_LANES];
+    uint64_t active = 0;
+    uint64_t hit = 0;
+    uint64_t tree_hit = 0;
+    size_t i;
+
+    const RouteTreeHeadNode *head = NULL;
+    int32_t default_next_hop = -1;
+    RouteTreeNodeV6 *first_bit_0 = NULL;
+    RouteTreeNodeV6 *first_bit_1 = NULL;
+    for (i = 0; i < n; ++i) {
+        if (0 == i || (head_nodes && head_nodes[i] != head)) {
+            head = head_nodes ? head_nodes[i] : head_node_v6;
+            const RouteTreeHeadNode *tree = head ? route_tree_lookup_tree(head) : NULL;
+            default_next_hop = head ? RCU_LOAD(head->default_next_hop) : -1;
+            first_bit_0 = tree ? route_tree_node_v6(pool, RCU_LOAD(tree->first_bit_0)) : NULL;
+            first_bit_1 = tree ? route_tree_node_v6(pool, RCU_LOAD(tree->first_bit_1)) : NULL;
+        }
+
+        if (default_next_hop >= 0) {
+            next_hop[i] = default_next_hop;
+            hit |= 1ULL << i;
+        }
+
+        if (simd) {
+            be_ipv6_to_cpu_simd(be_ipv6_u8ptr[i], &ipv6[i]);
+        }
+        else {
+            U8_PTR_TO_CPU_IPV6(ipv6[i], be_ipv6_u8ptr[i]);
+        }
+        bit_offset[i] = 0;
+        n_visited[i] = 0;
+        if (GET_BIT_U64_PTR(ipv6[i].u64, 127)) {
+            node_v6[i] = first_bit_1;
+        }
+        else {
+            node_v6[i] = first_bit_0;
+        }
+        if (node_v6[i]) {
+            PREFETCH_NODE(node_v6[i]);
+            active |= 1ULL << i;
+        }
+    }
+
+    // advance every unfinished lane by one node per round, so the loads of a round overlap
+    while (active) {
+        uint64_t lanes = active;
+        do {
+            i = __builtin_ctzll(lanes);
+            lanes &= lanes - 1;
+
+            enum RouteTreeReturnStatue status = lookup_subtree_v6(pool, node_v6[i], &node_v6[i], NULL, NULL,
+                                                            &ipv6[i], 128, &bit_offset[i], &next_hop[i], simd);
+            n_visited[i]++;
+            if (ROUTE_TREE_SUCCESS == status || ROUTE_TREE_SUCCESS_CONTINUE == status) {
+                tree_hit |= 1ULL << i;
+            }
+            if (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status) {
+                PREFETCH_NODE(node_v6[i]);
+            }
+            else {
+                active &= ~(1ULL << i);
+            }
+        } while (lanes);
+    }
+
+    hit |= tree_hit;
+    for (i = 0; i < n; ++i) {
+        ROUTE_TREE_STATS_LOOKUP(v6, n_visited[i], tree_hit >> i & 0x1, hit >> i & 0x1);
+    }
+
+    *hit_mask = hit;
+    return __builtin_popcountll(hit);
+}
+
+static IPV6_SIMD_TARGET size_t _lookup_bulk_v6_simd(const RouteTreePool *pool,
+                                                const RouteTreeHeadNode *head_node_v6,
+                                                const RouteTreeHeadNode * const *head_nodes,
+                                                const uint8_t * const *be_ipv6_u8ptr,
+                                                size_t n,
+                                                uint32_t *next_hop,
+                                                uint64_t *hit_mask)
+{
+    return _lookup_bulk_v6(pool, head_node_v6, head_nodes, be_ipv6_u8ptr, n, next_hop, hit_mask, true);
+}
+
+size_t compressed_route_tree_lookup_bulk_v4(const RouteTreePool *pool,
+                                        const RouteTreeHeadNode *head_node_v4,
+                                        const uint32_t *be_ipv4,
+                                        size_t n,
+                                        uint32_t *next_hop,
+                                        uint64_t *hit_mask)
+{
+    size_t hits = 0;
+    size_t i;
+
+    for (i = 0; i < n; i += BULK_LOOKUP_LANES) {
+        const size_t lanes = (n - i) < BULK_LOOKUP_LANES ? (n - i) : BULK_LOOKUP_LANES;
+        hits += _lookup_bulk_v4(pool, head_node_v4, NULL, &be_ipv4[i], lanes, &next_hop[i], &hit_mask[i / BULK_LOOKUP_LANES]);
+    }
+
+    return hits;
+}
+
+size_t compressed_route_tree_lookup_bulk_v6(const RouteTreePool *pool,
+                                        const RouteTreeHeadNode *head_node_v6,
+                                        const uint8_t * const *be_ipv6_u8ptr,
+                                        size_t n,
+                                        uint32_t *next_hop,
+                                        uint64_t *hit_mask)
+{
+    size_t hits = 0;
+    size_t i;
+
+    for (i = 0; i < n; i += BULK_LOOKUP_LANES) {
+        const size_t lanes = (n - i) < BULK_LOOKUP_LANES ? (n - i) : BULK_LOOKUP_LANES;
+        if (ipv6_simd) {
+            hits += _lookup_bulk_v6_simd(pool, head_node_v6, NULL, &be_ipv6_u8ptr[i], lanes, &next_hop[i], &hit_mask[i / BULK_LOOKUP_LANES]);
+        }
+        else {
+            hits += _lookup_bulk_v6(pool, head_node_v6, NULL, &be_ipv6_u8ptr[i], lanes, &next_hop[i], &hit_mask[i / BULK_LOOKUP_LANES], false);
+        }
+    }
+
+    return hits;
+}
+
+// internal hooks of the VRF table, next to the bulk lookups they share
+size_t route_tree_lookup_bulk_heads_v4(const RouteTreePool *pool,
+                                    const RouteTreeHeadNode * const *head_nodes,
+                                    const uint32_t *be_ipv4,
+                                    size_t n,
+                                    uint32_t *next_hop,
+                                    uint64_t *hit_mask)
+{
+    size_t hits = 0;
+    size_t i;
+
+    for (i = 0; i < n; i += BULK_LOOKUP_LANES) {
+        const size_t lanes = (n - i) < BULK_LOOKUP_LANES ? (n - i) : BULK_LOOKUP_LANES;
+        hits += _lookup_bulk_v4(pool, NULL, &head_nodes[i], &be_ipv4[i], lanes, &next_hop[i], &hit_mask[i / BULK_LOOKUP_LANES]);
+    }
+
+    return hits;
+}
+
+size_t route_tree_lookup_bulk_heads_v6(const RouteTreePool *pool,
+                                    const RouteTreeHeadNode * const *head_nodes,
+                                    const uint8_t * const *be_ipv6_u8ptr,
+                                    size_t n,
+                                    uint32_t *next_hop,
+                                    uint64_t *hit_mask)
+{
+    size_t hits = 0;
+    size_t i;
+
+    for (i = 0; i < n; i += BULK_LOOKUP_LANES) {
+        const size_t lanes = (n - i) < BULK_LOOKUP_LANES ? (n - i) : BULK_LOOKUP_LANES;
+        if (ipv6_simd) {
+            hits += _lookup_bulk_v6_simd(pool, NULL, &head_nodes[i], &be_ipv6_u8ptr[i], lanes, &next_hop[i], &hit_mask[i / BULK_LOOKUP_LANES]);
+        }
+        else {
+            hits += _lookup_bulk_v6(pool, NULL, &head_nodes[i], &be_ipv6_u8ptr[i], lanes, &next_hop[i], &hit_mask[i / BULK_LOOKUP_LANES], false);
+        }
+    }
+
+    return hits;
+}
+
+int compressed_route_tree_add_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                            uint32_t be_ipv4,
+                            uint8_t depth_len,
+                            uint32_t next_hop)
+{
+    // a thread without a writer id could only free nodes by waiting for the readers
+    if (compressed_route_tree_writer_register() < 0) {
+        return -1;
+    }
+    compressed_route_tree_rcu_reclaim(pool, head_node_v4);
+
+    if (depth_len > 32 || next_hop > ROUTE_TREE_MAX_NEXT_HOP) {
+        return -1;
+    }
+
+    if (0 == depth_len) {
+        RCU_STORE(head_node_v4->default_next_hop, (int32_t)next_hop);
+        if (head_node_v4->aggregate) {
+            route_tree_aggregate_update_v4(head_node_v4->aggregate, pool, head_node_v4, 0, 0);
+        }
+        route_tree_bump_generation(head_node_v4);
+        return 0;
+    }
+
+    uint32_t ipv4 = ntohl(be_ipv4);
+    ipv4 = GET_KEY_32(ipv4, 0, depth_len);
+
+    if (head_node_v4->fast_v4 && route_tree_fast_v4_check_add(head_node_v4->fast_v4, ipv4, depth_len)) {
+        return -1;
+    }
+
+    uint8_t bit_offset = 0;
+    uint32_t *target_node_v4;
+    RouteTreeNodeV4 *node_v4;
+    RouteTreeNodeV4 *parent_node_v4 = NULL;
+    if (GET_BIT_U32(ipv4, 31)) {
+        target_node_v4 = &head_node_v4->first_bit_1;
+        node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_1);
+        
+    }
+    else {
+        target_node_v4 = &head_node_v4->first_bit_0;
+        node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_0);
+    }
+    if (NULL == node_v4) {
+        goto add;
+    }
+
+    enum RouteTreeReturnStatue status;
+    uint32_t next_hop_exist;
+    do {
+        status = lookup_subtree_v4(pool, node_v4, &node_v4, &parent_node_v4,
+                                &target_node_v4, ipv4, depth_len,
+                                &bit_offset, &next_hop_exist);
+    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+
+    if (bit_offset == depth_len) {
+        // match done
+        const bool new_route = NODE_NEXT_HOP(node_v4) < 0;
+        if (new_route) {
+            head_node_v4->total_routes++;
+            head_node_v4->add_count++;
+        }
+        RCU_STORE(node_v4->info, NODE_INFO(NODE_KEY_BIT_LEN(node_v4), next_hop));
+        if (head_node_v4->fast_v4) {
+            route_tree_fast_v4_add(head_node_v4->fast_v4, ipv4, depth_len, next_hop);
+        }
+        if (head_node_v4->lc_v4) {
+            route_tree_lc_v4_update(head_node_v4->lc_v4, pool, head_node_v4, ipv4, depth_len, next_hop, -1, 0, new_route);
+        }
+        if (head_node_v4->poptrie) {
+            route_tree_poptrie_update_v4(head_node_v4->poptrie, pool, head_node_v4, ipv4, depth_len);
+        }
+        if (head_node_v4->aggregate) {
+            route_tree_aggregate_update_v4(head_node_v4->aggregate, pool, head_node_v4, ipv4, depth_len);
+        }
+        route_tree_bump_generation(head_node_v4);
+        return 0;
+    }
+
+add:
+    if (NULL == node_v4) {
+        // no node
+        RouteTreeNodeV4 *new_node;
+        if (alloc_node_bulk_v4(pool, head_node_v4, &new_node, 1)) {
+            return -1;
+        }
+
+        fill_node_v4(new_node, (depth_len - bit_offset), GET_KEY_32(ipv4, bit_offset, (depth_len - bit_offset)),
+                    next_hop, 0, 0);
+
+        RCU_STORE(*target_node_v4, route_tree_node_index_v4(pool, new_node));
+    }
+    else {
+        // mismatch or new key is shorter
+        if (NODE_KEY_BIT_LEN(node_v4) > (depth_len - bit_offset)) {
+            // key is shorter
+            uint32_t match_bit = get_diff_bit_v4(node_v4, ipv4, bit_offset, (depth_len - bit_offset));
+
+            if ((depth_len - bit_offset) != match_bit) {
+                // mismatch
+                if (handle_mismatch_node_v4(pool, head_node_v4, node_v4, ipv4, depth_len, bit_offset, next_hop, target_node_v4)) {
+                    return -1;
+                }
+            }
+            else {
+                // shorter consistent
+                RouteTreeNodeV4 *new_node[2];
+                if (alloc_node_bulk_v4(pool, head_node_v4, new_node, 2)) {
+                    return -1;
+                }
+
+                if (GET_BIT_U32(node_v4->key, 31-(depth_len - bit_offset))) {
+                    fill_node_v4(new_node[0], (depth_len - bit_offset), GET_KEY_32(node_v4->key, 0, (depth_len - bit_offset)),
+                            next_hop, 0, route_tree_node_index_v4(pool, new_node[1]));
+                }
+                else {
+                    fill_node_v4(new_node[0], (depth_len - bit_offset), GET_KEY_32(node_v4->key, 0, (depth_len - bit_offset)),
+                            next_hop, route_tree_node_index_v4(pool, new_node[1]), 0);
+                }
+
+                fill_node_v4(new_node[1],
+                        NODE_KEY_BIT_LEN(node_v4) - (depth_len - bit_offset),
+                        GET_KEY_32(node_v4->key, (depth_len - bit_offset), NODE_KEY_BIT_LEN(node_v4) - (depth_len - bit_offset)),
+                        NODE_NEXT_HOP(node_v4), node_v4->next_bit_0, node_v4->next_bit_1);
+
+                RCU_STORE(*target_node_v4, route_tree_node_index_v4(pool, new_node[0]));
+                free_node_v4(pool, head_node_v4, node_v4);
+            }
+        }
+        else {
+            // mismatch
+            if (handle_mismatch_node_v4(pool, head_node_v4, node_v4, ipv4, depth_len, bit_offset, next_hop, target_node_v4)) {
+                return -1;
+            }
+        }
+    }
+
+    head_node_v4->total_routes++;
+    head_node_v4->add_count++;
+
+    if (head_node_v4->fast_v4) {
+        route_tree_fast_v4_add(head_node_v4->fast_v4, ipv4, depth_len, next_hop);
+    }
+    if (head_node_v4->lc_v4) {
+        route_tree_lc_v4_update(head_node_v4->lc_v4, pool, head_node_v4, ipv4, depth_len, next_hop, -1, 0, 1);
+    }
+    if (head_node_v4->poptrie) {
+        route_tree_poptrie_update_v4(head_node_v4->poptrie, pool, head_node_v4, ipv4, depth_len);
+    }
+    if (head_node_v4->aggregate) {
+        route_tree_aggregate_update_v4(head_node_v4->aggregate, pool, head_node_v4, ipv4, depth_len);
+    }
+
+    route_tree_bump_generation(head_node_v4);
+    return 0;
+}
+
+int compressed_route_tree_add_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                            const uint8_t *be_ipv6_u8ptr,
+                            uint8_t depth_len,
+                            uint32_t next_hop)
+{
+    if (compressed_route_tree_writer_register() < 0) {
+        return -1;
+    }
+    compressed_route_tree_rcu_reclaim(pool, head_node_v6);
+
+    if (depth_len > 128 || next_hop > ROUTE_TREE_MAX_NEXT_HOP) {
+        return -1;
+    }
+
+    if (0 == depth_len) {
+        RCU_STORE(head_node_v6->default_next_hop, (int32_t)next_hop);
+        if (head_node_v6->aggregate) {
+            route_tree_aggregate_update_v6(head_node_v6->aggregate, pool, head_node_v6, &ipv6_any, 0);
+        }
+        route_tree_bump_generation(head_node_v6);
+        return 0;
+    }
+
+    RouteTreeIPV6 ipv6_ori;
+    U8_PTR_TO_CPU_IPV6(ipv6_ori, be_ipv6_u8ptr);
+    RouteTreeIPV6 ipv6;
+    get_key_ipv6(&ipv6_ori, 0, depth_len, &ipv6);
+
+    uint8_t bit_offset = 0;
+    uint32_t *target_node_v6;
+    RouteTreeNodeV6 *node_v6;
+    RouteTreeNodeV6 *parent_node_v6 = NULL;
+    if (GET_BIT_U64_PTR(ipv6.u64, 127)) {
+        target_node_v6 = &head_node_v6->first_bit_1;
+        node_v6 = route_tree_node_v6(pool, head_node_v6->first_bit_1);
+    }
+    else {
+        target_node_v6 = &head_node_v6->first_bit_0;
+        node_v6 = route_tree_node_v6(pool, head_node_v6->first_bit_0);
+    }
+    if (NULL == node_v6) {
+        goto add;
+    }
+
+    enum RouteTreeReturnStatue status;
+    uint32_t next_hop_exist;
+    do {
+        status = lookup_subtree_v6(pool, node_v6, &node_v6, &parent_node_v6,
+                                &target_node_v6, &ipv6, depth_len,
+                                &bit_offset, &next_hop_exist, false);
+    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+
+    if (bit_offset == depth_len) {
+        // match done
+        if (NODE_NEXT_HOP(node_v6) < 0) {
+            head_node_v6->total_routes++;
+            head_node_v6->add_count++;
+        }
+        RCU_STORE(node_v6->info, NODE_INFO(NODE_KEY_BIT_LEN(node_v6), next_hop));
+        if (head_node_v6->poptrie) {
+            route_tree_poptrie_update_v6(head_node_v6->poptrie, pool, head_node_v6, &ipv6, depth_len);
+        }
+        if (head_node_v6->bsl_v6) {
+            route_tree_bsl_v6_update(head_node_v6->bsl_v6, pool, head_node_v6, &ipv6, depth_len);
+        }
+        if (head_node_v6->v6_64) {
+            route_tree_v6_64_update(head_node_v6->v6_64, pool, head_node_v6, &ipv6, depth_len);
+        }
+        if (head_node_v6->aggregate) {
+            route_tree_aggregate_update_v6(head_node_v6->aggregate, pool, head_node_v6, &ipv6, depth_len);
+        }
+        route_tree_bump_generation(head_node_v6);
+        return 0;
+    }
+
+add:
+    if (NULL == node_v6) {
+        // no node
+        RouteTreeNodeV6 *new_node;
+        if (alloc_node_bulk_v6(pool, head_node_v6, &new_node, 1)) {
+            return -1;
+        }
+
+        RouteTreeIPV6 key;
+        get_key_ipv6(&ipv6, bit_offset, (depth_len - bit_offset), &key);
+        fill_node_v6(new_node, (depth_len - bit_offset), &key,
+                    next_hop, 0, 0);
+
+        RCU_STORE(*target_node_v6, route_tree_node_index_v6(pool, new_node));
+    }
+    else {
+        // mismatch or new key is shorter
+        if (NODE_KEY_BIT_LEN(node_v6) > (depth_len - bit_offset)) {
+            // key is shorter
+            uint32_t match_bit = get_diff_bit_v6(node_v6, &ipv6, bit_offset, (depth_len - bit_offset));
+
+            if ((depth_len - bit_offset) != match_bit) {
+                // mismatch
+                if (handle_mismatch_node_v6(pool, head_node_v6, node_v6, &ipv6, depth_len, bit_offset, next_hop, target_node_v6)) {
+                    return -1;
+                }
+            }
+            else {
+                // shorter consistent
+                RouteTreeNodeV6 *new_node[2];
+                if (alloc_node_bulk_v6(pool, head_node_v6, new_node, 2)) {
+                    return -1;
+                }
+
+                RouteTreeIPV6 key;
+                get_key_ipv6(&node_v6->key, 0, (depth_len - bit_offset), &key);
+                if (GET_BIT_U64_PTR(node_v6->key.u64, 127-(depth_len - bit_offset))) {
+                    fill_node_v6(new_node[0], (depth_len - bit_offset), &key,
+                            next_hop, 0, route_tree_node_index_v6(pool, new_node[1]));
+                }
+                else {
+                    fill_node_v6(new_node[0], (depth_len - bit_offset), &key,
+                            next_hop, route_tree_node_index_v6(pool, new_node[1]), 0);
+                }
+
+                get_key_ipv6(&node_v6->key, (depth_len - bit_offset), NODE_KEY_BIT_LEN(node_v6) - (depth_len - bit_offset), &key);
+                fill_node_v6(new_node[1],
+                        NODE_KEY_BIT_LEN(node_v6) - (depth_len - bit_offset),
+                        &key,
+                        NODE_NEXT_HOP(node_v6), node_v6->next_bit_0, node_v6->next_bit_1);
+
+                RCU_STORE(*target_node_v6, route_tree_node_index_v6(pool, new_node[0]));
+                free_node_v6(pool, head_node_v6, node_v6);
+            }
+        }
+        else {
+            // mismatch
+            if (handle_mismatch_node_v6(pool, head_node_v6, node_v6, &ipv6, depth_len, bit_offset, next_hop, target_node_v6)) {
+                return -1;
+            }
+        }
+    }
+
+    head_node_v6->total_routes++;
+    head_node_v6->add_count++;
+
+    if (head_node_v6->poptrie) {
+        route_tree_poptrie_update_v6(head_node_v6->poptrie, pool, head_node_v6, &ipv6, depth_len);
+    }
+    if (head_node_v6->bsl_v6) {
+        route_tree_bsl_v6_update(head_node_v6->bsl_v6, pool, head_node_v6, &ipv6, depth_len);
+    }
+    if (head_node_v6->v6_64) {
+        route_tree_v6_64_update(head_node_v6->v6_64, pool, head_node_v6, &ipv6, depth_len);
+    }
+    if (head_node_v6->aggregate) {
+        route_tree_aggregate_update_v6(head_node_v6->aggregate, pool, head_node_v6, &ipv6, depth_len);
+    }
+
+    route_tree_bump_generation(head_node_v6);
+    return 0;
+}
+
+int compressed_route_tree_del_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4, uint8_t depth_len)
+{
+    if (compressed_route_tree_writer_register() < 0) {
+        return -1;
+    }
+    compressed_route_tree_rcu_reclaim(pool, head_node_v4);
+
+    if (depth_len > 32) {
+        return -1;
+    }
+
+    if (0 == depth_len) {
+        RCU_STORE(head_node_v4->default_next_hop, -1);
+        if (head_node_v4->aggregate) {
+            route_tree_aggregate_update_v4(head_node_v4->aggregate, pool, head_node_v4, 0, 0);
+        }
+        route_tree_bump_generation(head_node_v4);
+        return 0;
+    }
+
+    uint32_t ipv4 = ntohl(be_ipv4);
     ipv4 = GET_KEY_32(ipv4, 0, depth_len);
 
     uint8_t bit_offset = 0;
-    RouteTreeNodeV4 **target_node_v4;
+    uint32_t *target_node_v4;
     RouteTreeNodeV4 *node_v4;
     RouteTreeNodeV4 *parent_node_v4 = NULL;
     if (GET_BIT_U32(ipv4, 31)) {
-        target_node_v4 = (RouteTreeNodeV4 **)(&head_node_v4->first_bit_1);
-        node_v4 = (RouteTreeNodeV4 *)head_node_v4->first_bit_1;
-        
+        target_node_v4 = &head_node_v4->first_bit_1;
+        node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_1);
     }
     else {
-        target_node_v4 = (RouteTreeNodeV4 **)(&head_node_v4->first_bit_0);
-        node_v4 = (RouteTreeNodeV4 *)head_node_v4->first_bit_0;
+        target_node_v4 = &head_node_v4->first_bit_0;
+        node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_0);
     }
     if (NULL == node_v4) {
-        goto add;
+        return -1;
     }
 
+    // slot of parent_node_v4, to merge it once the matched node is gone
+    uint32_t *parent_target_v4 = NULL;
     enum RouteTreeReturnStatue status;
     uint32_t next_hop_exist;
     do {
-        status = lookup_subtree_v4(node_v4, &node_v4, &parent_node_v4,
-                                &target_node_v4, ipv4, depth_len,
-                                &bit_offset, &next_hop_exist);
+        uint32_t * const last_target_v4 = target_node_v4;
+        status = lookup_subtree_v4(pool, node_v4, &node_v4, &parent_node_v4, &target_node_v4, ipv4, depth_len, &bit_offset, &next_hop_exist);
+        if (target_node_v4 != last_target_v4) {
+            parent_target_v4 = last_target_v4;
+        }
     } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
 
-    if (bit_offset == depth_len) {
+    if (bit_offset == depth_len && NODE_NEXT_HOP(node_v4) >= 0) {
         // match done
-        if (node_v4->next_hop < 0) {
-            head_node_v4->total_routes++;
-            head_node_v4->add_count++;
+        if (node_v4->next_bit_0 && node_v4->next_bit_1) {
+            // two child: set next_hop invalid;
+            RCU_STORE(node_v4->info, NODE_INFO(NODE_KEY_BIT_LEN(node_v4), -1));
         }
-        node_v4->next_hop = next_hop;
-        return 0;
+        else if (node_v4->next_bit_0 || node_v4->next_bit_1) {
+            // one child: merge child; delete node;
+            if (handle_merge_node_v4(pool, head_node_v4,
+                        node_v4,
+                        route_tree_node_v4(pool, node_v4->next_bit_0 ? node_v4->next_bit_0 : node_v4->next_bit_1),
+                        target_node_v4)) {
+
+                return -1;
+            }
+        }
+        else {
+            // no child: delete node;
+            bool parent_has_two_branches = false;
+            if (parent_node_v4 && parent_node_v4->next_bit_0 && parent_node_v4->next_bit_1) {
+                parent_has_two_branches = true;
+            }
+
+            RCU_STORE(*target_node_v4, 0);
+            free_node_v4(pool, head_node_v4, node_v4);
+
+            if (parent_has_two_branches && NODE_NEXT_HOP(parent_node_v4) < 0) {
+                // delete node and parent decrease branch; merge invalid next_hop parent and the other child;
+                if (handle_merge_node_v4(pool, head_node_v4,
+                            parent_node_v4,
+                            route_tree_node_v4(pool, parent_node_v4->next_bit_0 ? parent_node_v4->next_bit_0 : parent_node_v4->next_bit_1),
+                            parent_target_v4)) {
+
+                    return -1;
+                }
+            }
+        }
+    }
+    else {
+        return -1;
     }
 
-add:
-    if (NULL == node_v4) {
-        // no node
-        RouteTreeNodeV4 *new_node;
-        if (alloc_node_bulk_v4(head_node_v4, &new_node, 1)) {
-            return -1;
+    head_node_v4->total_routes--;
+    head_node_v4->del_count++;
+
+    if (head_node_v4->fast_v4 || head_node_v4->lc_v4) {
+        int32_t cover_next_hop;
+        uint8_t cover_depth_len;
+        lookup_cover_v4(pool, head_node_v4, ipv4, depth_len, &cover_next_hop, &cover_depth_len);
+        if (head_node_v4->fast_v4) {
+            route_tree_fast_v4_del(head_node_v4->fast_v4, ipv4, depth_len, cover_next_hop, cover_depth_len);
+        }
+        if (head_node_v4->lc_v4) {
+            route_tree_lc_v4_update(head_node_v4->lc_v4, pool, head_node_v4, ipv4, depth_len, -1,
+                                    cover_next_hop, cover_depth_len, -1);
+        }
+    }
+    if (head_node_v4->poptrie) {
+        route_tree_poptrie_update_v4(head_node_v4->poptrie, pool, head_node_v4, ipv4, depth_len);
+    }
+    if (head_node_v4->aggregate) {
+        route_tree_aggregate_update_v4(head_node_v4->aggregate, pool, head_node_v4, ipv4, depth_len);
+    }
+
+    route_tree_bump_generation(head_node_v4);
+    return 0;
+}
+
+int compressed_route_tree_del_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len)
+{
+    if (compressed_route_tree_writer_register() < 0) {
+        return -1;
+    }
+    compressed_route_tree_rcu_reclaim(pool, head_node_v6);
+
+    if (depth_len > 128) {
+        return -1;
+    }
+
+    if (0 == depth_len) {
+        RCU_STORE(head_node_v6->default_next_hop, -1);
+        if (head_node_v6->aggregate) {
+            route_tree_aggregate_update_v6(head_node_v6->aggregate, pool, head_node_v6, &ipv6_any, 0);
         }
+        route_tree_bump_generation(head_node_v6);
+        return 0;
+    }
 
-        fill_node_v4(new_node, (depth_len - bit_offset), GET_KEY_32(ipv4, bit_offset, (depth_len - bit_offset)),
-                    next_hop, parent_node_v4, NULL, NULL);
+    RouteTreeIPV6 ipv6_ori;
+    U8_PTR_TO_CPU_IPV6(ipv6_ori, be_ipv6_u8ptr);
+    RouteTreeIPV6 ipv6;
+    get_key_ipv6(&ipv6_ori, 0, depth_len, &ipv6);
 
-        *target_node_v4 = new_node;
+    uint8_t bit_offset = 0;
+    uint32_t *target_node_v6;
+    RouteTreeNodeV6 *node_v6;
+    RouteTreeNodeV6 *parent_node_v6 = NULL;
+    if (GET_BIT_U64_PTR(ipv6.u64, 127)) {
+        target_node_v6 = &head_node_v6->first_bit_1;
+        node_v6 = route_tree_node_v6(pool, head_node_v6->first_bit_1);
     }
     else {
-        // mismatch or new key is shorter
-        if (node_v4->key_bit_len > (depth_len - bit_offset)) {
-            // key is shorter
-            uint32_t match_bit = get_diff_bit_v4(node_v4, ipv4, bit_offset, (depth_len - bit_offset));
+        target_node_v6 = &head_node_v6->first_bit_0;
+        node_v6 = route_tree_node_v6(pool, head_node_v6->first_bit_0);
+    }
+    if (NULL == node_v6) {
+        return -1;
+    }
 
-            if ((depth_len - bit_offset) != match_bit) {
-                // mismatch
-                if (handle_mismatch_node_v4(head_node_v4, node_v4, ipv4, depth_len, bit_offset, next_hop, target_node_v4)) {
-                    return -1;
-                }
+    // slot of parent_node_v6, to merge it once the matched node is gone
+    uint32_t *parent_target_v6 = NULL;
+    enum RouteTreeReturnStatue status;
+    uint32_t next_hop_exist;
+    do {
+        uint32_t * const last_target_v6 = target_node_v6;
+        status = lookup_subtree_v6(pool, node_v6, &node_v6, &parent_node_v6, &target_node_v6, &ipv6, depth_len, &bit_offset, &next_hop_exist, false);
+        if (target_node_v6 != last_target_v6) {
+            parent_target_v6 = last_target_v6;
+        }
+    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+
+    if (bit_offset == depth_len && NODE_NEXT_HOP(node_v6) >= 0) {
+        // match done
+        if (node_v6->next_bit_0 && node_v6->next_bit_1) {
+            // two child: set next_hop invalid;
+            RCU_STORE(node_v6->info, NODE_INFO(NODE_KEY_BIT_LEN(node_v6), -1));
+        }
+        else if (node_v6->next_bit_0 || node_v6->next_bit_1) {
+            // one child: merge child; delete node;
+            if (handle_merge_node_v6(pool, head_node_v6,
+                        node_v6,
+                        route_tree_node_v6(pool, node_v6->next_bit_0 ? node_v6->next_bit_0 : node_v6->next_bit_1),
+                        target_node_v6)) {
+
+                return -1;
             }
-            else {
-                // shorter consistent
-                RouteTreeNodeV4 *new_node[2];
-                if (alloc_node_bulk_v4(head_node_v4, new_node, 2)) {
+        }
+        else {
+            // no child: delete node;
+            bool parent_has_two_branches = false;
+            if (parent_node_v6 && parent_node_v6->next_bit_0 && parent_node_v6->next_bit_1) {
+                parent_has_two_branches = true;
+            }
+
+            RCU_STORE(*target_node_v6, 0);
+            free_node_v6(pool, head_node_v6, node_v6);
+
+            if (parent_has_two_branches && NODE_NEXT_HOP(parent_node_v6) < 0) {
+                // delete node and parent decrease branch; merge invalid next_hop parent and the other child;
+                if (handle_merge_node_v6(pool, head_node_v6,
+                            parent_node_v6,
+                            route_tree_node_v6(pool, parent_node_v6->next_bit_0 ? parent_node_v6->next_bit_0 : parent_node_v6->next_bit_1),
+                            parent_target_v6)) {
+
                     return -1;
                 }
+            }
+        }
+    }
+    else {
+        return -1;
+    }
 
-                if (GET_BIT_U32(node_v4->key, 31-(depth_len - bit_offset))) {
-                    fill_node_v4(new_node[0], (depth_len - bit_offset), GET_KEY_32(node_v4->key, 0, (depth_len - bit_offset)),
-                            next_hop, parent_node_v4, NULL, new_node[1]);
-                }
-                else {
-                    fill_node_v4(new_node[0], (depth_len - bit_offset), GET_KEY_32(node_v4->key, 0, (depth_len - bit_offset)),
-                            next_hop, parent_node_v4, new_node[1], NULL);
-                }
+    head_node_v6->total_routes--;
+    head_node_v6->del_count++;
 
-                fill_node_v4(new_node[1],
-                        node_v4->key_bit_len - (depth_len - bit_offset),
-                        GET_KEY_32(node_v4->key, (depth_len - bit_offset), node_v4->key_bit_len - (depth_len - bit_offset)),
-                        node_v4->next_hop, new_node[0], node_v4->next_bit_0, node_v4->next_bit_1);
+    if (head_node_v6->poptrie) {
+        route_tree_poptrie_update_v6(head_node_v6->poptrie, pool, head_node_v6, &ipv6, depth_len);
+    }
+    if (head_node_v6->bsl_v6) {
+        route_tree_bsl_v6_update(head_node_v6->bsl_v6, pool, head_node_v6, &ipv6, depth_len);
+    }
+    if (head_node_v6->v6_64) {
+        route_tree_v6_64_update(head_node_v6->v6_64, pool, head_node_v6, &ipv6, depth_len);
+    }
+    if (head_node_v6->aggregate) {
+        route_tree_aggregate_update_v6(head_node_v6->aggregate, pool, head_node_v6, &ipv6, depth_len);
+    }
 
-                *target_node_v4 = new_node[0];
-                free_node_v4(head_node_v4, node_v4);
-            }
+    route_tree_bump_generation(head_node_v6);
+    return 0;
+}
+
+int compressed_route_tree_bulk_load_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                    const RouteTreeRouteV4 *routes,
+                                    size_t n_routes)
+{
+    if (compressed_route_tree_writer_register() < 0) {
+        return -1;
+    }
+    compressed_route_tree_rcu_reclaim(pool, head_node_v4);
+
+    if (head_node_v4->first_bit_0 || head_node_v4->first_bit_1
+            || head_node_v4->fast_v4 || head_node_v4->lc_v4 || head_node_v4->poptrie || head_node_v4->aggregate) {
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < n_routes; ++i) {
+        if (routes[i].depth_len > 32 || routes[i].next_hop > ROUTE_TREE_MAX_NEXT_HOP) {
+            return -1;
+        }
+    }
+    if (0 == n_routes) {
+        return 0;
+    }
+
+    BulkRouteV4 *bulk = malloc(sizeof(*bulk) * n_routes * 2);
+    if (NULL == bulk) {
+        return -1;
+    }
+
+    for (i = 0; i < n_routes; ++i) {
+        const uint32_t prefix = GET_KEY_32(ntohl(routes[i].be_ipv4), 0, routes[i].depth_len);
+        bulk[i].key = (uint64_t)prefix << 8 | routes[i].depth_len;
+        bulk[i].next_hop = routes[i].next_hop;
+    }
+    bulk_sort_v4(bulk, &bulk[n_routes], n_routes);
+
+    // keep the last of each prefix
+    size_t n = 0;
+    for (i = 0; i < n_routes; ++i) {
+        if (n && bulk[n - 1].key == bulk[i].key) {
+            bulk[n - 1] = bulk[i];
         }
         else {
-            // mismatch
-            if (handle_mismatch_node_v4(head_node_v4, node_v4, ipv4, depth_len, bit_offset, next_hop, target_node_v4)) {
-                return -1;
-            }
+            bulk[n++] = bulk[i];
         }
     }
 
-    head_node_v4->total_routes++;
-    head_node_v4->add_count++;
+    const BulkRouteV4 *start = bulk;
+    int32_t default_next_hop = head_node_v4->default_next_hop;
+    if (0 == BULK_V4_DEPTH_LEN(start)) {
+        default_next_hop = start->next_hop;
+        start++;
+        n--;
+    }
+
+    // first route below first_bit_1
+    size_t split = 0;
+    while (split < n && !GET_BIT_U32(BULK_V4_PREFIX(&start[split]), 31)) {
+        split++;
+    }
+
+    size_t n_nodes = 0;
+    if (split) {
+        n_nodes += bulk_count_v4(start, split);
+    }
+    if (n > split) {
+        n_nodes += bulk_count_v4(&start[split], n - split);
+    }
+    if (reserve_node_v4(pool, n_nodes)) {
+        free(bulk);
+        return -1;
+    }
+
+    RouteTreeNodeV4 *first[2] = {NULL, NULL};
+    alloc_node_bulk_v4(pool, head_node_v4, first, (split ? 1 : 0) + (n > split ? 1 : 0));
+    if (0 == split) {
+        first[1] = first[0];
+        first[0] = NULL;
+    }
+    if (split) {
+        bulk_build_v4(pool, head_node_v4, first[0], start, split, 0);
+    }
+    if (n > split) {
+        bulk_build_v4(pool, head_node_v4, first[1], &start[split], n - split, 0);
+    }
+
+    RCU_STORE(head_node_v4->first_bit_0, route_tree_node_index_v4(pool, first[0]));
+    RCU_STORE(head_node_v4->first_bit_1, route_tree_node_index_v4(pool, first[1]));
+    RCU_STORE(head_node_v4->default_next_hop, default_next_hop);
+
+    head_node_v4->total_routes += n;
+    head_node_v4->add_count += n;
+
+    free(bulk);
+    route_tree_bump_generation(head_node_v4);
+    return 0;
+}
+
+int compressed_route_tree_bulk_load_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    const RouteTreeRouteV6 *routes,
+                                    size_t n_routes)
+{
+    if (compressed_route_tree_writer_register() < 0) {
+        return -1;
+    }
+    compressed_route_tree_rcu_reclaim(pool, head_node_v6);
+
+    if (head_node_v6->first_bit_0 || head_node_v6->first_bit_1 || head_node_v6->poptrie || head_node_v6->bsl_v6
+            || head_node_v6->v6_64 || head_node_v6->aggregate) {
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < n_routes; ++i) {
+        if (routes[i].depth_len > 128 || routes[i].next_hop > ROUTE_TREE_MAX_NEXT_HOP) {
+            return -1;
+        }
+    }
+    if (0 == n_routes) {
+        return 0;
+    }
+
+    BulkRouteV6 *bulk = malloc(sizeof(*bulk) * n_routes * 2);
+    if (NULL == bulk) {
+        return -1;
+    }
+
+    for (i = 0; i < n_routes; ++i) {
+        RouteTreeIPV6 ipv6;
+        U8_PTR_TO_CPU_IPV6(ipv6, routes[i].be_ipv6);
+        get_key_ipv6(&ipv6, 0, routes[i].depth_len, &bulk[i].prefix);
+        bulk[i].depth_len = routes[i].depth_len;
+        bulk[i].next_hop = routes[i].next_hop;
+    }
+    bulk_sort_v6(bulk, &bulk[n_routes], n_routes);
+
+    // keep the last of each prefix
+    size_t n = 0;
+    for (i = 0; i < n_routes; ++i) {
+        if (n && bulk[n - 1].depth_len == bulk[i].depth_len
+                && !memcmp(bulk[n - 1].prefix.u8, bulk[i].prefix.u8, sizeof(bulk[i].prefix.u8))) {
+            bulk[n - 1] = bulk[i];
+        }
+        else {
+            bulk[n++] = bulk[i];
+        }
+    }
+
+    const BulkRouteV6 *start = bulk;
+    int32_t default_next_hop = head_node_v6->default_next_hop;
+    if (0 == start->depth_len) {
+        default_next_hop = start->next_hop;
+        start++;
+        n--;
+    }
+
+    // first route below first_bit_1
+    size_t split = 0;
+    while (split < n && !GET_BIT_U64_PTR(start[split].prefix.u64, 127)) {
+        split++;
+    }
+
+    size_t n_nodes = 0;
+    if (split) {
+        n_nodes += bulk_count_v6(start, split);
+    }
+    if (n > split) {
+        n_nodes += bulk_count_v6(&start[split], n - split);
+    }
+    if (reserve_node_v6(pool, n_nodes)) {
+        free(bulk);
+        return -1;
+    }
+
+    RouteTreeNodeV6 *first[2] = {NULL, NULL};
+    alloc_node_bulk_v6(pool, head_node_v6, first, (split ? 1 : 0) + (n > split ? 1 : 0));
+    if (0 == split) {
+        first[1] = first[0];
+        first[0] = NULL;
+    }
+    if (split) {
+        bulk_build_v6(pool, head_node_v6, first[0], start, split, 0);
+    }
+    if (n > split) {
+        bulk_build_v6(pool, head_node_v6, first[1], &start[split], n - split, 0);
+    }
+
+    RCU_STORE(head_node_v6->first_bit_0, route_tree_node_index_v6(pool, first[0]));
+    RCU_STORE(head_node_v6->first_bit_1, route_tree_node_index_v6(pool, first[1]));
+    RCU_STORE(head_node_v6->default_next_hop, default_next_hop);
+
+    head_node_v6->total_routes += n;
+    head_node_v6->add_count += n;
+
+    free(bulk);
+    route_tree_bump_generation(head_node_v6);
+    return 0;
+}
+
+size_t compressed_route_tree_batch_get_memory_footprint_v4(const size_t max_ops)
+{
+    // ops, then as much room for the sort
+    return sizeof(BulkRouteV4) * max_ops * 2;
+}
+
+size_t compressed_route_tree_batch_get_memory_footprint_v6(const size_t max_ops)
+{
+    return sizeof(BulkRouteV6) * max_ops * 2;
+}
+
+int compressed_route_tree_batch_begin(RouteTreeBatch *batch, void * const ops_ptr, const size_t max_ops)
+{
+    if (NULL == ops_ptr && max_ops) {
+        return -1;
+    }
+
+    batch->ops = ops_ptr;
+    batch->max_ops = max_ops;
+    batch->n_ops = 0;
+
+    return 0;
+}
+
+static int batch_record_v4(RouteTreeBatch *batch, uint32_t be_ipv4, uint8_t depth_len, uint32_t next_hop)
+{
+    if (depth_len > 32 || batch->n_ops == batch->max_ops) {
+        return -1;
+    }
+
+    BulkRouteV4 *op = &((BulkRouteV4 *)batch->ops)[batch->n_ops++];
+    op->key = (uint64_t)GET_KEY_32(ntohl(be_ipv4), 0, depth_len) << 8 | depth_len;
+    op->next_hop = next_hop;
 
     return 0;
 }
 
-int compressed_route_tree_add_v6(RouteTreeHeadNode *head_node_v6,
-                            const uint8_t *be_ipv6_u8ptr,
-                            uint8_t depth_len,
-                            uint32_t next_hop)
+static int batch_record_v6(RouteTreeBatch *batch, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t next_hop)
 {
-    if (depth_len > 128) {
+    if (depth_len > 128 || batch->n_ops == batch->max_ops) {
         return -1;
     }
 
-    if (0 == depth_len) {
-        head_node_v6->default_next_hop = next_hop;
-        return 0;
-    }
-
-    RouteTreeIPV6 ipv6_ori;
-    U8_PTR_TO_CPU_IPV6(ipv6_ori, be_ipv6_u8ptr);
+    BulkRouteV6 *op = &((BulkRouteV6 *)batch->ops)[batch->n_ops++];
     RouteTreeIPV6 ipv6;
-    get_key_ipv6(&ipv6_ori, 0, depth_len, &ipv6);
+    U8_PTR_TO_CPU_IPV6(ipv6, be_ipv6_u8ptr);
+    get_key_ipv6(&ipv6, 0, depth_len, &op->prefix);
+    op->depth_len = depth_len;
+    op->next_hop = next_hop;
 
-    uint8_t bit_offset = 0;
-    RouteTreeNodeV6 **target_node_v6;
-    RouteTreeNodeV6 *node_v6;
-    RouteTreeNodeV6 *parent_node_v6 = NULL;
-    if (GET_BIT_U64_PTR(ipv6.u64, 127)) {
-        target_node_v6 = (RouteTreeNodeV6 **)(&head_node_v6->first_bit_1);
-        node_v6 = (RouteTreeNodeV6 *)head_node_v6->first_bit_1;
-    }
-    else {
-        target_node_v6 = (RouteTreeNodeV6 **)(&head_node_v6->first_bit_0);
-        node_v6 = (RouteTreeNodeV6 *)head_node_v6->first_bit_0;
-    }
-    if (NULL == node_v6) {
-        goto add;
-    }
+    return 0;
+}
 
-    enum RouteTreeReturnStatue status;
-    uint32_t next_hop_exist;
-    do {
-        status = lookup_subtree_v6(node_v6, &node_v6, &parent_node_v6,
-                                &target_node_v6, &ipv6, depth_len,
-                                &bit_offset, &next_hop_exist);
-    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+int compressed_route_tree_batch_add_v4(RouteTreeBatch *batch, uint32_t be_ipv4, uint8_t depth_len, uint32_t next_hop)
+{
+    if (next_hop > ROUTE_TREE_MAX_NEXT_HOP) {
+        return -1;
+    }
+    return batch_record_v4(batch, be_ipv4, depth_len, next_hop);
+}
 
-    if (bit_offset == depth_len) {
-        // match done
-        if (node_v6->next_hop < 0) {
-            head_node_v6->total_routes++;
-            head_node_v6->add_count++;
-        }
-        node_v6->next_hop = next_hop;
-        return 0;
+int compressed_route_tree_batch_add_v6(RouteTreeBatch *batch, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t next_hop)
+{
+    if (next_hop > ROUTE_TREE_MAX_NEXT_HOP) {
+        return -1;
     }
+    return batch_record_v6(batch, be_ipv6_u8ptr, depth_len, next_hop);
+}
 
-add:
-    if (NULL == node_v6) {
-        // no node
-        RouteTreeNodeV6 *new_node;
-        if (alloc_node_bulk_v6(head_node_v6, &new_node, 1)) {
-            return -1;
-        }
+int compressed_route_tree_batch_del_v4(RouteTreeBatch *batch, uint32_t be_ipv4, uint8_t depth_len)
+{
+    return batch_record_v4(batch, be_ipv4, depth_len, BATCH_DEL_NEXT_HOP);
+}
 
-        RouteTreeIPV6 key;
-        get_key_ipv6(&ipv6, bit_offset, (depth_len - bit_offset), &key);
-        fill_node_v6(new_node, (depth_len - bit_offset), &key,
-                    next_hop, parent_node_v6, NULL, NULL);
+int compressed_route_tree_batch_del_v6(RouteTreeBatch *batch, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len)
+{
+    return batch_record_v6(batch, be_ipv6_u8ptr, depth_len, BATCH_DEL_NEXT_HOP);
+}
 
-        *target_node_v6 = new_node;
+int compressed_route_tree_batch_commit_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, RouteTreeBatch *batch)
+{
+    if (compressed_route_tree_writer_register() < 0) {
+        return -1;
     }
-    else {
-        // mismatch or new key is shorter
-        if (node_v6->key_bit_len > (depth_len - bit_offset)) {
-            // key is shorter
-            uint32_t match_bit = get_diff_bit_v6(node_v6, &ipv6, bit_offset, (depth_len - bit_offset));
-
-            if ((depth_len - bit_offset) != match_bit) {
-                // mismatch
-                if (handle_mismatch_node_v6(head_node_v6, node_v6, &ipv6, depth_len, bit_offset, next_hop, target_node_v6)) {
-                    return -1;
-                }
-            }
-            else {
-                // shorter consistent
-                RouteTreeNodeV6 *new_node[2];
-                if (alloc_node_bulk_v6(head_node_v6, new_node, 2)) {
-                    return -1;
-                }
+    compressed_route_tree_rcu_reclaim(pool, head_node_v4);
 
-                RouteTreeIPV6 key;
-                get_key_ipv6(&node_v6->key, 0, (depth_len - bit_offset), &key);
-                if (GET_BIT_U64_PTR(node_v6->key.u64, 127-(depth_len - bit_offset))) {
-                    fill_node_v6(new_node[0], (depth_len - bit_offset), &key,
-                            next_hop, parent_node_v6, NULL, new_node[1]);
-                }
-                else {
-                    fill_node_v6(new_node[0], (depth_len - bit_offset), &key,
-                            next_hop, parent_node_v6, new_node[1], NULL);
-                }
+    if (0 == batch->n_ops) {
+        return 0;
+    }
 
-                get_key_ipv6(&node_v6->key, (depth_len - bit_offset), node_v6->key_bit_len - (depth_len - bit_offset), &key);
-                fill_node_v6(new_node[1],
-                        node_v6->key_bit_len - (depth_len - bit_offset),
-                        &key,
-                        node_v6->next_hop, new_node[0], node_v6->next_bit_0, node_v6->next_bit_1);
+    BulkRouteV4 *ops = batch->ops;
+    BulkRouteV4 *tmp = &ops[batch->max_ops];
+    bulk_sort_v4(ops, tmp, batch->n_ops);
 
-                *target_node_v6 = new_node[0];
-                free_node_v6(head_node_v6, node_v6);
-            }
+    // keep the last op of each prefix, done in place so a failed commit can be retried
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < batch->n_ops; ++i) {
+        if (n && ops[n - 1].key == ops[i].key) {
+            ops[n - 1] = ops[i];
         }
         else {
-            // mismatch
-            if (handle_mismatch_node_v6(head_node_v6, node_v6, &ipv6, depth_len, bit_offset, next_hop, target_node_v6)) {
-                return -1;
+            ops[n++] = ops[i];
+        }
+    }
+    batch->n_ops = n;
+
+    BulkRouteV4 *start = ops;
+    int32_t default_next_hop = head_node_v4->default_next_hop;
+    if (0 == BULK_V4_DEPTH_LEN(start)) {
+        default_next_hop = BATCH_DEL_NEXT_HOP == start->next_hop ? -1 : (int32_t)start->next_hop;
+        start++;
+        tmp++;
+        n--;
+    }
+
+    if (head_node_v4->fast_v4) {
+        // adds sharing a /24 are next to each other
+        size_t n_groups = 0;
+        uint32_t tbl24_index = 0;
+        for (i = 0; i < n; ++i) {
+            const uint32_t prefix = BULK_V4_PREFIX(&start[i]);
+            if (BATCH_DEL_NEXT_HOP != start[i].next_hop
+                    && route_tree_fast_v4_need_tbl8(head_node_v4->fast_v4, prefix, BULK_V4_DEPTH_LEN(&start[i]))
+                    && (0 == n_groups || prefix >> 8 != tbl24_index)) {
+                n_groups++;
+                tbl24_index = prefix >> 8;
             }
         }
+        if (route_tree_fast_v4_check_tbl8(head_node_v4->fast_v4, n_groups)) {
+            return -1;
+        }
     }
 
-    head_node_v6->total_routes++;
-    head_node_v6->add_count++;
-
-    return 0;
-}
-
-int compressed_route_tree_del_v4(RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4, uint8_t depth_len)
-{
-    if (depth_len > 32) {
+    BatchCommit commit = {
+        .pool = pool,
+        .head_node = head_node_v4,
+    };
+    const size_t total_nodes = head_node_v4->total_nodes;
+
+    const size_t split = bulk_first_bit_1_v4(start, 0, n, 0);
+    RouteTreeHeadNode shadow;
+    pool_taken = &commit.taken;
+    shadow.first_bit_0 = batch_merge_v4(&commit, head_node_v4->first_bit_0, 0, start, tmp, split, 0);
+    shadow.first_bit_1 = batch_merge_v4(&commit, head_node_v4->first_bit_1, 0, &start[split], &tmp[split], n - split, 0);
+    pool_taken = NULL;
+    if (commit.failed) {
+        // nothing is published yet, put back the nodes taken
+        const PoolFamily f = pool_v4(pool);
+        batch_put_back(&f, &commit);
+        head_node_v4->total_nodes = total_nodes;
         return -1;
     }
 
-    if (0 == depth_len) {
-        head_node_v4->default_next_hop = -1;
-        return 0;
-    }
-
-    uint32_t ipv4 = ntohl(be_ipv4);
-    ipv4 = GET_KEY_32(ipv4, 0, depth_len);
+    RCU_STORE(head_node_v4->first_bits, shadow.first_bits);
+    RCU_STORE(head_node_v4->default_next_hop, default_next_hop);
 
-    uint8_t bit_offset = 0;
-    RouteTreeNodeV4 **target_node_v4;
-    RouteTreeNodeV4 *node_v4;
-    RouteTreeNodeV4 *parent_node_v4 = NULL;
-    if (GET_BIT_U32(ipv4, 31)) {
-        target_node_v4 = (RouteTreeNodeV4 **)(&head_node_v4->first_bit_1);
-        node_v4 = (RouteTreeNodeV4 *)head_node_v4->first_bit_1;
-    }
-    else {
-        target_node_v4 = (RouteTreeNodeV4 **)(&head_node_v4->first_bit_0);
-        node_v4 = (RouteTreeNodeV4 *)head_node_v4->first_bit_0;
-    }
-    if (NULL == node_v4) {
-        return -1;
+    for (i = 0; i < commit.retired.n; ++i) {
+        free_node_v4(pool, head_node_v4, route_tree_node_v4(pool, commit.retired.index[i]));
     }
+    free(commit.retired.index);
+    free(commit.taken.index);
 
-    enum RouteTreeReturnStatue status;
-    uint32_t next_hop_exist;
-    do {
-        status = lookup_subtree_v4(node_v4, &node_v4, &parent_node_v4, &target_node_v4, ipv4, depth_len, &bit_offset, &next_hop_exist);
-    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
+    head_node_v4->total_routes += commit.add_count - commit.del_count;
+    head_node_v4->add_count += commit.add_count;
+    head_node_v4->del_count += commit.del_count;
 
-    if (bit_offset == depth_len) {
-        // match done
-        if (node_v4->next_bit_0 && node_v4->next_bit_1) {
-            // two child: set next_hop invalid;
-            node_v4->next_hop = -1;
+    // in prefix order, so a cover is in place before the routes it covers
+    for (i = 0; (head_node_v4->fast_v4 || head_node_v4->lc_v4 || head_node_v4->poptrie) && i < n; ++i) {
+        const uint32_t prefix = BULK_V4_PREFIX(&start[i]);
+        const uint8_t depth_len = BULK_V4_DEPTH_LEN(&start[i]);
+        if (head_node_v4->poptrie) {
+            route_tree_poptrie_update_v4(head_node_v4->poptrie, pool, head_node_v4, prefix, depth_len);
         }
-        else if (node_v4->next_bit_0 || node_v4->next_bit_1) {
-            // one child: merge child; delete node;
-            if (handle_merge_node_v4(head_node_v4,
-                        node_v4,
-                        node_v4->next_bit_0 ? node_v4->next_bit_0 : node_v4->next_bit_1,
-                        target_node_v4)) {
-
-                return -1;
+        if (BATCH_DEL_NEXT_HOP == start[i].next_hop) {
+            int32_t cover_next_hop;
+            uint8_t cover_depth_len;
+            lookup_cover_v4(pool, head_node_v4, prefix, depth_len, &cover_next_hop, &cover_depth_len);
+            if (head_node_v4->fast_v4) {
+                route_tree_fast_v4_del(head_node_v4->fast_v4, prefix, depth_len, cover_next_hop, cover_depth_len);
+            }
+            if (head_node_v4->lc_v4) {
+                route_tree_lc_v4_update(head_node_v4->lc_v4, pool, head_node_v4, prefix, depth_len, -1,
+                                        cover_next_hop, cover_depth_len, start[i].route_delta);
             }
         }
         else {
-            // no child: delete node;
-            bool parent_has_two_branches = false;
-            if (parent_node_v4 && parent_node_v4->next_bit_0 && parent_node_v4->next_bit_1) {
-                parent_has_two_branches = true;
+            if (head_node_v4->fast_v4) {
+                route_tree_fast_v4_add(head_node_v4->fast_v4, prefix, depth_len, start[i].next_hop);
             }
-
-            *target_node_v4 = NULL;
-            free_node_v4(head_node_v4, node_v4);
-
-            if (parent_has_two_branches && parent_node_v4->next_hop < 0) {
-                // delete node and parent decrease branch; merge invalid next_hop parent and the other child;
-                if (handle_merge_node_v4(head_node_v4,
-                            parent_node_v4,
-                            parent_node_v4->next_bit_0 ? parent_node_v4->next_bit_0 : parent_node_v4->next_bit_1,
-                            (RouteTreeNodeV4 **)GET_PARENT_TARGET(parent_node_v4, head_node_v4))) {
-
-                    return -1;
-                }
+            if (head_node_v4->lc_v4) {
+                route_tree_lc_v4_update(head_node_v4->lc_v4, pool, head_node_v4, prefix, depth_len, start[i].next_hop,
+                                        -1, 0, start[i].route_delta);
             }
         }
     }
-    else {
-        return -1;
-    }
 
-    head_node_v4->total_routes--;
-    head_node_v4->del_count++;
+    if (head_node_v4->aggregate && start != ops) {
+        route_tree_aggregate_update_v4(head_node_v4->aggregate, pool, head_node_v4, 0, 0);
+    }
+    for (i = 0; head_node_v4->aggregate && i < n; ++i) {
+        route_tree_aggregate_update_v4(head_node_v4->aggregate, pool, head_node_v4,
+                                    BULK_V4_PREFIX(&start[i]), BULK_V4_DEPTH_LEN(&start[i]));
+    }
 
+    batch->n_ops = 0;
+    route_tree_bump_generation(head_node_v4);
     return 0;
 }
 
-int compressed_route_tree_del_v6(RouteTreeHeadNode *head_node_v6, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len)
+int compressed_route_tree_batch_commit_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6, RouteTreeBatch *batch)
 {
-    if (depth_len > 128) {
+    if (compressed_route_tree_writer_register() < 0) {
         return -1;
     }
+    compressed_route_tree_rcu_reclaim(pool, head_node_v6);
 
-    if (0 == depth_len) {
-        head_node_v6->default_next_hop = -1;
+    if (0 == batch->n_ops) {
         return 0;
     }
 
-    RouteTreeIPV6 ipv6_ori;
-    U8_PTR_TO_CPU_IPV6(ipv6_ori, be_ipv6_u8ptr);
-    RouteTreeIPV6 ipv6;
-    get_key_ipv6(&ipv6_ori, 0, depth_len, &ipv6);
+    BulkRouteV6 *ops = batch->ops;
+    BulkRouteV6 *tmp = &ops[batch->max_ops];
+    bulk_sort_v6(ops, tmp, batch->n_ops);
 
-    uint8_t bit_offset = 0;
-    RouteTreeNodeV6 **target_node_v6;
-    RouteTreeNodeV6 *node_v6;
-    RouteTreeNodeV6 *parent_node_v6 = NULL;
-    if (GET_BIT_U64_PTR(ipv6.u64, 127)) {
-        target_node_v6 = (RouteTreeNodeV6 **)(&head_node_v6->first_bit_1);
-        node_v6 = (RouteTreeNodeV6 *)head_node_v6->first_bit_1;
-    }
-    else {
-        target_node_v6 = (RouteTreeNodeV6 **)(&head_node_v6->first_bit_0);
-        node_v6 = (RouteTreeNodeV6 *)head_node_v6->first_bit_0;
+    // keep the last op of each prefix, done in place so a failed commit can be retried
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < batch->n_ops; ++i) {
+        if (n && ops[n - 1].depth_len == ops[i].depth_len
+                && !memcmp(ops[n - 1].prefix.u8, ops[i].prefix.u8, sizeof(ops[i].prefix.u8))) {
+            ops[n - 1] = ops[i];
+        }
+        else {
+            ops[n++] = ops[i];
+        }
     }
-    if (NULL == node_v6) {
+    batch->n_ops = n;
+
+    const BulkRouteV6 *start = ops;
+    int32_t default_next_hop = head_node_v6->default_next_hop;
+    if (0 == start->depth_len) {
+        default_next_hop = BATCH_DEL_NEXT_HOP == start->next_hop ? -1 : (int32_t)start->next_hop;
+        start++;
+        tmp++;
+        n--;
+    }
+
+    BatchCommit commit = {
+        .pool = pool,
+        .head_node = head_node_v6,
+    };
+    const size_t total_nodes = head_node_v6->total_nodes;
+
+    const size_t split = bulk_first_bit_1_v6(start, 0, n, 0);
+    RouteTreeHeadNode shadow;
+    pool_taken = &commit.taken;
+    shadow.first_bit_0 = batch_merge_v6(&commit, head_node_v6->first_bit_0, 0, start, tmp, split, 0);
+    shadow.first_bit_1 = batch_merge_v6(&commit, head_node_v6->first_bit_1, 0, &start[split], &tmp[split], n - split, 0);
+    pool_taken = NULL;
+    if (commit.failed) {
+        // nothing is published yet, put back the nodes taken
+        const PoolFamily f = pool_v6(pool);
+        batch_put_back(&f, &commit);
+        head_node_v6->total_nodes = total_nodes;
         return -1;
     }
 
-    enum RouteTreeReturnStatue status;
-    uint32_t next_hop_exist;
-    do {
-        status = lookup_subtree_v6(node_v6, &node_v6, &parent_node_v6, &target_node_v6, &ipv6, depth_len, &bit_offset, &next_hop_exist);
-    } while (ROUTE_TREE_FAILED_CONTINUE == status || ROUTE_TREE_SUCCESS_CONTINUE == status);
-
-    if (bit_offset == depth_len) {
-        // match done
-        if (node_v6->next_bit_0 && node_v6->next_bit_1) {
-            // two child: set next_hop invalid;
-            node_v6->next_hop = -1;
-        }
-        else if (node_v6->next_bit_0 || node_v6->next_bit_1) {
-            // one child: merge child; delete node;
-            if (handle_merge_node_v6(head_node_v6,
-                        node_v6,
-                        node_v6->next_bit_0 ? node_v6->next_bit_0 : node_v6->next_bit_1,
-                        target_node_v6)) {
-
-                return -1;
-            }
-        }
-        else {
-            // no child: delete node;
-            bool parent_has_two_branches = false;
-            if (parent_node_v6 && parent_node_v6->next_bit_0 && parent_node_v6->next_bit_1) {
-                parent_has_two_branches = true;
-            }
+    RCU_STORE(head_node_v6->first_bits, shadow.first_bits);
+    RCU_STORE(head_node_v6->default_next_hop, default_next_hop);
 
-            *target_node_v6 = NULL;
-            free_node_v6(head_node_v6, node_v6);
+    for (i = 0; i < commit.retired.n; ++i) {
+        free_node_v6(pool, head_node_v6, route_tree_node_v6(pool, commit.retired.index[i]));
+    }
+    free(commit.retired.index);
+    free(commit.taken.index);
 
-            if (parent_has_two_branches && parent_node_v6->next_hop < 0) {
-                // delete node and parent decrease branch; merge invalid next_hop parent and the other child;
-                if (handle_merge_node_v6(head_node_v6,
-                            parent_node_v6,
-                            parent_node_v6->next_bit_0 ? parent_node_v6->next_bit_0 : parent_node_v6->next_bit_1,
-                            (RouteTreeNodeV6 **)GET_PARENT_TARGET(parent_node_v6, head_node_v6))) {
+    head_node_v6->total_routes += commit.add_count - commit.del_count;
+    head_node_v6->add_count += commit.add_count;
+    head_node_v6->del_count += commit.del_count;
 
-                    return -1;
-                }
-            }
+    for (i = 0; (head_node_v6->poptrie || head_node_v6->bsl_v6 || head_node_v6->v6_64) && i < n; ++i) {
+        if (head_node_v6->poptrie) {
+            route_tree_poptrie_update_v6(head_node_v6->poptrie, pool, head_node_v6, &start[i].prefix, start[i].depth_len);
+        }
+        if (head_node_v6->bsl_v6) {
+            route_tree_bsl_v6_update(head_node_v6->bsl_v6, pool, head_node_v6, &start[i].prefix, start[i].depth_len);
+        }
+        if (head_node_v6->v6_64) {
+            route_tree_v6_64_update(head_node_v6->v6_64, pool, head_node_v6, &start[i].prefix, start[i].depth_len);
         }
-    }
-    else {
-        return -1;
     }
 
-    head_node_v6->total_routes--;
-    head_node_v6->del_count++;
+    if (head_node_v6->aggregate && start != ops) {
+        route_tree_aggregate_update_v6(head_node_v6->aggregate, pool, head_node_v6, &ops->prefix, 0);
+    }
+    for (i = 0; head_node_v6->aggregate && i < n; ++i) {
+        route_tree_aggregate_update_v6(head_node_v6->aggregate, pool, head_node_v6, &start[i].prefix, start[i].depth_len);
+    }
 
+    batch->n_ops = 0;
+    route_tree_bump_generation(head_node_v6);
     return 0;
 }
 
-int compressed_route_tree_iterate_v4(RouteTreeHeadNode *head_node_v4, bool print_tree, bool reset)
+int compressed_route_tree_iterate_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, bool print_tree, bool reset)
 {
-    if (print_tree && head_node_v4->default_next_hop >= 0) {
-        printf("default next_hop=%d\n", head_node_v4->default_next_hop);
+    // with reset, readers lose the tree before its nodes are freed; the
+    // aggregated copy holds nodes of the pool too
+    if (reset) {
+        compressed_route_tree_release_v4_aggregate(pool, head_node_v4);
+    }
+    RouteTreeHeadNode walked = *head_node_v4;
+    if (reset) {
+        compressed_route_tree_reset_head(head_node_v4);
+    }
+
+    if (print_tree && walked.default_next_hop >= 0) {
+        printf("default next_hop=%d\n", walked.default_next_hop);
     }
 
     const RouteTreeNodeV4 *node_v4;
 
-    node_v4 = (RouteTreeNodeV4 *)head_node_v4->first_bit_0;
+    node_v4 = route_tree_node_v4(pool, walked.first_bit_0);
     if (node_v4) {
         uint32_t ipv4 = 0;
-        _compressed_route_tree_iterate_v4(head_node_v4, node_v4, ipv4, 0, 0, print_tree, reset);
+        _compressed_route_tree_iterate_v4(pool, &walked, node_v4, ipv4, 0, 0, print_tree, reset);
     }
 
-    node_v4 = (RouteTreeNodeV4 *)head_node_v4->first_bit_1;
+    node_v4 = route_tree_node_v4(pool, walked.first_bit_1);
     if (node_v4) {
         if (print_tree) {
             printf("\n");
         }
         uint32_t ipv4 = 0;
-        _compressed_route_tree_iterate_v4(head_node_v4, node_v4, ipv4, 0, 0, print_tree, reset);
+        _compressed_route_tree_iterate_v4(pool, &walked, node_v4, ipv4, 0, 0, print_tree, reset);
     }
 
     if (print_tree) {
@@ -1301,33 +3752,43 @@ int compressed_route_tree_iterate_v4(RouteTreeHeadNode *head_node_v4, bool print
     }
 
     if (reset) {
-        compressed_route_tree_reset_head(head_node_v4);
+        reclaim_node_v4(pool);
     }
 
     return 0;
 }
 
-int compressed_route_tree_iterate_v6(RouteTreeHeadNode *head_node_v6, bool print_tree, bool reset)
+int compressed_route_tree_iterate_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6, bool print_tree, bool reset)
 {
-    if (print_tree && head_node_v6->default_next_hop >= 0) {
-        printf("default next_hop=%d\n", head_node_v6->default_next_hop);
+    // with reset, readers lose the tree before its nodes are freed; the
+    // aggregated copy holds nodes of the pool too
+    if (reset) {
+        compressed_route_tree_release_v6_aggregate(pool, head_node_v6);
+    }
+    RouteTreeHeadNode walked = *head_node_v6;
+    if (reset) {
+        compressed_route_tree_reset_head(head_node_v6);
+    }
+
+    if (print_tree && walked.default_next_hop >= 0) {
+        printf("default next_hop=%d\n", walked.default_next_hop);
     }
 
     const RouteTreeNodeV6 *node_v6;
 
-    node_v6 = (RouteTreeNodeV6 *)head_node_v6->first_bit_0;
+    node_v6 = route_tree_node_v6(pool, walked.first_bit_0);
     if (node_v6) {
         RouteTreeIPV6 ipv6 = {};
-        _compressed_route_tree_iterate_v6(head_node_v6, node_v6, &ipv6, 0, 0, print_tree, reset);
+        _compressed_route_tree_iterate_v6(pool, &walked, node_v6, &ipv6, 0, 0, print_tree, reset);
     }
 
-    node_v6 = (RouteTreeNodeV6 *)head_node_v6->first_bit_1;
+    node_v6 = route_tree_node_v6(pool, walked.first_bit_1);
     if (node_v6) {
         if (print_tree) {
             printf("\n");
         }
         RouteTreeIPV6 ipv6 = {};
-        _compressed_route_tree_iterate_v6(head_node_v6, node_v6, &ipv6, 0, 0, print_tree, reset);
+        _compressed_route_tree_iterate_v6(pool, &walked, node_v6, &ipv6, 0, 0, print_tree, reset);
     }
 
     if (print_tree) {
@@ -1335,8 +3796,92 @@ int compressed_route_tree_iterate_v6(RouteTreeHeadNode *head_node_v6, bool print
     }
 
     if (reset) {
-        compressed_route_tree_reset_head(head_node_v6);
+        reclaim_node_v6(pool);
     }
 
     return 0;
 }
+
+int compressed_route_tree_rcu_reader_register(void)
+{
+    uint32_t i;
+    for (i = 0; i < ROUTE_TREE_RCU_MAX_READERS; ++i) {
+        uint64_t unused = 0;
+        const uint64_t epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+        if (__atomic_compare_exchange_n(&rcu_readers[i].epoch, &unused, epoch,
+                                    false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            uint32_t used = __atomic_load_n(&rcu_readers_used, __ATOMIC_RELAXED);
+            while (used < i + 1
+                    && !__atomic_compare_exchange_n(&rcu_readers_used, &used, i + 1,
+                                                false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            }
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void compressed_route_tree_rcu_reader_unregister(int reader_id)
+{
+    __atomic_store_n(&rcu_readers[reader_id].epoch, 0, __ATOMIC_RELEASE);
+}
+
+void compressed_route_tree_rcu_quiescent(int reader_id)
+{
+    __atomic_store_n(&rcu_readers[reader_id].epoch,
+                    __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void compressed_route_tree_rcu_synchronize(void)
+{
+    const uint64_t epoch = route_tree_rcu_start_grace_period();
+    while (!route_tree_rcu_grace_period_done(epoch)) {
+        sched_yield();
+    }
+}
+
+int compressed_route_tree_writer_register(void)
+{
+    uint32_t used = __atomic_load_n(&pool_writers, __ATOMIC_RELAXED);
+
+    while (pool_writer_id < 0 && used != (1U << ROUTE_TREE_POOL_MAX_WRITERS) - 1) {
+        const int id = __builtin_ctz(~used);
+        if (__atomic_compare_exchange_n(&pool_writers, &used, used | 1U << id,
+                                    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            pool_writer_id = id;
+        }
+    }
+
+    return pool_writer_id;
+}
+
+void compressed_route_tree_writer_unregister(void)
+{
+    if (pool_writer_id >= 0) {
+        __atomic_and_fetch(&pool_writers, ~(1U << pool_writer_id), __ATOMIC_RELEASE);
+        pool_writer_id = -1;
+    }
+}
+
+void compressed_route_tree_rcu_reclaim(RouteTreePool *pool, RouteTreeHeadNode *head_node)
+{
+    reclaim_node_v4(pool);
+    reclaim_node_v6(pool);
+
+    if (head_node->fast_v4) {
+        route_tree_fast_v4_reclaim(head_node->fast_v4);
+    }
+    if (head_node->lc_v4) {
+        route_tree_lc_v4_reclaim(head_node->lc_v4);
+    }
+    if (head_node->poptrie) {
+        route_tree_poptrie_reclaim(head_node->poptrie);
+    }
+    if (head_node->bsl_v6) {
+        route_tree_bsl_v6_reclaim(head_node->bsl_v6, pool, head_node);
+    }
+    if (head_node->v6_64) {
+        route_tree_v6_64_reclaim(head_node->v6_64);
+    }
+}
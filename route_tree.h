@@ -19,9 +19,38 @@ typedef struct {
 } RouteTreeIPV6;
 
 typedef struct route_tree_head_node_s {
+    // node index in the pool, 0 if none; in one word so both swap at once
+    union {
+        struct {
+            uint32_t first_bit_0;
+            uint32_t first_bit_1;
+        };
+        uint64_t first_bits;
+    };
     int32_t default_next_hop;
-    void *first_bit_0;
-    void *first_bit_1;
+
+    /*
+     * Lookup engines, see their build functions. add/del and batch commits
+     * keep the built ones in sync. An update running out of the memory of a
+     * copy drops it from the head, lookups go back to the tree and it can
+     * be built again with more memory. With concurrent readers, call
+     * compressed_route_tree_rcu_synchronize after release, or after the copy
+     * was dropped, before reusing its memory.
+     */
+    // DIR-24-8 table kept in sync by add/del, NULL if not built
+    void *fast_v4;
+    // LC-trie copy walked by compressed_route_tree_lookup_v4, NULL if not built
+    void *lc_v4;
+    // Poptrie copy kept in sync by add/del, NULL if not built
+    void *poptrie;
+    // length search copy walked by compressed_route_tree_lookup_v6, NULL if not built
+    void *bsl_v6;
+    // copy cut at /64 walked by compressed_route_tree_lookup_v6, NULL if not built
+    void *v6_64;
+    // aggregated tree the lookups walk in place of this one, NULL if not built
+    void *aggregate;
+    // changes with every update of the routes, never 0, see RouteTreeFlowCache
+    uint64_t generation;
 
     // stats
     size_t total_nodes;
@@ -31,49 +60,791 @@ typedef struct route_tree_head_node_s {
     size_t del_count;
 } RouteTreeHeadNode;
 
+/*
+ * Nodes live in the pool node array and link to each other by 32-bit index,
+ * index 0 is never allocated and means no node. There is no parent link, the
+ * add/del paths remember the slots they walked through.
+ * info packs the next hop (upper 24 bits, signed, -1 if the node holds no
+ * route) with key_bit_len (lower 8 bits), so both are read and published
+ * with one access. This limits next hops to ROUTE_TREE_MAX_NEXT_HOP, 23
+ * bits where they used to take 32: add, bulk_load and batch adds fail on a
+ * larger one.
+ * A v4 node is 16 bytes, four per cache line; a v6 node is 32 bytes, two per
+ * cache line.
+ */
+#define ROUTE_TREE_MAX_NEXT_HOP 0x007fffffU
+
 typedef struct route_tree_node_v4_s {
-    uint8_t key_bit_len;
-    int32_t next_hop;
     uint32_t key;
-    struct route_tree_node_v4_s *parent;
-    struct route_tree_node_v4_s *next_bit_0;
-    struct route_tree_node_v4_s *next_bit_1;
+    uint32_t next_bit_0;
+    uint32_t next_bit_1;
+    uint32_t info;
 } RouteTreeNodeV4;
 
 typedef struct route_tree_node_v6_s {
-    uint8_t key_bit_len;
-    int32_t next_hop;
     RouteTreeIPV6 key;
-    struct route_tree_node_v6_s *parent;
-    struct route_tree_node_v6_s *next_bit_0;
-    struct route_tree_node_v6_s *next_bit_1;
+    uint32_t next_bit_0;
+    uint32_t next_bit_1;
+    uint32_t info;
 } RouteTreeNodeV6;
 
+/*
+ * Free nodes a writer thread keeps at hand, one per writer id and family.
+ * Nodes link to each other through next_bit_0, newest first, so the node
+ * taken next is the one freed last and likely still in cache.
+ * Nodes unlinked by the writer are not handed out at once, a concurrent
+ * reader may still be standing on them; they are kept in limbo blocks, free
+ * nodes whose other words hold their index:
+ *   pending  wait for the next grace period to start
+ *   waiting  wait for the grace period of limbo_epoch
+ */
+typedef struct route_tree_pool_cache_s {
+    uint32_t free_head;
+    uint32_t limbo_pending;
+    uint32_t limbo_waiting;
+    // entries used in the first pending block
+    uint32_t limbo_used;
+    size_t n_free;
+    uint64_t limbo_epoch;
+} __attribute__((aligned(64))) RouteTreePoolCache;
+
+#define ROUTE_TREE_POOL_MAX_WRITERS 16
+
+/*
+ * Node pool, one per table or per group of tables sharing a memory budget.
+ * The caller owns it and the node memory handed to
+ * compressed_route_tree_init_nodes, so both can be placed per NUMA node.
+ * Several writer threads may share a pool, e.g. one per VRF, as long as
+ * each head is only updated by one of them at a time. A thread takes a
+ * writer id on its first update, see compressed_route_tree_writer_register.
+ * An update that frees a node while the pool is full, with none left to
+ * track it, waits for the readers.
+ */
+typedef struct route_tree_pool_s {
+    RouteTreeNodeV4 *v4_nodes;
+    RouteTreeNodeV6 *v6_nodes;
+
+    /*
+     * Free nodes shared by the writers, linked like a cache and taken by
+     * batches under the lock. Node index 0 is no node and never free.
+     */
+    size_t v4_nodes_pool_total;
+    uint32_t v4_nodes_lock;
+    uint32_t v4_nodes_free;
+    size_t v4_nodes_free_count;
+    RouteTreePoolCache v4_nodes_cache[ROUTE_TREE_POOL_MAX_WRITERS];
+
+    size_t v6_nodes_pool_total;
+    uint32_t v6_nodes_lock;
+    uint32_t v6_nodes_free;
+    size_t v6_nodes_free_count;
+    RouteTreePoolCache v6_nodes_cache[ROUTE_TREE_POOL_MAX_WRITERS];
+
+    // growable pool: nodes the memory has room for, 0 if the size is fixed
+    size_t v4_nodes_pool_max;
+    size_t v6_nodes_pool_max;
+} RouteTreePool;
+
+
+
+/*
+ * Memory for compressed_route_tree_init_nodes and the lookup tables, in huge
+ * pages so walks do not miss the TLB at every node: 2M pages, or 1G with
+ * ROUTE_TREE_MEM_HUGE_1G, when the system has some reserved, else normal
+ * pages advised for transparent huge pages. numa_node binds the memory to
+ * that node, ROUTE_TREE_MEM_ANY_NODE leaves it to the first touch.
+ * page_size tells what was obtained.
+ */
+#define ROUTE_TREE_MEM_ANY_NODE (-1)
+// try 1G pages before 2M ones
+#define ROUTE_TREE_MEM_HUGE_1G 0x1U
+// normal pages only
+#define ROUTE_TREE_MEM_NO_HUGE 0x2U
+// fault every page in now rather than on first use
+#define ROUTE_TREE_MEM_POPULATE 0x4U
+// address space only: pages come on first use and are not accounted for
+// before, e.g. for compressed_route_tree_init_nodes_growable; no hugetlb
+// pages, POPULATE is ignored
+#define ROUTE_TREE_MEM_RESERVE 0x8U
+
+typedef struct route_tree_mem_s {
+    void *ptr;
+    size_t size;
+    size_t page_size;
+    int numa_node;
+} RouteTreeMem;
+
+int compressed_route_tree_mem_alloc(RouteTreeMem *mem, const size_t size, const int numa_node, const unsigned int flags);
+void compressed_route_tree_mem_free(RouteTreeMem *mem);
+// node of the CPU the thread runs on, ROUTE_TREE_MEM_ANY_NODE if unknown
+int compressed_route_tree_mem_current_node(void);
+
+/*
+ * Copy the nodes of pool into new memory, e.g. bound to another socket, so
+ * the threads there look up a local copy. Nodes link by index, so the copy
+ * is used with copies of the heads (*head, with fast_v4, lc_v4, poptrie,
+ * bsl_v6, v6_64 and aggregate set to NULL). It is a snapshot, not updated
+ * by later changes of pool, see the replicated table below; take it while
+ * the writer is idle and free mem once it is unused. A copy of a growable
+ * pool is growable up to the same maximum.
+ */
+int compressed_route_tree_replicate_pool(const RouteTreePool *pool, RouteTreePool *replica, RouteTreeMem *mem,
+                                    const int numa_node, const unsigned int flags);
+
+/*
+ * Replicated table: one replica of a pool and its heads per NUMA node, so
+ * each worker looks up memory of its own socket. The writer goes through
+ * replicated_add/del only, which apply the change to the primary and then
+ * to every replica; an update costs one add/del per copy.
+ * A replica whose update failed (its pool short) is detached and its
+ * readers use the primary until the set is built again.
+ * A worker gets its replica_id once with replicated_local, e.g. of
+ * compressed_route_tree_mem_current_node on a pinned thread, -1 meaning the
+ * primary, and passes it to every lookup. DIR-24-8 tables, LC-trie, Poptrie,
+ * length search, /64 or aggregated copies may be built on the replica heads,
+ * with memory of their node.
+ * Init copies the primary and must run while the writer is idle; with
+ * concurrent readers, call compressed_route_tree_rcu_synchronize before
+ * release.
+ */
+#define ROUTE_TREE_MAX_REPLICAS 8
+
+typedef struct route_tree_replica_s {
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    RouteTreeHeadNode head_node_v6;
+    RouteTreeMem mem;
+    int numa_node;
+    bool attached;
+} RouteTreeReplica;
+
+typedef struct route_tree_replicated_s {
+    // primary, a head may be NULL if the family is not used
+    RouteTreePool *pool;
+    RouteTreeHeadNode *head_node_v4;
+    RouteTreeHeadNode *head_node_v6;
+
+    RouteTreeReplica replicas[ROUTE_TREE_MAX_REPLICAS];
+    size_t n_replicas;
+} RouteTreeReplicated;
 
+int compressed_route_tree_replicated_init(RouteTreeReplicated *replicated, RouteTreePool *pool,
+                                    RouteTreeHeadNode *head_node_v4, RouteTreeHeadNode *head_node_v6,
+                                    const int *numa_nodes, const size_t n_numa_nodes, const unsigned int mem_flags);
+void compressed_route_tree_replicated_release(RouteTreeReplicated *replicated);
+int compressed_route_tree_replicated_local(const RouteTreeReplicated *replicated, const int numa_node);
+
+int compressed_route_tree_replicated_add_v4(RouteTreeReplicated *replicated, uint32_t be_ipv4, uint8_t depth_len, uint32_t next_hop);
+int compressed_route_tree_replicated_add_v6(RouteTreeReplicated *replicated, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t next_hop);
+int compressed_route_tree_replicated_del_v4(RouteTreeReplicated *replicated, uint32_t be_ipv4, uint8_t depth_len);
+int compressed_route_tree_replicated_del_v6(RouteTreeReplicated *replicated, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len);
+
+int compressed_route_tree_replicated_lookup_v4(const RouteTreeReplicated *replicated, const int replica_id,
+                                        uint32_t be_ipv4, uint32_t *next_hop);
+int compressed_route_tree_replicated_lookup_v6(const RouteTreeReplicated *replicated, const int replica_id,
+                                        const uint8_t *be_ipv6_u8ptr, uint32_t *next_hop);
+
+/*
+ * VRF table: the heads of up to max_vrfs VRFs sharing one pool, in an array
+ * indexed by vrf_id, so finding the head of a lookup is one load of the
+ * cache line it starts on. A VRF not created has empty heads, its lookups
+ * miss. Mixed VRF bulk lookups walk their addresses together like
+ * compressed_route_tree_lookup_bulk, addresses of the same VRF in a row
+ * sharing the load of the head.
+ * Each VRF counts its routes and nodes, vrf_get_usage reports them with
+ * the pool memory they hold; DIR-24-8 tables, LC-trie, Poptrie, length
+ * search or /64 copies built on a VRF head with vrf_head are the caller's
+ * memory and not counted, nor are the nodes of an aggregated copy.
+ * Destroy frees the routes of the VRF, and those of an aggregated copy, and
+ * detaches its lookup engines; with concurrent readers, call
+ * compressed_route_tree_rcu_synchronize before reusing the memory of the
+ * engines.
+ * Writers of different VRFs may run on different threads, see RouteTreePool.
+ */
+typedef struct route_tree_vrf_s {
+    RouteTreeHeadNode head_node_v4;
+    RouteTreeHeadNode head_node_v6;
+    bool active;
+} __attribute__((aligned(64))) RouteTreeVrf;
+
+typedef struct route_tree_vrf_table_s {
+    RouteTreePool *pool;
+    RouteTreeVrf *vrfs;
+    size_t max_vrfs;
+    size_t n_vrfs;
+} RouteTreeVrfTable;
+
+typedef struct route_tree_vrf_usage_s {
+    size_t routes_v4;
+    size_t routes_v6;
+    size_t nodes_v4;
+    size_t nodes_v6;
+    // bytes of pool nodes and of the head slot
+    size_t memory;
+} RouteTreeVrfUsage;
+
+size_t compressed_route_tree_vrf_get_memory_footprint(const size_t max_vrfs);
+int compressed_route_tree_vrf_init(RouteTreeVrfTable *table, RouteTreePool *pool, void * const vrfs_ptr, const size_t max_vrfs);
+int compressed_route_tree_vrf_create(RouteTreeVrfTable *table, uint32_t vrf_id);
+int compressed_route_tree_vrf_destroy(RouteTreeVrfTable *table, uint32_t vrf_id);
+// heads of an active VRF, NULL otherwise, e.g. to build a lookup engine on
+RouteTreeHeadNode *compressed_route_tree_vrf_head_v4(RouteTreeVrfTable *table, uint32_t vrf_id);
+RouteTreeHeadNode *compressed_route_tree_vrf_head_v6(RouteTreeVrfTable *table, uint32_t vrf_id);
+int compressed_route_tree_vrf_get_usage(const RouteTreeVrfTable *table, uint32_t vrf_id, RouteTreeVrfUsage *usage);
+
+int compressed_route_tree_vrf_add_v4(RouteTreeVrfTable *table, uint32_t vrf_id, uint32_t be_ipv4, uint8_t depth_len, uint32_t next_hop);
+int compressed_route_tree_vrf_add_v6(RouteTreeVrfTable *table, uint32_t vrf_id, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t next_hop);
+int compressed_route_tree_vrf_del_v4(RouteTreeVrfTable *table, uint32_t vrf_id, uint32_t be_ipv4, uint8_t depth_len);
+int compressed_route_tree_vrf_del_v6(RouteTreeVrfTable *table, uint32_t vrf_id, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len);
+
+int compressed_route_tree_vrf_lookup_v4(const RouteTreeVrfTable *table, uint32_t vrf_id, uint32_t be_ipv4, uint32_t *next_hop);
+int compressed_route_tree_vrf_lookup_v6(const RouteTreeVrfTable *table, uint32_t vrf_id, const uint8_t *be_ipv6_u8ptr, uint32_t *next_hop);
+// hit_mask as in compressed_route_tree_lookup_bulk_v4, an unknown vrf_id is a miss
+size_t compressed_route_tree_vrf_lookup_bulk_v4(const RouteTreeVrfTable *table, const uint32_t *vrf_ids,
+                                            const uint32_t *be_ipv4, size_t n,
+                                            uint32_t *next_hop, uint64_t *hit_mask);
+size_t compressed_route_tree_vrf_lookup_bulk_v6(const RouteTreeVrfTable *table, const uint32_t *vrf_ids,
+                                            const uint8_t * const *be_ipv6_u8ptr, size_t n,
+                                            uint32_t *next_hop, uint64_t *hit_mask);
+
+/*
+ * Next hop groups: routes added with nhg_add hold a group id, below
+ * max_groups, as their next hop; the group resolves it to one of its
+ * members, so set_members repoints every route of the group at once
+ * instead of one add per route. Each group counts the routes holding it
+ * and cannot be destroyed while some do; keep routes of a table using
+ * groups to nhg_add/nhg_del, raw add/del and batches bypass the counts.
+ * Lookups take a flow hash picking the member of an ECMP group, the same
+ * hash always picks the same member while the members do not change.
+ * A group with no members resolves to nothing, like a missing route.
+ * A group holds at most ROUTE_TREE_NHG_MAX_MEMBERS members. max_members
+ * bounds the member slots of all groups; lists are stored in power of two
+ * blocks, and a replaced list is reused only after a grace period, so
+ * set_members can fail until compressed_route_tree_rcu_synchronize.
+ * One writer per table, readers run concurrently as with the pool.
+ */
+#define ROUTE_TREE_NHG_MAX_MEMBERS 64
+#define ROUTE_TREE_NHG_SIZE_CLASSES 7
+
+typedef struct route_tree_nhg_s {
+    // member block index (upper half) and count (lower half), swapped whole
+    uint64_t members;
+    // routes holding the group
+    uint32_t refcount;
+    bool active;
+} RouteTreeNhg;
+
+typedef struct route_tree_nhg_table_s {
+    RouteTreeNhg *groups;
+    uint32_t *members;
+    // writer only, per slot: next block of the free or limbo list it is on
+    uint32_t *links;
+    size_t max_groups;
+    size_t n_groups;
+    size_t n_member_slots;
+    size_t next_member_slot;
+    // per block size, blocks linked through links, 0 ends
+    uint32_t free_block[ROUTE_TREE_NHG_SIZE_CLASSES];
+    uint32_t limbo_waiting[ROUTE_TREE_NHG_SIZE_CLASSES];
+    uint32_t limbo_pending[ROUTE_TREE_NHG_SIZE_CLASSES];
+    bool has_limbo_waiting;
+    bool has_limbo_pending;
+    uint64_t limbo_epoch;
+} RouteTreeNhgTable;
+
+size_t compressed_route_tree_nhg_get_memory_footprint(const size_t max_groups, const size_t max_members);
+int compressed_route_tree_nhg_init(RouteTreeNhgTable *table, void * const nhg_ptr, const size_t max_groups, const size_t max_members);
+int compressed_route_tree_nhg_create(RouteTreeNhgTable *table, uint32_t group_id);
+int compressed_route_tree_nhg_destroy(RouteTreeNhgTable *table, uint32_t group_id);
+int compressed_route_tree_nhg_set_members(RouteTreeNhgTable *table, uint32_t group_id, const uint32_t *members, size_t n_members);
+// members has room for ROUTE_TREE_NHG_MAX_MEMBERS
+int compressed_route_tree_nhg_get_members(const RouteTreeNhgTable *table, uint32_t group_id, uint32_t *members, size_t *n_members);
+uint32_t compressed_route_tree_nhg_refcount(const RouteTreeNhgTable *table, uint32_t group_id);
+
+int compressed_route_tree_nhg_add_v4(RouteTreeNhgTable *table, RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                    uint32_t be_ipv4, uint8_t depth_len, uint32_t group_id);
+int compressed_route_tree_nhg_add_v6(RouteTreeNhgTable *table, RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t group_id);
+int compressed_route_tree_nhg_del_v4(RouteTreeNhgTable *table, RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                    uint32_t be_ipv4, uint8_t depth_len);
+int compressed_route_tree_nhg_del_v6(RouteTreeNhgTable *table, RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    const uint8_t *be_ipv6_u8ptr, uint8_t depth_len);
+
+// group id, e.g. from any lookup of the table, to the member of flow_hash
+int compressed_route_tree_nhg_resolve(const RouteTreeNhgTable *table, uint32_t group_id, uint32_t flow_hash, uint32_t *next_hop);
+// resolve the hits of a bulk lookup in place, clearing the bits of groups with no members
+size_t compressed_route_tree_nhg_resolve_bulk(const RouteTreeNhgTable *table, const uint32_t *flow_hash, size_t n,
+                                            uint32_t *next_hop, uint64_t *hit_mask);
+int compressed_route_tree_nhg_lookup_v4(const RouteTreeNhgTable *table, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                                        uint32_t be_ipv4, uint32_t flow_hash, uint32_t *next_hop);
+int compressed_route_tree_nhg_lookup_v6(const RouteTreeNhgTable *table, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                                        const uint8_t *be_ipv6_u8ptr, uint32_t flow_hash, uint32_t *next_hop);
 
 size_t compressed_route_tree_get_memory_footprint_v4(const size_t v4_max_routes);
 size_t compressed_route_tree_get_memory_footprint_v6(const size_t v6_max_routes);
 
-int compressed_route_tree_init_nodes(void * const v4_nodes_pool_ptr, const size_t v4_max_routes,
+// a family with NULL node memory has no nodes, its adds fail
+int compressed_route_tree_init_nodes(RouteTreePool *pool,
+                                    void * const v4_nodes_pool_ptr, const size_t v4_max_routes,
                                     void * const v6_nodes_pool_ptr, const size_t v6_max_routes);
+
+/*
+ * Growable pool: nodes_ptr only reserves room for up to v4/v6_max_routes,
+ * e.g. memory from compressed_route_tree_mem_alloc with
+ * ROUTE_TREE_MEM_RESERVE. The pool starts with ROUTE_TREE_POOL_SLAB_NODES
+ * nodes per family and an update short of nodes adds slabs at the end of
+ * the node array, so nodes never move and lookups index them as usual.
+ * pool_shrink gives the slabs at the end whose nodes are all free back to
+ * the system and returns the number of nodes dropped; free nodes kept by
+ * the other writers count as in use. Nodes in use are not moved, so it
+ * also lines the free nodes up for the next allocations to fill the lowest
+ * slabs first, and the churn that follows frees the last ones for a later
+ * shrink. Run it from a writer, e.g. after a big withdrawal. A fixed pool
+ * does not shrink.
+ */
+#define ROUTE_TREE_POOL_SLAB_NODES (1UL << 16)
+
+size_t compressed_route_tree_get_memory_footprint_growable(const size_t v4_max_routes, const size_t v6_max_routes);
+int compressed_route_tree_init_nodes_growable(RouteTreePool *pool, void * const nodes_ptr,
+                                            const size_t v4_max_routes, const size_t v6_max_routes);
+size_t compressed_route_tree_pool_shrink_v4(RouteTreePool *pool);
+size_t compressed_route_tree_pool_shrink_v6(RouteTreePool *pool);
+
 void compressed_route_tree_reset_head(RouteTreeHeadNode *head_node);
 
-size_t compressed_route_tree_pool_count_v4();
-size_t compressed_route_tree_pool_free_count_v4();
-size_t compressed_route_tree_pool_count_v6();
-size_t compressed_route_tree_pool_free_count_v6();
+size_t compressed_route_tree_pool_count_v4(const RouteTreePool *pool);
+size_t compressed_route_tree_pool_free_count_v4(const RouteTreePool *pool);
+size_t compressed_route_tree_pool_count_v6(const RouteTreePool *pool);
+size_t compressed_route_tree_pool_free_count_v6(const RouteTreePool *pool);
 
-int compressed_route_tree_lookup_v4(const RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4, uint32_t *next_hop);
-int compressed_route_tree_lookup_v6(const RouteTreeHeadNode *head_node_v6, const uint8_t *be_ipv6_u8ptr, uint32_t *next_hop);
+int compressed_route_tree_lookup_v4(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4, uint32_t *next_hop);
+int compressed_route_tree_lookup_v6(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6, const uint8_t *be_ipv6_u8ptr, uint32_t *next_hop);
 
-int compressed_route_tree_add_v4(RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4, uint8_t depth_len, uint32_t next_hop);
-int compressed_route_tree_add_v6(RouteTreeHeadNode *head_node_v6, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t next_hop);
+/*
+ * Lookup also telling which route matched, for per-route data such as
+ * counters kept in a side array indexed by handle, the pool index of the
+ * node holding the route, below pool->v4_nodes_pool_total/v6_nodes_pool_total.
+ * The default route has handle 0 and depth_len 0. Walks the tree, never the
+ * LC-trie copy or DIR-24-8 table.
+ * A route keeps its handle until an add or del next to it splits or merges
+ * its node; route_handle gives the handle of a route now, 0 if it is not in
+ * the table, e.g. to move its counters after an update.
+ */
+typedef struct {
+    uint32_t next_hop;
+    uint32_t handle;
+    uint8_t depth_len;
+} RouteTreeLookupResult;
 
-int compressed_route_tree_del_v4(RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4, uint8_t depth_len);
-int compressed_route_tree_del_v6(RouteTreeHeadNode *head_node_v6, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len);
+int compressed_route_tree_lookup_ext_v4(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4,
+                                    RouteTreeLookupResult *result);
+int compressed_route_tree_lookup_ext_v6(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6, const uint8_t *be_ipv6_u8ptr,
+                                    RouteTreeLookupResult *result);
+uint32_t compressed_route_tree_route_handle_v4(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                                            uint32_t be_ipv4, uint8_t depth_len);
+uint32_t compressed_route_tree_route_handle_v6(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                                            const uint8_t *be_ipv6_u8ptr, uint8_t depth_len);
+
+/*
+ * Look up n addresses at once, walking them through the tree together so the
+ * node loads of different addresses overlap.
+ * Bit (i % 64) of hit_mask[i / 64] is set when next_hop[i] is valid; hit_mask
+ * must hold (n + 63) / 64 words. Return the number of hits.
+ */
+size_t compressed_route_tree_lookup_bulk_v4(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4, const uint32_t *be_ipv4, size_t n,
+                                        uint32_t *next_hop, uint64_t *hit_mask);
+size_t compressed_route_tree_lookup_bulk_v6(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6, const uint8_t * const *be_ipv6_u8ptr, size_t n,
+                                        uint32_t *next_hop, uint64_t *hit_mask);
+
+/*
+ * Flow cache in front of the lookups, for traffic where a few destinations
+ * carry most packets: results are kept by full address, a set of 4 v4 or
+ * 2 v6 entries takes one cache line, so a hit costs one line.
+ * A cache belongs to one thread and needs no locking; it can serve several
+ * heads. Entries are tagged with the generation of their head, which every
+ * add/del/commit changes, so an update drops all of them at no cost.
+ * n_sets_v4 and n_sets_v6 are powers of 2, 0 to leave a family uncached.
+ */
+typedef struct route_tree_flow_cache_s {
+    void *sets_v4;
+    void *sets_v6;
+    uint32_t set_mask_v4;
+    uint32_t set_mask_v6;
+    size_t n_sets_v4;
+    size_t n_sets_v6;
+
+    // stats
+    size_t hits;
+    size_t misses;
+} RouteTreeFlowCache;
+
+size_t compressed_route_tree_flow_cache_get_memory_footprint(const size_t n_sets_v4, const size_t n_sets_v6);
+int compressed_route_tree_flow_cache_init(RouteTreeFlowCache *cache, void * const cache_ptr,
+                                        const size_t n_sets_v4, const size_t n_sets_v6);
+void compressed_route_tree_flow_cache_flush(RouteTreeFlowCache *cache);
+int compressed_route_tree_lookup_v4_cached(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4, RouteTreeFlowCache *cache,
+                                        uint32_t be_ipv4, uint32_t *next_hop);
+int compressed_route_tree_lookup_v6_cached(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6, RouteTreeFlowCache *cache,
+                                        const uint8_t *be_ipv6_u8ptr, uint32_t *next_hop);
+
+/*
+ * DIR-24-8 table for IPv4, at most two memory accesses per lookup.
+ * Built from the routes already in head_node_v4 and then updated by
+ * compressed_route_tree_add_v4/del_v4. n_tbl8_groups bounds the number of
+ * distinct /24 holding a longer prefix; an add needing more fails, the
+ * table is never dropped. Without a table, never built or released, the
+ * lookup finds no route.
+ */
+size_t compressed_route_tree_get_memory_footprint_v4_fast(const size_t n_tbl8_groups);
+int compressed_route_tree_build_v4_fast(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, void * const fast_v4_ptr, const size_t n_tbl8_groups);
+void compressed_route_tree_release_v4_fast(RouteTreeHeadNode *head_node_v4);
+size_t compressed_route_tree_fast_v4_free_tbl8_count(const RouteTreeHeadNode *head_node_v4);
+int compressed_route_tree_lookup_v4_fast(const RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4, uint32_t *next_hop);
+
+/*
+ * Level-compressed mode for IPv4: an LC-trie copy of the tree in which a
+ * subtree at least half full k levels down is one node of 2^k slots, taking
+ * k bits of the address in one step. Once built, compressed_route_tree_lookup_v4
+ * walks it instead of the tree; the bulk lookups still walk the tree.
+ * Updates lay a node out again once the number of routes below it has
+ * doubled or dropped to a quarter. Slots are 8 bytes, BGP-like tables take
+ * 5 to 6 per route.
+ */
+size_t compressed_route_tree_get_memory_footprint_v4_lc(const size_t n_slots);
+int compressed_route_tree_build_v4_lc(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, void * const lc_v4_ptr, const size_t n_slots);
+void compressed_route_tree_release_v4_lc(RouteTreeHeadNode *head_node_v4);
+// slots never handed out yet
+size_t compressed_route_tree_lc_v4_free_slot_count(const RouteTreeHeadNode *head_node_v4);
+
+/*
+ * Poptrie copy of the tree for IPv4 or IPv6: a node takes 6 bits of the
+ * address per step through a 64-bit bitmap of its children and one of its
+ * leaves, the next hops pushed down from above, so a lookup counts bits
+ * with popcnt to find the next node and ends on one leaf, with no
+ * backtracking. Nodes are 24 bytes and leaves 4, runs of equal leaves
+ * share one. How many a table takes depends on its size and shape: a route
+ * adds at most one node per 6 bits of its length past the first and blocks
+ * round up to a power of 2, so a build of n routes needs at most 2 + 10 n
+ * nodes for IPv4, 2 + 42 n for IPv6, and 64 leaves per node. Real tables take
+ * far less, the generated IPv4 ones of the bench 1.1 nodes per route at
+ * 100k routes and 0.64 at 465k; size from such a figure, plus room for the
+ * paths updates copy until the blocks they replace are reclaimed, and build
+ * again with more memory if it fails.
+ * lookup_v4/v6_poptrie walk it, or the tree while it is not built.
+ * Updates lay out again the nodes on the path to the route, and those below
+ * it if its next hop is pushed down there, each route of a batch on its
+ * own. An update thus costs the whole subtree below its prefix: a few
+ * microseconds for a /16 or longer, about 0.4 ms for a /8 of a 300k route
+ * IPv4 table. Keep it for tables whose short routes seldom change;
+ * route_tree_bench reports the update rate with each copy attached.
+ */
+size_t compressed_route_tree_get_memory_footprint_poptrie(const size_t n_nodes, const size_t n_leaves);
+int compressed_route_tree_build_v4_poptrie(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                        void * const poptrie_ptr, const size_t n_nodes, const size_t n_leaves);
+int compressed_route_tree_build_v6_poptrie(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                        void * const poptrie_ptr, const size_t n_nodes, const size_t n_leaves);
+void compressed_route_tree_release_v4_poptrie(RouteTreeHeadNode *head_node_v4);
+void compressed_route_tree_release_v6_poptrie(RouteTreeHeadNode *head_node_v6);
+// nodes and leaves handed out so far
+void compressed_route_tree_poptrie_get_usage(const RouteTreeHeadNode *head_node, size_t *n_nodes, size_t *n_leaves);
+int compressed_route_tree_lookup_v4_poptrie(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                                        uint32_t be_ipv4, uint32_t *next_hop);
+int compressed_route_tree_lookup_v6_poptrie(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                                        const uint8_t *be_ipv6_u8ptr, uint32_t *next_hop);
+
+/*
+ * Binary search on prefix lengths for IPv6: the prefixes of every length
+ * holding routes, and markers left on the way to longer ones, are in one
+ * hash table, and a lookup searches the sorted lengths with one probe per
+ * step, about 6 for a full table where the tree walk may visit dozens of
+ * nodes. Once built, compressed_route_tree_lookup_v6 searches it instead of
+ * the tree; the bulk lookups still walk the tree.
+ * n_slots is a power of 2, a slot is 32 bytes and takes a route or a
+ * marker, about 4 per route of the generated tables of the bench; at most
+ * 7/8 of the slots are used. An optional Bloom filter of n_bloom_bits, a
+ * power of 2 of at least 64 or 0 for none, skips most probes of absent
+ * prefixes; about 8 bits per slot in use keep it small enough to stay in
+ * cache, which matters more than its false positives.
+ * The first route of a length, or the last one going, changes the search;
+ * the markers of the old one are removed by compressed_route_tree_rcu_reclaim
+ * once its readers are done. A change only waits for the readers after
+ * three others within one grace period. Removed slots are reused but probes
+ * go on through them, build again after heavy churn.
+ */
+size_t compressed_route_tree_get_memory_footprint_v6_bsl(const size_t n_slots, const size_t n_bloom_bits);
+int compressed_route_tree_build_v6_bsl(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    void * const bsl_v6_ptr, const size_t n_slots, const size_t n_bloom_bits);
+void compressed_route_tree_release_v6_bsl(RouteTreeHeadNode *head_node_v6);
+// slots holding a route or a marker
+size_t compressed_route_tree_bsl_v6_used_slot_count(const RouteTreeHeadNode *head_node_v6);
+
+/*
+ * IPv6 copy cut at /64: the nodes of the tree on the upper 64 bits of the
+ * address, 16 bytes each and walked with 64-bit keys like the v4 tree.
+ * Routes longer than /64 stay in the tree only, a lookup under one of
+ * them walks the tree instead. Once built, compressed_route_tree_lookup_v6
+ * walks it, unless a length search copy is built too; the bulk lookups
+ * still walk the tree.
+ * The nodes come in pairs of the two children of a node, 32 bytes;
+ * n_pairs of about the routes shorter than /64 hold the copy, with room
+ * for the pairs an update copies and those waiting for the readers.
+ */
+size_t compressed_route_tree_get_memory_footprint_v6_64(const size_t n_pairs);
+int compressed_route_tree_build_v6_64(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    void * const v6_64_ptr, const size_t n_pairs);
+void compressed_route_tree_release_v6_64(RouteTreeHeadNode *head_node_v6);
+size_t compressed_route_tree_v6_64_used_pair_count(const RouteTreeHeadNode *head_node_v6);
+
+/*
+ * Aggregated copy: a second tree in the pool of the head with the fewest
+ * routes giving every address the next hop the routes of the head give it,
+ * e.g. without the more specifics of the same next hop as their cover. The
+ * head keeps every route, for the cursors, handles and lookup_ext; once
+ * built, the other lookups walk the aggregated tree instead.
+ * Routes shorter than split_len, e.g. 16 for IPv4 or 32 for IPv6, are
+ * copied; the ones below are aggregated with ORTC per block of split_len
+ * bits, so an update computes its block again, and a route shorter than
+ * split_len the blocks it covers: a change of the default route goes
+ * through every block it covers. max_block_routes bounds the routes of a
+ * block, before and after the change.
+ * The pool needs room for the nodes of both trees. add/del and batch
+ * commits keep it in sync; an update running out of nodes or room in the
+ * block drops the copy from the head and gives its nodes back.
+ * Release gives the nodes back to the pool, its readers are waited for as
+ * for any other freed node.
+ */
+size_t compressed_route_tree_get_memory_footprint_aggregate(const size_t max_block_routes);
+int compressed_route_tree_build_v4_aggregate(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                        void * const aggregate_ptr, const size_t max_block_routes, const uint8_t split_len);
+int compressed_route_tree_build_v6_aggregate(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                        void * const aggregate_ptr, const size_t max_block_routes, const uint8_t split_len);
+void compressed_route_tree_release_v4_aggregate(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4);
+void compressed_route_tree_release_v6_aggregate(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6);
+// routes, the default one included, and nodes of the aggregated tree
+void compressed_route_tree_aggregate_get_usage(const RouteTreeHeadNode *head_node, size_t *n_routes, size_t *n_nodes);
+
+int compressed_route_tree_add_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4, uint8_t depth_len, uint32_t next_hop);
+int compressed_route_tree_add_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t next_hop);
+
+/*
+ * Load many routes into an empty table at once: the routes are radix sorted
+ * and the tree is built top-down in one pass over them, with no split or
+ * merge. Nodes are taken from the pool in depth-first order, two siblings
+ * at a time, so on a fresh pool they are laid out next to each other.
+ * A prefix given twice keeps the last next hop, as with add. depth_len 0
+ * sets the default next hop.
+ * Fails without touching the table if the head is not empty, has any lookup
+ * engine built, i.e. a DIR-24-8 table or an LC-trie, Poptrie, length search,
+ * /64 or aggregated copy (build them after loading), a route is invalid or
+ * the pool is short.
+ */
+typedef struct {
+    uint32_t be_ipv4;
+    uint8_t depth_len;
+    uint32_t next_hop;
+} RouteTreeRouteV4;
+
+typedef struct {
+    uint8_t be_ipv6[16];
+    uint8_t depth_len;
+    uint32_t next_hop;
+} RouteTreeRouteV6;
+
+int compressed_route_tree_bulk_load_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, const RouteTreeRouteV4 *routes, size_t n_routes);
+int compressed_route_tree_bulk_load_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6, const RouteTreeRouteV6 *routes, size_t n_routes);
+
+/*
+ * Update batch, e.g. one BGP convergence event. Adds and dels recorded
+ * between begin and commit are coalesced per prefix, the last one wins, and
+ * applied at commit to shadow copies of the subtrees they touch; untouched
+ * subtrees are shared. Both roots are then swapped with one store, so a
+ * reader sees the table before or after the whole batch, never half of it.
+ * Replaced nodes are recycled after the grace period like on del.
+ * ops_ptr holds max_ops ops, see get_memory_footprint; a batch add/del fails
+ * once it is full. A del of a missing route is ignored.
+ * A commit fails without touching the table if the pool or the DIR-24-8
+ * table is short, the batch is kept so it can be committed again; on
+ * success it is emptied. The default next hop (depth_len 0) and the
+ * DIR-24-8 table are updated right after the swap.
+ */
+typedef struct route_tree_batch_s {
+    void *ops;
+    size_t max_ops;
+    size_t n_ops;
+} RouteTreeBatch;
+
+size_t compressed_route_tree_batch_get_memory_footprint_v4(const size_t max_ops);
+size_t compressed_route_tree_batch_get_memory_footprint_v6(const size_t max_ops);
+
+int compressed_route_tree_batch_begin(RouteTreeBatch *batch, void * const ops_ptr, const size_t max_ops);
+int compressed_route_tree_batch_add_v4(RouteTreeBatch *batch, uint32_t be_ipv4, uint8_t depth_len, uint32_t next_hop);
+int compressed_route_tree_batch_add_v6(RouteTreeBatch *batch, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t next_hop);
+int compressed_route_tree_batch_del_v4(RouteTreeBatch *batch, uint32_t be_ipv4, uint8_t depth_len);
+int compressed_route_tree_batch_del_v6(RouteTreeBatch *batch, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len);
+int compressed_route_tree_batch_commit_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, RouteTreeBatch *batch);
+int compressed_route_tree_batch_commit_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6, RouteTreeBatch *batch);
+
+int compressed_route_tree_del_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, uint32_t be_ipv4, uint8_t depth_len);
+int compressed_route_tree_del_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len);
+
+/*
+ * One writer per head, multiple lock-free readers.
+ * Lookups may run on any number of threads while one thread applies
+ * add/del/build to a head. Nodes and tbl8 groups unlinked by the writer are only
+ * recycled after every registered reader has called
+ * compressed_route_tree_rcu_quiescent, which a reader does whenever it holds
+ * no result of a lookup in progress, e.g. between two bursts.
+ * An unregistered reader is not waited for, so it must not look up.
+ */
+#define ROUTE_TREE_RCU_MAX_READERS 128
+
+int compressed_route_tree_rcu_reader_register(void);
+void compressed_route_tree_rcu_reader_unregister(int reader_id);
+void compressed_route_tree_rcu_quiescent(int reader_id);
+
+// Writer side: wait until every registered reader is quiescent.
+void compressed_route_tree_rcu_synchronize(void);
+// Writer side: recycle what no reader can see anymore, also done by add/del.
+void compressed_route_tree_rcu_reclaim(RouteTreePool *pool, RouteTreeHeadNode *head_node);
+/*
+ * Writer side: take a writer id for the calling thread, returns it or -1.
+ * The ids are shared by every pool of the process and up to
+ * ROUTE_TREE_POOL_MAX_WRITERS threads hold one at a time. add, del,
+ * bulk_load and batch commits take one when the thread has none, and fail
+ * with -1 when all are taken; a writer thread can register first to find
+ * out at start. The reset of compressed_route_tree_iterate_v4/_v6 still
+ * works without one, but waits for the readers on every freed node.
+ */
+int compressed_route_tree_writer_register(void);
+/*
+ * Writer side: give up the writer id of the calling thread, e.g. before it
+ * exits. The free nodes it keeps in each pool stay with the id and go to
+ * the next thread taking it.
+ */
+void compressed_route_tree_writer_unregister(void);
+
+/*
+ * Snapshot of a pool and the heads built on it, e.g. one v4 and one v6 head.
+ * load_mmap maps the file privately and uses the nodes in place after
+ * validating them, so the restored tables can be looked up and updated at
+ * once. The caller owns the mapping returned in snapshot_ptr/snapshot_size
+ * and munmaps it once the pool is no longer used, like the node memory given
+ * to compressed_route_tree_init_nodes. No lookup engine is saved: build the
+ * DIR-24-8 table and the LC-trie, Poptrie, length search, /64 and aggregated
+ * copies again after a restore; the nodes of an aggregated copy are free in
+ * the restored pool.
+ * On failure, the pool is untouched and the heads are reset.
+ */
+int compressed_route_tree_save(const RouteTreePool *pool,
+                            const RouteTreeHeadNode *head_nodes_v4, size_t n_heads_v4,
+                            const RouteTreeHeadNode *head_nodes_v6, size_t n_heads_v6,
+                            const char *path);
+int compressed_route_tree_load_mmap(RouteTreePool *pool,
+                                RouteTreeHeadNode *head_nodes_v4, size_t n_heads_v4,
+                                RouteTreeHeadNode *head_nodes_v6, size_t n_heads_v6,
+                                const char *path,
+                                void **snapshot_ptr,
+                                size_t *snapshot_size);
+
+/*
+ * Lookup counters of compressed_route_tree_lookup_v4/v6 and the bulk
+ * lookups, compiled in with -DROUTE_TREE_STATS (make STATS=1); otherwise
+ * get_lookup_stats fails. Each thread counts in its own cache lines, the
+ * first ROUTE_TREE_STATS_MAX_THREADS threads to look up get some, later
+ * threads are not counted. get sums every thread; like reset, it does not
+ * stop lookups in progress, so a few may be missed.
+ * visited[n] counts the lookups which walked n nodes of the tree.
+ */
+#define ROUTE_TREE_STATS_MAX_THREADS 128
+#define ROUTE_TREE_STATS_MAX_VISITED 129
+
+typedef struct {
+    uint64_t lookups;
+    // a route of the tree matched
+    uint64_t hits;
+    // only the default route matched
+    uint64_t default_hits;
+    uint64_t misses;
+    uint64_t visited[ROUTE_TREE_STATS_MAX_VISITED];
+} RouteTreeLookupStats;
+
+int compressed_route_tree_get_lookup_stats_v4(RouteTreeLookupStats *stats);
+int compressed_route_tree_get_lookup_stats_v6(RouteTreeLookupStats *stats);
+void compressed_route_tree_reset_lookup_stats(void);
+
+/*
+ * Shape of the live tree: depth[n] counts the routes n nodes below the head,
+ * which is what a lookup ending on them walks. Always built in; it walks the
+ * whole tree, so call it from the writer.
+ */
+void compressed_route_tree_get_depth_stats_v4(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                                        uint64_t depth[ROUTE_TREE_STATS_MAX_VISITED]);
+void compressed_route_tree_get_depth_stats_v6(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                                        uint64_t depth[ROUTE_TREE_STATS_MAX_VISITED]);
+
+// reset empties the head, releases its aggregated copy and frees every node
+int compressed_route_tree_iterate_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, bool print_tree, bool reset);
+int compressed_route_tree_iterate_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6, bool print_tree, bool reset);
+
+/*
+ * Route cursor: walks the routes of a head with no recursion, allocation or
+ * I/O, so the control plane can dump a big table a chunk at a time from its
+ * event loop. Routes come in prefix order, a prefix before the longer ones
+ * it covers and bit 0 before bit 1, the default route first.
+ * The cursor holds the path from the head to the node it is on, one node
+ * per bit at most. When the head has changed since the last call, next
+ * walks down again to the first route after the last one it returned; a
+ * route added or deleted meanwhile is returned or not, but no route comes
+ * twice or out of order.
+ * A reader may keep a cursor across quiescent states, like the writer
+ * across its updates.
+ * seek resumes after be_ipv4/depth_len, whether the head has that route or
+ * not. next returns 0 and the route, or -1 once there is no route left;
+ * next_bulk returns the number of routes it put in routes.
+ */
+#define ROUTE_TREE_CURSOR_DEPTH_V4 32
+#define ROUTE_TREE_CURSOR_DEPTH_V6 128
+
+typedef struct {
+    const RouteTreePool *pool;
+    const RouteTreeHeadNode *head_node_v4;
+    // generation of the head the path was walked in
+    uint64_t generation;
+    // of the node on top of the path, in CPU order
+    uint32_t prefix;
+    uint32_t depth;
+    uint32_t state;
+    // last route returned, in CPU order
+    bool has_last;
+    uint8_t last_depth_len;
+    uint32_t last_prefix;
+    uint32_t path[ROUTE_TREE_CURSOR_DEPTH_V4];
+    // bit offset after each node of path
+    uint8_t end[ROUTE_TREE_CURSOR_DEPTH_V4];
+} RouteTreeCursorV4;
+
+typedef struct {
+    const RouteTreePool *pool;
+    const RouteTreeHeadNode *head_node_v6;
+    uint64_t generation;
+    RouteTreeIPV6 prefix;
+    uint32_t depth;
+    uint32_t state;
+    bool has_last;
+    uint8_t last_depth_len;
+    RouteTreeIPV6 last_prefix;
+    uint32_t path[ROUTE_TREE_CURSOR_DEPTH_V6];
+    uint8_t end[ROUTE_TREE_CURSOR_DEPTH_V6];
+} RouteTreeCursorV6;
 
-int compressed_route_tree_iterate_v4(RouteTreeHeadNode *head_node_v4, bool print_tree, bool reset);
-int compressed_route_tree_iterate_v6(RouteTreeHeadNode *head_node_v6, bool print_tree, bool reset);
+void compressed_route_tree_cursor_init_v4(RouteTreeCursorV4 *cursor, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4);
+void compressed_route_tree_cursor_init_v6(RouteTreeCursorV6 *cursor, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6);
+int compressed_route_tree_cursor_seek_v4(RouteTreeCursorV4 *cursor, uint32_t be_ipv4, uint8_t depth_len);
+int compressed_route_tree_cursor_seek_v6(RouteTreeCursorV6 *cursor, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len);
+int compressed_route_tree_cursor_next_v4(RouteTreeCursorV4 *cursor, uint32_t *be_ipv4, uint8_t *depth_len, uint32_t *next_hop);
+int compressed_route_tree_cursor_next_v6(RouteTreeCursorV6 *cursor, uint8_t *be_ipv6_u8ptr, uint8_t *depth_len, uint32_t *next_hop);
+size_t compressed_route_tree_cursor_next_bulk_v4(RouteTreeCursorV4 *cursor, RouteTreeRouteV4 *routes, size_t n_routes);
+size_t compressed_route_tree_cursor_next_bulk_v6(RouteTreeCursorV6 *cursor, RouteTreeRouteV6 *routes, size_t n_routes);
 
 
 #endif
\ No newline at end of file
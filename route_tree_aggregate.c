@@ -0,0 +1,706 @@
+#include "route_tree_internal.h"
+#include <arpa/inet.h>
+
+/*
+ * Aggregated copy of a head: a second tree in the same pool holding fewer
+ * routes with the same next hop for every address, walked by the lookups in
+ * place of the head's tree. The head keeps every route added.
+ *
+ * The routes are aggregated with ORTC (Draves et al., INFOCOM 1999) per
+ * block of the address space of split_len bits. Routes shorter than
+ * split_len are copied as they are; below, each block holding routes gets
+ * the fewest routes giving its addresses their next hop, on top of the one
+ * of the routes covering the block. An update only computes its block again,
+ * or with a route shorter than split_len the blocks it covers.
+ *
+ * ORTC works on the binary trie of the block, where every position either
+ * has two children or is a leaf taking the next hop of its longest route.
+ * Bottom up, a position gets the set of next hops it could be given with
+ * the fewest routes below: the common ones of its children if any, else all
+ * of them. Top down, a position whose set lacks the next hop given above
+ * gets a route to one of the set. A path compressed edge stands for
+ * positions with one leaf on the side, their sets are worked out without
+ * walking them one by one. Addresses of no route make a set of their own,
+ * never merged, so no route has to give them "no next hop" back; sets are
+ * capped at AGG_SET_MAX next hops, which may cost some routes but no answer.
+ */
+
+#define AGG_SET_MAX 8
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct {
+    // left aligned, bits past the length 0
+    RouteTreeU128 prefix;
+    int32_t next_hop;
+    uint8_t depth_len;
+    // already in the aggregated tree
+    bool present;
+} AggEntry;
+
+// next hops ascending, -1 alone for addresses of no route
+typedef struct {
+    uint8_t n;
+    int32_t next_hop[AGG_SET_MAX];
+} AggSet;
+
+typedef struct route_tree_aggregate_s {
+    // first, the lookups take the copy for its head
+    RouteTreeHeadNode head_node;
+
+    uint8_t max_len;
+    uint8_t split_len;
+    bool failed;
+
+    // routes of the block being computed, and the ones it drops
+    AggEntry *entries;
+    AggEntry *stale;
+    size_t max_entries;
+    size_t n_entries;
+    size_t n_stale;
+    // sets of the nodes of the block in depth-first order, 2 per route
+    AggSet *sets;
+    size_t n_sets;
+    size_t next_set;
+} RouteTreeAggregate;
+
+// tree node of either family, key left aligned like the prefixes
+typedef struct {
+    RouteTreeU128 key;
+    uint32_t next[2];
+    uint8_t key_bit_len;
+    int32_t next_hop;
+} AggNode;
+
+
+static inline RouteTreeU128 agg_cut(RouteTreeU128 prefix, uint8_t depth_len)
+{
+    return depth_len ? prefix & (~(RouteTreeU128)0 << (128 - depth_len)) : 0;
+}
+
+static inline uint32_t agg_bit(RouteTreeU128 prefix, uint8_t bit)
+{
+    return (uint32_t)(prefix >> (127 - bit)) & 0x1;
+}
+
+static void agg_node(const RouteTreeAggregate *agg, const RouteTreePool *pool, uint32_t index, AggNode *node)
+{
+    if (128 == agg->max_len) {
+        const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(pool, index);
+        node->key = ipv6_to_u128(&node_v6->key);
+        node->next[0] = node_v6->next_bit_0;
+        node->next[1] = node_v6->next_bit_1;
+        node->key_bit_len = NODE_KEY_BIT_LEN(node_v6);
+        node->next_hop = NODE_NEXT_HOP(node_v6);
+    }
+    else {
+        const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(pool, index);
+        node->key = (RouteTreeU128)node_v4->key << 96;
+        node->next[0] = node_v4->next_bit_0;
+        node->next[1] = node_v4->next_bit_1;
+        node->key_bit_len = NODE_KEY_BIT_LEN(node_v4);
+        node->next_hop = NODE_NEXT_HOP(node_v4);
+    }
+}
+
+static inline uint32_t agg_first(const RouteTreeHeadNode *head_node, RouteTreeU128 prefix)
+{
+    return agg_bit(prefix, 0) ? head_node->first_bit_1 : head_node->first_bit_0;
+}
+
+// add prefix/depth_len to the aggregated tree, or delete it with next_hop -1
+static void agg_write(RouteTreeAggregate *agg, RouteTreePool *pool, RouteTreeU128 prefix, uint8_t depth_len, int32_t next_hop)
+{
+    int ret;
+
+    if (128 == agg->max_len) {
+        uint8_t be_ipv6[16];
+        uint8_t i;
+        for (i = 0; i < 16; ++i) {
+            be_ipv6[i] = (uint8_t)(prefix >> (120 - 8 * i));
+        }
+        ret = next_hop >= 0 ? compressed_route_tree_add_v6(pool, &agg->head_node, be_ipv6, depth_len, next_hop)
+                            : compressed_route_tree_del_v6(pool, &agg->head_node, be_ipv6, depth_len);
+    }
+    else {
+        const uint32_t be_ipv4 = htonl((uint32_t)(prefix >> 96));
+        ret = next_hop >= 0 ? compressed_route_tree_add_v4(pool, &agg->head_node, be_ipv4, depth_len, next_hop)
+                            : compressed_route_tree_del_v4(pool, &agg->head_node, be_ipv4, depth_len);
+    }
+    if (ret) {
+        agg->failed = true;
+    }
+}
+
+static inline void agg_set_one(AggSet *set, int32_t next_hop)
+{
+    set->n = 1;
+    set->next_hop[0] = next_hop;
+}
+
+static bool agg_set_has(const AggSet *set, int32_t next_hop)
+{
+    uint8_t i;
+
+    for (i = 0; i < set->n; ++i) {
+        if (set->next_hop[i] == next_hop) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// set of a position whose children have sets a and b; set may be a or b
+static void agg_combine(AggSet *set, const AggSet *a, const AggSet *b)
+{
+    AggSet out;
+    uint8_t i = 0;
+    uint8_t j = 0;
+
+    out.n = 0;
+    while (i < a->n && j < b->n) {
+        if (a->next_hop[i] == b->next_hop[j]) {
+            out.next_hop[out.n++] = a->next_hop[i];
+            i++;
+            j++;
+        }
+        else if (a->next_hop[i] < b->next_hop[j]) {
+            i++;
+        }
+        else {
+            j++;
+        }
+    }
+
+    if (0 == out.n) {
+        if (a->next_hop[0] < 0 || b->next_hop[0] < 0) {
+            agg_set_one(&out, -1);
+        }
+        else {
+            i = 0;
+            j = 0;
+            while ((i < a->n || j < b->n) && out.n < AGG_SET_MAX) {
+                if (j == b->n || (i < a->n && a->next_hop[i] < b->next_hop[j])) {
+                    out.next_hop[out.n++] = a->next_hop[i++];
+                }
+                else {
+                    out.next_hop[out.n++] = b->next_hop[j++];
+                }
+            }
+        }
+    }
+    *set = out;
+}
+
+// set of a position on an edge, with a leaf of next_hop on the side
+static inline void agg_combine_leaf(AggSet *set, int32_t next_hop)
+{
+    AggSet leaf;
+
+    agg_set_one(&leaf, next_hop);
+    agg_combine(set, set, &leaf);
+}
+
+static void agg_node_set(RouteTreeAggregate *agg, const RouteTreePool *pool, const AggNode *node,
+                        uint8_t end, int32_t next_hop, AggSet *set);
+
+/*
+ * Set of the position at from_len on the edge to the node, which starts at
+ * bit_offset; next_hop is the one of the routes above, given to the leaves
+ * on the side. Past a second such leaf the set does not change any more.
+ */
+static void agg_edge_set(RouteTreeAggregate *agg, const RouteTreePool *pool, const AggNode *node,
+                        uint8_t bit_offset, uint8_t from_len, int32_t next_hop, AggSet *set)
+{
+    const uint8_t end = bit_offset + node->key_bit_len;
+
+    agg_node_set(agg, pool, node, end, node->next_hop >= 0 ? node->next_hop : next_hop, set);
+    if (from_len < end) {
+        agg_combine_leaf(set, next_hop);
+    }
+    if (from_len + 1 < end) {
+        agg_combine_leaf(set, next_hop);
+    }
+}
+
+/*
+ * Set of the position of a node ending at end, next_hop its own or the one
+ * above; kept for agg_emit_edge, which walks the nodes in the same order.
+ */
+static void agg_node_set(RouteTreeAggregate *agg, const RouteTreePool *pool, const AggNode *node,
+                        uint8_t end, int32_t next_hop, AggSet *set)
+{
+    AggSet sides[2];
+    uint8_t i;
+
+    if (agg->n_sets == 2 * agg->max_entries) {
+        agg->failed = true;
+        agg_set_one(set, next_hop);
+        return;
+    }
+    const size_t k = agg->n_sets++;
+
+    if (end == agg->max_len) {
+        agg_set_one(set, next_hop);
+        agg->sets[k] = *set;
+        return;
+    }
+
+    for (i = 0; i < 2; ++i) {
+        if (node->next[i]) {
+            AggNode child;
+            agg_node(agg, pool, node->next[i], &child);
+            agg_edge_set(agg, pool, &child, end, end + 1, next_hop, &sides[i]);
+        }
+        else {
+            agg_set_one(&sides[i], next_hop);
+        }
+    }
+    agg_combine(set, &sides[0], &sides[1]);
+    agg->sets[k] = *set;
+}
+
+static void agg_out(RouteTreeAggregate *agg, RouteTreeU128 prefix, uint8_t depth_len, int32_t next_hop)
+{
+    if (next_hop < 0) {
+        // addresses of no route are never under a route of the block
+        return;
+    }
+    if (agg->n_entries == agg->max_entries) {
+        agg->failed = true;
+        return;
+    }
+
+    AggEntry *entry = &agg->entries[agg->n_entries++];
+    entry->prefix = prefix;
+    entry->depth_len = depth_len;
+    entry->next_hop = next_hop;
+    entry->present = false;
+}
+
+static void agg_emit_edge(RouteTreeAggregate *agg, const RouteTreePool *pool, uint32_t index,
+                        RouteTreeU128 prefix, uint8_t bit_offset, uint8_t from_len, int32_t next_hop, int32_t given);
+
+/*
+ * Routes for the subtree of a node ending at end: given is the next hop the
+ * aggregated routes above give, next_hop the one the routes of the tree do.
+ */
+static void agg_emit_node(RouteTreeAggregate *agg, const RouteTreePool *pool, const AggNode *node,
+                        RouteTreeU128 prefix, uint8_t end, int32_t next_hop, const AggSet *set, int32_t given)
+{
+    uint32_t i;
+
+    if (!agg_set_has(set, given)) {
+        given = set->next_hop[set->n - 1];
+        agg_out(agg, prefix, end, given);
+    }
+    if (end == agg->max_len) {
+        return;
+    }
+
+    for (i = 0; i < 2 && !agg->failed; ++i) {
+        agg_emit_edge(agg, pool, node->next[i], prefix | ((RouteTreeU128)i << (127 - end)), end, end + 1, next_hop, given);
+    }
+}
+
+/*
+ * Routes for the edge to the node at index, starting at bit_offset, from
+ * the position prefix/from_len on; no node is a leaf at that position.
+ */
+static void agg_emit_edge(RouteTreeAggregate *agg, const RouteTreePool *pool, uint32_t index,
+                        RouteTreeU128 prefix, uint8_t bit_offset, uint8_t from_len, int32_t next_hop, int32_t given)
+{
+    AggNode node;
+    AggSet set;
+    AggSet set_last;
+    AggSet set_top;
+    uint8_t depth_len;
+
+    if (0 == index) {
+        if (given != next_hop) {
+            agg_out(agg, prefix, from_len, next_hop);
+        }
+        return;
+    }
+
+    agg_node(agg, pool, index, &node);
+    const uint8_t end = bit_offset + node.key_bit_len;
+    const int32_t node_next_hop = node.next_hop >= 0 ? node.next_hop : next_hop;
+    prefix = agg_cut(prefix, bit_offset) | (node.key >> bit_offset);
+
+    set = agg->sets[agg->next_set++];
+    set_last = set;
+    agg_combine_leaf(&set_last, next_hop);
+    set_top = set_last;
+    agg_combine_leaf(&set_top, next_hop);
+
+    for (depth_len = from_len; depth_len < end; ++depth_len) {
+        const AggSet *level = depth_len + 1 == end ? &set_last : &set_top;
+        if (!agg_set_has(level, given)) {
+            given = level->next_hop[level->n - 1];
+            agg_out(agg, agg_cut(prefix, depth_len), depth_len, given);
+        }
+        if (given != next_hop) {
+            const RouteTreeU128 side = agg_cut(prefix, depth_len + 1) ^ ((RouteTreeU128)1 << (127 - depth_len));
+            agg_out(agg, side, depth_len + 1, next_hop);
+        }
+    }
+
+    agg_emit_node(agg, pool, &node, prefix, end, node_next_hop, &set, given);
+}
+
+/*
+ * Walk head to the first node ending at split_len or below in block, if
+ * any; bit_offset gets where it starts and next_hop the one of the routes
+ * covering the block.
+ */
+static uint32_t agg_block_top(const RouteTreeAggregate *agg, const RouteTreePool *pool, const RouteTreeHeadNode *head_node,
+                            RouteTreeU128 block, uint8_t *bit_offset, int32_t *next_hop)
+{
+    uint32_t index = agg_first(head_node, block);
+
+    *bit_offset = 0;
+    *next_hop = head_node->default_next_hop;
+    while (index) {
+        AggNode node;
+        agg_node(agg, pool, index, &node);
+        const uint8_t end = *bit_offset + node.key_bit_len;
+        const uint8_t match_len = (end < agg->split_len ? end : agg->split_len) - *bit_offset;
+
+        if (((block << *bit_offset) ^ node.key) >> (128 - match_len)) {
+            return 0;
+        }
+        if (end >= agg->split_len) {
+            return index;
+        }
+        if (node.next_hop >= 0) {
+            *next_hop = node.next_hop;
+        }
+        *bit_offset = end;
+        index = node.next[agg_bit(block, end)];
+    }
+    return 0;
+}
+
+static int agg_entry_cmp(const void *a, const void *b)
+{
+    const AggEntry *x = a;
+    const AggEntry *y = b;
+
+    if (x->prefix != y->prefix) {
+        return x->prefix < y->prefix ? -1 : 1;
+    }
+    return (int)x->depth_len - (int)y->depth_len;
+}
+
+static AggEntry *agg_entry_find(RouteTreeAggregate *agg, RouteTreeU128 prefix, uint8_t depth_len)
+{
+    const AggEntry key = {.prefix = prefix, .depth_len = depth_len};
+    return bsearch(&key, agg->entries, agg->n_entries, sizeof(AggEntry), agg_entry_cmp);
+}
+
+// sort the routes of the aggregated subtree at index into kept and stale
+static void agg_check_present(RouteTreeAggregate *agg, const RouteTreePool *pool, uint32_t index,
+                            RouteTreeU128 prefix, uint8_t bit_offset)
+{
+    AggNode node;
+
+    agg_node(agg, pool, index, &node);
+    const uint8_t end = bit_offset + node.key_bit_len;
+    prefix |= node.key >> bit_offset;
+
+    if (node.next_hop >= 0) {
+        AggEntry *entry = agg_entry_find(agg, prefix, end);
+        if (entry) {
+            entry->present = entry->next_hop == node.next_hop;
+        }
+        else if (agg->n_stale < agg->max_entries) {
+            agg->stale[agg->n_stale].prefix = prefix;
+            agg->stale[agg->n_stale].depth_len = end;
+            agg->n_stale++;
+        }
+        else {
+            agg->failed = true;
+        }
+    }
+    if (node.next[0]) {
+        agg_check_present(agg, pool, node.next[0], prefix, end);
+    }
+    if (node.next[1]) {
+        agg_check_present(agg, pool, node.next[1], prefix, end);
+    }
+}
+
+// compute the routes of block again and bring the aggregated tree in line
+static void agg_block(RouteTreeAggregate *agg, RouteTreePool *pool, const RouteTreeHeadNode *head_node, RouteTreeU128 block)
+{
+    uint8_t bit_offset;
+    int32_t next_hop;
+    size_t i;
+
+    agg->n_entries = 0;
+    agg->n_stale = 0;
+    agg->n_sets = 0;
+    agg->next_set = 0;
+    const uint32_t top = agg_block_top(agg, pool, head_node, block, &bit_offset, &next_hop);
+    if (top) {
+        AggNode node;
+        AggSet set;
+        agg_node(agg, pool, top, &node);
+        agg_node_set(agg, pool, &node, bit_offset + node.key_bit_len, node.next_hop >= 0 ? node.next_hop : next_hop, &set);
+        if (!agg->failed) {
+            agg_emit_edge(agg, pool, top, block, bit_offset, agg->split_len, next_hop, next_hop);
+        }
+    }
+    if (agg->failed) {
+        return;
+    }
+    qsort(agg->entries, agg->n_entries, sizeof(AggEntry), agg_entry_cmp);
+
+    const uint32_t aggregated_top = agg_block_top(agg, pool, &agg->head_node, block, &bit_offset, &next_hop);
+    if (aggregated_top) {
+        agg_check_present(agg, pool, aggregated_top, agg_cut(block, bit_offset), bit_offset);
+    }
+
+    // new routes first, so the ones they replace are never missed
+    for (i = 0; i < agg->n_entries && !agg->failed; ++i) {
+        if (!agg->entries[i].present) {
+            agg_write(agg, pool, agg->entries[i].prefix, agg->entries[i].depth_len, agg->entries[i].next_hop);
+        }
+    }
+    for (i = 0; i < agg->n_stale && !agg->failed; ++i) {
+        agg_write(agg, pool, agg->stale[i].prefix, agg->stale[i].depth_len, -1);
+    }
+}
+
+/*
+ * Blocks of the subtree at index, below a route of depth_len shorter than
+ * split_len. With build, the routes shorter than split_len are copied,
+ * else the blocks under a longer one keep their cover and are skipped.
+ */
+static void agg_visit(RouteTreeAggregate *agg, RouteTreePool *pool, const RouteTreeHeadNode *head_node, uint32_t index,
+                    RouteTreeU128 prefix, uint8_t bit_offset, uint8_t depth_len, bool build)
+{
+    AggNode node;
+
+    agg_node(agg, pool, index, &node);
+    const uint8_t end = bit_offset + node.key_bit_len;
+    prefix |= node.key >> bit_offset;
+
+    if (end >= agg->split_len) {
+        agg_block(agg, pool, head_node, agg_cut(prefix, agg->split_len));
+        return;
+    }
+    if (node.next_hop >= 0 && end > depth_len) {
+        if (!build) {
+            return;
+        }
+        agg_write(agg, pool, prefix, end, node.next_hop);
+    }
+    if (node.next[0] && !agg->failed) {
+        agg_visit(agg, pool, head_node, node.next[0], prefix, end, depth_len, build);
+    }
+    if (node.next[1] && !agg->failed) {
+        agg_visit(agg, pool, head_node, node.next[1], prefix, end, depth_len, build);
+    }
+}
+
+// blocks under prefix/depth_len, shorter than split_len
+static void agg_blocks_below(RouteTreeAggregate *agg, RouteTreePool *pool, const RouteTreeHeadNode *head_node,
+                            RouteTreeU128 prefix, uint8_t depth_len, bool build)
+{
+    uint32_t index = agg_first(head_node, prefix);
+    uint8_t bit_offset = 0;
+
+    if (0 == depth_len) {
+        if (head_node->first_bit_0) {
+            agg_visit(agg, pool, head_node, head_node->first_bit_0, 0, 0, 0, build);
+        }
+        if (head_node->first_bit_1 && !agg->failed) {
+            agg_visit(agg, pool, head_node, head_node->first_bit_1, 0, 0, 0, build);
+        }
+        return;
+    }
+
+    while (index) {
+        AggNode node;
+        agg_node(agg, pool, index, &node);
+        const uint8_t end = bit_offset + node.key_bit_len;
+        const uint8_t match_len = (end < depth_len ? end : depth_len) - bit_offset;
+
+        if (((prefix << bit_offset) ^ node.key) >> (128 - match_len)) {
+            return;
+        }
+        if (end > depth_len) {
+            agg_visit(agg, pool, head_node, index, agg_cut(prefix, bit_offset), bit_offset, depth_len, build);
+            return;
+        }
+        if (end == depth_len) {
+            if (node.next[0]) {
+                agg_visit(agg, pool, head_node, node.next[0], prefix, end, depth_len, build);
+            }
+            if (node.next[1] && !agg->failed) {
+                agg_visit(agg, pool, head_node, node.next[1], prefix, end, depth_len, build);
+            }
+            return;
+        }
+        bit_offset = end;
+        index = node.next[agg_bit(prefix, end)];
+    }
+}
+
+// next hop of the route prefix/depth_len of head, -1 if none
+static int32_t agg_route_next_hop(const RouteTreeAggregate *agg, const RouteTreePool *pool, const RouteTreeHeadNode *head_node,
+                                RouteTreeU128 prefix, uint8_t depth_len)
+{
+    uint32_t index = agg_first(head_node, prefix);
+    uint8_t bit_offset = 0;
+
+    while (index) {
+        AggNode node;
+        agg_node(agg, pool, index, &node);
+        const uint8_t end = bit_offset + node.key_bit_len;
+
+        if (end > depth_len || ((prefix << bit_offset) ^ node.key) >> (128 - node.key_bit_len)) {
+            return -1;
+        }
+        if (end == depth_len) {
+            return node.next_hop;
+        }
+        bit_offset = end;
+        index = node.next[agg_bit(prefix, end)];
+    }
+    return -1;
+}
+
+static void agg_release(RouteTreeAggregate *agg, RouteTreePool *pool, RouteTreeHeadNode *head_node)
+{
+    RCU_STORE(head_node->aggregate, NULL);
+    // freed nodes wait for the readers in the pool
+    if (128 == agg->max_len) {
+        compressed_route_tree_iterate_v6(pool, &agg->head_node, false, true);
+    }
+    else {
+        compressed_route_tree_iterate_v4(pool, &agg->head_node, false, true);
+    }
+}
+
+static void agg_update(RouteTreeAggregate *agg, RouteTreePool *pool, RouteTreeHeadNode *head_node,
+                    RouteTreeU128 prefix, uint8_t depth_len)
+{
+    if (agg->failed) {
+        return;
+    }
+
+    if (depth_len >= agg->split_len) {
+        agg_block(agg, pool, head_node, agg_cut(prefix, agg->split_len));
+    }
+    else {
+        // copied as it is, then the blocks it covers
+        if (0 == depth_len) {
+            RCU_STORE(agg->head_node.default_next_hop, head_node->default_next_hop);
+            route_tree_bump_generation(&agg->head_node);
+        }
+        else {
+            const int32_t next_hop = agg_route_next_hop(agg, pool, head_node, prefix, depth_len);
+            if (next_hop >= 0 || agg_route_next_hop(agg, pool, &agg->head_node, prefix, depth_len) >= 0) {
+                agg_write(agg, pool, prefix, depth_len, next_hop);
+            }
+        }
+        if (!agg->failed) {
+            agg_blocks_below(agg, pool, head_node, prefix, depth_len, false);
+        }
+    }
+
+    if (agg->failed) {
+        agg_release(agg, pool, head_node);
+    }
+}
+
+static int agg_build(RouteTreePool *pool, RouteTreeHeadNode *head_node, void * const aggregate_ptr,
+                    const size_t max_entries, const uint8_t split_len, const uint8_t max_len)
+{
+    if (head_node->aggregate || 0 == max_entries || 0 == split_len || split_len > max_len) {
+        return -1;
+    }
+
+    RouteTreeAggregate *agg = aggregate_ptr;
+    memset(agg, 0, sizeof(*agg));
+    compressed_route_tree_reset_head(&agg->head_node);
+    agg->head_node.default_next_hop = head_node->default_next_hop;
+    agg->max_len = max_len;
+    agg->split_len = split_len;
+    agg->entries = (AggEntry *)((uintptr_t)aggregate_ptr + ALIGN_UP(sizeof(RouteTreeAggregate), 64));
+    agg->stale = agg->entries + max_entries;
+    agg->max_entries = max_entries;
+    agg->sets = (AggSet *)(agg->stale + max_entries);
+
+    agg_blocks_below(agg, pool, head_node, 0, 0, true);
+    if (agg->failed) {
+        agg_release(agg, pool, head_node);
+        return -1;
+    }
+
+    RCU_STORE(head_node->aggregate, (void *)agg);
+
+    return 0;
+}
+
+
+// Internal hooks:
+
+
+void route_tree_aggregate_update_v4(void *aggregate, RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                    uint32_t ipv4, uint8_t depth_len)
+{
+    agg_update(aggregate, pool, head_node_v4, (RouteTreeU128)ipv4 << 96, depth_len);
+}
+
+void route_tree_aggregate_update_v6(void *aggregate, RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    const RouteTreeIPV6 *ipv6, uint8_t depth_len)
+{
+    agg_update(aggregate, pool, head_node_v6, ipv6_to_u128(ipv6), depth_len);
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_get_memory_footprint_aggregate(const size_t max_block_routes)
+{
+    return ALIGN_UP(sizeof(RouteTreeAggregate), 64) + (sizeof(AggEntry) + sizeof(AggSet)) * max_block_routes * 2;
+}
+
+int compressed_route_tree_build_v4_aggregate(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                        void * const aggregate_ptr, const size_t max_block_routes, const uint8_t split_len)
+{
+    return agg_build(pool, head_node_v4, aggregate_ptr, max_block_routes, split_len, 32);
+}
+
+int compressed_route_tree_build_v6_aggregate(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                        void * const aggregate_ptr, const size_t max_block_routes, const uint8_t split_len)
+{
+    return agg_build(pool, head_node_v6, aggregate_ptr, max_block_routes, split_len, 128);
+}
+
+void compressed_route_tree_release_v4_aggregate(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4)
+{
+    if (head_node_v4->aggregate) {
+        agg_release(head_node_v4->aggregate, pool, head_node_v4);
+    }
+}
+
+void compressed_route_tree_release_v6_aggregate(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6)
+{
+    if (head_node_v6->aggregate) {
+        agg_release(head_node_v6->aggregate, pool, head_node_v6);
+    }
+}
+
+void compressed_route_tree_aggregate_get_usage(const RouteTreeHeadNode *head_node, size_t *n_routes, size_t *n_nodes)
+{
+    const RouteTreeAggregate *agg = head_node->aggregate;
+
+    *n_routes = agg ? agg->head_node.total_routes + (agg->head_node.default_next_hop >= 0) : 0;
+    *n_nodes = agg ? agg->head_node.total_nodes : 0;
+}
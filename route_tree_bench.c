@@ -0,0 +1,1040 @@
+/*
+ * Benchmark suite: builds BGP-like v4 and v6 tables, or loads them from a
+ * file, and measures lookup rate and latency under random, sequential and
+ * cache-hostile traffic, update rate and memory. Results are printed as
+ * JSON on stdout.
+ *
+ * Build: make route_tree_bench
+ * Usage: ./route_tree_bench [-r n_routes] [-l n_lookups] [-b burst]
+ *                           [-u n_updates] [-f route_file]
+ *
+ * A route file has one "prefix/len [next_hop]" per line, v4 and v6 mixed,
+ * e.g. a dump of a BGP table; it replaces the generated routes.
+ */
+#include "route_tree.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_BURST 256
+#define N_LATENCY_SAMPLES 200000
+#define BATCH_OPS 1024
+#define N_HOT_DESTINATIONS 4096
+#define FLOW_CACHE_SETS 4096
+
+static uint64_t rand_state = 88172645463325252ULL;
+
+static inline uint64_t rand_u64(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static inline double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// BGP-like prefix length, most routes are /24, then /22../16.
+static uint8_t rand_depth_v4(void)
+{
+    const uint32_t r = rand_u64() % 100;
+    if (r < 55) {
+        return 24;
+    }
+    if (r < 85) {
+        return 16 + rand_u64() % 8;
+    }
+    if (r < 95) {
+        return 8 + rand_u64() % 8;
+    }
+    return 25 + rand_u64() % 8;
+}
+
+// most routes are /48, then /29../47 allocations, some /64.
+static uint8_t rand_depth_v6(void)
+{
+    const uint32_t r = rand_u64() % 100;
+    if (r < 45) {
+        return 48;
+    }
+    if (r < 85) {
+        return 29 + rand_u64() % 19;
+    }
+    if (r < 95) {
+        return 64;
+    }
+    return 16 + rand_u64() % 13;
+}
+
+// global unicast, 2000::/12
+static void rand_ipv6(uint8_t *ipv6)
+{
+    uint64_t r = rand_u64();
+    memcpy(ipv6, &r, 8);
+    r = rand_u64();
+    memcpy(ipv6 + 8, &r, 8);
+    ipv6[0] = 0x20;
+    ipv6[1] &= 0x0f;
+}
+
+/*
+ * JSON output, one key per line.
+ */
+static uint32_t json_depth;
+static bool json_need_comma;
+
+static void json_key(const char *name)
+{
+    if (json_depth) {
+        printf("%s\n%*s", json_need_comma ? "," : "", json_depth * 2, "");
+    }
+    if (name) {
+        printf("\"%s\": ", name);
+    }
+    json_need_comma = true;
+}
+
+static void json_open(const char *name)
+{
+    json_key(name);
+    printf("{");
+    json_depth++;
+    json_need_comma = false;
+}
+
+static void json_close(void)
+{
+    json_depth--;
+    printf("\n%*s}", json_depth * 2, "");
+    json_need_comma = true;
+    if (0 == json_depth) {
+        printf("\n");
+    }
+}
+
+static void json_uint(const char *name, uint64_t value)
+{
+    json_key(name);
+    printf("%llu", (unsigned long long)value);
+}
+
+static void json_double(const char *name, double value)
+{
+    json_key(name);
+    printf("%.3f", value);
+}
+
+static void json_string(const char *name, const char *value)
+{
+    json_key(name);
+    printf("\"%s\"", value);
+}
+
+// values[0, n), trailing zeros left out
+static void json_uint_array(const char *name, const uint64_t *values, size_t n)
+{
+    while (n && 0 == values[n - 1]) {
+        n--;
+    }
+
+    json_key(name);
+    printf("[");
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        printf("%s%llu", i ? ", " : "", (unsigned long long)values[i]);
+    }
+    printf("]");
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// cost of reading the clock, taken off every latency sample
+static uint64_t timer_overhead_ns(void)
+{
+    uint64_t min = UINT64_MAX;
+    uint32_t i;
+    for (i = 0; i < 10000; ++i) {
+        const uint64_t start = now_ns();
+        const uint64_t t = now_ns() - start;
+        if (t < min) {
+            min = t;
+        }
+    }
+    return min;
+}
+
+static void json_lookup_stats(const RouteTreeLookupStats *stats)
+{
+    json_open("lookup_stats");
+    json_uint("lookups", stats->lookups);
+    json_uint("hits", stats->hits);
+    json_uint("default_hits", stats->default_hits);
+    json_uint("misses", stats->misses);
+    json_uint_array("visited", stats->visited, ROUTE_TREE_STATS_MAX_VISITED);
+    json_close();
+}
+
+static void json_latency(uint64_t *sample_ns, size_t n, uint64_t overhead_ns)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        sample_ns[i] = sample_ns[i] > overhead_ns ? sample_ns[i] - overhead_ns : 0;
+    }
+    qsort(sample_ns, n, sizeof(*sample_ns), cmp_u64);
+
+    json_open("latency_ns");
+    json_uint("samples", n);
+    json_uint("p50", sample_ns[n / 2]);
+    json_uint("p90", sample_ns[n * 90 / 100]);
+    json_uint("p99", sample_ns[n * 99 / 100]);
+    json_uint("p999", sample_ns[n * 999 / 1000]);
+    json_uint("max", sample_ns[n - 1]);
+    json_close();
+}
+
+/*
+ * Route tables.
+ */
+typedef struct {
+    RouteTreeRouteV4 *v4;
+    size_t n_v4;
+    RouteTreeRouteV6 *v6;
+    size_t n_v6;
+} BenchRoutes;
+
+static int generate_routes(BenchRoutes *routes, size_t n_routes)
+{
+    routes->v4 = malloc(sizeof(*routes->v4) * n_routes);
+    routes->v6 = malloc(sizeof(*routes->v6) * n_routes);
+    if (!routes->v4 || !routes->v6) {
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < n_routes; ++i) {
+        routes->v4[i].be_ipv4 = (uint32_t)rand_u64();
+        routes->v4[i].depth_len = rand_depth_v4();
+        routes->v4[i].next_hop = i & ROUTE_TREE_MAX_NEXT_HOP;
+
+        rand_ipv6(routes->v6[i].be_ipv6);
+        routes->v6[i].depth_len = rand_depth_v6();
+        routes->v6[i].next_hop = i & ROUTE_TREE_MAX_NEXT_HOP;
+    }
+    routes->n_v4 = n_routes;
+    routes->n_v6 = n_routes;
+
+    return 0;
+}
+
+static int load_routes(BenchRoutes *routes, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (NULL == fp) {
+        return -1;
+    }
+
+    size_t max_v4 = 0;
+    size_t max_v6 = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char prefix[64];
+        unsigned int depth_len;
+        unsigned int next_hop;
+        const int n = sscanf(line, "%63[^/ \t]/%u %u", prefix, &depth_len, &next_hop);
+        if (n < 2) {
+            continue;
+        }
+
+        if (strchr(prefix, ':')) {
+            if (routes->n_v6 == max_v6) {
+                max_v6 = max_v6 ? 2 * max_v6 : 4096;
+                routes->v6 = realloc(routes->v6, sizeof(*routes->v6) * max_v6);
+                if (NULL == routes->v6) {
+                    goto err;
+                }
+            }
+            RouteTreeRouteV6 *route = &routes->v6[routes->n_v6];
+            if (depth_len > 128 || 1 != inet_pton(AF_INET6, prefix, route->be_ipv6)) {
+                continue;
+            }
+            route->depth_len = depth_len;
+            route->next_hop = (n > 2 ? next_hop : routes->n_v6) & ROUTE_TREE_MAX_NEXT_HOP;
+            routes->n_v6++;
+        }
+        else {
+            if (routes->n_v4 == max_v4) {
+                max_v4 = max_v4 ? 2 * max_v4 : 4096;
+                routes->v4 = realloc(routes->v4, sizeof(*routes->v4) * max_v4);
+                if (NULL == routes->v4) {
+                    goto err;
+                }
+            }
+            RouteTreeRouteV4 *route = &routes->v4[routes->n_v4];
+            if (depth_len > 32 || 1 != inet_pton(AF_INET, prefix, &route->be_ipv4)) {
+                continue;
+            }
+            route->depth_len = depth_len;
+            route->next_hop = (n > 2 ? next_hop : routes->n_v4) & ROUTE_TREE_MAX_NEXT_HOP;
+            routes->n_v4++;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+
+err:
+    fclose(fp);
+    return -1;
+}
+
+/*
+ * Traffic:
+ *   random         uniform addresses (v6 in 2000::/12), mostly shallow walks
+ *   sequential     consecutive addresses, the same few nodes again and again
+ *   cache_hostile  each address inside a random route of the table, so
+ *                  walks go to full depth all over the tree
+ *   hot            cache_hostile addresses, but 9 in 10 lookups go to one
+ *                  of N_HOT_DESTINATIONS of them
+ */
+enum BenchTraffic {
+    BENCH_RANDOM,
+    BENCH_SEQUENTIAL,
+    BENCH_CACHE_HOSTILE,
+    BENCH_HOT,
+    BENCH_TRAFFIC_MAX,
+};
+
+static const char *bench_traffic_name[BENCH_TRAFFIC_MAX] = {
+    "random",
+    "sequential",
+    "cache_hostile",
+    "hot",
+};
+
+static void generate_traffic_v4(enum BenchTraffic traffic, const BenchRoutes *routes,
+                            uint32_t *be_ipv4, size_t n)
+{
+    const uint32_t start = (uint32_t)rand_u64();
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (BENCH_SEQUENTIAL == traffic) {
+            be_ipv4[i] = htonl(start + i);
+        }
+        else if (BENCH_HOT == traffic && i >= N_HOT_DESTINATIONS && rand_u64() % 10) {
+            be_ipv4[i] = be_ipv4[rand_u64() % N_HOT_DESTINATIONS];
+        }
+        else if ((BENCH_CACHE_HOSTILE == traffic || BENCH_HOT == traffic) && routes->n_v4) {
+            const RouteTreeRouteV4 *route = &routes->v4[rand_u64() % routes->n_v4];
+            const uint32_t mask = route->depth_len ? ~0U << (32 - route->depth_len) : 0;
+            be_ipv4[i] = htonl((ntohl(route->be_ipv4) & mask) | ((uint32_t)rand_u64() & ~mask));
+        }
+        else {
+            be_ipv4[i] = (uint32_t)rand_u64();
+        }
+    }
+}
+
+static void generate_traffic_v6(enum BenchTraffic traffic, const BenchRoutes *routes,
+                            uint8_t *be_ipv6, size_t n)
+{
+    uint8_t start[16];
+    rand_ipv6(start);
+
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        uint8_t *ipv6 = &be_ipv6[i * 16];
+        if (BENCH_SEQUENTIAL == traffic) {
+            // low 64 bits count up from start
+            uint64_t low;
+            memcpy(ipv6, start, 8);
+            memcpy(&low, &start[8], 8);
+            low = htobe64(be64toh(low) + i);
+            memcpy(&ipv6[8], &low, 8);
+        }
+        else if (BENCH_HOT == traffic && i >= N_HOT_DESTINATIONS && rand_u64() % 10) {
+            memcpy(ipv6, &be_ipv6[(rand_u64() % N_HOT_DESTINATIONS) * 16], 16);
+        }
+        else if ((BENCH_CACHE_HOSTILE == traffic || BENCH_HOT == traffic) && routes->n_v6) {
+            const RouteTreeRouteV6 *route = &routes->v6[rand_u64() % routes->n_v6];
+            uint8_t host[16];
+            rand_ipv6(host);
+            uint32_t byte;
+            for (byte = 0; byte < 16; ++byte) {
+                const uint32_t bits = route->depth_len > byte * 8 ? route->depth_len - byte * 8 : 0;
+                const uint8_t mask = bits >= 8 ? 0xff : (uint8_t)(0xff00 >> bits);
+                ipv6[byte] = (route->be_ipv6[byte] & mask) | (host[byte] & ~mask);
+            }
+        }
+        else {
+            rand_ipv6(ipv6);
+        }
+    }
+}
+
+/*
+ * Lookup rate of the single, bulk, flow cached, (v4) DIR-24-8 and Poptrie paths over
+ * n addresses, then latency of single lookups over a sample of them.
+ */
+static void bench_lookup_v4(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                        const uint32_t *be_ipv4, size_t n, size_t burst, RouteTreeFlowCache *cache,
+                        uint32_t *next_hop, uint64_t *sample_ns, uint64_t overhead_ns)
+{
+    uint64_t hit_mask[MAX_BURST / 64];
+    size_t hits = 0;
+    size_t i;
+    double start;
+
+    start = now_sec();
+    for (i = 0; i < n; ++i) {
+        hits += 0 == compressed_route_tree_lookup_v4(pool, head_node_v4, be_ipv4[i], &next_hop[i]);
+    }
+    json_double("single_mpps", n / (now_sec() - start) / 1e6);
+    json_double("hit_ratio", n ? (double)hits / n : 0);
+
+    hits = 0;
+    start = now_sec();
+    for (i = 0; i + burst <= n; i += burst) {
+        hits += compressed_route_tree_lookup_bulk_v4(pool, head_node_v4, &be_ipv4[i], burst, &next_hop[i], hit_mask);
+    }
+    json_double("bulk_mpps", i / (now_sec() - start) / 1e6);
+
+    compressed_route_tree_flow_cache_flush(cache);
+    start = now_sec();
+    for (i = 0; i < n; ++i) {
+        compressed_route_tree_lookup_v4_cached(pool, head_node_v4, cache, be_ipv4[i], &next_hop[i]);
+    }
+    json_double("cached_mpps", n / (now_sec() - start) / 1e6);
+    json_double("cache_hit_ratio", n ? (double)cache->hits / n : 0);
+
+    if (head_node_v4->fast_v4) {
+        start = now_sec();
+        for (i = 0; i < n; ++i) {
+            compressed_route_tree_lookup_v4_fast(head_node_v4, be_ipv4[i], &next_hop[i]);
+        }
+        json_double("fast_mpps", n / (now_sec() - start) / 1e6);
+    }
+
+    if (head_node_v4->poptrie) {
+        start = now_sec();
+        for (i = 0; i < n; ++i) {
+            compressed_route_tree_lookup_v4_poptrie(pool, head_node_v4, be_ipv4[i], &next_hop[i]);
+        }
+        json_double("poptrie_mpps", n / (now_sec() - start) / 1e6);
+    }
+
+    const size_t n_samples = n < N_LATENCY_SAMPLES ? n : N_LATENCY_SAMPLES;
+    for (i = 0; i < n_samples; ++i) {
+        const uint64_t t = now_ns();
+        compressed_route_tree_lookup_v4(pool, head_node_v4, be_ipv4[i], &next_hop[i]);
+        sample_ns[i] = now_ns() - t;
+    }
+    json_latency(sample_ns, n_samples, overhead_ns);
+}
+
+static void bench_lookup_v6(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                        const uint8_t * const *be_ipv6, size_t n, size_t burst, RouteTreeFlowCache *cache,
+                        uint32_t *next_hop, uint64_t *sample_ns, uint64_t overhead_ns)
+{
+    uint64_t hit_mask[MAX_BURST / 64];
+    size_t hits = 0;
+    size_t i;
+    double start;
+
+    start = now_sec();
+    for (i = 0; i < n; ++i) {
+        hits += 0 == compressed_route_tree_lookup_v6(pool, head_node_v6, be_ipv6[i], &next_hop[i]);
+    }
+    json_double("single_mpps", n / (now_sec() - start) / 1e6);
+    json_double("hit_ratio", n ? (double)hits / n : 0);
+
+    hits = 0;
+    start = now_sec();
+    for (i = 0; i + burst <= n; i += burst) {
+        hits += compressed_route_tree_lookup_bulk_v6(pool, head_node_v6, &be_ipv6[i], burst, &next_hop[i], hit_mask);
+    }
+    json_double("bulk_mpps", i / (now_sec() - start) / 1e6);
+
+    compressed_route_tree_flow_cache_flush(cache);
+    start = now_sec();
+    for (i = 0; i < n; ++i) {
+        compressed_route_tree_lookup_v6_cached(pool, head_node_v6, cache, be_ipv6[i], &next_hop[i]);
+    }
+    json_double("cached_mpps", n / (now_sec() - start) / 1e6);
+    json_double("cache_hit_ratio", n ? (double)cache->hits / n : 0);
+
+    if (head_node_v6->poptrie) {
+        start = now_sec();
+        for (i = 0; i < n; ++i) {
+            compressed_route_tree_lookup_v6_poptrie(pool, head_node_v6, be_ipv6[i], &next_hop[i]);
+        }
+        json_double("poptrie_mpps", n / (now_sec() - start) / 1e6);
+    }
+
+    const size_t n_samples = n < N_LATENCY_SAMPLES ? n : N_LATENCY_SAMPLES;
+    for (i = 0; i < n_samples; ++i) {
+        const uint64_t t = now_ns();
+        compressed_route_tree_lookup_v6(pool, head_node_v6, be_ipv6[i], &next_hop[i]);
+        sample_ns[i] = now_ns() - t;
+    }
+    json_latency(sample_ns, n_samples, overhead_ns);
+}
+
+/*
+ * Poptrie copy of the table, built again with twice the room while its
+ * nodes or leaves run out: how many it takes per route depends on the
+ * table. Returns its memory, NULL if it never fit.
+ */
+static void *bench_build_poptrie(const RouteTreePool *pool, RouteTreeHeadNode *head_node, bool v6,
+                            size_t n_nodes, size_t n_leaves)
+{
+    while (n_nodes <= UINT32_MAX && n_leaves <= UINT32_MAX) {
+        void *poptrie = malloc(compressed_route_tree_get_memory_footprint_poptrie(n_nodes, n_leaves));
+        if (NULL == poptrie) {
+            return NULL;
+        }
+        if (0 == (v6 ? compressed_route_tree_build_v6_poptrie(pool, head_node, poptrie, n_nodes, n_leaves)
+                    : compressed_route_tree_build_v4_poptrie(pool, head_node, poptrie, n_nodes, n_leaves))) {
+            return poptrie;
+        }
+        free(poptrie);
+        n_nodes *= 2;
+        n_leaves *= 2;
+    }
+    return NULL;
+}
+
+/*
+ * Update rate: del then add back n_updates routes of the table one by one,
+ * then the same churn as batches of BATCH_OPS ops.
+ */
+static void bench_update_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                        const BenchRoutes *routes, size_t n_updates, RouteTreeBatch *batch)
+{
+    size_t i;
+    double start;
+
+    if (0 == routes->n_v4) {
+        return;
+    }
+
+    start = now_sec();
+    for (i = 0; i < n_updates; ++i) {
+        const RouteTreeRouteV4 *route = &routes->v4[i % routes->n_v4];
+        compressed_route_tree_del_v4(pool, head_node_v4, route->be_ipv4, route->depth_len);
+    }
+    json_double("del_per_sec", n_updates / (now_sec() - start));
+
+    start = now_sec();
+    for (i = 0; i < n_updates; ++i) {
+        const RouteTreeRouteV4 *route = &routes->v4[i % routes->n_v4];
+        compressed_route_tree_add_v4(pool, head_node_v4, route->be_ipv4, route->depth_len, route->next_hop);
+    }
+    json_double("add_per_sec", n_updates / (now_sec() - start));
+
+    size_t n_ops = 0;
+    start = now_sec();
+    for (i = 0; i < n_updates; ++i) {
+        const RouteTreeRouteV4 *route = &routes->v4[i % routes->n_v4];
+        compressed_route_tree_batch_del_v4(batch, route->be_ipv4, route->depth_len);
+        compressed_route_tree_batch_add_v4(batch, route->be_ipv4, route->depth_len, (route->next_hop + 1) & ROUTE_TREE_MAX_NEXT_HOP);
+        n_ops += 2;
+        if (batch->n_ops + 2 > batch->max_ops) {
+            compressed_route_tree_batch_commit_v4(pool, head_node_v4, batch);
+        }
+    }
+    compressed_route_tree_batch_commit_v4(pool, head_node_v4, batch);
+    json_double("batch_ops_per_sec", n_ops / (now_sec() - start));
+}
+
+static void bench_update_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                        const BenchRoutes *routes, size_t n_updates, RouteTreeBatch *batch)
+{
+    size_t i;
+    double start;
+
+    if (0 == routes->n_v6) {
+        return;
+    }
+
+    start = now_sec();
+    for (i = 0; i < n_updates; ++i) {
+        const RouteTreeRouteV6 *route = &routes->v6[i % routes->n_v6];
+        compressed_route_tree_del_v6(pool, head_node_v6, route->be_ipv6, route->depth_len);
+    }
+    json_double("del_per_sec", n_updates / (now_sec() - start));
+
+    start = now_sec();
+    for (i = 0; i < n_updates; ++i) {
+        const RouteTreeRouteV6 *route = &routes->v6[i % routes->n_v6];
+        compressed_route_tree_add_v6(pool, head_node_v6, route->be_ipv6, route->depth_len, route->next_hop);
+    }
+    json_double("add_per_sec", n_updates / (now_sec() - start));
+
+    size_t n_ops = 0;
+    start = now_sec();
+    for (i = 0; i < n_updates; ++i) {
+        const RouteTreeRouteV6 *route = &routes->v6[i % routes->n_v6];
+        compressed_route_tree_batch_del_v6(batch, route->be_ipv6, route->depth_len);
+        compressed_route_tree_batch_add_v6(batch, route->be_ipv6, route->depth_len, (route->next_hop + 1) & ROUTE_TREE_MAX_NEXT_HOP);
+        n_ops += 2;
+        if (batch->n_ops + 2 > batch->max_ops) {
+            compressed_route_tree_batch_commit_v6(pool, head_node_v6, batch);
+        }
+    }
+    compressed_route_tree_batch_commit_v6(pool, head_node_v6, batch);
+    json_double("batch_ops_per_sec", n_ops / (now_sec() - start));
+}
+
+int main(int argc, char **argv)
+{
+    size_t n_routes = 500000;
+    size_t n_lookups = 4000000;
+    size_t burst = 64;
+    size_t n_updates = 100000;
+    const char *route_file = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:l:b:u:f:")) != -1) {
+        switch (opt) {
+        case 'r':
+            n_routes = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            n_lookups = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            burst = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            n_updates = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            route_file = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r n_routes] [-l n_lookups] [-b burst] [-u n_updates] [-f route_file]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (burst == 0 || burst > MAX_BURST) {
+        burst = MAX_BURST;
+    }
+    if (0 == n_lookups) {
+        n_lookups = 1;
+    }
+
+    BenchRoutes routes = {0};
+    if (route_file ? load_routes(&routes, route_file) : generate_routes(&routes, n_routes)) {
+        fprintf(stderr, "cannot get routes\n");
+        return 1;
+    }
+
+    // room for the table twice, batch commits copy the paths they change
+    const size_t v4_max_routes = 2 * routes.n_v4 + 1;
+    const size_t v6_max_routes = 2 * routes.n_v6 + 1;
+    const size_t n_tbl8_groups = routes.n_v4 / 8 + 256;
+    const size_t n_lc_slots = routes.n_v4 * 8 + 1024;
+    // a first guess, grown by bench_build_poptrie
+    const size_t n_pt_nodes_v4 = routes.n_v4 * 2 + 1024;
+    const size_t n_pt_leaves_v4 = routes.n_v4 * 4 + 4096;
+    const size_t n_pt_nodes_v6 = routes.n_v6 * 4 + 1024;
+    const size_t n_pt_leaves_v6 = routes.n_v6 * 8 + 4096;
+    // 4 slots per route at most 7/8 full, about 8 Bloom bits per slot used
+    size_t n_bsl_slots = 1024;
+    while (n_bsl_slots < routes.n_v6 * 8) {
+        n_bsl_slots <<= 1;
+    }
+    const size_t n_bsl_bloom_bits = n_bsl_slots * 4;
+    // about one pair per route, as much again for the updates
+    const size_t n_v64_pairs = routes.n_v6 * 2 + 1024;
+    // routes below one split length block of the aggregated copy
+    const size_t n_agg_block_routes = 65536;
+    // huge pages when the system has some
+    RouteTreeMem v4_nodes;
+    RouteTreeMem v6_nodes;
+    compressed_route_tree_mem_alloc(&v4_nodes, compressed_route_tree_get_memory_footprint_v4(v4_max_routes), ROUTE_TREE_MEM_ANY_NODE, 0);
+    compressed_route_tree_mem_alloc(&v6_nodes, compressed_route_tree_get_memory_footprint_v6(v6_max_routes), ROUTE_TREE_MEM_ANY_NODE, 0);
+    void *fast_v4 = malloc(compressed_route_tree_get_memory_footprint_v4_fast(n_tbl8_groups));
+    void *lc_v4 = malloc(compressed_route_tree_get_memory_footprint_v4_lc(n_lc_slots));
+    void *bsl_v6 = malloc(compressed_route_tree_get_memory_footprint_v6_bsl(n_bsl_slots, n_bsl_bloom_bits));
+    void *v6_64 = malloc(compressed_route_tree_get_memory_footprint_v6_64(n_v64_pairs));
+    void *aggregate = malloc(compressed_route_tree_get_memory_footprint_aggregate(n_agg_block_routes));
+    void *flow_cache_mem = malloc(compressed_route_tree_flow_cache_get_memory_footprint(FLOW_CACHE_SETS, FLOW_CACHE_SETS));
+    void *batch_ops = malloc(compressed_route_tree_batch_get_memory_footprint_v6(BATCH_OPS));
+    uint32_t *ipv4 = malloc(sizeof(*ipv4) * n_lookups);
+    uint8_t *ipv6 = malloc(16 * n_lookups);
+    const uint8_t **ipv6_ptr = malloc(sizeof(*ipv6_ptr) * n_lookups);
+    uint32_t *next_hop = malloc(sizeof(*next_hop) * n_lookups);
+    uint64_t *sample_ns = malloc(sizeof(*sample_ns) * N_LATENCY_SAMPLES);
+    if (!v4_nodes.ptr || !v6_nodes.ptr || !fast_v4 || !lc_v4 || !bsl_v6 || !v6_64 || !aggregate || !flow_cache_mem || !batch_ops || !ipv4 || !ipv6 || !ipv6_ptr || !next_hop || !sample_ns) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    RouteTreePool pool;
+    if (compressed_route_tree_init_nodes(&pool, v4_nodes.ptr, v4_max_routes, v6_nodes.ptr, v6_max_routes)) {
+        fprintf(stderr, "init nodes failed\n");
+        return 1;
+    }
+
+    RouteTreeHeadNode head_v4;
+    RouteTreeHeadNode head_v6;
+    compressed_route_tree_reset_head(&head_v4);
+    compressed_route_tree_reset_head(&head_v6);
+
+    RouteTreeBatch batch;
+    compressed_route_tree_batch_begin(&batch, batch_ops, BATCH_OPS);
+
+    RouteTreeFlowCache flow_cache;
+    compressed_route_tree_flow_cache_init(&flow_cache, flow_cache_mem, FLOW_CACHE_SETS, FLOW_CACHE_SETS);
+
+    const uint64_t overhead_ns = timer_overhead_ns();
+    uint64_t depth[ROUTE_TREE_STATS_MAX_VISITED];
+    RouteTreeLookupStats lookup_stats;
+    size_t i;
+    double start;
+    uint32_t traffic;
+
+    json_open(NULL);
+    json_open("config");
+    json_string("routes", route_file ? route_file : "generated");
+    json_uint("n_lookups", n_lookups);
+    json_uint("burst", burst);
+    json_uint("n_updates", n_updates);
+    json_uint("timer_overhead_ns", overhead_ns);
+    json_uint("node_page_size", v4_nodes.page_size);
+    json_close();
+
+    // v4
+    json_open("v4");
+    start = now_sec();
+    for (i = 0; i < routes.n_v4; ++i) {
+        compressed_route_tree_add_v4(&pool, &head_v4, routes.v4[i].be_ipv4, routes.v4[i].depth_len, routes.v4[i].next_hop);
+    }
+    const double v4_build_sec = now_sec() - start;
+    json_uint("routes", head_v4.total_routes);
+    json_uint("nodes", head_v4.total_nodes);
+    json_double("build_add_per_sec", routes.n_v4 / v4_build_sec);
+
+    json_open("memory");
+    json_uint("footprint_bytes", compressed_route_tree_get_memory_footprint_v4(routes.n_v4));
+    json_uint("node_bytes", head_v4.total_nodes * sizeof(RouteTreeNodeV4));
+    json_uint("fast_footprint_bytes", compressed_route_tree_get_memory_footprint_v4_fast(n_tbl8_groups));
+    json_close();
+
+    compressed_route_tree_get_depth_stats_v4(&pool, &head_v4, depth);
+    json_uint_array("routes_by_depth", depth, ROUTE_TREE_STATS_MAX_VISITED);
+
+    if (compressed_route_tree_build_v4_fast(&pool, &head_v4, fast_v4, n_tbl8_groups)) {
+        fprintf(stderr, "v4 fast build failed\n");
+        return 1;
+    }
+    void *poptrie_v4 = bench_build_poptrie(&pool, &head_v4, false, n_pt_nodes_v4, n_pt_leaves_v4);
+    if (NULL == poptrie_v4) {
+        fprintf(stderr, "v4 poptrie build failed\n");
+        return 1;
+    }
+    size_t n_pt_used_nodes;
+    size_t n_pt_used_leaves;
+    compressed_route_tree_poptrie_get_usage(&head_v4, &n_pt_used_nodes, &n_pt_used_leaves);
+    json_open("poptrie");
+    json_uint("nodes", n_pt_used_nodes);
+    json_uint("leaves", n_pt_used_leaves);
+    json_close();
+    json_open("lookup");
+    for (traffic = 0; traffic < BENCH_TRAFFIC_MAX; ++traffic) {
+        generate_traffic_v4(traffic, &routes, ipv4, n_lookups);
+        compressed_route_tree_reset_lookup_stats();
+        json_open(bench_traffic_name[traffic]);
+        bench_lookup_v4(&pool, &head_v4, ipv4, n_lookups, burst, &flow_cache, next_hop, sample_ns, overhead_ns);
+        if (0 == compressed_route_tree_get_lookup_stats_v4(&lookup_stats)) {
+            json_lookup_stats(&lookup_stats);
+        }
+        json_close();
+    }
+    json_close();
+    compressed_route_tree_release_v4_fast(&head_v4);
+    compressed_route_tree_release_v4_poptrie(&head_v4);
+
+    // single lookups walk the LC-trie copy once it is built
+    if (compressed_route_tree_build_v4_lc(&pool, &head_v4, lc_v4, n_lc_slots)) {
+        fprintf(stderr, "v4 lc build failed\n");
+        return 1;
+    }
+    json_open("lookup_lc");
+    json_uint("slot_bytes", (n_lc_slots - compressed_route_tree_lc_v4_free_slot_count(&head_v4)) * 8);
+    for (traffic = 0; traffic < BENCH_TRAFFIC_MAX; ++traffic) {
+        generate_traffic_v4(traffic, &routes, ipv4, n_lookups);
+        compressed_route_tree_reset_lookup_stats();
+        json_open(bench_traffic_name[traffic]);
+        bench_lookup_v4(&pool, &head_v4, ipv4, n_lookups, burst, &flow_cache, next_hop, sample_ns, overhead_ns);
+        if (0 == compressed_route_tree_get_lookup_stats_v4(&lookup_stats)) {
+            json_lookup_stats(&lookup_stats);
+        }
+        json_close();
+    }
+    json_close();
+    compressed_route_tree_release_v4_lc(&head_v4);
+
+    // single lookups walk the aggregated copy once it is built
+    if (compressed_route_tree_build_v4_aggregate(&pool, &head_v4, aggregate, n_agg_block_routes, 16)) {
+        fprintf(stderr, "v4 aggregate build failed\n");
+        return 1;
+    }
+    size_t n_agg_routes;
+    size_t n_agg_nodes;
+    compressed_route_tree_aggregate_get_usage(&head_v4, &n_agg_routes, &n_agg_nodes);
+    json_open("lookup_aggregate");
+    json_uint("routes", n_agg_routes);
+    json_uint("nodes", n_agg_nodes);
+    for (traffic = 0; traffic < BENCH_TRAFFIC_MAX; ++traffic) {
+        generate_traffic_v4(traffic, &routes, ipv4, n_lookups);
+        compressed_route_tree_reset_lookup_stats();
+        json_open(bench_traffic_name[traffic]);
+        bench_lookup_v4(&pool, &head_v4, ipv4, n_lookups, burst, &flow_cache, next_hop, sample_ns, overhead_ns);
+        if (0 == compressed_route_tree_get_lookup_stats_v4(&lookup_stats)) {
+            json_lookup_stats(&lookup_stats);
+        }
+        json_close();
+    }
+    json_close();
+    compressed_route_tree_release_v4_aggregate(&pool, &head_v4);
+
+    json_open("update");
+    bench_update_v4(&pool, &head_v4, &routes, n_updates, &batch);
+    json_close();
+
+    // update rate with one copy at a time kept in sync
+    if (compressed_route_tree_build_v4_fast(&pool, &head_v4, fast_v4, n_tbl8_groups)) {
+        fprintf(stderr, "v4 fast build failed\n");
+        return 1;
+    }
+    json_open("update_fast");
+    bench_update_v4(&pool, &head_v4, &routes, n_updates, &batch);
+    json_close();
+    compressed_route_tree_release_v4_fast(&head_v4);
+
+    free(poptrie_v4);
+    poptrie_v4 = bench_build_poptrie(&pool, &head_v4, false, n_pt_nodes_v4, n_pt_leaves_v4);
+    if (NULL == poptrie_v4) {
+        fprintf(stderr, "v4 poptrie build failed\n");
+        return 1;
+    }
+    json_open("update_poptrie");
+    bench_update_v4(&pool, &head_v4, &routes, n_updates, &batch);
+    json_close();
+    compressed_route_tree_release_v4_poptrie(&head_v4);
+
+    if (compressed_route_tree_build_v4_lc(&pool, &head_v4, lc_v4, n_lc_slots)) {
+        fprintf(stderr, "v4 lc build failed\n");
+        return 1;
+    }
+    json_open("update_lc");
+    bench_update_v4(&pool, &head_v4, &routes, n_updates, &batch);
+    json_close();
+    compressed_route_tree_release_v4_lc(&head_v4);
+
+    if (compressed_route_tree_build_v4_aggregate(&pool, &head_v4, aggregate, n_agg_block_routes, 16)) {
+        fprintf(stderr, "v4 aggregate build failed\n");
+        return 1;
+    }
+    json_open("update_aggregate");
+    bench_update_v4(&pool, &head_v4, &routes, n_updates, &batch);
+    json_close();
+    compressed_route_tree_release_v4_aggregate(&pool, &head_v4);
+    json_close();
+
+    // v6
+    json_open("v6");
+    start = now_sec();
+    for (i = 0; i < routes.n_v6; ++i) {
+        compressed_route_tree_add_v6(&pool, &head_v6, routes.v6[i].be_ipv6, routes.v6[i].depth_len, routes.v6[i].next_hop);
+    }
+    const double v6_build_sec = now_sec() - start;
+    json_uint("routes", head_v6.total_routes);
+    json_uint("nodes", head_v6.total_nodes);
+    json_double("build_add_per_sec", routes.n_v6 / v6_build_sec);
+
+    json_open("memory");
+    json_uint("footprint_bytes", compressed_route_tree_get_memory_footprint_v6(routes.n_v6));
+    json_uint("node_bytes", head_v6.total_nodes * sizeof(RouteTreeNodeV6));
+    json_close();
+
+    compressed_route_tree_get_depth_stats_v6(&pool, &head_v6, depth);
+    json_uint_array("routes_by_depth", depth, ROUTE_TREE_STATS_MAX_VISITED);
+
+    void *poptrie_v6 = bench_build_poptrie(&pool, &head_v6, true, n_pt_nodes_v6, n_pt_leaves_v6);
+    if (NULL == poptrie_v6) {
+        fprintf(stderr, "v6 poptrie build failed\n");
+        return 1;
+    }
+    compressed_route_tree_poptrie_get_usage(&head_v6, &n_pt_used_nodes, &n_pt_used_leaves);
+    json_open("poptrie");
+    json_uint("nodes", n_pt_used_nodes);
+    json_uint("leaves", n_pt_used_leaves);
+    json_close();
+
+    for (i = 0; i < n_lookups; ++i) {
+        ipv6_ptr[i] = &ipv6[i * 16];
+    }
+    json_open("lookup");
+    for (traffic = 0; traffic < BENCH_TRAFFIC_MAX; ++traffic) {
+        generate_traffic_v6(traffic, &routes, ipv6, n_lookups);
+        compressed_route_tree_reset_lookup_stats();
+        json_open(bench_traffic_name[traffic]);
+        bench_lookup_v6(&pool, &head_v6, ipv6_ptr, n_lookups, burst, &flow_cache, next_hop, sample_ns, overhead_ns);
+        if (0 == compressed_route_tree_get_lookup_stats_v6(&lookup_stats)) {
+            json_lookup_stats(&lookup_stats);
+        }
+        json_close();
+    }
+    json_close();
+    compressed_route_tree_release_v6_poptrie(&head_v6);
+
+    // single lookups search the prefix lengths once the copy is built
+    if (compressed_route_tree_build_v6_bsl(&pool, &head_v6, bsl_v6, n_bsl_slots, n_bsl_bloom_bits)) {
+        fprintf(stderr, "v6 bsl build failed\n");
+        return 1;
+    }
+    json_open("lookup_bsl");
+    json_uint("slot_bytes", compressed_route_tree_bsl_v6_used_slot_count(&head_v6) * 32);
+    json_uint("bloom_bytes", n_bsl_bloom_bits / 8);
+    for (traffic = 0; traffic < BENCH_TRAFFIC_MAX; ++traffic) {
+        generate_traffic_v6(traffic, &routes, ipv6, n_lookups);
+        compressed_route_tree_reset_lookup_stats();
+        json_open(bench_traffic_name[traffic]);
+        bench_lookup_v6(&pool, &head_v6, ipv6_ptr, n_lookups, burst, &flow_cache, next_hop, sample_ns, overhead_ns);
+        if (0 == compressed_route_tree_get_lookup_stats_v6(&lookup_stats)) {
+            json_lookup_stats(&lookup_stats);
+        }
+        json_close();
+    }
+    json_close();
+    compressed_route_tree_release_v6_bsl(&head_v6);
+
+    // single lookups walk the copy cut at /64 once it is built
+    if (compressed_route_tree_build_v6_64(&pool, &head_v6, v6_64, n_v64_pairs)) {
+        fprintf(stderr, "v6 /64 build failed\n");
+        return 1;
+    }
+    json_open("lookup_v6_64");
+    json_uint("pair_bytes", compressed_route_tree_v6_64_used_pair_count(&head_v6) * 32);
+    for (traffic = 0; traffic < BENCH_TRAFFIC_MAX; ++traffic) {
+        generate_traffic_v6(traffic, &routes, ipv6, n_lookups);
+        compressed_route_tree_reset_lookup_stats();
+        json_open(bench_traffic_name[traffic]);
+        bench_lookup_v6(&pool, &head_v6, ipv6_ptr, n_lookups, burst, &flow_cache, next_hop, sample_ns, overhead_ns);
+        if (0 == compressed_route_tree_get_lookup_stats_v6(&lookup_stats)) {
+            json_lookup_stats(&lookup_stats);
+        }
+        json_close();
+    }
+    json_close();
+    compressed_route_tree_release_v6_64(&head_v6);
+
+    // single lookups walk the aggregated copy once it is built
+    if (compressed_route_tree_build_v6_aggregate(&pool, &head_v6, aggregate, n_agg_block_routes, 32)) {
+        fprintf(stderr, "v6 aggregate build failed\n");
+        return 1;
+    }
+    compressed_route_tree_aggregate_get_usage(&head_v6, &n_agg_routes, &n_agg_nodes);
+    json_open("lookup_aggregate");
+    json_uint("routes", n_agg_routes);
+    json_uint("nodes", n_agg_nodes);
+    for (traffic = 0; traffic < BENCH_TRAFFIC_MAX; ++traffic) {
+        generate_traffic_v6(traffic, &routes, ipv6, n_lookups);
+        compressed_route_tree_reset_lookup_stats();
+        json_open(bench_traffic_name[traffic]);
+        bench_lookup_v6(&pool, &head_v6, ipv6_ptr, n_lookups, burst, &flow_cache, next_hop, sample_ns, overhead_ns);
+        if (0 == compressed_route_tree_get_lookup_stats_v6(&lookup_stats)) {
+            json_lookup_stats(&lookup_stats);
+        }
+        json_close();
+    }
+    json_close();
+    compressed_route_tree_release_v6_aggregate(&pool, &head_v6);
+
+    json_open("update");
+    bench_update_v6(&pool, &head_v6, &routes, n_updates, &batch);
+    json_close();
+
+    // update rate with one copy at a time kept in sync
+    free(poptrie_v6);
+    poptrie_v6 = bench_build_poptrie(&pool, &head_v6, true, n_pt_nodes_v6, n_pt_leaves_v6);
+    if (NULL == poptrie_v6) {
+        fprintf(stderr, "v6 poptrie build failed\n");
+        return 1;
+    }
+    json_open("update_poptrie");
+    bench_update_v6(&pool, &head_v6, &routes, n_updates, &batch);
+    json_close();
+    compressed_route_tree_release_v6_poptrie(&head_v6);
+
+    if (compressed_route_tree_build_v6_bsl(&pool, &head_v6, bsl_v6, n_bsl_slots, n_bsl_bloom_bits)) {
+        fprintf(stderr, "v6 bsl build failed\n");
+        return 1;
+    }
+    json_open("update_bsl");
+    bench_update_v6(&pool, &head_v6, &routes, n_updates, &batch);
+    json_close();
+    compressed_route_tree_release_v6_bsl(&head_v6);
+
+    if (compressed_route_tree_build_v6_64(&pool, &head_v6, v6_64, n_v64_pairs)) {
+        fprintf(stderr, "v6 /64 build failed\n");
+        return 1;
+    }
+    json_open("update_v6_64");
+    bench_update_v6(&pool, &head_v6, &routes, n_updates, &batch);
+    json_close();
+    compressed_route_tree_release_v6_64(&head_v6);
+
+    if (compressed_route_tree_build_v6_aggregate(&pool, &head_v6, aggregate, n_agg_block_routes, 32)) {
+        fprintf(stderr, "v6 aggregate build failed\n");
+        return 1;
+    }
+    json_open("update_aggregate");
+    bench_update_v6(&pool, &head_v6, &routes, n_updates, &batch);
+    json_close();
+    compressed_route_tree_release_v6_aggregate(&pool, &head_v6);
+    json_close();
+    json_close();
+
+    free(sample_ns);
+    free(next_hop);
+    free(ipv6_ptr);
+    free(ipv6);
+    free(ipv4);
+    free(batch_ops);
+    free(flow_cache_mem);
+    free(aggregate);
+    free(v6_64);
+    free(bsl_v6);
+    free(poptrie_v6);
+    free(poptrie_v4);
+    free(lc_v4);
+    free(fast_v4);
+    compressed_route_tree_mem_free(&v6_nodes);
+    compressed_route_tree_mem_free(&v4_nodes);
+    free(routes.v6);
+    free(routes.v4);
+
+    return 0;
+}
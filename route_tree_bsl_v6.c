@@ -0,0 +1,756 @@
+#include "route_tree_internal.h"
+
+/*
+ * IPv6 copy of the tree searched by binary search on prefix lengths, after
+ * Waldvogel et al. (SIGCOMM 1997).
+ *
+ * The lengths holding routes are kept sorted and a lookup searches them as
+ * a binary tree: it looks the address cut to the middle length up and goes
+ * on with the longer half on a hit, the shorter half on a miss. A route
+ * leaves a marker, its prefix cut to the length, at each shorter length the
+ * search goes through on the way to it, so the search turns towards it.
+ * Every prefix, route or marker, holds the next hop of the longest route
+ * covering it (bmp), so the last hit gives the result and a marker leading
+ * nowhere costs no backtracking: log2 of the number of lengths probes.
+ *
+ * The prefixes of all lengths share one open addressing table, keyed by
+ * prefix and length, with linear probing. A slot is written before its tag
+ * and its prefix does not change while the tag is up; a removed slot waits
+ * for a grace period before being reused and never gets empty again, so
+ * probes go on through it. An optional Bloom filter on prefix and length,
+ * one 64-bit word per test, lets most probes of absent prefixes stop there;
+ * its bits are never cleared.
+ *
+ * The first route of a length, or the last one going, changes the search:
+ * the markers of the new one are added to a free search and it is swapped
+ * in. The old one is retired: its markers stay counted and its lengths
+ * untouched until the readers are done with it, then reclaim counts the
+ * markers of the search in use again and removes the others. Only a change
+ * coming after BSL_SEARCHES - 1 others within one grace period has to
+ * wait for the readers.
+ */
+
+#define BSL_EMPTY 0
+// removed, waiting for the readers
+#define BSL_DEAD 1
+// removed, free to reuse
+#define BSL_FREE 2
+#define BSL_TAG(depth_len) (0x100U | (depth_len))
+// probes end on an empty slot, keep 1/8 of them
+#define BSL_MAX_USED(n_slots) ((n_slots) - (n_slots) / 8)
+// steps of a binary search over 128 lengths, but the last
+#define BSL_MAX_MARKERS 8
+// the search in use, retired ones and free ones
+#define BSL_SEARCHES 4
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct {
+    // left aligned, bits past the length 0
+    uint64_t key_hi;
+    uint64_t key_lo;
+    uint32_t tag;
+    // next hop of the longest route covering the prefix, -1 if none
+    int32_t bmp;
+
+    // writer only, routes the prefix is a marker of;
+    // next slot + 1 of the limbo list
+    union {
+        uint32_t n_markers;
+        uint32_t next_slot;
+    };
+    bool route;
+    // markers added by the walk of the tree, see bsl_mark_routes
+    bool marked;
+} BslSlot;
+
+// lengths holding routes, ascending
+typedef struct {
+    uint8_t n_lengths;
+    uint8_t lengths[128];
+} BslSearch;
+
+typedef struct route_tree_bsl_v6_s {
+    BslSlot *slots;
+    uint32_t slot_mask;
+    // NULL if no Bloom filter
+    uint64_t *bloom;
+    uint32_t bloom_mask;
+
+    // search in use, a change of lengths writes a free one
+    BslSearch search[BSL_SEARCHES];
+    uint8_t cur;
+    // writer only, searches retired since the markers were counted, one
+    // bit each, and the grace period of the last one
+    uint8_t retired;
+    uint64_t retired_epoch;
+
+    // writer only
+    uint32_t n_routes[129];
+    // slots not empty, and holding a prefix
+    uint32_t n_used;
+    uint32_t n_live;
+    // removed slots, + 1
+    uint32_t limbo_waiting;
+    uint32_t limbo_pending;
+    uint64_t limbo_epoch;
+
+    // set by a full table during an update
+    bool failed;
+} RouteTreeBslV6;
+
+// routes of the tree on the way to a prefix, ascending
+typedef struct {
+    uint8_t n;
+    uint8_t depth_len[128];
+    int32_t next_hop[128];
+} BslCovers;
+
+// subtrees of the tree below a prefix
+typedef struct {
+    uint32_t index[2];
+    RouteTreeU128 prefix;
+    uint8_t bit_offset;
+} BslBelow;
+
+enum BslAction {
+    // add the slot of each route
+    BSL_ROUTE,
+    // add the markers of each route of the table
+    BSL_MARK,
+    // update the bmp of the markers of each route
+    BSL_FIX,
+};
+
+typedef struct {
+    enum BslAction action;
+    const BslSearch *search;
+    // markers shorter are left alone
+    uint8_t min_len;
+} BslWalk;
+
+
+static inline RouteTreeU128 bsl_cut(RouteTreeU128 u128, uint8_t depth_len)
+{
+    return depth_len ? u128 & (~(RouteTreeU128)0 << (128 - depth_len)) : 0;
+}
+
+static inline uint64_t bsl_hash(RouteTreeU128 key, uint8_t depth_len)
+{
+    uint64_t hash = (uint64_t)(key >> 64) * 0x9e3779b97f4a7c15ULL ^ (uint64_t)key * 0xc2b2ae3d27d4eb4fULL ^ depth_len;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    return hash ^ (hash >> 32);
+}
+
+// two bits of the word (hash >> 32) & bloom_mask
+static inline uint64_t bsl_bloom_bits(uint64_t hash)
+{
+    const uint64_t mixed = hash * 0x9e3779b97f4a7c15ULL;
+    return (1ULL << (mixed >> 58)) | (1ULL << ((mixed >> 52) & 63));
+}
+
+static inline const BslSlot *bsl_probe(const RouteTreeBslV6 *bsl, RouteTreeU128 key, uint8_t depth_len, uint64_t hash)
+{
+    const uint32_t tag = BSL_TAG(depth_len);
+    uint32_t i;
+
+    for (i = hash & bsl->slot_mask; ; i = (i + 1) & bsl->slot_mask) {
+        const BslSlot *slot = &bsl->slots[i];
+        const uint32_t slot_tag = RCU_LOAD(slot->tag);
+        if (BSL_EMPTY == slot_tag) {
+            return NULL;
+        }
+        if (tag == slot_tag && slot->key_hi == (uint64_t)(key >> 64) && slot->key_lo == (uint64_t)key) {
+            return slot;
+        }
+    }
+}
+
+static inline BslSlot *bsl_find(RouteTreeBslV6 *bsl, RouteTreeU128 key, uint8_t depth_len)
+{
+    return (BslSlot *)bsl_probe(bsl, key, depth_len, bsl_hash(key, depth_len));
+}
+
+static void bsl_reclaim(RouteTreeBslV6 *bsl)
+{
+    if (bsl->limbo_waiting && route_tree_rcu_grace_period_done(bsl->limbo_epoch)) {
+        while (bsl->limbo_waiting) {
+            BslSlot *slot = &bsl->slots[bsl->limbo_waiting - 1];
+            bsl->limbo_waiting = slot->next_slot;
+            RCU_STORE(slot->tag, BSL_FREE);
+        }
+    }
+
+    if (0 == bsl->limbo_waiting && bsl->limbo_pending) {
+        bsl->limbo_waiting = bsl->limbo_pending;
+        bsl->limbo_pending = 0;
+        bsl->limbo_epoch = route_tree_rcu_start_grace_period();
+    }
+}
+
+// first free slot on the way of hash, or the empty one ending it while there is room
+static BslSlot *bsl_take(RouteTreeBslV6 *bsl, uint64_t hash)
+{
+    uint32_t i;
+
+    for (i = hash & bsl->slot_mask; ; i = (i + 1) & bsl->slot_mask) {
+        const uint32_t tag = bsl->slots[i].tag;
+        if (BSL_FREE == tag) {
+            return &bsl->slots[i];
+        }
+        if (BSL_EMPTY == tag) {
+            if (bsl->n_used >= BSL_MAX_USED(bsl->slot_mask + 1)) {
+                return NULL;
+            }
+            bsl->n_used++;
+            return &bsl->slots[i];
+        }
+    }
+}
+
+// the prefix must not be in the table yet
+static BslSlot *bsl_insert(RouteTreeBslV6 *bsl, RouteTreeU128 key, uint8_t depth_len, int32_t bmp)
+{
+    const uint64_t hash = bsl_hash(key, depth_len);
+    BslSlot *slot = bsl_take(bsl, hash);
+    if (NULL == slot) {
+        bsl_reclaim(bsl);
+        slot = bsl_take(bsl, hash);
+    }
+    if (NULL == slot) {
+        bsl->failed = true;
+        return NULL;
+    }
+
+    slot->key_hi = key >> 64;
+    slot->key_lo = key;
+    slot->bmp = bmp;
+    slot->n_markers = 0;
+    slot->route = false;
+    slot->marked = false;
+    if (bsl->bloom) {
+        uint64_t *word = &bsl->bloom[(hash >> 32) & bsl->bloom_mask];
+        RCU_STORE(*word, *word | bsl_bloom_bits(hash));
+    }
+    RCU_STORE(slot->tag, BSL_TAG(depth_len));
+    bsl->n_live++;
+
+    return slot;
+}
+
+static void bsl_remove(RouteTreeBslV6 *bsl, BslSlot *slot)
+{
+    RCU_STORE(slot->tag, BSL_DEAD);
+    slot->next_slot = bsl->limbo_pending;
+    bsl->limbo_pending = slot - bsl->slots + 1;
+    bsl->n_live--;
+}
+
+// lengths of the markers of a route of depth_len, where the search goes longer
+static uint8_t bsl_marker_lengths(const BslSearch *search, uint8_t depth_len, uint8_t *lengths)
+{
+    int lo = 0;
+    int hi = search->n_lengths - 1;
+    uint8_t n = 0;
+
+    while (lo <= hi) {
+        const int mid = (lo + hi) / 2;
+        if (search->lengths[mid] == depth_len) {
+            break;
+        }
+        if (search->lengths[mid] < depth_len) {
+            lengths[n++] = search->lengths[mid];
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return n;
+}
+
+static void bsl_set_search(const RouteTreeBslV6 *bsl, BslSearch *search)
+{
+    uint32_t depth_len;
+
+    search->n_lengths = 0;
+    for (depth_len = 1; depth_len <= 128; ++depth_len) {
+        if (bsl->n_routes[depth_len]) {
+            search->lengths[search->n_lengths++] = depth_len;
+        }
+    }
+}
+
+// next hop of the longest route of covers not longer than depth_len
+static int32_t bsl_cover(const BslCovers *covers, uint8_t depth_len)
+{
+    uint8_t i = covers->n;
+
+    while (i--) {
+        if (covers->depth_len[i] <= depth_len) {
+            return covers->next_hop[i];
+        }
+    }
+    return -1;
+}
+
+static void bsl_route(RouteTreeBslV6 *bsl, RouteTreeU128 prefix, uint8_t depth_len, int32_t next_hop,
+                    const BslCovers *covers, const BslWalk *walk)
+{
+    uint8_t lengths[BSL_MAX_MARKERS];
+    uint8_t n;
+    uint8_t i;
+
+    if (BSL_ROUTE == walk->action) {
+        BslSlot *slot = bsl_insert(bsl, prefix, depth_len, next_hop);
+        if (slot) {
+            slot->route = true;
+            bsl->n_routes[depth_len]++;
+        }
+        return;
+    }
+
+    if (BSL_MARK == walk->action) {
+        BslSlot *slot = bsl_find(bsl, prefix, depth_len);
+        if (NULL == slot || !slot->route) {
+            return;
+        }
+        slot->marked = true;
+    }
+
+    n = bsl_marker_lengths(walk->search, depth_len, lengths);
+    for (i = 0; i < n && !bsl->failed; ++i) {
+        const uint8_t marker_len = lengths[i];
+        if (marker_len < walk->min_len) {
+            continue;
+        }
+
+        const RouteTreeU128 key = bsl_cut(prefix, marker_len);
+        BslSlot *slot = bsl_find(bsl, key, marker_len);
+        if (BSL_MARK == walk->action) {
+            if (NULL == slot) {
+                slot = bsl_insert(bsl, key, marker_len, bsl_cover(covers, marker_len));
+            }
+            if (slot) {
+                slot->n_markers++;
+            }
+        }
+        else if (slot) {
+            RCU_STORE(slot->bmp, bsl_cover(covers, marker_len));
+        }
+    }
+}
+
+// routes of the tree subtree at index, covers holds those above it
+static void bsl_visit(RouteTreeBslV6 *bsl, const RouteTreePool *pool, uint32_t index,
+                    RouteTreeU128 prefix, uint8_t bit_offset, BslCovers *covers, const BslWalk *walk)
+{
+    const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(pool, index);
+    const uint8_t end = bit_offset + NODE_KEY_BIT_LEN(node_v6);
+    const int32_t next_hop = NODE_NEXT_HOP(node_v6);
+
+    prefix |= ipv6_to_u128(&node_v6->key) >> bit_offset;
+    if (next_hop >= 0) {
+        covers->depth_len[covers->n] = end;
+        covers->next_hop[covers->n] = next_hop;
+        covers->n++;
+        bsl_route(bsl, prefix, end, next_hop, covers, walk);
+    }
+
+    if (node_v6->next_bit_0 && !bsl->failed) {
+        bsl_visit(bsl, pool, node_v6->next_bit_0, prefix, end, covers, walk);
+    }
+    if (node_v6->next_bit_1 && !bsl->failed) {
+        bsl_visit(bsl, pool, node_v6->next_bit_1, prefix, end, covers, walk);
+    }
+    if (next_hop >= 0) {
+        covers->n--;
+    }
+}
+
+static void bsl_walk_tree(RouteTreeBslV6 *bsl, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                        const BslWalk *walk)
+{
+    BslCovers covers;
+
+    covers.n = 0;
+    if (head_node_v6->first_bit_0) {
+        bsl_visit(bsl, pool, head_node_v6->first_bit_0, 0, 0, &covers, walk);
+    }
+    if (head_node_v6->first_bit_1 && !bsl->failed) {
+        bsl_visit(bsl, pool, head_node_v6->first_bit_1, 0, 0, &covers, walk);
+    }
+}
+
+// walk the tree to prefix/depth_len, for the routes covering it and the subtrees below it
+static void bsl_path(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                    RouteTreeU128 prefix, uint8_t depth_len, BslCovers *covers, BslBelow *below)
+{
+    uint32_t index = (prefix >> 127) ? head_node_v6->first_bit_1 : head_node_v6->first_bit_0;
+    RouteTreeU128 tree_prefix = 0;
+    uint8_t bit_offset = 0;
+
+    covers->n = 0;
+    below->index[0] = 0;
+    below->index[1] = 0;
+    while (index) {
+        const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(pool, index);
+        const RouteTreeU128 key = ipv6_to_u128(&node_v6->key);
+        const uint8_t end = bit_offset + NODE_KEY_BIT_LEN(node_v6);
+        const uint8_t match_len = (end < depth_len ? end : depth_len) - bit_offset;
+
+        if (((prefix << bit_offset) ^ key) >> (128 - match_len)) {
+            break;
+        }
+        if (end > depth_len) {
+            below->index[0] = index;
+            break;
+        }
+
+        tree_prefix |= key >> bit_offset;
+        bit_offset = end;
+        if (NODE_NEXT_HOP(node_v6) >= 0) {
+            covers->depth_len[covers->n] = end;
+            covers->next_hop[covers->n] = NODE_NEXT_HOP(node_v6);
+            covers->n++;
+        }
+        if (end == depth_len) {
+            below->index[0] = node_v6->next_bit_0;
+            below->index[1] = node_v6->next_bit_1;
+            break;
+        }
+        index = ((prefix << bit_offset) >> 127) ? node_v6->next_bit_1 : node_v6->next_bit_0;
+    }
+
+    below->prefix = tree_prefix;
+    below->bit_offset = bit_offset;
+}
+
+/*
+ * Add the markers in search of the routes of the table, which within a
+ * batch commit differ from those of the tree until each op is brought in
+ * line. Follows a walk of the tree with BSL_MARK, for the routes it did not
+ * reach; the bmp of their markers is taken from the tree one by one, the
+ * update of such a route fixes those below it.
+ */
+static void bsl_mark_routes(RouteTreeBslV6 *bsl, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                            const BslSearch *search)
+{
+    uint8_t lengths[BSL_MAX_MARKERS];
+    uint32_t i;
+
+    for (i = 0; i <= bsl->slot_mask && !bsl->failed; ++i) {
+        BslSlot *slot = &bsl->slots[i];
+        if (slot->tag < BSL_TAG(0) || !slot->route) {
+            continue;
+        }
+        if (slot->marked) {
+            slot->marked = false;
+            continue;
+        }
+
+        const RouteTreeU128 prefix = ((RouteTreeU128)slot->key_hi << 64) | slot->key_lo;
+        const uint8_t n = bsl_marker_lengths(search, slot->tag & 0xff, lengths);
+        uint8_t k;
+        for (k = 0; k < n; ++k) {
+            const RouteTreeU128 key = bsl_cut(prefix, lengths[k]);
+            BslSlot *marker = bsl_find(bsl, key, lengths[k]);
+            if (NULL == marker) {
+                BslCovers covers;
+                BslBelow below;
+                bsl_path(pool, head_node_v6, key, lengths[k], &covers, &below);
+                marker = bsl_insert(bsl, key, lengths[k], bsl_cover(&covers, lengths[k]));
+                if (NULL == marker) {
+                    return;
+                }
+            }
+            marker->n_markers++;
+        }
+    }
+}
+
+/*
+ * Once the readers of the retired searches are done, count the markers of
+ * the search in use only and remove those no route leaves anymore; the
+ * retired searches are free again.
+ */
+static void bsl_recount(RouteTreeBslV6 *bsl, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6)
+{
+    uint32_t i;
+
+    for (i = 0; i <= bsl->slot_mask; ++i) {
+        if (bsl->slots[i].tag >= BSL_TAG(0)) {
+            bsl->slots[i].n_markers = 0;
+        }
+    }
+    bsl_mark_routes(bsl, pool, head_node_v6, &bsl->search[bsl->cur]);
+    if (bsl->failed) {
+        return;
+    }
+    for (i = 0; i <= bsl->slot_mask; ++i) {
+        BslSlot *slot = &bsl->slots[i];
+        if (slot->tag >= BSL_TAG(0) && !slot->route && 0 == slot->n_markers) {
+            bsl_remove(bsl, slot);
+        }
+    }
+    bsl->retired = 0;
+}
+
+/*
+ * Swap in a search over the lengths of n_routes; the old one keeps its
+ * markers until its readers are done, see bsl_recount.
+ */
+static void bsl_relength(RouteTreeBslV6 *bsl, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6)
+{
+    const uint8_t cur = bsl->cur;
+    uint8_t next;
+
+    if (bsl->retired && route_tree_rcu_grace_period_done(bsl->retired_epoch)) {
+        bsl_recount(bsl, pool, head_node_v6);
+    }
+    for (next = 0; next < BSL_SEARCHES; ++next) {
+        if (next != cur && !(bsl->retired & (1U << next))) {
+            break;
+        }
+    }
+    if (BSL_SEARCHES == next) {
+        // every other search is still read
+        compressed_route_tree_rcu_synchronize();
+        bsl_recount(bsl, pool, head_node_v6);
+        next = cur ^ 1;
+    }
+    if (bsl->failed) {
+        return;
+    }
+
+    const BslWalk walk = {BSL_MARK, &bsl->search[next], 0};
+
+    bsl_set_search(bsl, &bsl->search[next]);
+    bsl_walk_tree(bsl, pool, head_node_v6, &walk);
+    bsl_mark_routes(bsl, pool, head_node_v6, &bsl->search[next]);
+    if (bsl->failed) {
+        return;
+    }
+    RCU_STORE(bsl->cur, next);
+    bsl->retired |= 1U << cur;
+    bsl->retired_epoch = route_tree_rcu_start_grace_period();
+}
+
+/*
+ * Bring prefix/depth_len in line with the tree: add it, drop it or change
+ * its next hop, then the bmp of the markers below it.
+ */
+static void bsl_update(RouteTreeBslV6 *bsl, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                        RouteTreeU128 prefix, uint8_t depth_len)
+{
+    BslCovers covers;
+    BslBelow below;
+    uint8_t lengths[BSL_MAX_MARKERS];
+    uint8_t n;
+    uint8_t i;
+
+    // the default route stays on the head
+    if (0 == depth_len || bsl->failed) {
+        return;
+    }
+
+    prefix = bsl_cut(prefix, depth_len);
+    bsl_path(pool, head_node_v6, prefix, depth_len, &covers, &below);
+
+    const bool in_tree = covers.n && covers.depth_len[covers.n - 1] == depth_len;
+    BslSlot *slot = bsl_find(bsl, prefix, depth_len);
+    if (!in_tree && !(slot && slot->route)) {
+        return;
+    }
+
+    const BslSearch *search = &bsl->search[bsl->cur];
+    if (in_tree && !(slot && slot->route)) {
+        if (0 == bsl->n_routes[depth_len]++) {
+            bsl_relength(bsl, pool, head_node_v6);
+            if (bsl->failed) {
+                goto failed;
+            }
+            search = &bsl->search[bsl->cur];
+            // a route below may have left a marker here
+            slot = bsl_find(bsl, prefix, depth_len);
+        }
+        if (NULL == slot) {
+            slot = bsl_insert(bsl, prefix, depth_len, covers.next_hop[covers.n - 1]);
+        }
+        if (NULL == slot) {
+            goto failed;
+        }
+        slot->route = true;
+
+        n = bsl_marker_lengths(search, depth_len, lengths);
+        for (i = 0; i < n; ++i) {
+            BslSlot *marker = bsl_find(bsl, bsl_cut(prefix, lengths[i]), lengths[i]);
+            if (NULL == marker) {
+                marker = bsl_insert(bsl, bsl_cut(prefix, lengths[i]), lengths[i], bsl_cover(&covers, lengths[i]));
+            }
+            if (NULL == marker) {
+                goto failed;
+            }
+            marker->n_markers++;
+        }
+    }
+    else if (!in_tree) {
+        n = bsl_marker_lengths(search, depth_len, lengths);
+        for (i = 0; i < n; ++i) {
+            BslSlot *marker = bsl_find(bsl, bsl_cut(prefix, lengths[i]), lengths[i]);
+            if (marker && 0 == --marker->n_markers && !marker->route) {
+                bsl_remove(bsl, marker);
+            }
+        }
+        slot->route = false;
+        if (0 == slot->n_markers) {
+            bsl_remove(bsl, slot);
+        }
+    }
+    if (slot->tag == BSL_TAG(depth_len)) {
+        RCU_STORE(slot->bmp, bsl_cover(&covers, depth_len));
+    }
+
+    // markers below take the next hop of the route, or of its cover; those
+    // of the retired searches too, the search in use may go through them
+    uint8_t k;
+    for (k = 0; k < BSL_SEARCHES; ++k) {
+        if (k != bsl->cur && !(bsl->retired & (1U << k))) {
+            continue;
+        }
+        const BslWalk walk = {BSL_FIX, &bsl->search[k], depth_len + 1};
+        for (i = 0; i < 2; ++i) {
+            if (below.index[i]) {
+                bsl_visit(bsl, pool, below.index[i], below.prefix, below.bit_offset, &covers, &walk);
+            }
+        }
+    }
+
+    if (!in_tree && 0 == --bsl->n_routes[depth_len]) {
+        bsl_relength(bsl, pool, head_node_v6);
+    }
+    if (!bsl->failed) {
+        return;
+    }
+
+failed:
+    bsl->failed = true;
+    RCU_STORE(head_node_v6->bsl_v6, NULL);
+}
+
+
+// Internal hooks:
+
+
+int route_tree_bsl_v6_lookup(const void *bsl_v6, const RouteTreeIPV6 *ipv6, uint32_t *next_hop, uint32_t *n_visited)
+{
+    const RouteTreeBslV6 *bsl = bsl_v6;
+    const BslSearch *search = &bsl->search[RCU_LOAD(bsl->cur)];
+    const RouteTreeU128 addr = ipv6_to_u128(ipv6);
+    int32_t bmp = -1;
+    int lo = 0;
+    int hi = search->n_lengths - 1;
+
+    while (lo <= hi) {
+        const int mid = (lo + hi) / 2;
+        const uint8_t depth_len = search->lengths[mid];
+        const RouteTreeU128 key = bsl_cut(addr, depth_len);
+        const uint64_t hash = bsl_hash(key, depth_len);
+        const BslSlot *slot = NULL;
+
+        (*n_visited)++;
+        if (NULL == bsl->bloom || (RCU_LOAD(bsl->bloom[(hash >> 32) & bsl->bloom_mask]) & bsl_bloom_bits(hash)) == bsl_bloom_bits(hash)) {
+            slot = bsl_probe(bsl, key, depth_len, hash);
+        }
+        if (slot) {
+            bmp = RCU_LOAD(slot->bmp);
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+
+    if (bmp < 0) {
+        return -1;
+    }
+    *next_hop = bmp;
+    return 0;
+}
+
+void route_tree_bsl_v6_update(void *bsl_v6, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                            const RouteTreeIPV6 *ipv6, uint8_t depth_len)
+{
+    bsl_update(bsl_v6, pool, head_node_v6, ipv6_to_u128(ipv6), depth_len);
+}
+
+void route_tree_bsl_v6_reclaim(void *bsl_v6, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6)
+{
+    RouteTreeBslV6 *bsl = bsl_v6;
+
+    if (bsl->retired && route_tree_rcu_grace_period_done(bsl->retired_epoch)) {
+        bsl_recount(bsl, pool, head_node_v6);
+        if (bsl->failed) {
+            RCU_STORE(head_node_v6->bsl_v6, NULL);
+            return;
+        }
+    }
+    bsl_reclaim(bsl);
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_get_memory_footprint_v6_bsl(const size_t n_slots, const size_t n_bloom_bits)
+{
+    return ALIGN_UP(sizeof(RouteTreeBslV6), 64) + ALIGN_UP(sizeof(BslSlot) * n_slots, 64) + n_bloom_bits / 8;
+}
+
+int compressed_route_tree_build_v6_bsl(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    void * const bsl_v6_ptr, const size_t n_slots, const size_t n_bloom_bits)
+{
+    if (head_node_v6->bsl_v6 || n_slots < 2 || n_slots > (1ULL << 32) || 0 != (n_slots & (n_slots - 1))
+            || (n_bloom_bits && (n_bloom_bits < 64 || n_bloom_bits / 64 > (1ULL << 32)
+                                || 0 != (n_bloom_bits & (n_bloom_bits - 1))))) {
+        return -1;
+    }
+
+    RouteTreeBslV6 *bsl = bsl_v6_ptr;
+    memset(bsl, 0, sizeof(*bsl));
+    bsl->slots = (BslSlot *)((uintptr_t)bsl_v6_ptr + ALIGN_UP(sizeof(RouteTreeBslV6), 64));
+    bsl->slot_mask = n_slots - 1;
+    memset(bsl->slots, 0, sizeof(BslSlot) * n_slots);
+    if (n_bloom_bits) {
+        bsl->bloom = (uint64_t *)((uintptr_t)bsl->slots + ALIGN_UP(sizeof(BslSlot) * n_slots, 64));
+        bsl->bloom_mask = n_bloom_bits / 64 - 1;
+        memset(bsl->bloom, 0, n_bloom_bits / 8);
+    }
+
+    BslWalk walk = {BSL_ROUTE, NULL, 0};
+    bsl_walk_tree(bsl, pool, head_node_v6, &walk);
+    bsl_set_search(bsl, &bsl->search[0]);
+    walk.action = BSL_MARK;
+    walk.search = &bsl->search[0];
+    bsl_walk_tree(bsl, pool, head_node_v6, &walk);
+    bsl_mark_routes(bsl, pool, head_node_v6, &bsl->search[0]);
+    if (bsl->failed) {
+        return -1;
+    }
+
+    RCU_STORE(head_node_v6->bsl_v6, (void *)bsl);
+
+    return 0;
+}
+
+void compressed_route_tree_release_v6_bsl(RouteTreeHeadNode *head_node_v6)
+{
+    RCU_STORE(head_node_v6->bsl_v6, NULL);
+}
+
+size_t compressed_route_tree_bsl_v6_used_slot_count(const RouteTreeHeadNode *head_node_v6)
+{
+    const RouteTreeBslV6 *bsl = head_node_v6->bsl_v6;
+    return bsl ? bsl->n_live : 0;
+}
@@ -0,0 +1,1655 @@
+/*
+ * Differential checks: every lookup engine is built on a table of random
+ * nested prefixes, alone and then with the others of its family, and
+ * compared with lookup_ext, which walks the plain tree, on addresses in and
+ * around the prefixes, while random add/del and batch commits change the
+ * table. The tree itself is compared with a scan of the prefixes,
+ * bulk_load and snapshots with the table they come from, next hop groups
+ * with the members they were given, a growable pool with the routes it
+ * grew for.
+ * Prints one line per check and exits with 1 on the first mismatch.
+ *
+ * Build and run: make check
+ */
+#include "route_tree.h"
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define N_PREFIXES 4096
+#define N_ROUNDS 8
+#define N_UPDATES 512
+#define N_LOOKUPS 8192
+#define N_SCAN_LOOKUPS 1024
+#define CHECK_BURST 64
+#define BATCH_OPS 64
+#define MAX_POOL_ROUTES (4 * N_PREFIXES)
+#define FLOW_CACHE_SETS 256
+#define N_NEXT_HOPS 8
+
+static uint64_t rand_state = 88172645463325252ULL;
+
+static inline uint64_t rand_u64(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+/*
+ * Candidate routes of a family, present when in the table under test.
+ * Index 0 is the default route. Few next hops, so the aggregated copy has
+ * routes to merge.
+ */
+typedef struct {
+    uint32_t ipv4[N_PREFIXES];
+    uint8_t ipv6[N_PREFIXES][16];
+    uint8_t depth_len[N_PREFIXES];
+    uint32_t next_hop[N_PREFIXES];
+    bool present[N_PREFIXES];
+} CheckPrefixes;
+
+static CheckPrefixes prefixes_v4;
+static CheckPrefixes prefixes_v6;
+
+enum CheckEngine {
+    CHECK_TREE,
+    CHECK_BULK,
+    CHECK_CACHED,
+    CHECK_FAST,
+    CHECK_LC,
+    CHECK_POPTRIE,
+    CHECK_BSL,
+    CHECK_V6_64,
+    CHECK_AGGREGATE,
+    CHECK_ENGINE_MAX,
+};
+
+static const char *check_engine_name[CHECK_ENGINE_MAX] = {
+    [CHECK_TREE] = "tree",
+    [CHECK_BULK] = "bulk",
+    [CHECK_CACHED] = "flow_cache",
+    [CHECK_FAST] = "dir_24_8",
+    [CHECK_LC] = "lc_trie",
+    [CHECK_POPTRIE] = "poptrie",
+    [CHECK_BSL] = "bsl",
+    [CHECK_V6_64] = "v6_64",
+    [CHECK_AGGREGATE] = "aggregate",
+};
+
+static const enum CheckEngine check_engines_v4[] = {
+    CHECK_TREE, CHECK_BULK, CHECK_CACHED, CHECK_FAST, CHECK_LC, CHECK_POPTRIE, CHECK_AGGREGATE,
+};
+
+static const enum CheckEngine check_engines_v6[] = {
+    CHECK_TREE, CHECK_BULK, CHECK_CACHED, CHECK_POPTRIE, CHECK_BSL, CHECK_V6_64, CHECK_AGGREGATE,
+};
+
+// memory of the pools, of each engine, the flow cache and batches
+static void *nodes_v4_mem;
+static void *nodes_v6_mem;
+static void *engine_mem[CHECK_ENGINE_MAX];
+static void *cache_mem;
+static void *batch_mem;
+
+static inline uint32_t mask_v4(uint8_t depth_len)
+{
+    return depth_len ? 0xffffffffU << (32 - depth_len) : 0;
+}
+
+static void mask_v6(const uint8_t *ipv6, uint8_t depth_len, uint8_t *masked)
+{
+    uint32_t i;
+    for (i = 0; i < 16; ++i) {
+        const int bits = depth_len - (int)i * 8;
+        masked[i] = bits >= 8 ? ipv6[i] : bits <= 0 ? 0 : ipv6[i] & (0xff << (8 - bits));
+    }
+}
+
+// flip the bits of ipv6 from bit start on at random
+static void scramble_v6(uint8_t *ipv6, uint32_t start)
+{
+    uint32_t b;
+    for (b = start; b < 128; ++b) {
+        if (rand_u64() & 1) {
+            ipv6[b / 8] ^= 0x80 >> (b % 8);
+        }
+    }
+}
+
+static bool find_prefix_v4(const CheckPrefixes *prefixes, size_t n, uint32_t ipv4, uint8_t depth_len)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (prefixes->depth_len[i] == depth_len && prefixes->ipv4[i] == ipv4) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool find_prefix_v6(const CheckPrefixes *prefixes, size_t n, const uint8_t *ipv6, uint8_t depth_len)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (prefixes->depth_len[i] == depth_len && 0 == memcmp(prefixes->ipv6[i], ipv6, 16)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// prefixes under 4 /8, most /16 to /24, every length taken
+static void generate_prefixes_v4(CheckPrefixes *prefixes)
+{
+    uint32_t base[4];
+    uint32_t i;
+    for (i = 0; i < 4; ++i) {
+        base[i] = (uint32_t)rand_u64() & 0xff000000U;
+    }
+
+    memset(prefixes, 0, sizeof(*prefixes));
+    size_t n = 1;
+    while (n < N_PREFIXES) {
+        const uint32_t r = rand_u64() % 100;
+        const uint8_t depth_len = r < 60 ? 16 + rand_u64() % 9 : 1 + rand_u64() % 32;
+        const uint32_t ipv4 = (base[rand_u64() % 4] | ((uint32_t)rand_u64() & 0x00ffffffU)) & mask_v4(depth_len);
+        if (find_prefix_v4(prefixes, n, ipv4, depth_len)) {
+            continue;
+        }
+        prefixes->ipv4[n] = ipv4;
+        prefixes->depth_len[n] = depth_len;
+        n++;
+    }
+}
+
+// prefixes under 4 /20, lengths around /64 and some up to /128
+static void generate_prefixes_v6(CheckPrefixes *prefixes)
+{
+    uint8_t base[4][16];
+    uint32_t i;
+    for (i = 0; i < 4; ++i) {
+        memset(base[i], 0, 16);
+        base[i][0] = 0x20;
+        base[i][1] = rand_u64() & 0x0f;
+        base[i][2] = rand_u64() & 0xf0;
+    }
+
+    memset(prefixes, 0, sizeof(*prefixes));
+    size_t n = 1;
+    while (n < N_PREFIXES) {
+        const uint32_t r = rand_u64() % 100;
+        uint8_t depth_len;
+        if (r < 10) {
+            depth_len = 1 + rand_u64() % 20;
+        }
+        else if (r < 50) {
+            depth_len = 21 + rand_u64() % 43;
+        }
+        else if (r < 75) {
+            depth_len = 64;
+        }
+        else {
+            depth_len = 65 + rand_u64() % 64;
+        }
+
+        uint8_t ipv6[16];
+        memcpy(ipv6, base[rand_u64() % 4], 16);
+        scramble_v6(ipv6, 20);
+        mask_v6(ipv6, depth_len, prefixes->ipv6[n]);
+        if (find_prefix_v6(prefixes, n, prefixes->ipv6[n], depth_len)) {
+            continue;
+        }
+        prefixes->depth_len[n] = depth_len;
+        n++;
+    }
+}
+
+// an address under a prefix or one of its siblings, sometimes anywhere
+static uint32_t rand_ipv4(const CheckPrefixes *prefixes)
+{
+    if (0 == rand_u64() % 8) {
+        return (uint32_t)rand_u64();
+    }
+    const size_t k = rand_u64() % N_PREFIXES;
+    const uint8_t depth_len = prefixes->depth_len[k];
+    const uint8_t keep = depth_len > 2 ? depth_len - rand_u64() % 3 : 0;
+    return prefixes->ipv4[k] ^ ((uint32_t)rand_u64() & ~mask_v4(keep));
+}
+
+static void rand_ipv6(const CheckPrefixes *prefixes, uint8_t *ipv6)
+{
+    if (0 == rand_u64() % 8) {
+        memcpy(ipv6, prefixes->ipv6[1 + rand_u64() % (N_PREFIXES - 1)], 16);
+        scramble_v6(ipv6, 0);
+        return;
+    }
+    const size_t k = rand_u64() % N_PREFIXES;
+    const uint8_t depth_len = prefixes->depth_len[k];
+    memcpy(ipv6, prefixes->ipv6[k], 16);
+    scramble_v6(ipv6, depth_len > 2 ? depth_len - rand_u64() % 3 : 0);
+}
+
+// longest present prefix by scanning them all
+static int scan_lookup_v4(const CheckPrefixes *prefixes, uint32_t ipv4, uint32_t *next_hop)
+{
+    int best = -1;
+    size_t i;
+    for (i = 0; i < N_PREFIXES; ++i) {
+        if (prefixes->present[i] && (ipv4 & mask_v4(prefixes->depth_len[i])) == prefixes->ipv4[i]
+            && (best < 0 || prefixes->depth_len[i] > prefixes->depth_len[best])) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        return -1;
+    }
+    *next_hop = prefixes->next_hop[best];
+    return 0;
+}
+
+static int scan_lookup_v6(const CheckPrefixes *prefixes, const uint8_t *ipv6, uint32_t *next_hop)
+{
+    int best = -1;
+    size_t i;
+    for (i = 0; i < N_PREFIXES; ++i) {
+        if (!prefixes->present[i] || (best >= 0 && prefixes->depth_len[i] <= prefixes->depth_len[best])) {
+            continue;
+        }
+        uint8_t masked[16];
+        mask_v6(ipv6, prefixes->depth_len[i], masked);
+        if (0 == memcmp(masked, prefixes->ipv6[i], 16)) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        return -1;
+    }
+    *next_hop = prefixes->next_hop[best];
+    return 0;
+}
+
+// the poptrie and aggregated memory serves one family at a time
+static size_t engine_get_memory_footprint(enum CheckEngine engine)
+{
+    switch (engine) {
+    case CHECK_FAST:
+        return compressed_route_tree_get_memory_footprint_v4_fast(N_PREFIXES);
+    case CHECK_LC:
+        return compressed_route_tree_get_memory_footprint_v4_lc(16 * N_PREFIXES);
+    case CHECK_POPTRIE:
+        return compressed_route_tree_get_memory_footprint_poptrie(16 * N_PREFIXES, 64 * N_PREFIXES);
+    case CHECK_BSL:
+        return compressed_route_tree_get_memory_footprint_v6_bsl(1 << 16, 1 << 16);
+    case CHECK_V6_64:
+        return compressed_route_tree_get_memory_footprint_v6_64(4 * N_PREFIXES);
+    case CHECK_AGGREGATE:
+        return compressed_route_tree_get_memory_footprint_aggregate(N_PREFIXES);
+    default:
+        return 0;
+    }
+}
+
+static int build_engine_v4(enum CheckEngine engine, RouteTreePool *pool, RouteTreeHeadNode *head_node_v4)
+{
+    switch (engine) {
+    case CHECK_FAST:
+        return compressed_route_tree_build_v4_fast(pool, head_node_v4, engine_mem[engine], N_PREFIXES);
+    case CHECK_LC:
+        return compressed_route_tree_build_v4_lc(pool, head_node_v4, engine_mem[engine], 16 * N_PREFIXES);
+    case CHECK_POPTRIE:
+        return compressed_route_tree_build_v4_poptrie(pool, head_node_v4, engine_mem[engine], 16 * N_PREFIXES, 64 * N_PREFIXES);
+    case CHECK_AGGREGATE:
+        return compressed_route_tree_build_v4_aggregate(pool, head_node_v4, engine_mem[engine], N_PREFIXES, 16);
+    default:
+        return 0;
+    }
+}
+
+static int build_engine_v6(enum CheckEngine engine, RouteTreePool *pool, RouteTreeHeadNode *head_node_v6)
+{
+    switch (engine) {
+    case CHECK_POPTRIE:
+        return compressed_route_tree_build_v6_poptrie(pool, head_node_v6, engine_mem[engine], 16 * N_PREFIXES, 64 * N_PREFIXES);
+    case CHECK_BSL:
+        return compressed_route_tree_build_v6_bsl(pool, head_node_v6, engine_mem[engine], 1 << 16, 1 << 16);
+    case CHECK_V6_64:
+        return compressed_route_tree_build_v6_64(pool, head_node_v6, engine_mem[engine], 4 * N_PREFIXES);
+    case CHECK_AGGREGATE:
+        return compressed_route_tree_build_v6_aggregate(pool, head_node_v6, engine_mem[engine], N_PREFIXES, 32);
+    default:
+        return 0;
+    }
+}
+
+static void release_engine_v4(enum CheckEngine engine, RouteTreePool *pool, RouteTreeHeadNode *head_node_v4)
+{
+    switch (engine) {
+    case CHECK_FAST:
+        compressed_route_tree_release_v4_fast(head_node_v4);
+        break;
+    case CHECK_LC:
+        compressed_route_tree_release_v4_lc(head_node_v4);
+        break;
+    case CHECK_POPTRIE:
+        compressed_route_tree_release_v4_poptrie(head_node_v4);
+        break;
+    case CHECK_AGGREGATE:
+        compressed_route_tree_release_v4_aggregate(pool, head_node_v4);
+        break;
+    default:
+        break;
+    }
+}
+
+static void release_engine_v6(enum CheckEngine engine, RouteTreePool *pool, RouteTreeHeadNode *head_node_v6)
+{
+    switch (engine) {
+    case CHECK_POPTRIE:
+        compressed_route_tree_release_v6_poptrie(head_node_v6);
+        break;
+    case CHECK_BSL:
+        compressed_route_tree_release_v6_bsl(head_node_v6);
+        break;
+    case CHECK_V6_64:
+        compressed_route_tree_release_v6_64(head_node_v6);
+        break;
+    case CHECK_AGGREGATE:
+        compressed_route_tree_release_v6_aggregate(pool, head_node_v6);
+        break;
+    default:
+        break;
+    }
+}
+
+// false if an update dropped the copy, the memory given is enough for all
+static bool engine_attached(enum CheckEngine engine, const RouteTreeHeadNode *head_node)
+{
+    switch (engine) {
+    case CHECK_FAST:
+        return NULL != head_node->fast_v4;
+    case CHECK_LC:
+        return NULL != head_node->lc_v4;
+    case CHECK_POPTRIE:
+        return NULL != head_node->poptrie;
+    case CHECK_BSL:
+        return NULL != head_node->bsl_v6;
+    case CHECK_V6_64:
+        return NULL != head_node->v6_64;
+    case CHECK_AGGREGATE:
+        return NULL != head_node->aggregate;
+    default:
+        return true;
+    }
+}
+
+// hit_mask as for the bulk lookups
+static void engine_lookup_v4(enum CheckEngine engine, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                            RouteTreeFlowCache *cache, const uint32_t *be_ipv4, uint32_t *next_hop, uint64_t *hit_mask)
+{
+    if (CHECK_BULK == engine) {
+        compressed_route_tree_lookup_bulk_v4(pool, head_node_v4, be_ipv4, CHECK_BURST, next_hop, hit_mask);
+        return;
+    }
+
+    hit_mask[0] = 0;
+    size_t i;
+    for (i = 0; i < CHECK_BURST; ++i) {
+        int ret;
+        if (CHECK_CACHED == engine) {
+            ret = compressed_route_tree_lookup_v4_cached(pool, head_node_v4, cache, be_ipv4[i], &next_hop[i]);
+        }
+        else if (CHECK_FAST == engine) {
+            ret = compressed_route_tree_lookup_v4_fast(head_node_v4, be_ipv4[i], &next_hop[i]);
+        }
+        else if (CHECK_POPTRIE == engine) {
+            ret = compressed_route_tree_lookup_v4_poptrie(pool, head_node_v4, be_ipv4[i], &next_hop[i]);
+        }
+        else {
+            ret = compressed_route_tree_lookup_v4(pool, head_node_v4, be_ipv4[i], &next_hop[i]);
+        }
+        if (0 == ret) {
+            hit_mask[0] |= 1ULL << i;
+        }
+    }
+}
+
+static void engine_lookup_v6(enum CheckEngine engine, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                            RouteTreeFlowCache *cache, const uint8_t * const *be_ipv6, uint32_t *next_hop, uint64_t *hit_mask)
+{
+    if (CHECK_BULK == engine) {
+        compressed_route_tree_lookup_bulk_v6(pool, head_node_v6, be_ipv6, CHECK_BURST, next_hop, hit_mask);
+        return;
+    }
+
+    hit_mask[0] = 0;
+    size_t i;
+    for (i = 0; i < CHECK_BURST; ++i) {
+        int ret;
+        if (CHECK_CACHED == engine) {
+            ret = compressed_route_tree_lookup_v6_cached(pool, head_node_v6, cache, be_ipv6[i], &next_hop[i]);
+        }
+        else if (CHECK_POPTRIE == engine) {
+            ret = compressed_route_tree_lookup_v6_poptrie(pool, head_node_v6, be_ipv6[i], &next_hop[i]);
+        }
+        else {
+            ret = compressed_route_tree_lookup_v6(pool, head_node_v6, be_ipv6[i], &next_hop[i]);
+        }
+        if (0 == ret) {
+            hit_mask[0] |= 1ULL << i;
+        }
+    }
+}
+
+// engine against lookup_ext, and for the tree lookup_ext against a scan
+static int check_lookups_v4(enum CheckEngine engine, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                            RouteTreeFlowCache *cache)
+{
+    size_t n;
+    for (n = 0; n < N_LOOKUPS; n += CHECK_BURST) {
+        uint32_t be_ipv4[CHECK_BURST];
+        uint32_t next_hop[CHECK_BURST];
+        uint64_t hit_mask[1];
+        size_t i;
+        for (i = 0; i < CHECK_BURST; ++i) {
+            be_ipv4[i] = htonl(rand_ipv4(&prefixes_v4));
+        }
+        engine_lookup_v4(engine, pool, head_node_v4, cache, be_ipv4, next_hop, hit_mask);
+
+        for (i = 0; i < CHECK_BURST; ++i) {
+            RouteTreeLookupResult result;
+            const bool hit = 0 == compressed_route_tree_lookup_ext_v4(pool, head_node_v4, be_ipv4[i], &result);
+            const bool engine_hit = hit_mask[0] >> i & 1;
+            if (hit != engine_hit || (hit && result.next_hop != next_hop[i])) {
+                printf("v4 %s: %08x tree %d/%u, engine %d/%u\n", check_engine_name[engine], ntohl(be_ipv4[i]),
+                        hit, hit ? result.next_hop : 0, engine_hit, engine_hit ? next_hop[i] : 0);
+                return -1;
+            }
+
+            uint32_t scan_next_hop;
+            if (CHECK_TREE == engine && n < N_SCAN_LOOKUPS) {
+                const bool scan_hit = 0 == scan_lookup_v4(&prefixes_v4, ntohl(be_ipv4[i]), &scan_next_hop);
+                if (hit != scan_hit || (hit && result.next_hop != scan_next_hop)) {
+                    printf("v4 tree: %08x tree %d/%u, scan %d/%u\n", ntohl(be_ipv4[i]),
+                            hit, hit ? result.next_hop : 0, scan_hit, scan_hit ? scan_next_hop : 0);
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int check_lookups_v6(enum CheckEngine engine, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                            RouteTreeFlowCache *cache)
+{
+    size_t n;
+    for (n = 0; n < N_LOOKUPS; n += CHECK_BURST) {
+        uint8_t ipv6[CHECK_BURST][16];
+        const uint8_t *be_ipv6[CHECK_BURST];
+        uint32_t next_hop[CHECK_BURST];
+        uint64_t hit_mask[1];
+        size_t i;
+        for (i = 0; i < CHECK_BURST; ++i) {
+            rand_ipv6(&prefixes_v6, ipv6[i]);
+            be_ipv6[i] = ipv6[i];
+        }
+        engine_lookup_v6(engine, pool, head_node_v6, cache, be_ipv6, next_hop, hit_mask);
+
+        for (i = 0; i < CHECK_BURST; ++i) {
+            RouteTreeLookupResult result;
+            const bool hit = 0 == compressed_route_tree_lookup_ext_v6(pool, head_node_v6, be_ipv6[i], &result);
+            const bool engine_hit = hit_mask[0] >> i & 1;
+            bool scan_hit = hit;
+            uint32_t scan_next_hop = result.next_hop;
+            if (CHECK_TREE == engine && n < N_SCAN_LOOKUPS) {
+                scan_hit = 0 == scan_lookup_v6(&prefixes_v6, be_ipv6[i], &scan_next_hop);
+            }
+            if (hit != engine_hit || (hit && result.next_hop != next_hop[i])
+                || hit != scan_hit || (hit && result.next_hop != scan_next_hop)) {
+                char text[INET6_ADDRSTRLEN];
+                inet_ntop(AF_INET6, be_ipv6[i], text, sizeof(text));
+                printf("v6 %s: %s tree %d/%u, engine %d/%u, scan %d/%u\n", check_engine_name[engine], text,
+                        hit, hit ? result.next_hop : 0, engine_hit, engine_hit ? next_hop[i] : 0,
+                        scan_hit, scan_hit ? scan_next_hop : 0);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// random adds, dels and batches of both, mirrored in prefixes_v4
+static int update_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4)
+{
+    size_t n = 0;
+    while (n < N_UPDATES) {
+        const size_t k = rand_u64() % N_PREFIXES;
+        const uint32_t be_ipv4 = htonl(prefixes_v4.ipv4[k]);
+        const uint8_t depth_len = prefixes_v4.depth_len[k];
+        const uint32_t r = rand_u64() % 16;
+        if (r < 14) {
+            int ret;
+            if (prefixes_v4.present[k] && r < 7) {
+                ret = compressed_route_tree_del_v4(pool, head_node_v4, be_ipv4, depth_len);
+                prefixes_v4.present[k] = false;
+            }
+            else {
+                prefixes_v4.next_hop[k] = rand_u64() % N_NEXT_HOPS;
+                ret = compressed_route_tree_add_v4(pool, head_node_v4, be_ipv4, depth_len, prefixes_v4.next_hop[k]);
+                prefixes_v4.present[k] = true;
+            }
+            if (ret) {
+                printf("v4 update of %08x/%u failed\n", prefixes_v4.ipv4[k], depth_len);
+                return -1;
+            }
+            n++;
+            continue;
+        }
+
+        RouteTreeBatch batch;
+        compressed_route_tree_batch_begin(&batch, batch_mem, BATCH_OPS);
+        const size_t n_ops = 1 + rand_u64() % BATCH_OPS;
+        size_t i;
+        for (i = 0; i < n_ops; ++i) {
+            const size_t j = rand_u64() % N_PREFIXES;
+            if (prefixes_v4.present[j] && rand_u64() % 2) {
+                compressed_route_tree_batch_del_v4(&batch, htonl(prefixes_v4.ipv4[j]), prefixes_v4.depth_len[j]);
+                prefixes_v4.present[j] = false;
+            }
+            else {
+                prefixes_v4.next_hop[j] = rand_u64() % N_NEXT_HOPS;
+                compressed_route_tree_batch_add_v4(&batch, htonl(prefixes_v4.ipv4[j]), prefixes_v4.depth_len[j],
+                                                prefixes_v4.next_hop[j]);
+                prefixes_v4.present[j] = true;
+            }
+        }
+        if (compressed_route_tree_batch_commit_v4(pool, head_node_v4, &batch)) {
+            printf("v4 batch commit failed\n");
+            return -1;
+        }
+        n += n_ops;
+    }
+    return 0;
+}
+
+static int update_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6)
+{
+    size_t n = 0;
+    while (n < N_UPDATES) {
+        const size_t k = rand_u64() % N_PREFIXES;
+        const uint8_t *be_ipv6 = prefixes_v6.ipv6[k];
+        const uint8_t depth_len = prefixes_v6.depth_len[k];
+        const uint32_t r = rand_u64() % 16;
+        if (r < 14) {
+            int ret;
+            if (prefixes_v6.present[k] && r < 7) {
+                ret = compressed_route_tree_del_v6(pool, head_node_v6, be_ipv6, depth_len);
+                prefixes_v6.present[k] = false;
+            }
+            else {
+                prefixes_v6.next_hop[k] = rand_u64() % N_NEXT_HOPS;
+                ret = compressed_route_tree_add_v6(pool, head_node_v6, be_ipv6, depth_len, prefixes_v6.next_hop[k]);
+                prefixes_v6.present[k] = true;
+            }
+            if (ret) {
+                printf("v6 update of prefix %zu/%u failed\n", k, depth_len);
+                return -1;
+            }
+            n++;
+            continue;
+        }
+
+        RouteTreeBatch batch;
+        compressed_route_tree_batch_begin(&batch, batch_mem, BATCH_OPS);
+        const size_t n_ops = 1 + rand_u64() % BATCH_OPS;
+        size_t i;
+        for (i = 0; i < n_ops; ++i) {
+            const size_t j = rand_u64() % N_PREFIXES;
+            if (prefixes_v6.present[j] && rand_u64() % 2) {
+                compressed_route_tree_batch_del_v6(&batch, prefixes_v6.ipv6[j], prefixes_v6.depth_len[j]);
+                prefixes_v6.present[j] = false;
+            }
+            else {
+                prefixes_v6.next_hop[j] = rand_u64() % N_NEXT_HOPS;
+                compressed_route_tree_batch_add_v6(&batch, prefixes_v6.ipv6[j], prefixes_v6.depth_len[j],
+                                                prefixes_v6.next_hop[j]);
+                prefixes_v6.present[j] = true;
+            }
+        }
+        if (compressed_route_tree_batch_commit_v6(pool, head_node_v6, &batch)) {
+            printf("v6 batch commit failed\n");
+            return -1;
+        }
+        n += n_ops;
+    }
+    return 0;
+}
+
+static int init_pool(RouteTreePool *pool)
+{
+    return compressed_route_tree_init_nodes(pool, nodes_v4_mem, MAX_POOL_ROUTES, nodes_v6_mem, MAX_POOL_ROUTES);
+}
+
+// table with every other prefix
+static int fill_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4)
+{
+    compressed_route_tree_reset_head(head_node_v4);
+
+    size_t k;
+    for (k = 0; k < N_PREFIXES; ++k) {
+        prefixes_v4.present[k] = k % 2;
+        prefixes_v4.next_hop[k] = rand_u64() % N_NEXT_HOPS;
+        if (prefixes_v4.present[k]
+            && compressed_route_tree_add_v4(pool, head_node_v4, htonl(prefixes_v4.ipv4[k]),
+                                        prefixes_v4.depth_len[k], prefixes_v4.next_hop[k])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int fill_v6(RouteTreePool *pool, RouteTreeHeadNode *head_node_v6)
+{
+    compressed_route_tree_reset_head(head_node_v6);
+
+    size_t k;
+    for (k = 0; k < N_PREFIXES; ++k) {
+        prefixes_v6.present[k] = k % 2;
+        prefixes_v6.next_hop[k] = rand_u64() % N_NEXT_HOPS;
+        if (prefixes_v6.present[k]
+            && compressed_route_tree_add_v6(pool, head_node_v6, prefixes_v6.ipv6[k],
+                                        prefixes_v6.depth_len[k], prefixes_v6.next_hop[k])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Build the engine, compare it after the build and after every round of
+ * updates, then release it and reset the table, which must give every node
+ * back to the pool.
+ */
+static int check_engine_v4(enum CheckEngine engine)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    RouteTreeFlowCache cache;
+    if (init_pool(&pool) || fill_v4(&pool, &head_node_v4)
+        || compressed_route_tree_flow_cache_init(&cache, cache_mem, FLOW_CACHE_SETS, FLOW_CACHE_SETS)
+        || build_engine_v4(engine, &pool, &head_node_v4)) {
+        printf("v4 %s: build failed\n", check_engine_name[engine]);
+        return -1;
+    }
+
+    uint32_t round;
+    for (round = 0; round <= N_ROUNDS; ++round) {
+        if (round && update_v4(&pool, &head_node_v4)) {
+            return -1;
+        }
+        compressed_route_tree_rcu_reclaim(&pool, &head_node_v4);
+        if (!engine_attached(engine, &head_node_v4)) {
+            printf("v4 %s: dropped in round %u\n", check_engine_name[engine], round);
+            return -1;
+        }
+        if (check_lookups_v4(engine, &pool, &head_node_v4, &cache)) {
+            return -1;
+        }
+    }
+
+    // iterate with reset releases the aggregated copy itself
+    if (CHECK_AGGREGATE != engine) {
+        release_engine_v4(engine, &pool, &head_node_v4);
+    }
+    compressed_route_tree_iterate_v4(&pool, &head_node_v4, false, true);
+    compressed_route_tree_rcu_reclaim(&pool, &head_node_v4);
+    if (compressed_route_tree_pool_count_v4(&pool)) {
+        printf("v4 %s: %zu nodes left after reset\n", check_engine_name[engine], compressed_route_tree_pool_count_v4(&pool));
+        return -1;
+    }
+    printf("v4 %s ok\n", check_engine_name[engine]);
+    return 0;
+}
+
+static int check_engine_v6(enum CheckEngine engine)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v6;
+    RouteTreeFlowCache cache;
+    if (init_pool(&pool) || fill_v6(&pool, &head_node_v6)
+        || compressed_route_tree_flow_cache_init(&cache, cache_mem, FLOW_CACHE_SETS, FLOW_CACHE_SETS)
+        || build_engine_v6(engine, &pool, &head_node_v6)) {
+        printf("v6 %s: build failed\n", check_engine_name[engine]);
+        return -1;
+    }
+
+    uint32_t round;
+    for (round = 0; round <= N_ROUNDS; ++round) {
+        if (round && update_v6(&pool, &head_node_v6)) {
+            return -1;
+        }
+        compressed_route_tree_rcu_reclaim(&pool, &head_node_v6);
+        if (!engine_attached(engine, &head_node_v6)) {
+            printf("v6 %s: dropped in round %u\n", check_engine_name[engine], round);
+            return -1;
+        }
+        if (check_lookups_v6(engine, &pool, &head_node_v6, &cache)) {
+            return -1;
+        }
+    }
+
+    // iterate with reset releases the aggregated copy itself
+    if (CHECK_AGGREGATE != engine) {
+        release_engine_v6(engine, &pool, &head_node_v6);
+    }
+    compressed_route_tree_iterate_v6(&pool, &head_node_v6, false, true);
+    compressed_route_tree_rcu_reclaim(&pool, &head_node_v6);
+    if (compressed_route_tree_pool_count_v6(&pool)) {
+        printf("v6 %s: %zu nodes left after reset\n", check_engine_name[engine], compressed_route_tree_pool_count_v6(&pool));
+        return -1;
+    }
+    printf("v6 %s ok\n", check_engine_name[engine]);
+    return 0;
+}
+
+/*
+ * Every engine of the family built on one head, so each update goes through
+ * all their hooks in turn. lookup_v4/v6 walk the first copy they find, the
+ * LC-trie or the length search one, so after the updates the engines are
+ * released one by one and the lookups compared again after each, as the
+ * next copy takes over.
+ */
+static int check_all_engines_v4(void)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    RouteTreeFlowCache cache;
+    size_t i;
+    if (init_pool(&pool) || fill_v4(&pool, &head_node_v4)
+        || compressed_route_tree_flow_cache_init(&cache, cache_mem, FLOW_CACHE_SETS, FLOW_CACHE_SETS)) {
+        return -1;
+    }
+    for (i = 0; i < sizeof(check_engines_v4) / sizeof(check_engines_v4[0]); ++i) {
+        if (build_engine_v4(check_engines_v4[i], &pool, &head_node_v4)) {
+            printf("v4 all engines: %s build failed\n", check_engine_name[check_engines_v4[i]]);
+            return -1;
+        }
+    }
+
+    uint32_t round;
+    for (round = 0; round <= N_ROUNDS; ++round) {
+        if (round && update_v4(&pool, &head_node_v4)) {
+            return -1;
+        }
+        compressed_route_tree_rcu_reclaim(&pool, &head_node_v4);
+        for (i = 0; i < sizeof(check_engines_v4) / sizeof(check_engines_v4[0]); ++i) {
+            const enum CheckEngine engine = check_engines_v4[i];
+            if (!engine_attached(engine, &head_node_v4)) {
+                printf("v4 all engines: %s dropped in round %u\n", check_engine_name[engine], round);
+                return -1;
+            }
+            if (check_lookups_v4(engine, &pool, &head_node_v4, &cache)) {
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < sizeof(check_engines_v4) / sizeof(check_engines_v4[0]); ++i) {
+        if (CHECK_AGGREGATE != check_engines_v4[i]) {
+            release_engine_v4(check_engines_v4[i], &pool, &head_node_v4);
+            if (check_lookups_v4(CHECK_TREE, &pool, &head_node_v4, &cache)) {
+                return -1;
+            }
+        }
+    }
+    compressed_route_tree_iterate_v4(&pool, &head_node_v4, false, true);
+    compressed_route_tree_rcu_reclaim(&pool, &head_node_v4);
+    if (compressed_route_tree_pool_count_v4(&pool)) {
+        printf("v4 all engines: %zu nodes left after reset\n", compressed_route_tree_pool_count_v4(&pool));
+        return -1;
+    }
+    printf("v4 all engines ok\n");
+    return 0;
+}
+
+static int check_all_engines_v6(void)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v6;
+    RouteTreeFlowCache cache;
+    size_t i;
+    if (init_pool(&pool) || fill_v6(&pool, &head_node_v6)
+        || compressed_route_tree_flow_cache_init(&cache, cache_mem, FLOW_CACHE_SETS, FLOW_CACHE_SETS)) {
+        return -1;
+    }
+    for (i = 0; i < sizeof(check_engines_v6) / sizeof(check_engines_v6[0]); ++i) {
+        if (build_engine_v6(check_engines_v6[i], &pool, &head_node_v6)) {
+            printf("v6 all engines: %s build failed\n", check_engine_name[check_engines_v6[i]]);
+            return -1;
+        }
+    }
+
+    uint32_t round;
+    for (round = 0; round <= N_ROUNDS; ++round) {
+        if (round && update_v6(&pool, &head_node_v6)) {
+            return -1;
+        }
+        compressed_route_tree_rcu_reclaim(&pool, &head_node_v6);
+        for (i = 0; i < sizeof(check_engines_v6) / sizeof(check_engines_v6[0]); ++i) {
+            const enum CheckEngine engine = check_engines_v6[i];
+            if (!engine_attached(engine, &head_node_v6)) {
+                printf("v6 all engines: %s dropped in round %u\n", check_engine_name[engine], round);
+                return -1;
+            }
+            if (check_lookups_v6(engine, &pool, &head_node_v6, &cache)) {
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < sizeof(check_engines_v6) / sizeof(check_engines_v6[0]); ++i) {
+        if (CHECK_AGGREGATE != check_engines_v6[i]) {
+            release_engine_v6(check_engines_v6[i], &pool, &head_node_v6);
+            if (check_lookups_v6(CHECK_TREE, &pool, &head_node_v6, &cache)) {
+                return -1;
+            }
+        }
+    }
+    compressed_route_tree_iterate_v6(&pool, &head_node_v6, false, true);
+    compressed_route_tree_rcu_reclaim(&pool, &head_node_v6);
+    if (compressed_route_tree_pool_count_v6(&pool)) {
+        printf("v6 all engines: %zu nodes left after reset\n", compressed_route_tree_pool_count_v6(&pool));
+        return -1;
+    }
+    printf("v6 all engines ok\n");
+    return 0;
+}
+
+// lookup_v4_fast on a head without its table, never built or released, finds no route
+static int check_fast_release(void)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    uint32_t next_hop;
+    if (init_pool(&pool) || fill_v4(&pool, &head_node_v4)) {
+        return -1;
+    }
+
+    // fill_v4 added the odd prefixes
+    const uint32_t be_ipv4 = htonl(prefixes_v4.ipv4[1]);
+    const int before = compressed_route_tree_lookup_v4_fast(&head_node_v4, be_ipv4, &next_hop);
+    if (build_engine_v4(CHECK_FAST, &pool, &head_node_v4)) {
+        return -1;
+    }
+    const int built = compressed_route_tree_lookup_v4_fast(&head_node_v4, be_ipv4, &next_hop);
+    release_engine_v4(CHECK_FAST, &pool, &head_node_v4);
+    const int released = compressed_route_tree_lookup_v4_fast(&head_node_v4, be_ipv4, &next_hop);
+    if (0 == before || built || 0 == released) {
+        printf("v4 dir_24_8 release: lookups %d before the build, %d built, %d released\n", before, built, released);
+        return -1;
+    }
+    printf("v4 dir_24_8 release ok\n");
+    return 0;
+}
+
+// lookup_ext of two heads, e.g. a table and its bulk loaded or restored copy
+static int compare_heads_v4(const char *name, const RouteTreePool *pool_a, const RouteTreeHeadNode *head_a,
+                            const RouteTreePool *pool_b, const RouteTreeHeadNode *head_b)
+{
+    if (head_a->total_routes != head_b->total_routes) {
+        printf("v4 %s: %zu routes, %zu in the copy\n", name, head_a->total_routes, head_b->total_routes);
+        return -1;
+    }
+    size_t n;
+    for (n = 0; n < N_LOOKUPS; ++n) {
+        const uint32_t be_ipv4 = htonl(rand_ipv4(&prefixes_v4));
+        RouteTreeLookupResult a;
+        RouteTreeLookupResult b;
+        const int ret_a = compressed_route_tree_lookup_ext_v4(pool_a, head_a, be_ipv4, &a);
+        const int ret_b = compressed_route_tree_lookup_ext_v4(pool_b, head_b, be_ipv4, &b);
+        if (ret_a != ret_b || (0 == ret_a && (a.next_hop != b.next_hop || a.depth_len != b.depth_len))) {
+            printf("v4 %s: %08x table %d/%u, copy %d/%u\n", name, ntohl(be_ipv4),
+                    ret_a, ret_a ? 0 : a.next_hop, ret_b, ret_b ? 0 : b.next_hop);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compare_heads_v6(const char *name, const RouteTreePool *pool_a, const RouteTreeHeadNode *head_a,
+                            const RouteTreePool *pool_b, const RouteTreeHeadNode *head_b)
+{
+    if (head_a->total_routes != head_b->total_routes) {
+        printf("v6 %s: %zu routes, %zu in the copy\n", name, head_a->total_routes, head_b->total_routes);
+        return -1;
+    }
+    size_t n;
+    for (n = 0; n < N_LOOKUPS; ++n) {
+        uint8_t be_ipv6[16];
+        rand_ipv6(&prefixes_v6, be_ipv6);
+        RouteTreeLookupResult a;
+        RouteTreeLookupResult b;
+        const int ret_a = compressed_route_tree_lookup_ext_v6(pool_a, head_a, be_ipv6, &a);
+        const int ret_b = compressed_route_tree_lookup_ext_v6(pool_b, head_b, be_ipv6, &b);
+        if (ret_a != ret_b || (0 == ret_a && (a.next_hop != b.next_hop || a.depth_len != b.depth_len))) {
+            char text[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, be_ipv6, text, sizeof(text));
+            printf("v6 %s: %s table %d/%u, copy %d/%u\n", name, text,
+                    ret_a, ret_a ? 0 : a.next_hop, ret_b, ret_b ? 0 : b.next_hop);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the routes of a churned table loaded at once into a second head of the pool
+static int check_bulk_load(void)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    RouteTreeHeadNode head_node_v6;
+    RouteTreeHeadNode loaded_v4;
+    RouteTreeHeadNode loaded_v6;
+    static RouteTreeRouteV4 routes_v4[N_PREFIXES];
+    static RouteTreeRouteV6 routes_v6[N_PREFIXES];
+
+    if (init_pool(&pool)
+        || fill_v4(&pool, &head_node_v4) || update_v4(&pool, &head_node_v4)
+        || fill_v6(&pool, &head_node_v6) || update_v6(&pool, &head_node_v6)) {
+        return -1;
+    }
+
+    size_t n_v4 = 0;
+    size_t n_v6 = 0;
+    size_t k;
+    for (k = 0; k < N_PREFIXES; ++k) {
+        if (prefixes_v4.present[k]) {
+            routes_v4[n_v4].be_ipv4 = htonl(prefixes_v4.ipv4[k]);
+            routes_v4[n_v4].depth_len = prefixes_v4.depth_len[k];
+            routes_v4[n_v4].next_hop = prefixes_v4.next_hop[k];
+            n_v4++;
+        }
+        if (prefixes_v6.present[k]) {
+            memcpy(routes_v6[n_v6].be_ipv6, prefixes_v6.ipv6[k], 16);
+            routes_v6[n_v6].depth_len = prefixes_v6.depth_len[k];
+            routes_v6[n_v6].next_hop = prefixes_v6.next_hop[k];
+            n_v6++;
+        }
+    }
+
+    compressed_route_tree_reset_head(&loaded_v4);
+    compressed_route_tree_reset_head(&loaded_v6);
+    if (compressed_route_tree_bulk_load_v4(&pool, &loaded_v4, routes_v4, n_v4)
+        || compressed_route_tree_bulk_load_v6(&pool, &loaded_v6, routes_v6, n_v6)) {
+        printf("bulk_load failed\n");
+        return -1;
+    }
+    if (compare_heads_v4("bulk_load", &pool, &head_node_v4, &pool, &loaded_v4)
+        || compare_heads_v6("bulk_load", &pool, &head_node_v6, &pool, &loaded_v6)) {
+        return -1;
+    }
+    printf("bulk_load ok\n");
+    return 0;
+}
+
+// a churned pool saved and mapped back into a second one
+static int check_snapshot(void)
+{
+    RouteTreePool pool;
+    RouteTreePool restored;
+    RouteTreeHeadNode heads[2];
+    RouteTreeHeadNode restored_heads[2];
+
+    if (init_pool(&pool)
+        || fill_v4(&pool, &heads[0]) || update_v4(&pool, &heads[0])
+        || fill_v6(&pool, &heads[1]) || update_v6(&pool, &heads[1])) {
+        return -1;
+    }
+
+    char path[] = "/tmp/route_tree_check.XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("snapshot: no temporary file\n");
+        return -1;
+    }
+    close(fd);
+
+    void *snapshot_ptr = NULL;
+    size_t snapshot_size = 0;
+    int ret = -1;
+    if (compressed_route_tree_save(&pool, &heads[0], 1, &heads[1], 1, path)
+        || compressed_route_tree_load_mmap(&restored, &restored_heads[0], 1, &restored_heads[1], 1, path,
+                                        &snapshot_ptr, &snapshot_size)) {
+        printf("snapshot: save or load failed\n");
+    }
+    else if (0 == compare_heads_v4("snapshot", &pool, &heads[0], &restored, &restored_heads[0])
+        && 0 == compare_heads_v6("snapshot", &pool, &heads[1], &restored, &restored_heads[1])) {
+        printf("snapshot ok\n");
+        ret = 0;
+    }
+    if (snapshot_ptr) {
+        munmap(snapshot_ptr, snapshot_size);
+    }
+    unlink(path);
+    return ret;
+}
+
+/*
+ * A route of a new length and its removal swap in new length searches
+ * while a reader is held on the old ones; neither waits for it, and the
+ * markers of the old searches go once it is quiescent.
+ */
+static int check_bsl_reader(void)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v6;
+    if (init_pool(&pool) || fill_v6(&pool, &head_node_v6) || build_engine_v6(CHECK_BSL, &pool, &head_node_v6)) {
+        return -1;
+    }
+
+    // a prefix of a length holding no route
+    size_t k;
+    for (k = 1; k < N_PREFIXES; ++k) {
+        size_t j;
+        for (j = 1; j < N_PREFIXES; ++j) {
+            if (prefixes_v6.present[j] && prefixes_v6.depth_len[j] == prefixes_v6.depth_len[k]) {
+                break;
+            }
+        }
+        if (N_PREFIXES == j) {
+            break;
+        }
+    }
+    if (N_PREFIXES == k) {
+        printf("v6 bsl reader: every length holds a route\n");
+        return -1;
+    }
+
+    const size_t n_slots = compressed_route_tree_bsl_v6_used_slot_count(&head_node_v6);
+    const int reader_id = compressed_route_tree_rcu_reader_register();
+    if (reader_id < 0) {
+        return -1;
+    }
+    int ret = -1;
+    prefixes_v6.present[k] = true;
+    if (compressed_route_tree_add_v6(&pool, &head_node_v6, prefixes_v6.ipv6[k], prefixes_v6.depth_len[k], prefixes_v6.next_hop[k])
+        || check_lookups_v6(CHECK_BSL, &pool, &head_node_v6, NULL)) {
+        goto out;
+    }
+    prefixes_v6.present[k] = false;
+    if (compressed_route_tree_del_v6(&pool, &head_node_v6, prefixes_v6.ipv6[k], prefixes_v6.depth_len[k])
+        || check_lookups_v6(CHECK_BSL, &pool, &head_node_v6, NULL)) {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    compressed_route_tree_rcu_quiescent(reader_id);
+    compressed_route_tree_rcu_reader_unregister(reader_id);
+    if (ret) {
+        return -1;
+    }
+    compressed_route_tree_rcu_reclaim(&pool, &head_node_v6);
+    if (!engine_attached(CHECK_BSL, &head_node_v6)
+        || compressed_route_tree_bsl_v6_used_slot_count(&head_node_v6) != n_slots) {
+        printf("v6 bsl reader: %zu slots used, %zu before\n",
+                compressed_route_tree_bsl_v6_used_slot_count(&head_node_v6), n_slots);
+        return -1;
+    }
+    printf("v6 bsl reader ok\n");
+    return 0;
+}
+
+/*
+ * Free slots of the LC-trie copy after each replace of a route, by add or
+ * by a batch of one op. Both leave the route count as it is, so the copy
+ * goes through the same rebuilds.
+ */
+#define CHECK_LC_REPLACES N_PREFIXES
+
+static int lc_replace_trace(bool batched, size_t *n_free)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    if (init_pool(&pool) || fill_v4(&pool, &head_node_v4) || build_engine_v4(CHECK_LC, &pool, &head_node_v4)) {
+        return -1;
+    }
+
+    uint64_t state = 1;
+    size_t i;
+    for (i = 0; i < CHECK_LC_REPLACES; ++i) {
+        // fill_v4 added the odd prefixes
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        const size_t k = 2 * (state >> 33) % N_PREFIXES + 1;
+        const uint32_t be_ipv4 = htonl(prefixes_v4.ipv4[k]);
+        int ret;
+        if (batched) {
+            RouteTreeBatch batch;
+            compressed_route_tree_batch_begin(&batch, batch_mem, BATCH_OPS);
+            compressed_route_tree_batch_add_v4(&batch, be_ipv4, prefixes_v4.depth_len[k], prefixes_v4.next_hop[k]);
+            ret = compressed_route_tree_batch_commit_v4(&pool, &head_node_v4, &batch);
+        }
+        else {
+            ret = compressed_route_tree_add_v4(&pool, &head_node_v4, be_ipv4, prefixes_v4.depth_len[k], prefixes_v4.next_hop[k]);
+        }
+        if (ret) {
+            printf("v4 lc replace of %08x/%u failed\n", prefixes_v4.ipv4[k], prefixes_v4.depth_len[k]);
+            return -1;
+        }
+        n_free[i] = compressed_route_tree_lc_v4_free_slot_count(&head_node_v4);
+    }
+
+    const int ret = check_lookups_v4(CHECK_LC, &pool, &head_node_v4, NULL);
+    release_engine_v4(CHECK_LC, &pool, &head_node_v4);
+    return ret;
+}
+
+static int check_lc_replace(void)
+{
+    static size_t n_free_add[CHECK_LC_REPLACES];
+    static size_t n_free_batch[CHECK_LC_REPLACES];
+    if (lc_replace_trace(false, n_free_add) || lc_replace_trace(true, n_free_batch)) {
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < CHECK_LC_REPLACES; ++i) {
+        if (n_free_add[i] != n_free_batch[i]) {
+            printf("v4 lc replace %zu: %zu free slots by batch, %zu by add\n", i, n_free_batch[i], n_free_add[i]);
+            return -1;
+        }
+    }
+    printf("v4 lc replace ok\n");
+    return 0;
+}
+
+/*
+ * A growable pool adds slabs as host routes come in and gives them back
+ * once they are gone, twice over; the routes are looked up after each
+ * growth.
+ */
+#define CHECK_GROW_ROUTES (ROUTE_TREE_POOL_SLAB_NODES + 4096)
+
+static int check_grow_shrink(void)
+{
+    RouteTreeMem mem;
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    if (compressed_route_tree_mem_alloc(&mem, compressed_route_tree_get_memory_footprint_growable(2 * CHECK_GROW_ROUTES, 0),
+                                    ROUTE_TREE_MEM_ANY_NODE, ROUTE_TREE_MEM_RESERVE)) {
+        return -1;
+    }
+    int ret = -1;
+    if (compressed_route_tree_init_nodes_growable(&pool, mem.ptr, 2 * CHECK_GROW_ROUTES, 0)) {
+        goto out;
+    }
+    compressed_route_tree_reset_head(&head_node_v4);
+
+    uint32_t pass;
+    for (pass = 0; pass < 2; ++pass) {
+        // an odd multiplier keeps the addresses apart
+        size_t i;
+        for (i = 0; i < CHECK_GROW_ROUTES; ++i) {
+            if (compressed_route_tree_add_v4(&pool, &head_node_v4, htonl((uint32_t)i * 2654435761U), 32, i % N_NEXT_HOPS)) {
+                printf("grow: add %zu failed with %zu nodes\n", i, pool.v4_nodes_pool_total);
+                goto out;
+            }
+        }
+        if (pool.v4_nodes_pool_total <= ROUTE_TREE_POOL_SLAB_NODES) {
+            printf("grow: still %zu nodes after the adds\n", pool.v4_nodes_pool_total);
+            goto out;
+        }
+        for (i = 0; i < CHECK_GROW_ROUTES; ++i) {
+            uint32_t next_hop;
+            if (compressed_route_tree_lookup_v4(&pool, &head_node_v4, htonl((uint32_t)i * 2654435761U), &next_hop)
+                || next_hop != i % N_NEXT_HOPS) {
+                printf("grow: route %zu lost\n", i);
+                goto out;
+            }
+        }
+
+        for (i = 0; i < CHECK_GROW_ROUTES; ++i) {
+            compressed_route_tree_del_v4(&pool, &head_node_v4, htonl((uint32_t)i * 2654435761U), 32);
+        }
+        // the last nodes freed go through the limbo lists, no reader holds them
+        compressed_route_tree_rcu_reclaim(&pool, &head_node_v4);
+        compressed_route_tree_rcu_reclaim(&pool, &head_node_v4);
+        const size_t total = pool.v4_nodes_pool_total;
+        if (compressed_route_tree_pool_shrink_v4(&pool) != total - ROUTE_TREE_POOL_SLAB_NODES
+            || compressed_route_tree_pool_count_v4(&pool)) {
+            printf("shrink: %zu nodes of %zu left, %zu in use\n", pool.v4_nodes_pool_total, total,
+                    compressed_route_tree_pool_count_v4(&pool));
+            goto out;
+        }
+    }
+    printf("grow shrink ok\n");
+    ret = 0;
+
+out:
+    compressed_route_tree_mem_free(&mem);
+    return ret;
+}
+
+/*
+ * Destroying a VRF frees its routes and detaches its DIR-24-8 table while
+ * another VRF of the pool goes on as before; the id can be created again.
+ */
+static int check_vrf_destroy(void)
+{
+    RouteTreePool pool;
+    RouteTreeVrfTable table;
+    RouteTreeHeadNode head_node_v4;
+    void *vrfs_mem = malloc(compressed_route_tree_vrf_get_memory_footprint(4));
+    if (NULL == vrfs_mem || init_pool(&pool) || compressed_route_tree_vrf_init(&table, &pool, vrfs_mem, 4)
+        || compressed_route_tree_vrf_create(&table, 1) || compressed_route_tree_vrf_create(&table, 2)) {
+        free(vrfs_mem);
+        return -1;
+    }
+
+    // the table under test in VRF 2, the other prefixes in VRF 1
+    int ret = -1;
+    size_t k;
+    if (fill_v4(&pool, &head_node_v4)) {
+        goto out;
+    }
+    for (k = 1; k < N_PREFIXES; ++k) {
+        const uint32_t vrf_id = prefixes_v4.present[k] ? 2 : 1;
+        if (compressed_route_tree_vrf_add_v4(&table, vrf_id, htonl(prefixes_v4.ipv4[k]), prefixes_v4.depth_len[k],
+                                            prefixes_v4.next_hop[k])) {
+            goto out;
+        }
+    }
+    if (compressed_route_tree_build_v4_fast(&pool, compressed_route_tree_vrf_head_v4(&table, 1), engine_mem[CHECK_FAST], N_PREFIXES)
+        || compressed_route_tree_vrf_destroy(&table, 1)) {
+        goto out;
+    }
+
+    RouteTreeHeadNode *vrf_head_v4 = compressed_route_tree_vrf_head_v4(&table, 2);
+    compressed_route_tree_rcu_reclaim(&pool, vrf_head_v4);
+    compressed_route_tree_rcu_reclaim(&pool, vrf_head_v4);
+    if (compressed_route_tree_pool_count_v4(&pool) != head_node_v4.total_nodes + vrf_head_v4->total_nodes) {
+        printf("vrf destroy: %zu nodes in use, %zu in the tables left\n", compressed_route_tree_pool_count_v4(&pool),
+                head_node_v4.total_nodes + vrf_head_v4->total_nodes);
+        goto out;
+    }
+    for (k = 0; k < N_LOOKUPS; ++k) {
+        const uint32_t be_ipv4 = htonl(rand_ipv4(&prefixes_v4));
+        uint32_t next_hop;
+        uint32_t vrf_next_hop;
+        const bool hit = 0 == compressed_route_tree_lookup_v4(&pool, &head_node_v4, be_ipv4, &next_hop);
+        const bool vrf_hit = 0 == compressed_route_tree_vrf_lookup_v4(&table, 2, be_ipv4, &vrf_next_hop);
+        if (hit != vrf_hit || (hit && next_hop != vrf_next_hop)
+            || 0 == compressed_route_tree_vrf_lookup_v4(&table, 1, be_ipv4, &next_hop)) {
+            printf("vrf destroy: %08x differs\n", ntohl(be_ipv4));
+            goto out;
+        }
+    }
+    if (compressed_route_tree_vrf_create(&table, 1) || compressed_route_tree_vrf_head_v4(&table, 1)->fast_v4) {
+        printf("vrf destroy: VRF 1 not created again empty\n");
+        goto out;
+    }
+    printf("vrf destroy ok\n");
+    ret = 0;
+
+out:
+    free(vrfs_mem);
+    return ret;
+}
+
+/*
+ * The cursor returns the routes of the table once each and in prefix
+ * order, a chunk at a time, also while updates change the table between
+ * the chunks.
+ */
+static int cursor_walk_v4(RouteTreePool *pool, RouteTreeHeadNode *head_node_v4, bool update, size_t *n_routes)
+{
+    RouteTreeCursorV4 cursor;
+    RouteTreeRouteV4 routes[CHECK_BURST];
+    uint64_t last = 0;
+    size_t n;
+
+    compressed_route_tree_cursor_init_v4(&cursor, pool, head_node_v4);
+    *n_routes = 0;
+    while ((n = compressed_route_tree_cursor_next_bulk_v4(&cursor, routes, CHECK_BURST)) > 0) {
+        size_t i;
+        for (i = 0; i < n; ++i) {
+            // prefix, then length: a cover comes before the routes it covers
+            const uint64_t key = (uint64_t)ntohl(routes[i].be_ipv4) << 8 | routes[i].depth_len;
+            if (*n_routes && key <= last) {
+                printf("v4 cursor: %08x/%u out of order\n", ntohl(routes[i].be_ipv4), routes[i].depth_len);
+                return -1;
+            }
+            last = key;
+            (*n_routes)++;
+
+            size_t k;
+            for (k = 0; !update && k < N_PREFIXES; ++k) {
+                if (prefixes_v4.present[k] && prefixes_v4.ipv4[k] == ntohl(routes[i].be_ipv4)
+                    && prefixes_v4.depth_len[k] == routes[i].depth_len) {
+                    break;
+                }
+            }
+            if (!update && (N_PREFIXES == k || prefixes_v4.next_hop[k] != routes[i].next_hop)) {
+                printf("v4 cursor: %08x/%u not in the table\n", ntohl(routes[i].be_ipv4), routes[i].depth_len);
+                return -1;
+            }
+        }
+        if (update && update_v4(pool, head_node_v4)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int check_cursor(void)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    size_t n_routes;
+    if (init_pool(&pool) || fill_v4(&pool, &head_node_v4)
+        || cursor_walk_v4(&pool, &head_node_v4, false, &n_routes)) {
+        return -1;
+    }
+    if (n_routes != head_node_v4.total_routes) {
+        printf("v4 cursor: %zu routes of %zu\n", n_routes, head_node_v4.total_routes);
+        return -1;
+    }
+    if (cursor_walk_v4(&pool, &head_node_v4, true, &n_routes)) {
+        return -1;
+    }
+    printf("v4 cursor ok\n");
+    return 0;
+}
+
+/*
+ * Two replicas of a table follow replicated add/del and look up the same
+ * next hops as the primary head.
+ */
+#define CHECK_REPLICAS 2
+
+static int check_replicated(void)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    RouteTreeReplicated replicated;
+    const int numa_nodes[CHECK_REPLICAS] = { ROUTE_TREE_MEM_ANY_NODE, ROUTE_TREE_MEM_ANY_NODE };
+    if (init_pool(&pool) || fill_v4(&pool, &head_node_v4)
+        || compressed_route_tree_replicated_init(&replicated, &pool, &head_node_v4, NULL, numa_nodes, CHECK_REPLICAS, 0)) {
+        return -1;
+    }
+
+    int ret = -1;
+    size_t n;
+    for (n = 0; n < N_UPDATES; ++n) {
+        const size_t k = 1 + rand_u64() % (N_PREFIXES - 1);
+        const uint32_t be_ipv4 = htonl(prefixes_v4.ipv4[k]);
+        int update_ret;
+        if (prefixes_v4.present[k] && rand_u64() % 2) {
+            update_ret = compressed_route_tree_replicated_del_v4(&replicated, be_ipv4, prefixes_v4.depth_len[k]);
+            prefixes_v4.present[k] = false;
+        }
+        else {
+            prefixes_v4.next_hop[k] = rand_u64() % N_NEXT_HOPS;
+            update_ret = compressed_route_tree_replicated_add_v4(&replicated, be_ipv4, prefixes_v4.depth_len[k],
+                                                            prefixes_v4.next_hop[k]);
+            prefixes_v4.present[k] = true;
+        }
+        if (update_ret) {
+            printf("replicated: update of %08x/%u failed\n", prefixes_v4.ipv4[k], prefixes_v4.depth_len[k]);
+            goto out;
+        }
+    }
+
+    for (n = 0; n < N_LOOKUPS; ++n) {
+        const uint32_t be_ipv4 = htonl(rand_ipv4(&prefixes_v4));
+        RouteTreeLookupResult result;
+        const bool hit = 0 == compressed_route_tree_lookup_ext_v4(&pool, &head_node_v4, be_ipv4, &result);
+        int replica_id;
+        for (replica_id = 0; replica_id < CHECK_REPLICAS; ++replica_id) {
+            uint32_t next_hop;
+            const bool replica_hit = 0 == compressed_route_tree_replicated_lookup_v4(&replicated, replica_id, be_ipv4, &next_hop);
+            if (!replicated.replicas[replica_id].attached || hit != replica_hit || (hit && result.next_hop != next_hop)) {
+                printf("replicated: %08x primary %d/%u, replica %d %d/%u\n", ntohl(be_ipv4), hit, hit ? result.next_hop : 0,
+                        replica_id, replica_hit, replica_hit ? next_hop : 0);
+                goto out;
+            }
+        }
+    }
+    printf("replicated ok\n");
+    ret = 0;
+
+out:
+    compressed_route_tree_replicated_release(&replicated);
+    return ret;
+}
+
+// a pool with node memory for one family only, the other given NULL
+static int check_single_family(void)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    RouteTreeHeadNode head_node_v6;
+    uint32_t next_hop;
+
+    compressed_route_tree_reset_head(&head_node_v4);
+    compressed_route_tree_reset_head(&head_node_v6);
+    if (compressed_route_tree_init_nodes(&pool, nodes_v4_mem, MAX_POOL_ROUTES, NULL, 0)
+        || fill_v4(&pool, &head_node_v4)
+        || 0 == compressed_route_tree_add_v6(&pool, &head_node_v6, prefixes_v6.ipv6[1], prefixes_v6.depth_len[1], 1)
+        || 0 == compressed_route_tree_lookup_v6(&pool, &head_node_v6, prefixes_v6.ipv6[1], &next_hop)
+        || compressed_route_tree_pool_count_v6(&pool)) {
+        printf("single family: v6 without nodes\n");
+        return -1;
+    }
+
+    compressed_route_tree_reset_head(&head_node_v4);
+    if (compressed_route_tree_init_nodes(&pool, NULL, 0, nodes_v6_mem, MAX_POOL_ROUTES)
+        || fill_v6(&pool, &head_node_v6)
+        || 0 == compressed_route_tree_add_v4(&pool, &head_node_v4, htonl(prefixes_v4.ipv4[1]), prefixes_v4.depth_len[1], 1)
+        || 0 == compressed_route_tree_lookup_v4(&pool, &head_node_v4, htonl(prefixes_v4.ipv4[1]), &next_hop)
+        || compressed_route_tree_pool_count_v4(&pool)) {
+        printf("single family: v4 without nodes\n");
+        return -1;
+    }
+    printf("single family ok\n");
+    return 0;
+}
+
+/*
+ * Routes holding groups resolve to a member of the group lookup_ext finds,
+ * the same one for the same flow hash, through set_members and after them.
+ */
+#define CHECK_NHG_GROUPS 16
+
+static int check_nhg_lookups(const RouteTreeNhgTable *table, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4)
+{
+    size_t n;
+    for (n = 0; n < N_LOOKUPS; ++n) {
+        const uint32_t be_ipv4 = htonl(rand_ipv4(&prefixes_v4));
+        const uint32_t flow_hash = (uint32_t)rand_u64();
+        RouteTreeLookupResult result;
+        uint32_t next_hop;
+        uint32_t again;
+        const bool hit = 0 == compressed_route_tree_lookup_ext_v4(pool, head_node_v4, be_ipv4, &result);
+        const bool nhg_hit = 0 == compressed_route_tree_nhg_lookup_v4(table, pool, head_node_v4, be_ipv4, flow_hash, &next_hop);
+
+        uint32_t members[ROUTE_TREE_NHG_MAX_MEMBERS];
+        size_t n_members = 0;
+        if (hit) {
+            compressed_route_tree_nhg_get_members(table, result.next_hop, members, &n_members);
+        }
+        bool member = false;
+        size_t i;
+        for (i = 0; i < n_members; ++i) {
+            member |= members[i] == next_hop;
+        }
+        if (nhg_hit != (n_members > 0) || (nhg_hit && !member)
+            || (nhg_hit && (compressed_route_tree_nhg_resolve(table, result.next_hop, flow_hash, &again) || again != next_hop))) {
+            printf("nhg: %08x group %d/%u, %zu members, resolved %d/%u\n", ntohl(be_ipv4),
+                    hit, hit ? result.next_hop : 0, n_members, nhg_hit, nhg_hit ? next_hop : 0);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * A reader on the members of a group across set_members of every group,
+ * its own included, finds them unchanged until it is quiescent. The group
+ * word is decoded as route_tree.h lays it out. set_members may fail while
+ * the reader holds the blocks back.
+ */
+static int check_nhg_reader(RouteTreeNhgTable *table, uint32_t group_id)
+{
+    const int reader_id = compressed_route_tree_rcu_reader_register();
+    if (reader_id < 0) {
+        return -1;
+    }
+
+    const uint64_t word = table->groups[group_id].members;
+    const uint32_t *held = &table->members[word >> 32];
+    const size_t n_held = (uint32_t)word;
+    uint32_t expected[ROUTE_TREE_NHG_MAX_MEMBERS];
+    memcpy(expected, held, sizeof(uint32_t) * n_held);
+
+    int ret = 0;
+    uint32_t round;
+    for (round = 0; round < 16 * CHECK_NHG_GROUPS && 0 == ret; ++round) {
+        uint32_t members[ROUTE_TREE_NHG_MAX_MEMBERS];
+        const size_t n_members = rand_u64() % (ROUTE_TREE_NHG_MAX_MEMBERS + 1);
+        size_t i;
+        for (i = 0; i < n_members; ++i) {
+            members[i] = (uint32_t)rand_u64() % 100000;
+        }
+        compressed_route_tree_nhg_set_members(table, round % CHECK_NHG_GROUPS, members, n_members);
+        if (memcmp(expected, held, sizeof(uint32_t) * n_held)) {
+            printf("nhg: members of group %u changed under a reader in round %u\n", group_id, round);
+            ret = -1;
+        }
+    }
+
+    compressed_route_tree_rcu_quiescent(reader_id);
+    compressed_route_tree_rcu_reader_unregister(reader_id);
+    return ret;
+}
+
+static int check_nhg(void)
+{
+    RouteTreePool pool;
+    RouteTreeHeadNode head_node_v4;
+    RouteTreeNhgTable table;
+    const size_t max_members = CHECK_NHG_GROUPS * ROUTE_TREE_NHG_MAX_MEMBERS * 4;
+    void *nhg_mem = malloc(compressed_route_tree_nhg_get_memory_footprint(CHECK_NHG_GROUPS, max_members));
+    if (NULL == nhg_mem || compressed_route_tree_nhg_init(&table, nhg_mem, CHECK_NHG_GROUPS, max_members)
+        || init_pool(&pool)) {
+        free(nhg_mem);
+        return -1;
+    }
+    compressed_route_tree_reset_head(&head_node_v4);
+
+    int ret = -1;
+    uint32_t members[ROUTE_TREE_NHG_MAX_MEMBERS];
+    uint32_t group_id;
+    for (group_id = 0; group_id < CHECK_NHG_GROUPS; ++group_id) {
+        size_t i;
+        for (i = 0; i < ROUTE_TREE_NHG_MAX_MEMBERS; ++i) {
+            members[i] = group_id * 1000 + i;
+        }
+        if (compressed_route_tree_nhg_create(&table, group_id)
+            || compressed_route_tree_nhg_set_members(&table, group_id, members, group_id % 5)) {
+            goto out;
+        }
+    }
+    size_t k;
+    for (k = 0; k < N_PREFIXES; ++k) {
+        prefixes_v4.present[k] = k % 2;
+        if (prefixes_v4.present[k]
+            && compressed_route_tree_nhg_add_v4(&table, &pool, &head_node_v4, htonl(prefixes_v4.ipv4[k]),
+                                            prefixes_v4.depth_len[k], k % CHECK_NHG_GROUPS)) {
+            goto out;
+        }
+    }
+    if (check_nhg_lookups(&table, &pool, &head_node_v4) || check_nhg_reader(&table, 4)
+        || check_nhg_lookups(&table, &pool, &head_node_v4)) {
+        goto out;
+    }
+
+    uint32_t round;
+    for (round = 0; round < N_ROUNDS * 64; ++round) {
+        const size_t n_members = rand_u64() % (ROUTE_TREE_NHG_MAX_MEMBERS + 1);
+        size_t i;
+        for (i = 0; i < n_members; ++i) {
+            members[i] = (uint32_t)rand_u64() % 100000;
+        }
+        group_id = rand_u64() % CHECK_NHG_GROUPS;
+        int set = compressed_route_tree_nhg_set_members(&table, group_id, members, n_members);
+        if (set) {
+            // the blocks replaced lately may all be waiting for the grace period
+            compressed_route_tree_rcu_synchronize();
+            set = compressed_route_tree_nhg_set_members(&table, group_id, members, n_members);
+        }
+        if (set) {
+            printf("nhg: set_members of group %u failed in round %u\n", group_id, round);
+            goto out;
+        }
+        if (0 == round % 64 && check_nhg_lookups(&table, &pool, &head_node_v4)) {
+            goto out;
+        }
+    }
+    printf("nhg ok\n");
+    ret = 0;
+
+out:
+    free(nhg_mem);
+    return ret;
+}
+
+int main(void)
+{
+    nodes_v4_mem = malloc(compressed_route_tree_get_memory_footprint_v4(MAX_POOL_ROUTES));
+    nodes_v6_mem = malloc(compressed_route_tree_get_memory_footprint_v6(MAX_POOL_ROUTES));
+    cache_mem = malloc(compressed_route_tree_flow_cache_get_memory_footprint(FLOW_CACHE_SETS, FLOW_CACHE_SETS));
+    const size_t batch_size_v4 = compressed_route_tree_batch_get_memory_footprint_v4(BATCH_OPS);
+    const size_t batch_size_v6 = compressed_route_tree_batch_get_memory_footprint_v6(BATCH_OPS);
+    batch_mem = malloc(batch_size_v4 > batch_size_v6 ? batch_size_v4 : batch_size_v6);
+    if (!nodes_v4_mem || !nodes_v6_mem || !cache_mem || !batch_mem) {
+        printf("out of memory\n");
+        return 1;
+    }
+    size_t i;
+    for (i = 0; i < CHECK_ENGINE_MAX; ++i) {
+        const size_t size = engine_get_memory_footprint(i);
+        if (size && NULL == (engine_mem[i] = malloc(size))) {
+            printf("out of memory\n");
+            return 1;
+        }
+    }
+
+    generate_prefixes_v4(&prefixes_v4);
+    generate_prefixes_v6(&prefixes_v6);
+
+    for (i = 0; i < sizeof(check_engines_v4) / sizeof(check_engines_v4[0]); ++i) {
+        if (check_engine_v4(check_engines_v4[i])) {
+            return 1;
+        }
+    }
+    for (i = 0; i < sizeof(check_engines_v6) / sizeof(check_engines_v6[0]); ++i) {
+        if (check_engine_v6(check_engines_v6[i])) {
+            return 1;
+        }
+    }
+    if (check_all_engines_v4() || check_all_engines_v6() || check_fast_release() || check_lc_replace() || check_bsl_reader() || check_bulk_load() || check_snapshot() || check_grow_shrink() || check_vrf_destroy() || check_cursor() || check_replicated() || check_single_family() || check_nhg()) {
+        return 1;
+    }
+
+    free(nodes_v4_mem);
+    free(nodes_v6_mem);
+    for (i = 0; i < CHECK_ENGINE_MAX; ++i) {
+        free(engine_mem[i]);
+    }
+    free(cache_mem);
+    free(batch_mem);
+    return 0;
+}
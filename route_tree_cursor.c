@@ -0,0 +1,498 @@
+#include "route_tree_internal.h"
+#include <arpa/inet.h>
+#include <endian.h>
+
+/*
+ * Route cursor: path[0..depth) are the nodes from the head down to the top
+ * node, depth 0 is the head itself, whose route is the default one. state
+ * tells what is left of the top node:
+ *   AT     its route is still to be returned
+ *   AFTER  its route is done, its children are next
+ *   PAST   its subtree is done, the sibling after it is next
+ * Going down a node ORs its key into prefix, going up masks it back, so
+ * prefix is always the one of the top node.
+ */
+
+enum RouteTreeCursorState {
+    CURSOR_AT,
+    CURSOR_AFTER,
+    CURSOR_PAST,
+};
+
+static inline uint32_t mask_u32(uint8_t depth_len)
+{
+    return depth_len ? ~0U << (32 - depth_len) : 0;
+}
+
+static inline RouteTreeU128 mask_u128(uint8_t depth_len)
+{
+    return depth_len ? ~(RouteTreeU128)0 << (128 - depth_len) : 0;
+}
+
+// a before b in cursor order
+static inline bool cursor_before_v4(uint32_t a, uint8_t a_len, uint32_t b, uint8_t b_len)
+{
+    const uint32_t mask = mask_u32(a_len < b_len ? a_len : b_len);
+    if ((a & mask) != (b & mask)) {
+        return (a & mask) < (b & mask);
+    }
+    return a_len < b_len;
+}
+
+static inline bool cursor_before_v6(RouteTreeU128 a, uint8_t a_len, RouteTreeU128 b, uint8_t b_len)
+{
+    const RouteTreeU128 mask = mask_u128(a_len < b_len ? a_len : b_len);
+    if ((a & mask) != (b & mask)) {
+        return (a & mask) < (b & mask);
+    }
+    return a_len < b_len;
+}
+
+static inline uint8_t cursor_end_v4(const RouteTreeCursorV4 *cursor, uint32_t depth)
+{
+    return depth ? cursor->end[depth - 1] : 0;
+}
+
+static inline uint8_t cursor_end_v6(const RouteTreeCursorV6 *cursor, uint32_t depth)
+{
+    return depth ? cursor->end[depth - 1] : 0;
+}
+
+static inline void cursor_children_v4(const RouteTreeCursorV4 *cursor, uint32_t depth, uint32_t *next_bit_0, uint32_t *next_bit_1)
+{
+    if (0 == depth) {
+        // both roots at once, a batch commit swaps them together
+        RouteTreeHeadNode roots;
+        roots.first_bits = RCU_LOAD(cursor->head_node_v4->first_bits);
+        *next_bit_0 = roots.first_bit_0;
+        *next_bit_1 = roots.first_bit_1;
+    }
+    else {
+        const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(cursor->pool, cursor->path[depth - 1]);
+        *next_bit_0 = RCU_LOAD(node_v4->next_bit_0);
+        *next_bit_1 = RCU_LOAD(node_v4->next_bit_1);
+    }
+}
+
+static inline void cursor_children_v6(const RouteTreeCursorV6 *cursor, uint32_t depth, uint32_t *next_bit_0, uint32_t *next_bit_1)
+{
+    if (0 == depth) {
+        RouteTreeHeadNode roots;
+        roots.first_bits = RCU_LOAD(cursor->head_node_v6->first_bits);
+        *next_bit_0 = roots.first_bit_0;
+        *next_bit_1 = roots.first_bit_1;
+    }
+    else {
+        const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(cursor->pool, cursor->path[depth - 1]);
+        *next_bit_0 = RCU_LOAD(node_v6->next_bit_0);
+        *next_bit_1 = RCU_LOAD(node_v6->next_bit_1);
+    }
+}
+
+// false if index cannot be below the top node, e.g. seen half updated
+static inline bool cursor_push_v4(RouteTreeCursorV4 *cursor, uint32_t index)
+{
+    const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(cursor->pool, index);
+    const uint8_t start = cursor_end_v4(cursor, cursor->depth);
+    const uint32_t end = start + INFO_KEY_BIT_LEN(RCU_LOAD(node_v4->info));
+
+    if (ROUTE_TREE_CURSOR_DEPTH_V4 == cursor->depth || end <= start || end > 32) {
+        return false;
+    }
+
+    cursor->prefix |= (node_v4->key >> start) & mask_u32(end);
+    cursor->path[cursor->depth] = index;
+    cursor->end[cursor->depth] = end;
+    cursor->depth++;
+    return true;
+}
+
+static inline bool cursor_push_v6(RouteTreeCursorV6 *cursor, uint32_t index)
+{
+    const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(cursor->pool, index);
+    const uint8_t start = cursor_end_v6(cursor, cursor->depth);
+    const uint32_t end = start + INFO_KEY_BIT_LEN(RCU_LOAD(node_v6->info));
+
+    if (ROUTE_TREE_CURSOR_DEPTH_V6 == cursor->depth || end <= start || end > 128) {
+        return false;
+    }
+
+    const RouteTreeU128 prefix = ipv6_to_u128(&cursor->prefix) | ((ipv6_to_u128(&node_v6->key) >> start) & mask_u128(end));
+    u128_to_ipv6(prefix, &cursor->prefix);
+    cursor->path[cursor->depth] = index;
+    cursor->end[cursor->depth] = end;
+    cursor->depth++;
+    return true;
+}
+
+static inline uint32_t cursor_pop_v4(RouteTreeCursorV4 *cursor)
+{
+    const uint32_t index = cursor->path[--cursor->depth];
+    cursor->prefix &= mask_u32(cursor_end_v4(cursor, cursor->depth));
+    return index;
+}
+
+static inline uint32_t cursor_pop_v6(RouteTreeCursorV6 *cursor)
+{
+    const uint32_t index = cursor->path[--cursor->depth];
+    u128_to_ipv6(ipv6_to_u128(&cursor->prefix) & mask_u128(cursor_end_v6(cursor, cursor->depth)), &cursor->prefix);
+    return index;
+}
+
+// move to the next node in cursor order, false once there is none
+static bool cursor_advance_v4(RouteTreeCursorV4 *cursor)
+{
+    uint32_t next_bit_0;
+    uint32_t next_bit_1;
+
+    if (CURSOR_AFTER == cursor->state) {
+        cursor_children_v4(cursor, cursor->depth, &next_bit_0, &next_bit_1);
+        if ((next_bit_0 && cursor_push_v4(cursor, next_bit_0))
+                || (next_bit_1 && cursor_push_v4(cursor, next_bit_1))) {
+            return true;
+        }
+        cursor->state = CURSOR_PAST;
+    }
+
+    while (cursor->depth) {
+        const uint32_t index = cursor_pop_v4(cursor);
+        cursor_children_v4(cursor, cursor->depth, &next_bit_0, &next_bit_1);
+        if (index == next_bit_0 && next_bit_1 && cursor_push_v4(cursor, next_bit_1)) {
+            cursor->state = CURSOR_AFTER;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool cursor_advance_v6(RouteTreeCursorV6 *cursor)
+{
+    uint32_t next_bit_0;
+    uint32_t next_bit_1;
+
+    if (CURSOR_AFTER == cursor->state) {
+        cursor_children_v6(cursor, cursor->depth, &next_bit_0, &next_bit_1);
+        if ((next_bit_0 && cursor_push_v6(cursor, next_bit_0))
+                || (next_bit_1 && cursor_push_v6(cursor, next_bit_1))) {
+            return true;
+        }
+        cursor->state = CURSOR_PAST;
+    }
+
+    while (cursor->depth) {
+        const uint32_t index = cursor_pop_v6(cursor);
+        cursor_children_v6(cursor, cursor->depth, &next_bit_0, &next_bit_1);
+        if (index == next_bit_0 && next_bit_1 && cursor_push_v6(cursor, next_bit_1)) {
+            cursor->state = CURSOR_AFTER;
+            return true;
+        }
+    }
+    return false;
+}
+
+// walk down to the node next after ipv4/depth_len, ipv4 masked
+static void cursor_walk_after_v4(RouteTreeCursorV4 *cursor, uint32_t ipv4, uint8_t depth_len)
+{
+    cursor->depth = 0;
+    cursor->prefix = 0;
+    cursor->state = CURSOR_AFTER;
+
+    while (cursor_end_v4(cursor, cursor->depth) < depth_len) {
+        const uint8_t start = cursor_end_v4(cursor, cursor->depth);
+        const bool bit = (ipv4 >> (31 - start)) & 0x1;
+        uint32_t next_bit_0;
+        uint32_t next_bit_1;
+
+        cursor_children_v4(cursor, cursor->depth, &next_bit_0, &next_bit_1);
+        const uint32_t next = bit ? next_bit_1 : next_bit_0;
+        if (0 == next) {
+            // only next_bit_0 is before ipv4, next_bit_1 after
+            if (!bit && next_bit_1 && cursor_push_v4(cursor, next_bit_1)) {
+                cursor->state = CURSOR_AT;
+            }
+            else {
+                cursor->state = CURSOR_PAST;
+            }
+            return;
+        }
+        if (!cursor_push_v4(cursor, next)) {
+            cursor->state = CURSOR_PAST;
+            return;
+        }
+
+        const uint8_t end = cursor->end[cursor->depth - 1];
+        const uint32_t mask = mask_u32(end < depth_len ? end : depth_len);
+        if ((cursor->prefix & mask) != (ipv4 & mask)) {
+            cursor->state = (cursor->prefix & mask) < (ipv4 & mask) ? CURSOR_PAST : CURSOR_AT;
+            return;
+        }
+        if (end > depth_len) {
+            cursor->state = CURSOR_AT;
+            return;
+        }
+    }
+}
+
+static void cursor_walk_after_v6(RouteTreeCursorV6 *cursor, RouteTreeU128 ipv6, uint8_t depth_len)
+{
+    cursor->depth = 0;
+    memset(&cursor->prefix, 0, sizeof(cursor->prefix));
+    cursor->state = CURSOR_AFTER;
+
+    while (cursor_end_v6(cursor, cursor->depth) < depth_len) {
+        const uint8_t start = cursor_end_v6(cursor, cursor->depth);
+        const bool bit = (ipv6 >> (127 - start)) & 0x1;
+        uint32_t next_bit_0;
+        uint32_t next_bit_1;
+
+        cursor_children_v6(cursor, cursor->depth, &next_bit_0, &next_bit_1);
+        const uint32_t next = bit ? next_bit_1 : next_bit_0;
+        if (0 == next) {
+            if (!bit && next_bit_1 && cursor_push_v6(cursor, next_bit_1)) {
+                cursor->state = CURSOR_AT;
+            }
+            else {
+                cursor->state = CURSOR_PAST;
+            }
+            return;
+        }
+        if (!cursor_push_v6(cursor, next)) {
+            cursor->state = CURSOR_PAST;
+            return;
+        }
+
+        const uint8_t end = cursor->end[cursor->depth - 1];
+        const RouteTreeU128 mask = mask_u128(end < depth_len ? end : depth_len);
+        const RouteTreeU128 prefix = ipv6_to_u128(&cursor->prefix);
+        if ((prefix & mask) != (ipv6 & mask)) {
+            cursor->state = (prefix & mask) < (ipv6 & mask) ? CURSOR_PAST : CURSOR_AT;
+            return;
+        }
+        if (end > depth_len) {
+            cursor->state = CURSOR_AT;
+            return;
+        }
+    }
+}
+
+// the path is walked again if the head changed since it was
+static void cursor_sync_v4(RouteTreeCursorV4 *cursor)
+{
+    const uint64_t generation = RCU_LOAD(cursor->head_node_v4->generation);
+
+    if (generation == cursor->generation) {
+        return;
+    }
+    cursor->generation = generation;
+    if (cursor->has_last) {
+        cursor_walk_after_v4(cursor, cursor->last_prefix, cursor->last_depth_len);
+    }
+    else {
+        cursor->depth = 0;
+        cursor->prefix = 0;
+        cursor->state = CURSOR_AT;
+    }
+}
+
+static void cursor_sync_v6(RouteTreeCursorV6 *cursor)
+{
+    const uint64_t generation = RCU_LOAD(cursor->head_node_v6->generation);
+
+    if (generation == cursor->generation) {
+        return;
+    }
+    cursor->generation = generation;
+    if (cursor->has_last) {
+        cursor_walk_after_v6(cursor, ipv6_to_u128(&cursor->last_prefix), cursor->last_depth_len);
+    }
+    else {
+        cursor->depth = 0;
+        memset(&cursor->prefix, 0, sizeof(cursor->prefix));
+        cursor->state = CURSOR_AT;
+    }
+}
+
+static int cursor_next_v4(RouteTreeCursorV4 *cursor, uint32_t *ipv4, uint8_t *depth_len, uint32_t *next_hop)
+{
+    for (;;) {
+        if (CURSOR_AT == cursor->state) {
+            cursor->state = CURSOR_AFTER;
+        }
+        else if (!cursor_advance_v4(cursor)) {
+            return -1;
+        }
+
+        const int32_t node_next_hop = cursor->depth
+                        ? INFO_NEXT_HOP(RCU_LOAD(route_tree_node_v4(cursor->pool, cursor->path[cursor->depth - 1])->info))
+                        : RCU_LOAD(cursor->head_node_v4->default_next_hop);
+        const uint8_t node_depth_len = cursor_end_v4(cursor, cursor->depth);
+        if (node_next_hop < 0
+                || (cursor->has_last
+                    && !cursor_before_v4(cursor->last_prefix, cursor->last_depth_len, cursor->prefix, node_depth_len))) {
+            continue;
+        }
+
+        cursor->has_last = true;
+        cursor->last_prefix = cursor->prefix;
+        cursor->last_depth_len = node_depth_len;
+        *ipv4 = cursor->prefix;
+        *depth_len = node_depth_len;
+        *next_hop = node_next_hop;
+        return 0;
+    }
+}
+
+static int cursor_next_v6(RouteTreeCursorV6 *cursor, RouteTreeIPV6 *ipv6, uint8_t *depth_len, uint32_t *next_hop)
+{
+    for (;;) {
+        if (CURSOR_AT == cursor->state) {
+            cursor->state = CURSOR_AFTER;
+        }
+        else if (!cursor_advance_v6(cursor)) {
+            return -1;
+        }
+
+        const int32_t node_next_hop = cursor->depth
+                        ? INFO_NEXT_HOP(RCU_LOAD(route_tree_node_v6(cursor->pool, cursor->path[cursor->depth - 1])->info))
+                        : RCU_LOAD(cursor->head_node_v6->default_next_hop);
+        const uint8_t node_depth_len = cursor_end_v6(cursor, cursor->depth);
+        if (node_next_hop < 0
+                || (cursor->has_last
+                    && !cursor_before_v6(ipv6_to_u128(&cursor->last_prefix), cursor->last_depth_len,
+                                        ipv6_to_u128(&cursor->prefix), node_depth_len))) {
+            continue;
+        }
+
+        cursor->has_last = true;
+        cursor->last_prefix = cursor->prefix;
+        cursor->last_depth_len = node_depth_len;
+        *ipv6 = cursor->prefix;
+        *depth_len = node_depth_len;
+        *next_hop = node_next_hop;
+        return 0;
+    }
+}
+
+static inline void cpu_ipv6_to_be(const RouteTreeIPV6 *ipv6, uint8_t *be_ipv6_u8ptr)
+{
+    const uint64_t be_u64[2] = {htobe64(ipv6->u64[1]), htobe64(ipv6->u64[0])};
+    memcpy(be_ipv6_u8ptr, be_u64, sizeof(be_u64));
+}
+
+
+// Public API:
+
+
+void compressed_route_tree_cursor_init_v4(RouteTreeCursorV4 *cursor, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4)
+{
+    cursor->pool = pool;
+    cursor->head_node_v4 = head_node_v4;
+    cursor->generation = RCU_LOAD(head_node_v4->generation);
+    cursor->prefix = 0;
+    cursor->depth = 0;
+    cursor->state = CURSOR_AT;
+    cursor->has_last = false;
+    cursor->last_depth_len = 0;
+    cursor->last_prefix = 0;
+}
+
+void compressed_route_tree_cursor_init_v6(RouteTreeCursorV6 *cursor, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6)
+{
+    cursor->pool = pool;
+    cursor->head_node_v6 = head_node_v6;
+    cursor->generation = RCU_LOAD(head_node_v6->generation);
+    memset(&cursor->prefix, 0, sizeof(cursor->prefix));
+    cursor->depth = 0;
+    cursor->state = CURSOR_AT;
+    cursor->has_last = false;
+    cursor->last_depth_len = 0;
+    memset(&cursor->last_prefix, 0, sizeof(cursor->last_prefix));
+}
+
+int compressed_route_tree_cursor_seek_v4(RouteTreeCursorV4 *cursor, uint32_t be_ipv4, uint8_t depth_len)
+{
+    if (depth_len > 32) {
+        return -1;
+    }
+
+    cursor->generation = RCU_LOAD(cursor->head_node_v4->generation);
+    cursor->has_last = true;
+    cursor->last_prefix = ntohl(be_ipv4) & mask_u32(depth_len);
+    cursor->last_depth_len = depth_len;
+    cursor_walk_after_v4(cursor, cursor->last_prefix, depth_len);
+
+    return 0;
+}
+
+int compressed_route_tree_cursor_seek_v6(RouteTreeCursorV6 *cursor, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len)
+{
+    if (depth_len > 128) {
+        return -1;
+    }
+
+    uint64_t be_u64[2];
+    memcpy(be_u64, be_ipv6_u8ptr, sizeof(be_u64));
+    const RouteTreeU128 ipv6 = (((RouteTreeU128)be64toh(be_u64[0]) << 64) | be64toh(be_u64[1])) & mask_u128(depth_len);
+
+    cursor->generation = RCU_LOAD(cursor->head_node_v6->generation);
+    cursor->has_last = true;
+    u128_to_ipv6(ipv6, &cursor->last_prefix);
+    cursor->last_depth_len = depth_len;
+    cursor_walk_after_v6(cursor, ipv6, depth_len);
+
+    return 0;
+}
+
+int compressed_route_tree_cursor_next_v4(RouteTreeCursorV4 *cursor, uint32_t *be_ipv4, uint8_t *depth_len, uint32_t *next_hop)
+{
+    uint32_t ipv4;
+
+    cursor_sync_v4(cursor);
+    if (cursor_next_v4(cursor, &ipv4, depth_len, next_hop)) {
+        return -1;
+    }
+    *be_ipv4 = htonl(ipv4);
+    return 0;
+}
+
+int compressed_route_tree_cursor_next_v6(RouteTreeCursorV6 *cursor, uint8_t *be_ipv6_u8ptr, uint8_t *depth_len, uint32_t *next_hop)
+{
+    RouteTreeIPV6 ipv6;
+
+    cursor_sync_v6(cursor);
+    if (cursor_next_v6(cursor, &ipv6, depth_len, next_hop)) {
+        return -1;
+    }
+    cpu_ipv6_to_be(&ipv6, be_ipv6_u8ptr);
+    return 0;
+}
+
+size_t compressed_route_tree_cursor_next_bulk_v4(RouteTreeCursorV4 *cursor, RouteTreeRouteV4 *routes, size_t n_routes)
+{
+    size_t i;
+    uint32_t ipv4;
+
+    cursor_sync_v4(cursor);
+    for (i = 0; i < n_routes; ++i) {
+        if (cursor_next_v4(cursor, &ipv4, &routes[i].depth_len, &routes[i].next_hop)) {
+            break;
+        }
+        routes[i].be_ipv4 = htonl(ipv4);
+    }
+    return i;
+}
+
+size_t compressed_route_tree_cursor_next_bulk_v6(RouteTreeCursorV6 *cursor, RouteTreeRouteV6 *routes, size_t n_routes)
+{
+    size_t i;
+    RouteTreeIPV6 ipv6;
+
+    cursor_sync_v6(cursor);
+    for (i = 0; i < n_routes; ++i) {
+        if (cursor_next_v6(cursor, &ipv6, &routes[i].depth_len, &routes[i].next_hop)) {
+            break;
+        }
+        cpu_ipv6_to_be(&ipv6, routes[i].be_ipv6);
+    }
+    return i;
+}
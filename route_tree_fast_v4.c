@@ -0,0 +1,385 @@
+#include "route_tree_internal.h"
+#include <arpa/inet.h>
+
+/*
+ * DIR-24-8 lookup table compiled from the compressed tree.
+ *
+ * tbl24 is indexed by the upper 24 bits of the address. An entry either holds
+ * the next hop of the longest prefix (<= /24) covering it, or points to a
+ * 256-entry tbl8 group indexed by the lower 8 bits, used when a longer prefix
+ * exists below it. A lookup costs at most two memory accesses.
+ *
+ * Entry layout:
+ *   bit  31     valid
+ *   bit  30     extended, value is a tbl8 group index (tbl24 only)
+ *   bits 24-29  depth of the prefix which set the entry
+ *   bits 0-23   next hop, at most ROUTE_TREE_MAX_NEXT_HOP, or tbl8 group index
+ * An invalid entry falls back to head_node->default_next_hop.
+ *
+ * A tbl8 group released by a collapse may still be read by a concurrent
+ * lookup, it goes through the limbo list before being reused.
+ */
+
+#define TBL24_ENTRIES (1U << 24)
+#define TBL8_GROUP_ENTRIES 256
+
+#define FAST_ENTRY_VALID 0x80000000U
+#define FAST_ENTRY_EXT 0x40000000U
+#define FAST_ENTRY_DEPTH_SHIFT 24
+#define FAST_ENTRY_VALUE_MASK 0x00ffffffU
+
+#define FAST_ENTRY(depth_len, value) \
+                (FAST_ENTRY_VALID | ((uint32_t)(depth_len) << FAST_ENTRY_DEPTH_SHIFT) | (value))
+#define FAST_ENTRY_DEPTH(entry) (((entry) >> FAST_ENTRY_DEPTH_SHIFT) & 0x3f)
+#define FAST_ENTRY_VALUE(entry) ((entry) & FAST_ENTRY_VALUE_MASK)
+#define FAST_ENTRY_IS_EXT(entry) (((entry) & (FAST_ENTRY_VALID | FAST_ENTRY_EXT)) == (FAST_ENTRY_VALID | FAST_ENTRY_EXT))
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct route_tree_fast_v4_s {
+    uint32_t *tbl24;
+    uint32_t *tbl8;
+
+    // stack of free tbl8 group index
+    uint32_t *tbl8_free;
+    uint32_t tbl8_free_count;
+    uint32_t tbl8_groups;
+
+    // released tbl8 group index, the waiting ones first then the pending ones
+    uint32_t *tbl8_limbo;
+    uint32_t tbl8_limbo_waiting;
+    uint32_t tbl8_limbo_pending;
+    uint64_t tbl8_limbo_epoch;
+} RouteTreeFastV4;
+
+
+static inline bool fast_entry_replaceable(uint32_t entry, uint8_t depth_len)
+{
+    return !(entry & FAST_ENTRY_VALID) || FAST_ENTRY_DEPTH(entry) <= depth_len;
+}
+
+static void fast_fill_tbl8(uint32_t *tbl8_group, uint32_t first, uint32_t count, uint8_t depth_len, uint32_t next_hop)
+{
+    uint32_t i;
+    for (i = first; i < first + count; ++i) {
+        if (fast_entry_replaceable(tbl8_group[i], depth_len)) {
+            RCU_STORE(tbl8_group[i], FAST_ENTRY(depth_len, next_hop));
+        }
+    }
+}
+
+static void fast_restore_tbl8(uint32_t *tbl8_group, uint32_t first, uint32_t count, uint8_t depth_len, uint32_t cover_entry)
+{
+    uint32_t i;
+    for (i = first; i < first + count; ++i) {
+        if ((tbl8_group[i] & FAST_ENTRY_VALID) && FAST_ENTRY_DEPTH(tbl8_group[i]) == depth_len) {
+            RCU_STORE(tbl8_group[i], cover_entry);
+        }
+    }
+}
+
+static inline uint32_t *fast_tbl8_group(const RouteTreeFastV4 *fast, uint32_t tbl24_entry)
+{
+    return &fast->tbl8[FAST_ENTRY_VALUE(tbl24_entry) * TBL8_GROUP_ENTRIES];
+}
+
+static void fast_try_collapse_tbl8(RouteTreeFastV4 *fast, uint32_t tbl24_index)
+{
+    const uint32_t tbl24_entry = fast->tbl24[tbl24_index];
+    const uint32_t *tbl8_group = fast_tbl8_group(fast, tbl24_entry);
+    const uint32_t first = tbl8_group[0];
+
+    if ((first & FAST_ENTRY_VALID) && FAST_ENTRY_DEPTH(first) > 24) {
+        return;
+    }
+
+    uint32_t i;
+    for (i = 1; i < TBL8_GROUP_ENTRIES; ++i) {
+        if (tbl8_group[i] != first) {
+            return;
+        }
+    }
+
+    RCU_STORE(fast->tbl24[tbl24_index], first);
+    fast->tbl8_limbo[fast->tbl8_limbo_waiting + fast->tbl8_limbo_pending++] = FAST_ENTRY_VALUE(tbl24_entry);
+}
+
+static void _fast_build_v4(RouteTreeFastV4 *fast, const RouteTreePool *pool, const RouteTreeNodeV4 *node_v4,
+                        uint32_t ipv4, uint8_t bit_offset)
+{
+    ipv4 |= (node_v4->key >> bit_offset);
+    bit_offset += NODE_KEY_BIT_LEN(node_v4);
+
+    if (NODE_NEXT_HOP(node_v4) >= 0) {
+        route_tree_fast_v4_add(fast, ipv4, bit_offset, NODE_NEXT_HOP(node_v4));
+    }
+
+    if (node_v4->next_bit_0) {
+        _fast_build_v4(fast, pool, route_tree_node_v4(pool, node_v4->next_bit_0), ipv4, bit_offset);
+    }
+    if (node_v4->next_bit_1) {
+        _fast_build_v4(fast, pool, route_tree_node_v4(pool, node_v4->next_bit_1), ipv4, bit_offset);
+    }
+}
+
+static void _fast_check_build_v4(const RouteTreePool *pool, const RouteTreeNodeV4 *node_v4, uint32_t ipv4, uint8_t bit_offset,
+                                uint32_t *last_tbl24_index, size_t *need_groups)
+{
+    ipv4 |= (node_v4->key >> bit_offset);
+    bit_offset += NODE_KEY_BIT_LEN(node_v4);
+
+    if (NODE_NEXT_HOP(node_v4) >= 0 && bit_offset > 24 && (ipv4 >> 8) != *last_tbl24_index) {
+        // routes are visited in address order, so routes sharing a tbl8 group are adjacent
+        *last_tbl24_index = ipv4 >> 8;
+        (*need_groups)++;
+    }
+
+    if (node_v4->next_bit_0) {
+        _fast_check_build_v4(pool, route_tree_node_v4(pool, node_v4->next_bit_0), ipv4, bit_offset, last_tbl24_index, need_groups);
+    }
+    if (node_v4->next_bit_1) {
+        _fast_check_build_v4(pool, route_tree_node_v4(pool, node_v4->next_bit_1), ipv4, bit_offset, last_tbl24_index, need_groups);
+    }
+}
+
+
+// Internal hooks:
+
+
+int route_tree_fast_v4_check_add(void *fast_v4, uint32_t ipv4, uint8_t depth_len)
+{
+    if (route_tree_fast_v4_need_tbl8(fast_v4, ipv4, depth_len)) {
+        // need a new tbl8 group
+        return route_tree_fast_v4_check_tbl8(fast_v4, 1);
+    }
+
+    return 0;
+}
+
+bool route_tree_fast_v4_need_tbl8(void *fast_v4, uint32_t ipv4, uint8_t depth_len)
+{
+    const RouteTreeFastV4 *fast = fast_v4;
+
+    return depth_len > 24 && !FAST_ENTRY_IS_EXT(fast->tbl24[ipv4 >> 8]);
+}
+
+int route_tree_fast_v4_check_tbl8(void *fast_v4, size_t n_groups)
+{
+    RouteTreeFastV4 *fast = fast_v4;
+
+    if (fast->tbl8_free_count < n_groups) {
+        route_tree_fast_v4_reclaim(fast);
+    }
+    if (fast->tbl8_free_count < n_groups) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void route_tree_fast_v4_add(void *fast_v4, uint32_t ipv4, uint8_t depth_len, uint32_t next_hop)
+{
+    RouteTreeFastV4 *fast = fast_v4;
+
+    if (depth_len <= 24) {
+        const uint32_t first = ipv4 >> 8;
+        const uint32_t last = first + (1U << (24 - depth_len));
+        uint32_t i;
+        for (i = first; i < last; ++i) {
+            const uint32_t tbl24_entry = fast->tbl24[i];
+            if (FAST_ENTRY_IS_EXT(tbl24_entry)) {
+                fast_fill_tbl8(fast_tbl8_group(fast, tbl24_entry), 0, TBL8_GROUP_ENTRIES, depth_len, next_hop);
+            }
+            else if (fast_entry_replaceable(tbl24_entry, depth_len)) {
+                RCU_STORE(fast->tbl24[i], FAST_ENTRY(depth_len, next_hop));
+            }
+        }
+        return;
+    }
+
+    const uint32_t tbl24_index = ipv4 >> 8;
+    uint32_t tbl24_entry = fast->tbl24[tbl24_index];
+    if (!FAST_ENTRY_IS_EXT(tbl24_entry)) {
+        // checked by route_tree_fast_v4_check_add
+        const uint32_t group = fast->tbl8_free[--fast->tbl8_free_count];
+        uint32_t *tbl8_group = &fast->tbl8[group * TBL8_GROUP_ENTRIES];
+        uint32_t i;
+        for (i = 0; i < TBL8_GROUP_ENTRIES; ++i) {
+            tbl8_group[i] = tbl24_entry;
+        }
+
+        // publish the group only after it is filled
+        tbl24_entry = FAST_ENTRY_VALID | FAST_ENTRY_EXT | group;
+        RCU_STORE(fast->tbl24[tbl24_index], tbl24_entry);
+    }
+
+    fast_fill_tbl8(fast_tbl8_group(fast, tbl24_entry), ipv4 & 0xff, 1U << (32 - depth_len), depth_len, next_hop);
+}
+
+void route_tree_fast_v4_del(void *fast_v4, uint32_t ipv4, uint8_t depth_len,
+                            int32_t cover_next_hop, uint8_t cover_depth_len)
+{
+    RouteTreeFastV4 *fast = fast_v4;
+    const uint32_t cover_entry = cover_next_hop >= 0 ? FAST_ENTRY(cover_depth_len, (uint32_t)cover_next_hop) : 0;
+
+    if (depth_len <= 24) {
+        const uint32_t first = ipv4 >> 8;
+        const uint32_t last = first + (1U << (24 - depth_len));
+        uint32_t i;
+        for (i = first; i < last; ++i) {
+            const uint32_t tbl24_entry = fast->tbl24[i];
+            if (FAST_ENTRY_IS_EXT(tbl24_entry)) {
+                fast_restore_tbl8(fast_tbl8_group(fast, tbl24_entry), 0, TBL8_GROUP_ENTRIES, depth_len, cover_entry);
+            }
+            else if ((tbl24_entry & FAST_ENTRY_VALID) && FAST_ENTRY_DEPTH(tbl24_entry) == depth_len) {
+                RCU_STORE(fast->tbl24[i], cover_entry);
+            }
+        }
+        return;
+    }
+
+    const uint32_t tbl24_index = ipv4 >> 8;
+    const uint32_t tbl24_entry = fast->tbl24[tbl24_index];
+    if (!FAST_ENTRY_IS_EXT(tbl24_entry)) {
+        return;
+    }
+
+    fast_restore_tbl8(fast_tbl8_group(fast, tbl24_entry), ipv4 & 0xff, 1U << (32 - depth_len), depth_len, cover_entry);
+    fast_try_collapse_tbl8(fast, tbl24_index);
+}
+
+void route_tree_fast_v4_reclaim(void *fast_v4)
+{
+    RouteTreeFastV4 *fast = fast_v4;
+
+    if (fast->tbl8_limbo_waiting) {
+        if (!route_tree_rcu_grace_period_done(fast->tbl8_limbo_epoch)) {
+            return;
+        }
+
+        uint32_t i;
+        for (i = 0; i < fast->tbl8_limbo_waiting; ++i) {
+            fast->tbl8_free[fast->tbl8_free_count++] = fast->tbl8_limbo[i];
+        }
+        memmove(fast->tbl8_limbo, &fast->tbl8_limbo[fast->tbl8_limbo_waiting],
+                sizeof(*fast->tbl8_limbo) * fast->tbl8_limbo_pending);
+        fast->tbl8_limbo_waiting = 0;
+    }
+
+    if (fast->tbl8_limbo_pending) {
+        fast->tbl8_limbo_waiting = fast->tbl8_limbo_pending;
+        fast->tbl8_limbo_pending = 0;
+        fast->tbl8_limbo_epoch = route_tree_rcu_start_grace_period();
+    }
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_get_memory_footprint_v4_fast(const size_t n_tbl8_groups)
+{
+    return ALIGN_UP(sizeof(RouteTreeFastV4), 64)
+                + sizeof(uint32_t) * TBL24_ENTRIES
+                + sizeof(uint32_t) * TBL8_GROUP_ENTRIES * n_tbl8_groups
+                + sizeof(uint32_t) * n_tbl8_groups * 2;
+}
+
+int compressed_route_tree_build_v4_fast(const RouteTreePool *pool,
+                                    RouteTreeHeadNode *head_node_v4,
+                                    void * const fast_v4_ptr,
+                                    const size_t n_tbl8_groups)
+{
+    if (n_tbl8_groups > FAST_ENTRY_VALUE_MASK + 1) {
+        return -1;
+    }
+
+    // make sure the table can hold every route before touching it
+    uint32_t last_tbl24_index = ~0U;
+    size_t need_groups = 0;
+    const RouteTreeNodeV4 *node_v4;
+    node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_0);
+    if (node_v4) {
+        _fast_check_build_v4(pool, node_v4, 0, 0, &last_tbl24_index, &need_groups);
+    }
+    node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_1);
+    if (node_v4) {
+        _fast_check_build_v4(pool, node_v4, 0, 0, &last_tbl24_index, &need_groups);
+    }
+    if (need_groups > n_tbl8_groups) {
+        return -1;
+    }
+
+    RouteTreeFastV4 *fast = fast_v4_ptr;
+    fast->tbl24 = (uint32_t *)((uintptr_t)fast_v4_ptr + ALIGN_UP(sizeof(RouteTreeFastV4), 64));
+    fast->tbl8 = fast->tbl24 + TBL24_ENTRIES;
+    fast->tbl8_free = fast->tbl8 + TBL8_GROUP_ENTRIES * n_tbl8_groups;
+    fast->tbl8_groups = n_tbl8_groups;
+    fast->tbl8_free_count = n_tbl8_groups;
+    fast->tbl8_limbo = fast->tbl8_free + n_tbl8_groups;
+    fast->tbl8_limbo_waiting = 0;
+    fast->tbl8_limbo_pending = 0;
+    fast->tbl8_limbo_epoch = 0;
+
+    size_t i;
+    for (i = 0; i < n_tbl8_groups; ++i) {
+        // hand out low group index first
+        fast->tbl8_free[i] = n_tbl8_groups - 1 - i;
+    }
+    memset(fast->tbl24, 0, sizeof(uint32_t) * TBL24_ENTRIES);
+
+    node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_0);
+    if (node_v4) {
+        _fast_build_v4(fast, pool, node_v4, 0, 0);
+    }
+    node_v4 = route_tree_node_v4(pool, head_node_v4->first_bit_1);
+    if (node_v4) {
+        _fast_build_v4(fast, pool, node_v4, 0, 0);
+    }
+
+    RCU_STORE(head_node_v4->fast_v4, (void *)fast);
+
+    return 0;
+}
+
+void compressed_route_tree_release_v4_fast(RouteTreeHeadNode *head_node_v4)
+{
+    RCU_STORE(head_node_v4->fast_v4, NULL);
+}
+
+size_t compressed_route_tree_fast_v4_free_tbl8_count(const RouteTreeHeadNode *head_node_v4)
+{
+    const RouteTreeFastV4 *fast = head_node_v4->fast_v4;
+    return fast ? fast->tbl8_free_count : 0;
+}
+
+int compressed_route_tree_lookup_v4_fast(const RouteTreeHeadNode *head_node_v4,
+                                    uint32_t be_ipv4,
+                                    uint32_t *next_hop)
+{
+    const RouteTreeFastV4 *fast = RCU_LOAD(head_node_v4->fast_v4);
+    const uint32_t ipv4 = ntohl(be_ipv4);
+
+    // never built or released, the tree is not at hand
+    if (NULL == fast) {
+        return -1;
+    }
+
+    uint32_t entry = RCU_LOAD(fast->tbl24[ipv4 >> 8]);
+    if (FAST_ENTRY_IS_EXT(entry)) {
+        entry = RCU_LOAD(fast_tbl8_group(fast, entry)[ipv4 & 0xff]);
+    }
+
+    if (entry & FAST_ENTRY_VALID) {
+        *next_hop = FAST_ENTRY_VALUE(entry);
+        return 0;
+    }
+
+    const int32_t default_next_hop = RCU_LOAD(head_node_v4->default_next_hop);
+    if (default_next_hop >= 0) {
+        *next_hop = default_next_hop;
+        return 0;
+    }
+
+    return -1;
+}
@@ -0,0 +1,187 @@
+#include "route_tree_internal.h"
+
+/*
+ * Flow cache: a set is one cache line holding the most recent lookups of
+ * the addresses hashing to it, newest first. A hit compares the full
+ * address and the generation of the head, so once the head has changed
+ * every entry made before misses and is pushed out in time.
+ * A result without a route is cached too, as next_hop -1.
+ */
+
+#define FLOW_CACHE_WAYS_V4 4
+#define FLOW_CACHE_WAYS_V6 2
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct {
+    uint32_t be_ipv4;
+    int32_t next_hop;
+    // 0 is no entry, heads never have it
+    uint64_t generation;
+} FlowEntryV4;
+
+typedef struct {
+    uint64_t be_ipv6[2];
+    uint64_t generation;
+    int32_t next_hop;
+    uint32_t reserved;
+} FlowEntryV6;
+
+typedef struct {
+    FlowEntryV4 entry[FLOW_CACHE_WAYS_V4];
+} __attribute__((aligned(64))) FlowSetV4;
+
+typedef struct {
+    FlowEntryV6 entry[FLOW_CACHE_WAYS_V6];
+} __attribute__((aligned(64))) FlowSetV6;
+
+
+static inline FlowSetV4 *flow_set_v4(const RouteTreeFlowCache *cache, uint32_t be_ipv4)
+{
+    uint32_t hash = be_ipv4 * 0x9e3779b1U;
+    hash ^= hash >> 16;
+    return &((FlowSetV4 *)cache->sets_v4)[hash & cache->set_mask_v4];
+}
+
+static inline FlowSetV6 *flow_set_v6(const RouteTreeFlowCache *cache, const uint64_t *be_ipv6)
+{
+    uint64_t hash = (be_ipv6[0] ^ (be_ipv6[1] * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+    return &((FlowSetV6 *)cache->sets_v6)[hash & cache->set_mask_v6];
+}
+
+static inline bool is_power_of_2(size_t n)
+{
+    return 0 == (n & (n - 1));
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_flow_cache_get_memory_footprint(const size_t n_sets_v4, const size_t n_sets_v6)
+{
+    // room to align the sets on a cache line
+    return 64 + sizeof(FlowSetV4) * n_sets_v4 + sizeof(FlowSetV6) * n_sets_v6;
+}
+
+int compressed_route_tree_flow_cache_init(RouteTreeFlowCache *cache, void * const cache_ptr,
+                                        const size_t n_sets_v4, const size_t n_sets_v6)
+{
+    if (!is_power_of_2(n_sets_v4) || !is_power_of_2(n_sets_v6)
+            || n_sets_v4 > UINT32_MAX || n_sets_v6 > UINT32_MAX) {
+        return -1;
+    }
+
+    FlowSetV4 *sets_v4 = (FlowSetV4 *)ALIGN_UP((uintptr_t)cache_ptr, 64);
+    FlowSetV6 *sets_v6 = (FlowSetV6 *)&sets_v4[n_sets_v4];
+
+    cache->sets_v4 = n_sets_v4 ? sets_v4 : NULL;
+    cache->sets_v6 = n_sets_v6 ? sets_v6 : NULL;
+    cache->set_mask_v4 = n_sets_v4 ? n_sets_v4 - 1 : 0;
+    cache->set_mask_v6 = n_sets_v6 ? n_sets_v6 - 1 : 0;
+    cache->n_sets_v4 = n_sets_v4;
+    cache->n_sets_v6 = n_sets_v6;
+    compressed_route_tree_flow_cache_flush(cache);
+
+    return 0;
+}
+
+void compressed_route_tree_flow_cache_flush(RouteTreeFlowCache *cache)
+{
+    if (cache->sets_v4) {
+        memset(cache->sets_v4, 0, sizeof(FlowSetV4) * cache->n_sets_v4);
+    }
+    if (cache->sets_v6) {
+        memset(cache->sets_v6, 0, sizeof(FlowSetV6) * cache->n_sets_v6);
+    }
+    cache->hits = 0;
+    cache->misses = 0;
+}
+
+int compressed_route_tree_lookup_v4_cached(const RouteTreePool *pool,
+                                        const RouteTreeHeadNode *head_node_v4,
+                                        RouteTreeFlowCache *cache,
+                                        uint32_t be_ipv4,
+                                        uint32_t *next_hop)
+{
+    if (NULL == cache->sets_v4) {
+        return compressed_route_tree_lookup_v4(pool, head_node_v4, be_ipv4, next_hop);
+    }
+
+    // loaded before the walk, a change published after it gets a new generation
+    const uint64_t generation = RCU_LOAD(head_node_v4->generation);
+    FlowSetV4 *set = flow_set_v4(cache, be_ipv4);
+    uint32_t way;
+
+    for (way = 0; way < FLOW_CACHE_WAYS_V4; ++way) {
+        const FlowEntryV4 *entry = &set->entry[way];
+        if (entry->generation == generation && entry->be_ipv4 == be_ipv4) {
+            cache->hits++;
+            if (entry->next_hop < 0) {
+                return -1;
+            }
+            *next_hop = entry->next_hop;
+            return 0;
+        }
+    }
+
+    cache->misses++;
+    uint32_t found_next_hop;
+    const int ret = compressed_route_tree_lookup_v4(pool, head_node_v4, be_ipv4, &found_next_hop);
+
+    memmove(&set->entry[1], &set->entry[0], sizeof(set->entry[0]) * (FLOW_CACHE_WAYS_V4 - 1));
+    set->entry[0].be_ipv4 = be_ipv4;
+    set->entry[0].next_hop = 0 == ret ? (int32_t)found_next_hop : -1;
+    set->entry[0].generation = generation;
+
+    if (0 == ret) {
+        *next_hop = found_next_hop;
+    }
+    return ret;
+}
+
+int compressed_route_tree_lookup_v6_cached(const RouteTreePool *pool,
+                                        const RouteTreeHeadNode *head_node_v6,
+                                        RouteTreeFlowCache *cache,
+                                        const uint8_t *be_ipv6_u8ptr,
+                                        uint32_t *next_hop)
+{
+    if (NULL == cache->sets_v6) {
+        return compressed_route_tree_lookup_v6(pool, head_node_v6, be_ipv6_u8ptr, next_hop);
+    }
+
+    const uint64_t generation = RCU_LOAD(head_node_v6->generation);
+    uint64_t be_ipv6[2];
+    memcpy(be_ipv6, be_ipv6_u8ptr, sizeof(be_ipv6));
+    FlowSetV6 *set = flow_set_v6(cache, be_ipv6);
+    uint32_t way;
+
+    for (way = 0; way < FLOW_CACHE_WAYS_V6; ++way) {
+        const FlowEntryV6 *entry = &set->entry[way];
+        if (entry->generation == generation
+                && entry->be_ipv6[0] == be_ipv6[0] && entry->be_ipv6[1] == be_ipv6[1]) {
+            cache->hits++;
+            if (entry->next_hop < 0) {
+                return -1;
+            }
+            *next_hop = entry->next_hop;
+            return 0;
+        }
+    }
+
+    cache->misses++;
+    uint32_t found_next_hop;
+    const int ret = compressed_route_tree_lookup_v6(pool, head_node_v6, be_ipv6_u8ptr, &found_next_hop);
+
+    memmove(&set->entry[1], &set->entry[0], sizeof(set->entry[0]) * (FLOW_CACHE_WAYS_V6 - 1));
+    set->entry[0].be_ipv6[0] = be_ipv6[0];
+    set->entry[0].be_ipv6[1] = be_ipv6[1];
+    set->entry[0].next_hop = 0 == ret ? (int32_t)found_next_hop : -1;
+    set->entry[0].generation = generation;
+
+    if (0 == ret) {
+        *next_hop = found_next_hop;
+    }
+    return ret;
+}
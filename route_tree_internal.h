@@ -0,0 +1,186 @@
+#ifndef __ROUTE_TREE_INTERNAL_H__
+#define __ROUTE_TREE_INTERNAL_H__
+
+#include "route_tree.h"
+
+/*
+ * Readers may run concurrently with the writer of a head. Pointers and values
+ * reachable by readers are published with RCU_STORE and read with RCU_LOAD.
+ */
+#define RCU_LOAD(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define RCU_STORE(var, value) __atomic_store_n(&(var), (value), __ATOMIC_RELEASE)
+
+/*
+ * Node index <-> node, index 0 is no node. Not macros, so an RCU_LOAD
+ * argument is evaluated once.
+ * Writer side reads of key_bit_len/next_hop use NODE_KEY_BIT_LEN and
+ * NODE_NEXT_HOP; readers load info once with RCU_LOAD and decode it.
+ */
+static inline RouteTreeNodeV4 *route_tree_node_v4(const RouteTreePool *pool, uint32_t index)
+{
+    return index ? &pool->v4_nodes[index] : NULL;
+}
+
+static inline RouteTreeNodeV6 *route_tree_node_v6(const RouteTreePool *pool, uint32_t index)
+{
+    return index ? &pool->v6_nodes[index] : NULL;
+}
+
+static inline uint32_t route_tree_node_index_v4(const RouteTreePool *pool, const RouteTreeNodeV4 *node)
+{
+    return node ? (uint32_t)(node - pool->v4_nodes) : 0;
+}
+
+static inline uint32_t route_tree_node_index_v6(const RouteTreePool *pool, const RouteTreeNodeV6 *node)
+{
+    return node ? (uint32_t)(node - pool->v6_nodes) : 0;
+}
+
+/*
+ * IPv6 keys are handled as one 128-bit integer, u64[1] is the high half, so
+ * extracting, comparing and diffing a prefix is a shift, a xor and a clz
+ * instead of a branch per u64 boundary case.
+ */
+typedef unsigned __int128 RouteTreeU128;
+
+static inline RouteTreeU128 ipv6_to_u128(const RouteTreeIPV6 *ipv6)
+{
+    return ((RouteTreeU128)ipv6->u64[1] << 64) | ipv6->u64[0];
+}
+
+static inline void u128_to_ipv6(RouteTreeU128 u128, RouteTreeIPV6 *ipv6)
+{
+    ipv6->u64[1] = (uint64_t)(u128 >> 64);
+    ipv6->u64[0] = (uint64_t)u128;
+}
+
+#define NODE_INFO(key_bit_len, next_hop) (((uint32_t)(next_hop) << 8) | (uint8_t)(key_bit_len))
+#define INFO_KEY_BIT_LEN(info) ((uint8_t)((info) & 0xff))
+#define INFO_NEXT_HOP(info) ((int32_t)(info) >> 8)
+#define NODE_KEY_BIT_LEN(node) INFO_KEY_BIT_LEN((node)->info)
+#define NODE_NEXT_HOP(node) INFO_NEXT_HOP((node)->info)
+
+/*
+ * Lookup counters, see route_tree_stats.c. A lookup keeps n_visited and
+ * tree_hit whether or not they are compiled in; without ROUTE_TREE_STATS
+ * they are unused and optimized away.
+ */
+#ifdef ROUTE_TREE_STATS
+typedef struct {
+    RouteTreeLookupStats v4;
+    RouteTreeLookupStats v6;
+} __attribute__((aligned(64))) RouteTreeStatsSlot;
+
+extern __thread RouteTreeStatsSlot *route_tree_stats_slot;
+RouteTreeStatsSlot *route_tree_stats_claim_slot(void);
+
+#define ROUTE_TREE_STATS_LOOKUP(family, n_visited, tree_hit, found) \
+                do { \
+                    RouteTreeStatsSlot *_slot = route_tree_stats_slot; \
+                    if (__builtin_expect(NULL == _slot, 0)) { \
+                        _slot = route_tree_stats_claim_slot(); \
+                    } \
+                    _slot->family.lookups++; \
+                    _slot->family.visited[(n_visited)]++; \
+                    if (tree_hit) { \
+                        _slot->family.hits++; \
+                    } \
+                    else if (found) { \
+                        _slot->family.default_hits++; \
+                    } \
+                    else { \
+                        _slot->family.misses++; \
+                    } \
+                } while (0)
+#else
+#define ROUTE_TREE_STATS_LOOKUP(family, n_visited, tree_hit, found) \
+                do { \
+                    (void)(n_visited); \
+                    (void)(tree_hit); \
+                } while (0)
+#endif
+
+// Start a grace period, return the epoch every reader has to reach.
+uint64_t route_tree_rcu_start_grace_period(void);
+bool route_tree_rcu_grace_period_done(uint64_t epoch);
+// Give head_node a new generation once a change of its routes is published.
+void route_tree_bump_generation(RouteTreeHeadNode *head_node);
+
+// Growable pools: place the sections of nodes_ptr by v4/v6_nodes_pool_max
+// (not if NULL) and return their size.
+size_t route_tree_pool_growable_layout(RouteTreePool *pool, void *nodes_ptr);
+// Make the nodes whose bit is clear in used (one bit per index, index 0
+// excepted) the free nodes of pool, with no writer cache or limbo.
+void route_tree_pool_set_used_v4(RouteTreePool *pool, const uint8_t *used);
+void route_tree_pool_set_used_v6(RouteTreePool *pool, const uint8_t *used);
+// Bulk lookups with a head per address, NULL for none; see route_tree_vrf.c
+size_t route_tree_lookup_bulk_heads_v4(const RouteTreePool *pool, const RouteTreeHeadNode * const *head_nodes,
+                                    const uint32_t *be_ipv4, size_t n, uint32_t *next_hop, uint64_t *hit_mask);
+size_t route_tree_lookup_bulk_heads_v6(const RouteTreePool *pool, const RouteTreeHeadNode * const *head_nodes,
+                                    const uint8_t * const *be_ipv6_u8ptr, size_t n, uint32_t *next_hop, uint64_t *hit_mask);
+// Give free pages back to the system, see route_tree_mem.c
+void route_tree_mem_discard(void *ptr, size_t size);
+
+/*
+ * Hooks called by the add/del paths of route_tree.c to keep the lookup
+ * engines built from a RouteTreeHeadNode in sync with the tree.
+ * Addresses are in CPU order and already masked to depth_len.
+ */
+
+// DIR-24-8 table, see route_tree_fast_v4.c
+int route_tree_fast_v4_check_add(void *fast_v4, uint32_t ipv4, uint8_t depth_len);
+// the add would take a new tbl8 group
+bool route_tree_fast_v4_need_tbl8(void *fast_v4, uint32_t ipv4, uint8_t depth_len);
+// n_groups tbl8 groups can be taken
+int route_tree_fast_v4_check_tbl8(void *fast_v4, size_t n_groups);
+void route_tree_fast_v4_add(void *fast_v4, uint32_t ipv4, uint8_t depth_len, uint32_t next_hop);
+void route_tree_fast_v4_del(void *fast_v4, uint32_t ipv4, uint8_t depth_len,
+                            int32_t cover_next_hop, uint8_t cover_depth_len);
+void route_tree_fast_v4_reclaim(void *fast_v4);
+
+// LC-trie copy, see route_tree_lc_v4.c
+int route_tree_lc_v4_lookup(const void *lc_v4, uint32_t ipv4, uint32_t *next_hop, uint32_t *n_visited);
+// next_hop -1 is a del, the slots of the route go back to its cover;
+// route_delta is the change of the route count of the head
+void route_tree_lc_v4_update(void *lc_v4, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                            uint32_t ipv4, uint8_t depth_len, int32_t next_hop,
+                            int32_t cover_next_hop, uint8_t cover_depth_len,
+                            int route_delta);
+void route_tree_lc_v4_reclaim(void *lc_v4);
+
+// Poptrie copy, see route_tree_poptrie.c; called once the tree has the
+// change of the route ipv4/depth_len
+void route_tree_poptrie_update_v4(void *poptrie, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                uint32_t ipv4, uint8_t depth_len);
+void route_tree_poptrie_update_v6(void *poptrie, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                const RouteTreeIPV6 *ipv6, uint8_t depth_len);
+void route_tree_poptrie_reclaim(void *poptrie);
+
+// length search copy, see route_tree_bsl_v6.c
+int route_tree_bsl_v6_lookup(const void *bsl_v6, const RouteTreeIPV6 *ipv6, uint32_t *next_hop, uint32_t *n_visited);
+void route_tree_bsl_v6_update(void *bsl_v6, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                            const RouteTreeIPV6 *ipv6, uint8_t depth_len);
+// counts the markers again once a retired search has no readers left
+void route_tree_bsl_v6_reclaim(void *bsl_v6, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6);
+
+// copy cut at /64, see route_tree_v6_64.c; lookup returns 1 to walk the tree
+int route_tree_v6_64_lookup(const void *v6_64, const RouteTreeIPV6 *ipv6, uint32_t *next_hop, uint32_t *n_visited);
+void route_tree_v6_64_update(void *v6_64, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                            const RouteTreeIPV6 *ipv6, uint8_t depth_len);
+void route_tree_v6_64_reclaim(void *v6_64);
+
+// aggregated copy, see route_tree_aggregate.c; its head comes first
+void route_tree_aggregate_update_v4(void *aggregate, RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                    uint32_t ipv4, uint8_t depth_len);
+void route_tree_aggregate_update_v6(void *aggregate, RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    const RouteTreeIPV6 *ipv6, uint8_t depth_len);
+
+// head whose tree the lookups walk
+static inline const RouteTreeHeadNode *route_tree_lookup_tree(const RouteTreeHeadNode *head_node)
+{
+    const RouteTreeHeadNode *aggregate = RCU_LOAD(head_node->aggregate);
+    return aggregate ? aggregate : head_node;
+}
+
+
+#endif
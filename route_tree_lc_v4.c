@@ -0,0 +1,573 @@
+#include "route_tree_internal.h"
+
+/*
+ * Level-compressed (LC-trie) copy of the IPv4 tree.
+ *
+ * A node takes stride bits of the address at once through an array of
+ * 2^stride slots. The stride of a node is the largest k such that the
+ * routes below it reach at least half of the 2^k prefixes k bits down, so a
+ * dense subtree, like the /17 to /24 under a busy /16, is walked in one
+ * step and a sparse one stays close to binary. A run of bits with no branch
+ * and no route ending in it is skipped and checked against skip_key before
+ * the node, as the key of a tree node is.
+ *
+ * A node starting at bit s holds the routes of depth_len in (s, s + stride]:
+ * each is expanded over the slots it covers and a slot keeps the longest one.
+ * Longer routes go to the child of their slot. A lookup remembers the last
+ * valid slot on its way down, like the tree walk remembers the last route.
+ *
+ * A node is a block of LC_HEADER_SLOTS + 2^stride slots in the caller
+ * memory. Slots are updated in place by the add/del hooks. A change of shape
+ * rebuilds the subtree below one slot from the tree and swaps it in with
+ * one store, the old blocks go through the limbo list before being reused.
+ * Each node counts the routes below it, and is rebuilt, its stride chosen
+ * again, once that count has grown or shrunk enough since it was laid out.
+ */
+
+#define LC_MAX_STRIDE 16
+#define LC_HEADER_SLOTS 2
+#define LC_BLOCK_SLOTS(stride) (LC_HEADER_SLOTS + (1U << (stride)))
+#define LC_REBUILD_SLACK 8
+// a node is laid out again when its routes grew this many times, or shrank
+#define LC_GROW_FACTOR 2
+#define LC_SHRINK_FACTOR 4
+#define LC_NO_ROUTE NODE_INFO(0, -1)
+
+// bit_len bits of u32 from bit_offset, right aligned, bit_len > 0
+#define LC_BITS(u32, bit_offset, bit_len) (((uint32_t)(u32) << (bit_offset)) >> (32 - (bit_len)))
+// bit_len bits of u32 from bit_offset, left aligned as a node key
+#define LC_KEY(u32, bit_offset, bit_len) \
+                (0 == (bit_len) ? 0 : LC_BITS(u32, bit_offset, bit_len) << (32 - (bit_len)))
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct {
+    // NODE_INFO of the longest route of the node covering the slot
+    uint32_t info;
+    // block of the child node, 0 if none
+    uint32_t child;
+} RouteTreeLcSlot;
+
+// first LC_HEADER_SLOTS slots of a block
+typedef struct {
+    uint32_t skip_key;
+    uint8_t skip_len;
+    uint8_t stride;
+    uint16_t reserved;
+
+    // writer only, routes below the node now and when it was built;
+    // next block of a free or limbo list
+    uint32_t n_routes;
+    union {
+        uint32_t built_routes;
+        uint32_t next_block;
+    };
+} RouteTreeLcHeader;
+
+typedef struct route_tree_lc_v4_s {
+    RouteTreeLcSlot *slots;
+    uint32_t n_slots;
+    // slots from next_slot on were never handed out
+    uint32_t next_slot;
+    uint32_t root;
+
+    // free blocks by stride
+    uint32_t free_block[LC_MAX_STRIDE + 1];
+    // released blocks
+    uint32_t limbo_waiting;
+    uint32_t limbo_pending;
+    uint64_t limbo_epoch;
+
+    // set by an allocation failure during a build
+    bool failed;
+} RouteTreeLcV4;
+
+typedef struct {
+    uint32_t prefix;
+    uint8_t depth_len;
+    uint32_t next_hop;
+} LcRouteV4;
+
+typedef struct {
+    LcRouteV4 *routes;
+    size_t n;
+    size_t max;
+    bool failed;
+} LcRouteListV4;
+
+
+static inline RouteTreeLcHeader *lc_header(const RouteTreeLcV4 *lc, uint32_t block)
+{
+    return (RouteTreeLcHeader *)&lc->slots[block];
+}
+
+static inline RouteTreeLcSlot *lc_slot(const RouteTreeLcV4 *lc, uint32_t block, uint32_t index)
+{
+    return &lc->slots[block + LC_HEADER_SLOTS + index];
+}
+
+static void lc_reclaim(RouteTreeLcV4 *lc)
+{
+    if (lc->limbo_waiting && route_tree_rcu_grace_period_done(lc->limbo_epoch)) {
+        while (lc->limbo_waiting) {
+            const uint32_t block = lc->limbo_waiting;
+            RouteTreeLcHeader *header = lc_header(lc, block);
+            lc->limbo_waiting = header->next_block;
+            header->next_block = lc->free_block[header->stride];
+            lc->free_block[header->stride] = block;
+        }
+    }
+
+    if (0 == lc->limbo_waiting && lc->limbo_pending) {
+        lc->limbo_waiting = lc->limbo_pending;
+        lc->limbo_pending = 0;
+        lc->limbo_epoch = route_tree_rcu_start_grace_period();
+    }
+}
+
+static uint32_t lc_alloc(RouteTreeLcV4 *lc, uint8_t stride)
+{
+    uint32_t block = lc->free_block[stride];
+    if (0 == block && (size_t)lc->n_slots - lc->next_slot < LC_BLOCK_SLOTS(stride)) {
+        lc_reclaim(lc);
+        block = lc->free_block[stride];
+    }
+
+    if (block) {
+        lc->free_block[stride] = lc_header(lc, block)->next_block;
+        return block;
+    }
+
+    if ((size_t)lc->n_slots - lc->next_slot >= LC_BLOCK_SLOTS(stride)) {
+        block = lc->next_slot;
+        lc->next_slot += LC_BLOCK_SLOTS(stride);
+        return block;
+    }
+
+    // cut the smallest larger free block into blocks of this stride
+    uint8_t larger;
+    for (larger = stride + 1; larger <= LC_MAX_STRIDE; ++larger) {
+        block = lc->free_block[larger];
+        if (block) {
+            lc->free_block[larger] = lc_header(lc, block)->next_block;
+
+            uint32_t piece;
+            for (piece = LC_BLOCK_SLOTS(stride); piece + LC_BLOCK_SLOTS(stride) <= LC_BLOCK_SLOTS(larger);
+                    piece += LC_BLOCK_SLOTS(stride)) {
+                RouteTreeLcHeader *header = lc_header(lc, block + piece);
+                header->stride = stride;
+                header->next_block = lc->free_block[stride];
+                lc->free_block[stride] = block + piece;
+            }
+            return block;
+        }
+    }
+
+    lc->failed = true;
+    return 0;
+}
+
+// queue the blocks of a subtree no longer reachable by new lookups
+static void lc_retire(RouteTreeLcV4 *lc, uint32_t block)
+{
+    RouteTreeLcHeader *header = lc_header(lc, block);
+    uint32_t i;
+
+    for (i = 0; i < (1U << header->stride); ++i) {
+        const uint32_t child = lc_slot(lc, block, i)->child;
+        if (child) {
+            lc_retire(lc, child);
+        }
+    }
+
+    header->next_block = lc->limbo_pending;
+    lc->limbo_pending = block;
+}
+
+static void lc_push_route(LcRouteListV4 *list, uint32_t prefix, uint8_t depth_len, uint32_t next_hop)
+{
+    if (list->n == list->max) {
+        const size_t max = list->max ? list->max * 2 : 64;
+        LcRouteV4 *routes = realloc(list->routes, sizeof(*routes) * max);
+        if (NULL == routes) {
+            list->failed = true;
+            return;
+        }
+        list->routes = routes;
+        list->max = max;
+    }
+
+    list->routes[list->n].prefix = prefix;
+    list->routes[list->n].depth_len = depth_len;
+    list->routes[list->n].next_hop = next_hop;
+    list->n++;
+}
+
+// routes of a tree subtree in depth-first order, which is prefix then depth_len order
+static void lc_collect_subtree(const RouteTreePool *pool, uint32_t index, uint32_t prefix, uint8_t bit_offset,
+                            LcRouteListV4 *list)
+{
+    const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(pool, index);
+
+    prefix |= node_v4->key >> bit_offset;
+    bit_offset += NODE_KEY_BIT_LEN(node_v4);
+    if (NODE_NEXT_HOP(node_v4) >= 0) {
+        lc_push_route(list, prefix, bit_offset, NODE_NEXT_HOP(node_v4));
+    }
+
+    if (node_v4->next_bit_0) {
+        lc_collect_subtree(pool, node_v4->next_bit_0, prefix, bit_offset, list);
+    }
+    if (node_v4->next_bit_1) {
+        lc_collect_subtree(pool, node_v4->next_bit_1, prefix, bit_offset, list);
+    }
+}
+
+// routes of the tree sharing the first start bits of ipv4 and longer than start
+static void lc_collect(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                    uint32_t ipv4, uint8_t start, LcRouteListV4 *list)
+{
+    if (0 == start) {
+        if (head_node_v4->first_bit_0) {
+            lc_collect_subtree(pool, head_node_v4->first_bit_0, 0, 0, list);
+        }
+        if (head_node_v4->first_bit_1) {
+            lc_collect_subtree(pool, head_node_v4->first_bit_1, 0, 0, list);
+        }
+        return;
+    }
+
+    uint32_t index = (ipv4 >> 31) ? head_node_v4->first_bit_1 : head_node_v4->first_bit_0;
+    uint32_t prefix = 0;
+    uint8_t bit_offset = 0;
+    while (index) {
+        const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(pool, index);
+        const uint8_t key_end = bit_offset + NODE_KEY_BIT_LEN(node_v4);
+        const uint8_t match_len = (key_end < start ? key_end : start) - bit_offset;
+
+        if (LC_BITS(ipv4, bit_offset, match_len) != LC_BITS(node_v4->key, 0, match_len)) {
+            return;
+        }
+        if (key_end > start) {
+            lc_collect_subtree(pool, index, prefix, bit_offset, list);
+            return;
+        }
+
+        prefix |= node_v4->key >> bit_offset;
+        bit_offset = key_end;
+        if (key_end == start) {
+            // the route of the node belongs above start
+            if (node_v4->next_bit_0) {
+                lc_collect_subtree(pool, node_v4->next_bit_0, prefix, bit_offset, list);
+            }
+            if (node_v4->next_bit_1) {
+                lc_collect_subtree(pool, node_v4->next_bit_1, prefix, bit_offset, list);
+            }
+            return;
+        }
+
+        index = LC_BITS(ipv4, bit_offset, 1) ? node_v4->next_bit_1 : node_v4->next_bit_0;
+    }
+}
+
+// distinct prefixes of bit_len bits among routes at least that long
+static size_t lc_count_prefix(const LcRouteV4 *routes, size_t n, uint8_t bit_len)
+{
+    size_t count = 0;
+    uint32_t last = 0;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (routes[i].depth_len >= bit_len) {
+            const uint32_t prefix = LC_BITS(routes[i].prefix, 0, bit_len);
+            if (0 == count || prefix != last) {
+                count++;
+                last = prefix;
+            }
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Lay out routes[0, n), sorted, longer than start and sharing their first
+ * start bits, as a subtree. Return its block, 0 if there are no routes or
+ * the memory ran out, in which case lc->failed is set.
+ * routes[0] has the shortest depth_len of any route ending before the last
+ * common bit, so the skip only needs the first and last routes.
+ */
+static uint32_t lc_build(RouteTreeLcV4 *lc, const LcRouteV4 *routes, size_t n, uint8_t start)
+{
+    if (0 == n) {
+        return 0;
+    }
+
+    const uint32_t diff = routes[0].prefix ^ routes[n - 1].prefix;
+    uint8_t node_start = diff ? __builtin_clz(diff) : 32;
+    if (node_start > routes[0].depth_len - 1) {
+        node_start = routes[0].depth_len - 1;
+    }
+
+    uint8_t stride = 1;
+    uint8_t k;
+    for (k = 2; k <= LC_MAX_STRIDE && node_start + k <= 32 && (1U << k) <= 2 * n; ++k) {
+        if (2 * lc_count_prefix(routes, n, node_start + k) >= (1U << k)) {
+            stride = k;
+        }
+    }
+
+    const uint32_t block = lc_alloc(lc, stride);
+    if (0 == block) {
+        return 0;
+    }
+
+    RouteTreeLcHeader *header = lc_header(lc, block);
+    header->skip_len = node_start - start;
+    header->skip_key = LC_KEY(routes[0].prefix, start, header->skip_len);
+    header->stride = stride;
+    header->reserved = 0;
+    header->n_routes = n;
+    header->built_routes = n;
+
+    const uint8_t node_end = node_start + stride;
+    uint32_t i;
+    for (i = 0; i < (1U << stride); ++i) {
+        lc_slot(lc, block, i)->info = LC_NO_ROUTE;
+        lc_slot(lc, block, i)->child = 0;
+    }
+
+    size_t j = 0;
+    while (j < n) {
+        const LcRouteV4 *route = &routes[j];
+        if (route->depth_len <= node_end) {
+            // a longer route inside this one comes later and overwrites it
+            const uint32_t first = LC_BITS(route->prefix, node_start, route->depth_len - node_start)
+                                    << (node_end - route->depth_len);
+            const uint32_t last = first + (1U << (node_end - route->depth_len));
+            for (i = first; i < last; ++i) {
+                lc_slot(lc, block, i)->info = NODE_INFO(route->depth_len, route->next_hop);
+            }
+            j++;
+            continue;
+        }
+
+        // the longer routes of one slot are next to each other
+        const uint32_t index = LC_BITS(route->prefix, node_start, stride);
+        size_t end = j + 1;
+        while (end < n && routes[end].depth_len > node_end
+                && LC_BITS(routes[end].prefix, node_start, stride) == index) {
+            end++;
+        }
+
+        const uint32_t child = lc_build(lc, route, end - j, node_end);
+        if (lc->failed) {
+            return 0;
+        }
+        lc_slot(lc, block, index)->child = child;
+        j = end;
+    }
+
+    return block;
+}
+
+/*
+ * Lay out again the subtree hanging from *target, which starts at bit start
+ * on the way to ipv4. Running out of memory drops the LC copy from the head.
+ */
+static void lc_rebuild(RouteTreeLcV4 *lc, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                    uint32_t *target, uint32_t ipv4, uint8_t start)
+{
+    LcRouteListV4 list = {0};
+    uint32_t block = 0;
+
+    lc_collect(pool, head_node_v4, ipv4, start, &list);
+    if (!list.failed) {
+        block = lc_build(lc, list.routes, list.n, start);
+    }
+    free(list.routes);
+
+    if (list.failed || lc->failed) {
+        RCU_STORE(head_node_v4->lc_v4, NULL);
+        return;
+    }
+
+    const uint32_t old_block = *target;
+    RCU_STORE(*target, block);
+    if (old_block) {
+        lc_retire(lc, old_block);
+    }
+}
+
+/*
+ * A node already at LC_MAX_STRIDE has nothing to gain from growing, its
+ * children are rebuilt on their own. Shrinking only wastes slots, so it
+ * waits longer, and the new copy is small next to the old one.
+ */
+static inline bool lc_need_rebuild(const RouteTreeLcHeader *header)
+{
+    return 0 == header->n_routes
+            || (header->stride < LC_MAX_STRIDE
+                && header->n_routes >= LC_GROW_FACTOR * header->built_routes + LC_REBUILD_SLACK)
+            || LC_SHRINK_FACTOR * header->n_routes + LC_REBUILD_SLACK <= header->built_routes;
+}
+
+
+// Internal hooks:
+
+
+int route_tree_lc_v4_lookup(const void *lc_v4, uint32_t ipv4, uint32_t *next_hop, uint32_t *n_visited)
+{
+    const RouteTreeLcV4 *lc = lc_v4;
+    uint32_t block = RCU_LOAD(lc->root);
+    uint8_t bit_offset = 0;
+    int ret = -1;
+
+    while (block) {
+        const RouteTreeLcHeader *header = lc_header(lc, block);
+        (*n_visited)++;
+
+        if (header->skip_len) {
+            if (LC_KEY(ipv4, bit_offset, header->skip_len) != header->skip_key) {
+                break;
+            }
+            bit_offset += header->skip_len;
+        }
+
+        const RouteTreeLcSlot *slot = lc_slot(lc, block, LC_BITS(ipv4, bit_offset, header->stride));
+        const uint32_t info = RCU_LOAD(slot->info);
+        if (INFO_NEXT_HOP(info) >= 0) {
+            *next_hop = INFO_NEXT_HOP(info);
+            ret = 0;
+        }
+        bit_offset += header->stride;
+        block = RCU_LOAD(slot->child);
+    }
+
+    return ret;
+}
+
+void route_tree_lc_v4_update(void *lc_v4, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                            uint32_t ipv4, uint8_t depth_len, int32_t next_hop,
+                            int32_t cover_next_hop, uint8_t cover_depth_len,
+                            int route_delta)
+{
+    RouteTreeLcV4 *lc = lc_v4;
+    uint32_t *target = &lc->root;
+    uint8_t start = 0;
+
+    while (true) {
+        const uint32_t block = *target;
+        if (0 == block) {
+            if (next_hop >= 0) {
+                lc_rebuild(lc, pool, head_node_v4, target, ipv4, start);
+            }
+            return;
+        }
+
+        RouteTreeLcHeader *header = lc_header(lc, block);
+        header->n_routes += route_delta;
+        if (lc_need_rebuild(header)) {
+            lc_rebuild(lc, pool, head_node_v4, target, ipv4, start);
+            return;
+        }
+
+        if (header->skip_len) {
+            if (depth_len <= start + header->skip_len
+                    || LC_KEY(ipv4, start, header->skip_len) != header->skip_key) {
+                // the route ends in the skipped bits or branches off them
+                lc_rebuild(lc, pool, head_node_v4, target, ipv4, start);
+                return;
+            }
+        }
+
+        const uint8_t node_start = start + header->skip_len;
+        const uint8_t node_end = node_start + header->stride;
+        if (depth_len > node_end) {
+            target = &lc_slot(lc, block, LC_BITS(ipv4, node_start, header->stride))->child;
+            start = node_end;
+            continue;
+        }
+
+        const uint32_t first = LC_BITS(ipv4, node_start, depth_len - node_start) << (node_end - depth_len);
+        const uint32_t last = first + (1U << (node_end - depth_len));
+        uint32_t info;
+        if (next_hop >= 0) {
+            info = NODE_INFO(depth_len, next_hop);
+        }
+        else if (cover_next_hop >= 0 && cover_depth_len > node_start) {
+            info = NODE_INFO(cover_depth_len, cover_next_hop);
+        }
+        else {
+            // the cover, if any, is in a node above
+            info = LC_NO_ROUTE;
+        }
+
+        uint32_t i;
+        for (i = first; i < last; ++i) {
+            RouteTreeLcSlot *slot = lc_slot(lc, block, i);
+            const uint8_t slot_depth_len = INFO_KEY_BIT_LEN(slot->info);
+            if (next_hop >= 0 ? slot_depth_len <= depth_len : slot_depth_len == depth_len) {
+                RCU_STORE(slot->info, info);
+            }
+        }
+        return;
+    }
+}
+
+void route_tree_lc_v4_reclaim(void *lc_v4)
+{
+    lc_reclaim(lc_v4);
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_get_memory_footprint_v4_lc(const size_t n_slots)
+{
+    return ALIGN_UP(sizeof(RouteTreeLcV4), 64) + sizeof(RouteTreeLcSlot) * n_slots;
+}
+
+int compressed_route_tree_build_v4_lc(const RouteTreePool *pool,
+                                    RouteTreeHeadNode *head_node_v4,
+                                    void * const lc_v4_ptr,
+                                    const size_t n_slots)
+{
+    if (head_node_v4->lc_v4 || n_slots > UINT32_MAX) {
+        return -1;
+    }
+
+    RouteTreeLcV4 *lc = lc_v4_ptr;
+    memset(lc, 0, sizeof(*lc));
+    lc->slots = (RouteTreeLcSlot *)((uintptr_t)lc_v4_ptr + ALIGN_UP(sizeof(RouteTreeLcV4), 64));
+    lc->n_slots = n_slots;
+    // block 0 is no block
+    lc->next_slot = 1;
+
+    LcRouteListV4 list = {0};
+    lc_collect(pool, head_node_v4, 0, 0, &list);
+    if (!list.failed) {
+        lc->root = lc_build(lc, list.routes, list.n, 0);
+    }
+    free(list.routes);
+
+    if (list.failed || lc->failed) {
+        return -1;
+    }
+
+    RCU_STORE(head_node_v4->lc_v4, (void *)lc);
+
+    return 0;
+}
+
+void compressed_route_tree_release_v4_lc(RouteTreeHeadNode *head_node_v4)
+{
+    RCU_STORE(head_node_v4->lc_v4, NULL);
+}
+
+size_t compressed_route_tree_lc_v4_free_slot_count(const RouteTreeHeadNode *head_node_v4)
+{
+    const RouteTreeLcV4 *lc = head_node_v4->lc_v4;
+    return lc ? lc->n_slots - lc->next_slot : 0;
+}
@@ -0,0 +1,197 @@
+#include "route_tree_internal.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Memory for pools and lookup tables.
+ *
+ * Nodes are reached at random, with 4K pages a walk through a big pool
+ * misses the TLB at about every node. The mapping takes 1G or 2M pages from
+ * the hugetlbfs reserve when there are some (vm.nr_hugepages), and falls
+ * back to normal pages advised for transparent huge pages.
+ * Binding to a NUMA node uses the mbind system call directly, so there is
+ * no libnuma dependency; it is done before any page is touched, so every
+ * page comes from that node.
+ */
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+// from linux/mempolicy.h
+#define ROUTE_TREE_MPOL_BIND 2
+#define ROUTE_TREE_MAX_NUMA_NODES 1024
+
+#define PAGE_SIZE_4K (4UL << 10)
+#define PAGE_SIZE_2M (2UL << 20)
+#define PAGE_SIZE_1G (1UL << 30)
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+
+static void *mem_map(size_t size, size_t page_size, bool reserve)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (reserve ? MAP_NORESERVE : 0);
+    if (PAGE_SIZE_1G == page_size) {
+        flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+    }
+    else if (PAGE_SIZE_2M == page_size) {
+        flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+    }
+
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return MAP_FAILED == ptr ? NULL : ptr;
+}
+
+static int mem_bind(void *ptr, size_t size, int numa_node)
+{
+    if (numa_node < 0 || numa_node >= ROUTE_TREE_MAX_NUMA_NODES) {
+        return -1;
+    }
+
+    unsigned long node_mask[ROUTE_TREE_MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+    node_mask[numa_node / (8 * sizeof(unsigned long))] = 1UL << (numa_node % (8 * sizeof(unsigned long)));
+
+    return syscall(SYS_mbind, ptr, size, ROUTE_TREE_MPOL_BIND, node_mask, ROUTE_TREE_MAX_NUMA_NODES + 1, 0) ? -1 : 0;
+}
+
+
+// Internal hooks:
+
+
+void route_tree_mem_discard(void *ptr, size_t size)
+{
+    const uintptr_t begin = ALIGN_UP((uintptr_t)ptr, PAGE_SIZE_4K);
+    const uintptr_t end = ((uintptr_t)ptr + size) & ~(PAGE_SIZE_4K - 1);
+
+    // best effort, the memory may not be ours to give back
+    if (begin < end) {
+        madvise((void *)begin, end - begin, MADV_DONTNEED);
+    }
+}
+
+
+// Public API:
+
+
+int compressed_route_tree_mem_alloc(RouteTreeMem *mem, const size_t size, const int numa_node, const unsigned int flags)
+{
+    static const size_t page_sizes[] = {PAGE_SIZE_1G, PAGE_SIZE_2M, PAGE_SIZE_4K};
+    size_t i;
+
+    memset(mem, 0, sizeof(*mem));
+    mem->numa_node = ROUTE_TREE_MEM_ANY_NODE;
+    if (0 == size) {
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(page_sizes) / sizeof(page_sizes[0]); ++i) {
+        const size_t page_size = page_sizes[i];
+        // hugetlb pages are taken from the reserve at once
+        if (PAGE_SIZE_4K != page_size && (flags & (ROUTE_TREE_MEM_NO_HUGE | ROUTE_TREE_MEM_RESERVE))) {
+            continue;
+        }
+        // a 1G page for a small table wastes most of it
+        if (PAGE_SIZE_1G == page_size && !(flags & ROUTE_TREE_MEM_HUGE_1G)) {
+            continue;
+        }
+
+        const size_t map_size = ALIGN_UP(size, page_size);
+        void *ptr = mem_map(map_size, page_size, flags & ROUTE_TREE_MEM_RESERVE);
+        if (ptr) {
+            mem->ptr = ptr;
+            mem->size = map_size;
+            mem->page_size = page_size;
+            break;
+        }
+    }
+    if (NULL == mem->ptr) {
+        return -1;
+    }
+
+    if (PAGE_SIZE_4K == mem->page_size && !(flags & ROUTE_TREE_MEM_NO_HUGE)) {
+        // best effort, THP may be disabled
+        madvise(mem->ptr, mem->size, MADV_HUGEPAGE);
+    }
+
+    if (ROUTE_TREE_MEM_ANY_NODE != numa_node) {
+        if (mem_bind(mem->ptr, mem->size, numa_node)) {
+            munmap(mem->ptr, mem->size);
+            memset(mem, 0, sizeof(*mem));
+            mem->numa_node = ROUTE_TREE_MEM_ANY_NODE;
+            return -1;
+        }
+        mem->numa_node = numa_node;
+    }
+
+    if ((flags & ROUTE_TREE_MEM_POPULATE) && !(flags & ROUTE_TREE_MEM_RESERVE)) {
+        size_t offset;
+        for (offset = 0; offset < mem->size; offset += mem->page_size) {
+            ((volatile uint8_t *)mem->ptr)[offset] = 0;
+        }
+    }
+
+    return 0;
+}
+
+int compressed_route_tree_mem_current_node(void)
+{
+    unsigned int cpu;
+    unsigned int numa_node;
+
+    if (syscall(SYS_getcpu, &cpu, &numa_node, NULL)) {
+        return ROUTE_TREE_MEM_ANY_NODE;
+    }
+    return (int)numa_node;
+}
+
+void compressed_route_tree_mem_free(RouteTreeMem *mem)
+{
+    if (mem->ptr) {
+        munmap(mem->ptr, mem->size);
+    }
+    memset(mem, 0, sizeof(*mem));
+    mem->numa_node = ROUTE_TREE_MEM_ANY_NODE;
+}
+
+int compressed_route_tree_replicate_pool(const RouteTreePool *pool, RouteTreePool *replica, RouteTreeMem *mem,
+                                    const int numa_node, const unsigned int flags)
+{
+    *replica = *pool;
+
+    if (pool->v4_nodes_pool_max) {
+        // room to grow as much as pool
+        if (compressed_route_tree_mem_alloc(mem, route_tree_pool_growable_layout(replica, NULL), numa_node,
+                                        flags | ROUTE_TREE_MEM_RESERVE)) {
+            return -1;
+        }
+        route_tree_pool_growable_layout(replica, mem->ptr);
+    }
+    else {
+        // node arrays as laid out by compressed_route_tree_init_nodes, the free lists are in the nodes
+        const size_t v4_size = sizeof(RouteTreeNodeV4) * pool->v4_nodes_pool_total;
+        const size_t v6_size = sizeof(RouteTreeNodeV6) * pool->v6_nodes_pool_total;
+        const size_t v6_offset = ALIGN_UP(v4_size, 64);
+
+        if (compressed_route_tree_mem_alloc(mem, v6_offset + v6_size, numa_node, flags)) {
+            return -1;
+        }
+
+        replica->v4_nodes = mem->ptr;
+        replica->v6_nodes = (RouteTreeNodeV6 *)((uintptr_t)mem->ptr + v6_offset);
+    }
+
+    memcpy(replica->v4_nodes, pool->v4_nodes, sizeof(RouteTreeNodeV4) * pool->v4_nodes_pool_total);
+    memcpy(replica->v6_nodes, pool->v6_nodes, sizeof(RouteTreeNodeV6) * pool->v6_nodes_pool_total);
+    replica->v4_nodes_lock = 0;
+    replica->v6_nodes_lock = 0;
+
+    return 0;
+}
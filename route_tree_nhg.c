@@ -0,0 +1,420 @@
+#include "route_tree_internal.h"
+
+/*
+ * Next hop groups: the routes hold a group id as their next hop and the
+ * group holds the members, so repointing a group changes the next hop of
+ * every route holding it with one store, whatever the number of routes
+ * (prefix independent convergence).
+ * A group publishes its members as one word, the member block index in the
+ * upper half and the member count in the lower half. A new member list is
+ * written to a fresh block before the word is swapped; the old block waits
+ * for a grace period in a limbo list before it is reused, as the tbl8 groups
+ * of route_tree_fast_v4.c do.
+ * Blocks come in power of two sizes from 1 to ROUTE_TREE_NHG_MAX_MEMBERS
+ * members, one free list per size. The free and limbo lists link blocks
+ * through links[block], which only the writer reads: a block in limbo
+ * keeps its members untouched for the readers still on it, and they are
+ * only written again once the block is handed out. Once the fresh slots
+ * are used up a larger free block is split, freed halves are not merged
+ * back. Slot 0 is never allocated and means no block.
+ */
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+#define NHG_WORD(block, n_members) (((uint64_t)(block) << 32) | (uint32_t)(n_members))
+#define NHG_WORD_BLOCK(word) ((uint32_t)((word) >> 32))
+#define NHG_WORD_MEMBERS(word) ((uint32_t)(word))
+
+
+static inline uint8_t nhg_size_class(uint32_t n_members)
+{
+    return n_members > 1 ? (uint8_t)(32 - __builtin_clz(n_members - 1)) : 0;
+}
+
+static inline RouteTreeNhg *nhg_active(RouteTreeNhgTable *table, uint32_t group_id)
+{
+    if (group_id >= table->max_groups || !table->groups[group_id].active) {
+        return NULL;
+    }
+    return &table->groups[group_id];
+}
+
+static void nhg_reclaim(RouteTreeNhgTable *table)
+{
+    uint8_t size_class;
+
+    if (table->has_limbo_waiting && route_tree_rcu_grace_period_done(table->limbo_epoch)) {
+        for (size_class = 0; size_class < ROUTE_TREE_NHG_SIZE_CLASSES; ++size_class) {
+            while (table->limbo_waiting[size_class]) {
+                const uint32_t block = table->limbo_waiting[size_class];
+                table->limbo_waiting[size_class] = table->links[block];
+                table->links[block] = table->free_block[size_class];
+                table->free_block[size_class] = block;
+            }
+        }
+        table->has_limbo_waiting = false;
+    }
+
+    if (!table->has_limbo_waiting && table->has_limbo_pending) {
+        for (size_class = 0; size_class < ROUTE_TREE_NHG_SIZE_CLASSES; ++size_class) {
+            table->limbo_waiting[size_class] = table->limbo_pending[size_class];
+            table->limbo_pending[size_class] = 0;
+        }
+        table->has_limbo_pending = false;
+        table->has_limbo_waiting = true;
+        table->limbo_epoch = route_tree_rcu_start_grace_period();
+    }
+}
+
+// smallest free block of size_class or above, 0 if none
+static uint32_t nhg_pop_free(RouteTreeNhgTable *table, uint8_t *size_class)
+{
+    uint8_t i;
+    for (i = *size_class; i < ROUTE_TREE_NHG_SIZE_CLASSES; ++i) {
+        const uint32_t block = table->free_block[i];
+        if (block) {
+            table->free_block[i] = table->links[block];
+            *size_class = i;
+            return block;
+        }
+    }
+    return 0;
+}
+
+static uint32_t nhg_alloc(RouteTreeNhgTable *table, uint8_t size_class)
+{
+    const size_t size = (size_t)1 << size_class;
+    uint32_t block = table->free_block[size_class];
+
+    if (block) {
+        table->free_block[size_class] = table->links[block];
+        return block;
+    }
+    if (table->n_member_slots - table->next_member_slot >= size) {
+        block = (uint32_t)table->next_member_slot;
+        table->next_member_slot += size;
+        return block;
+    }
+
+    // out of fresh slots, split a larger free block, halves go to the lists below it
+    nhg_reclaim(table);
+    uint8_t block_class = size_class;
+    block = nhg_pop_free(table, &block_class);
+    while (block && block_class > size_class) {
+        --block_class;
+        const uint32_t half = block + ((uint32_t)1 << block_class);
+        table->links[half] = table->free_block[block_class];
+        table->free_block[block_class] = half;
+    }
+    return block;
+}
+
+// readers may still walk the members of word until the next grace period
+static void nhg_free(RouteTreeNhgTable *table, uint64_t word)
+{
+    const uint32_t block = NHG_WORD_BLOCK(word);
+    if (0 == block) {
+        return;
+    }
+
+    const uint8_t size_class = nhg_size_class(NHG_WORD_MEMBERS(word));
+    table->links[block] = table->limbo_pending[size_class];
+    table->limbo_pending[size_class] = block;
+    table->has_limbo_pending = true;
+}
+
+static inline void nhg_ref(RouteTreeNhgTable *table, int32_t group_id, int delta)
+{
+    if (group_id >= 0 && (uint32_t)group_id < table->max_groups) {
+        table->groups[group_id].refcount += delta;
+    }
+}
+
+static inline int nhg_resolve(const RouteTreeNhgTable *table, uint32_t group_id, uint32_t flow_hash, uint32_t *next_hop)
+{
+    if (group_id >= table->max_groups) {
+        return -1;
+    }
+
+    const uint64_t word = RCU_LOAD(table->groups[group_id].members);
+    const uint32_t n_members = NHG_WORD_MEMBERS(word);
+    if (0 == n_members) {
+        return -1;
+    }
+
+    // multiply-shift maps the hash onto the members without a division
+    *next_hop = RCU_LOAD(table->members[NHG_WORD_BLOCK(word) + (uint32_t)(((uint64_t)flow_hash * n_members) >> 32)]);
+    return 0;
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_nhg_get_memory_footprint(const size_t max_groups, const size_t max_members)
+{
+    // slot 0 is never allocated; the members, then the links of the writer
+    return ALIGN_UP(sizeof(RouteTreeNhg) * max_groups, 64) + ALIGN_UP(sizeof(uint32_t) * (max_members + 1), 64)
+        + sizeof(uint32_t) * (max_members + 1);
+}
+
+int compressed_route_tree_nhg_init(RouteTreeNhgTable *table, void * const nhg_ptr, const size_t max_groups, const size_t max_members)
+{
+    if (0 == max_groups || max_groups > (size_t)ROUTE_TREE_MAX_NEXT_HOP + 1 || max_members >= UINT32_MAX) {
+        return -1;
+    }
+
+    memset(table, 0, sizeof(*table));
+    table->groups = (RouteTreeNhg *)nhg_ptr;
+    table->members = (uint32_t *)((uint8_t *)nhg_ptr + ALIGN_UP(sizeof(RouteTreeNhg) * max_groups, 64));
+    table->links = (uint32_t *)((uint8_t *)table->members + ALIGN_UP(sizeof(uint32_t) * (max_members + 1), 64));
+    table->max_groups = max_groups;
+    table->n_member_slots = max_members + 1;
+    table->next_member_slot = 1;
+    memset(table->groups, 0, sizeof(RouteTreeNhg) * max_groups);
+
+    return 0;
+}
+
+int compressed_route_tree_nhg_create(RouteTreeNhgTable *table, uint32_t group_id)
+{
+    if (group_id >= table->max_groups || table->groups[group_id].active) {
+        return -1;
+    }
+
+    RouteTreeNhg *group = &table->groups[group_id];
+    group->refcount = 0;
+    RCU_STORE(group->members, NHG_WORD(0, 0));
+    group->active = true;
+    table->n_groups++;
+
+    return 0;
+}
+
+int compressed_route_tree_nhg_destroy(RouteTreeNhgTable *table, uint32_t group_id)
+{
+    RouteTreeNhg *group = nhg_active(table, group_id);
+
+    if (NULL == group || group->refcount) {
+        return -1;
+    }
+
+    const uint64_t word = group->members;
+    RCU_STORE(group->members, NHG_WORD(0, 0));
+    nhg_free(table, word);
+    group->active = false;
+    table->n_groups--;
+
+    return 0;
+}
+
+int compressed_route_tree_nhg_set_members(RouteTreeNhgTable *table, uint32_t group_id, const uint32_t *members, size_t n_members)
+{
+    RouteTreeNhg *group = nhg_active(table, group_id);
+    uint32_t block = 0;
+    size_t i;
+
+    if (NULL == group || n_members > ROUTE_TREE_NHG_MAX_MEMBERS) {
+        return -1;
+    }
+
+    if (n_members) {
+        block = nhg_alloc(table, nhg_size_class((uint32_t)n_members));
+        if (0 == block) {
+            return -1;
+        }
+        for (i = 0; i < n_members; ++i) {
+            table->members[block + i] = members[i];
+        }
+    }
+
+    // the members are written before the word making them visible
+    const uint64_t word = group->members;
+    RCU_STORE(group->members, NHG_WORD(block, n_members));
+    nhg_free(table, word);
+
+    return 0;
+}
+
+int compressed_route_tree_nhg_get_members(const RouteTreeNhgTable *table, uint32_t group_id, uint32_t *members, size_t *n_members)
+{
+    if (group_id >= table->max_groups || !table->groups[group_id].active) {
+        return -1;
+    }
+
+    const uint64_t word = RCU_LOAD(table->groups[group_id].members);
+    const uint32_t n = NHG_WORD_MEMBERS(word);
+    uint32_t i;
+    for (i = 0; i < n; ++i) {
+        members[i] = RCU_LOAD(table->members[NHG_WORD_BLOCK(word) + i]);
+    }
+    *n_members = n;
+
+    return 0;
+}
+
+uint32_t compressed_route_tree_nhg_refcount(const RouteTreeNhgTable *table, uint32_t group_id)
+{
+    return group_id < table->max_groups ? table->groups[group_id].refcount : 0;
+}
+
+int compressed_route_tree_nhg_add_v4(RouteTreeNhgTable *table, RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                    uint32_t be_ipv4, uint8_t depth_len, uint32_t group_id)
+{
+    if (NULL == nhg_active(table, group_id) || depth_len > 32) {
+        return -1;
+    }
+
+    int32_t old_group_id = -1;
+    if (0 == depth_len) {
+        old_group_id = head_node_v4->default_next_hop;
+    }
+    else {
+        const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(pool, compressed_route_tree_route_handle_v4(pool, head_node_v4, be_ipv4, depth_len));
+        if (node_v4) {
+            old_group_id = NODE_NEXT_HOP(node_v4);
+        }
+    }
+
+    if (compressed_route_tree_add_v4(pool, head_node_v4, be_ipv4, depth_len, group_id)) {
+        return -1;
+    }
+    nhg_ref(table, (int32_t)group_id, 1);
+    nhg_ref(table, old_group_id, -1);
+
+    return 0;
+}
+
+int compressed_route_tree_nhg_add_v6(RouteTreeNhgTable *table, RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t group_id)
+{
+    if (NULL == nhg_active(table, group_id) || depth_len > 128) {
+        return -1;
+    }
+
+    int32_t old_group_id = -1;
+    if (0 == depth_len) {
+        old_group_id = head_node_v6->default_next_hop;
+    }
+    else {
+        const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(pool, compressed_route_tree_route_handle_v6(pool, head_node_v6, be_ipv6_u8ptr, depth_len));
+        if (node_v6) {
+            old_group_id = NODE_NEXT_HOP(node_v6);
+        }
+    }
+
+    if (compressed_route_tree_add_v6(pool, head_node_v6, be_ipv6_u8ptr, depth_len, group_id)) {
+        return -1;
+    }
+    nhg_ref(table, (int32_t)group_id, 1);
+    nhg_ref(table, old_group_id, -1);
+
+    return 0;
+}
+
+int compressed_route_tree_nhg_del_v4(RouteTreeNhgTable *table, RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                    uint32_t be_ipv4, uint8_t depth_len)
+{
+    if (depth_len > 32) {
+        return -1;
+    }
+
+    int32_t old_group_id = -1;
+    if (0 == depth_len) {
+        old_group_id = head_node_v4->default_next_hop;
+    }
+    else {
+        const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(pool, compressed_route_tree_route_handle_v4(pool, head_node_v4, be_ipv4, depth_len));
+        if (node_v4) {
+            old_group_id = NODE_NEXT_HOP(node_v4);
+        }
+    }
+    if (old_group_id < 0) {
+        return -1;
+    }
+
+    if (compressed_route_tree_del_v4(pool, head_node_v4, be_ipv4, depth_len)) {
+        return -1;
+    }
+    nhg_ref(table, old_group_id, -1);
+
+    return 0;
+}
+
+int compressed_route_tree_nhg_del_v6(RouteTreeNhgTable *table, RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    const uint8_t *be_ipv6_u8ptr, uint8_t depth_len)
+{
+    if (depth_len > 128) {
+        return -1;
+    }
+
+    int32_t old_group_id = -1;
+    if (0 == depth_len) {
+        old_group_id = head_node_v6->default_next_hop;
+    }
+    else {
+        const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(pool, compressed_route_tree_route_handle_v6(pool, head_node_v6, be_ipv6_u8ptr, depth_len));
+        if (node_v6) {
+            old_group_id = NODE_NEXT_HOP(node_v6);
+        }
+    }
+    if (old_group_id < 0) {
+        return -1;
+    }
+
+    if (compressed_route_tree_del_v6(pool, head_node_v6, be_ipv6_u8ptr, depth_len)) {
+        return -1;
+    }
+    nhg_ref(table, old_group_id, -1);
+
+    return 0;
+}
+
+int compressed_route_tree_nhg_resolve(const RouteTreeNhgTable *table, uint32_t group_id, uint32_t flow_hash, uint32_t *next_hop)
+{
+    return nhg_resolve(table, group_id, flow_hash, next_hop);
+}
+
+size_t compressed_route_tree_nhg_resolve_bulk(const RouteTreeNhgTable *table, const uint32_t *flow_hash, size_t n,
+                                            uint32_t *next_hop, uint64_t *hit_mask)
+{
+    size_t n_hits = 0;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        const uint64_t bit = (uint64_t)1 << (i % 64);
+        if (!(hit_mask[i / 64] & bit)) {
+            continue;
+        }
+        if (nhg_resolve(table, next_hop[i], flow_hash[i], &next_hop[i])) {
+            hit_mask[i / 64] &= ~bit;
+        }
+        else {
+            n_hits++;
+        }
+    }
+
+    return n_hits;
+}
+
+int compressed_route_tree_nhg_lookup_v4(const RouteTreeNhgTable *table, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                                        uint32_t be_ipv4, uint32_t flow_hash, uint32_t *next_hop)
+{
+    uint32_t group_id;
+
+    if (compressed_route_tree_lookup_v4(pool, head_node_v4, be_ipv4, &group_id)) {
+        return -1;
+    }
+    return nhg_resolve(table, group_id, flow_hash, next_hop);
+}
+
+int compressed_route_tree_nhg_lookup_v6(const RouteTreeNhgTable *table, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                                        const uint8_t *be_ipv6_u8ptr, uint32_t flow_hash, uint32_t *next_hop)
+{
+    uint32_t group_id;
+
+    if (compressed_route_tree_lookup_v6(pool, head_node_v6, be_ipv6_u8ptr, &group_id)) {
+        return -1;
+    }
+    return nhg_resolve(table, group_id, flow_hash, next_hop);
+}
@@ -0,0 +1,763 @@
+#include "route_tree_internal.h"
+#include <arpa/inet.h>
+#include <endian.h>
+
+/*
+ * Poptrie copy of the tree, after Asai and Ohara (SIGCOMM 2015).
+ *
+ * A node takes 6 bits of the address per step through 64 slots. Bit i of
+ * vector is set when slot i goes on to a child node; the children of a node
+ * are next to each other from base1 on, the one of slot i after as many as
+ * vector has bits below i. Other slots end on a leaf, the next hop of the
+ * longest route covering the slot, pushed down from the nodes above. A run
+ * of slots with the same leaf keeps one: bit i of leafvec is set where a run
+ * starts and the leaf of slot i is found from base0 by the popcount of
+ * leafvec up to i. A lookup is a loop of one node load and one popcount,
+ * then one leaf load, with no backtracking. The default route is not pushed
+ * down, a lookup ending on no leaf takes the one of the head.
+ *
+ * Node and leaf arrays are blocks of 1 to 64 entries, rounded up to a power
+ * of 2, in the caller memory. A block in use is never written: an update
+ * lays out again from the tree the nodes on the path to its route, keeping
+ * the children it cannot reach, and the subtrees below the slots the route
+ * covers, then swaps the root in with one store. Old blocks go through the
+ * limbo lists before being reused; the lists are linked in a side array,
+ * as readers may still be walking the blocks.
+ */
+
+#define PT_STRIDE 6
+#define PT_SLOTS (1U << PT_STRIDE)
+// blocks of 2^0 to 2^6 entries
+#define PT_CLASSES (PT_STRIDE + 1)
+#define PT_NO_ROUTE (-1)
+
+// bit_len bits of a left aligned u128 from bit_offset, right aligned, 0 < bit_len <= 64
+#define PT_BITS(u128, bit_offset, bit_len) \
+                ((uint64_t)(((RouteTreeU128)(u128) << (bit_offset)) >> (128 - (bit_len))))
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct {
+    uint64_t vector;
+    uint64_t leafvec;
+    uint32_t base0;
+    uint32_t base1;
+} PoptrieNode;
+
+typedef struct {
+    uint32_t n_units;
+    // units from next_unit on were never handed out
+    uint32_t next_unit;
+    // smallest block, one link per block of that size
+    uint8_t min_class;
+    // next block of a free or limbo list, by block >> min_class
+    uint32_t *link;
+
+    uint32_t free_block[PT_CLASSES];
+    uint32_t limbo_pending[PT_CLASSES];
+    uint32_t limbo_waiting[PT_CLASSES];
+} PoptrieArena;
+
+typedef struct route_tree_poptrie_s {
+    PoptrieNode *nodes;
+    int32_t *leaves;
+    // block of the root node
+    uint32_t root;
+    // address bits, 32 or 128
+    uint8_t width;
+
+    PoptrieArena node_arena;
+    PoptrieArena leaf_arena;
+    bool limbo_waiting;
+    uint64_t limbo_epoch;
+
+    // set by an allocation failure during an update
+    bool failed;
+} RouteTreePoptrie;
+
+// a node of either tree, key left aligned
+typedef struct {
+    RouteTreeU128 key;
+    uint8_t key_bit_len;
+    int32_t next_hop;
+    uint32_t next_bit_0;
+    uint32_t next_bit_1;
+} PoptrieTreeNode;
+
+// slots of a node being laid out
+typedef struct {
+    int32_t leaf[PT_SLOTS];
+    uint64_t vector;
+} PoptrieWindow;
+
+/*
+ * POPCNT kernels for the lookups, picked at run time when the CPU has it;
+ * otherwise the compiler falls back to a bit-twiddling popcount.
+ */
+#if defined(__x86_64__)
+#define POPCNT_TARGET __attribute__((target("popcnt")))
+
+static bool poptrie_popcnt;
+
+__attribute__((constructor)) static void poptrie_popcnt_init(void)
+{
+    __builtin_cpu_init();
+    poptrie_popcnt = __builtin_cpu_supports("popcnt");
+}
+#else
+#define POPCNT_TARGET
+#define poptrie_popcnt false
+#endif
+
+
+static inline uint8_t pt_class(const PoptrieArena *arena, uint32_t n)
+{
+    const uint8_t class = n > 1 ? 32 - __builtin_clz(n - 1) : 0;
+    return class > arena->min_class ? class : arena->min_class;
+}
+
+static inline uint32_t *pt_link(const PoptrieArena *arena, uint32_t block)
+{
+    return &arena->link[block >> arena->min_class];
+}
+
+// whether bit_len bits of prefix from bit_offset are the first ones of key
+static inline bool pt_match(RouteTreeU128 prefix, RouteTreeU128 key, uint8_t bit_offset, uint8_t bit_len)
+{
+    return 0 == bit_len || 0 == (((prefix << bit_offset) ^ key) >> (128 - bit_len));
+}
+
+static inline uint32_t pt_popcount(uint64_t u64)
+{
+    return __builtin_popcountll(u64);
+}
+
+static void pt_arena_init(PoptrieArena *arena, uint32_t n_units, uint8_t min_class, uint32_t *link)
+{
+    memset(arena, 0, sizeof(*arena));
+    arena->n_units = n_units;
+    // block 0 is no block
+    arena->next_unit = 1U << min_class;
+    arena->min_class = min_class;
+    arena->link = link;
+}
+
+static bool pt_arena_pending(const PoptrieArena *arena)
+{
+    uint8_t class;
+
+    for (class = 0; class < PT_CLASSES; ++class) {
+        if (arena->limbo_pending[class]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void pt_arena_wait(PoptrieArena *arena)
+{
+    memcpy(arena->limbo_waiting, arena->limbo_pending, sizeof(arena->limbo_waiting));
+    memset(arena->limbo_pending, 0, sizeof(arena->limbo_pending));
+}
+
+static void pt_arena_release(PoptrieArena *arena)
+{
+    uint8_t class;
+
+    for (class = 0; class < PT_CLASSES; ++class) {
+        while (arena->limbo_waiting[class]) {
+            const uint32_t block = arena->limbo_waiting[class];
+            arena->limbo_waiting[class] = *pt_link(arena, block);
+            *pt_link(arena, block) = arena->free_block[class];
+            arena->free_block[class] = block;
+        }
+    }
+}
+
+/*
+ * Blocks waiting for a grace period become free once it is over. Blocks
+ * retired since start one only with start_grace_period: an update retires
+ * blocks still reachable from the root until it swaps it.
+ */
+static void pt_reclaim(RouteTreePoptrie *pt, bool start_grace_period)
+{
+    if (pt->limbo_waiting && route_tree_rcu_grace_period_done(pt->limbo_epoch)) {
+        pt_arena_release(&pt->node_arena);
+        pt_arena_release(&pt->leaf_arena);
+        pt->limbo_waiting = false;
+    }
+
+    if (start_grace_period && !pt->limbo_waiting
+            && (pt_arena_pending(&pt->node_arena) || pt_arena_pending(&pt->leaf_arena))) {
+        pt_arena_wait(&pt->node_arena);
+        pt_arena_wait(&pt->leaf_arena);
+        pt->limbo_waiting = true;
+        pt->limbo_epoch = route_tree_rcu_start_grace_period();
+    }
+}
+
+static uint32_t pt_alloc(RouteTreePoptrie *pt, PoptrieArena *arena, uint32_t n)
+{
+    const uint8_t class = pt_class(arena, n);
+    uint32_t block = arena->free_block[class];
+    if (0 == block && arena->n_units - arena->next_unit < (1U << class)) {
+        pt_reclaim(pt, false);
+        block = arena->free_block[class];
+    }
+
+    if (block) {
+        arena->free_block[class] = *pt_link(arena, block);
+        return block;
+    }
+
+    if (arena->n_units - arena->next_unit >= (1U << class)) {
+        block = arena->next_unit;
+        arena->next_unit += 1U << class;
+        return block;
+    }
+
+    // cut the smallest larger free block into blocks of this class
+    uint8_t larger;
+    for (larger = class + 1; larger < PT_CLASSES; ++larger) {
+        block = arena->free_block[larger];
+        if (block) {
+            arena->free_block[larger] = *pt_link(arena, block);
+
+            uint32_t piece;
+            for (piece = 1U << class; piece < (1U << larger); piece += 1U << class) {
+                *pt_link(arena, block + piece) = arena->free_block[class];
+                arena->free_block[class] = block + piece;
+            }
+            return block;
+        }
+    }
+
+    pt->failed = true;
+    return 0;
+}
+
+static void pt_retire_block(PoptrieArena *arena, uint32_t block, uint32_t n)
+{
+    const uint8_t class = pt_class(arena, n);
+    *pt_link(arena, block) = arena->limbo_pending[class];
+    arena->limbo_pending[class] = block;
+}
+
+// queue the blocks of node and of the nodes below it
+static void pt_retire(RouteTreePoptrie *pt, const PoptrieNode *node)
+{
+    const uint32_t n_children = pt_popcount(node->vector);
+    uint32_t i;
+
+    for (i = 0; i < n_children; ++i) {
+        pt_retire(pt, &pt->nodes[node->base1 + i]);
+    }
+    if (n_children) {
+        pt_retire_block(&pt->node_arena, node->base1, n_children);
+    }
+    if (node->leafvec) {
+        pt_retire_block(&pt->leaf_arena, node->base0, pt_popcount(node->leafvec));
+    }
+}
+
+static inline void pt_tree_node(const RouteTreePoptrie *pt, const RouteTreePool *pool, uint32_t index,
+                                PoptrieTreeNode *tree_node)
+{
+    if (32 == pt->width) {
+        const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(pool, index);
+        tree_node->key = (RouteTreeU128)node_v4->key << 96;
+        tree_node->key_bit_len = NODE_KEY_BIT_LEN(node_v4);
+        tree_node->next_hop = NODE_NEXT_HOP(node_v4);
+        tree_node->next_bit_0 = node_v4->next_bit_0;
+        tree_node->next_bit_1 = node_v4->next_bit_1;
+    }
+    else {
+        const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(pool, index);
+        tree_node->key = ipv6_to_u128(&node_v6->key);
+        tree_node->key_bit_len = NODE_KEY_BIT_LEN(node_v6);
+        tree_node->next_hop = NODE_NEXT_HOP(node_v6);
+        tree_node->next_bit_0 = node_v6->next_bit_0;
+        tree_node->next_bit_1 = node_v6->next_bit_1;
+    }
+}
+
+// routes of the tree subtree at index in the slots of the node at bit start
+static void pt_window_visit(const RouteTreePoptrie *pt, const RouteTreePool *pool, uint32_t index,
+                            RouteTreeU128 prefix, uint8_t bit_offset, uint8_t start, PoptrieWindow *window)
+{
+    PoptrieTreeNode tree_node;
+    pt_tree_node(pt, pool, index, &tree_node);
+
+    const uint8_t end = bit_offset + tree_node.key_bit_len;
+    prefix |= tree_node.key >> bit_offset;
+    if (end > start + PT_STRIDE) {
+        // routes go on below the slot
+        window->vector |= 1ULL << PT_BITS(prefix, start, PT_STRIDE);
+        return;
+    }
+
+    if (tree_node.next_hop >= 0) {
+        // a longer route inside this one comes later and overwrites it
+        const uint32_t first = PT_BITS(prefix, start, end - start) << (start + PT_STRIDE - end);
+        const uint32_t last = first + (1U << (start + PT_STRIDE - end));
+        uint32_t i;
+        for (i = first; i < last; ++i) {
+            window->leaf[i] = tree_node.next_hop;
+        }
+    }
+
+    if (tree_node.next_bit_0) {
+        pt_window_visit(pt, pool, tree_node.next_bit_0, prefix, end, start, window);
+    }
+    if (tree_node.next_bit_1) {
+        pt_window_visit(pt, pool, tree_node.next_bit_1, prefix, end, start, window);
+    }
+}
+
+/*
+ * Slots of the node at bit start on the way to prefix: each takes the
+ * longest route covering it, the one of the slot above if none ends in the
+ * node, and is marked in vector if longer routes go on below it.
+ */
+static void pt_window(const RouteTreePoptrie *pt, const RouteTreePool *pool, const RouteTreeHeadNode *head_node,
+                    RouteTreeU128 prefix, uint8_t start, PoptrieWindow *window)
+{
+    int32_t cover = PT_NO_ROUTE;
+    uint32_t i;
+
+    window->vector = 0;
+    if (0 == start) {
+        for (i = 0; i < PT_SLOTS; ++i) {
+            window->leaf[i] = cover;
+        }
+        if (head_node->first_bit_0) {
+            pt_window_visit(pt, pool, head_node->first_bit_0, 0, 0, start, window);
+        }
+        if (head_node->first_bit_1) {
+            pt_window_visit(pt, pool, head_node->first_bit_1, 0, 0, start, window);
+        }
+        return;
+    }
+
+    uint32_t index = PT_BITS(prefix, 0, 1) ? head_node->first_bit_1 : head_node->first_bit_0;
+    RouteTreeU128 tree_prefix = 0;
+    uint8_t bit_offset = 0;
+    uint32_t visit[2] = {0, 0};
+    while (index) {
+        PoptrieTreeNode tree_node;
+        pt_tree_node(pt, pool, index, &tree_node);
+
+        const uint8_t end = bit_offset + tree_node.key_bit_len;
+        const uint8_t match_len = (end < start ? end : start) - bit_offset;
+        if (!pt_match(prefix, tree_node.key, bit_offset, match_len)) {
+            break;
+        }
+        if (end > start) {
+            visit[0] = index;
+            break;
+        }
+
+        tree_prefix |= tree_node.key >> bit_offset;
+        bit_offset = end;
+        if (tree_node.next_hop >= 0) {
+            cover = tree_node.next_hop;
+        }
+        if (end == start) {
+            visit[0] = tree_node.next_bit_0;
+            visit[1] = tree_node.next_bit_1;
+            break;
+        }
+        index = PT_BITS(prefix, bit_offset, 1) ? tree_node.next_bit_1 : tree_node.next_bit_0;
+    }
+
+    for (i = 0; i < PT_SLOTS; ++i) {
+        window->leaf[i] = cover;
+    }
+    for (i = 0; i < 2; ++i) {
+        if (visit[i]) {
+            pt_window_visit(pt, pool, visit[i], tree_prefix, bit_offset, start, window);
+        }
+    }
+}
+
+// whether routes of the tree go on below the first bit_len bits of prefix
+static bool pt_below(const RouteTreePoptrie *pt, const RouteTreePool *pool, const RouteTreeHeadNode *head_node,
+                    RouteTreeU128 prefix, uint8_t bit_len)
+{
+    uint32_t index = PT_BITS(prefix, 0, 1) ? head_node->first_bit_1 : head_node->first_bit_0;
+    uint8_t bit_offset = 0;
+
+    while (index) {
+        PoptrieTreeNode tree_node;
+        pt_tree_node(pt, pool, index, &tree_node);
+
+        const uint8_t end = bit_offset + tree_node.key_bit_len;
+        const uint8_t match_len = (end < bit_len ? end : bit_len) - bit_offset;
+        if (!pt_match(prefix, tree_node.key, bit_offset, match_len)) {
+            return false;
+        }
+        if (end > bit_len) {
+            return true;
+        }
+        bit_offset = end;
+        index = PT_BITS(prefix, bit_offset, 1) ? tree_node.next_bit_1 : tree_node.next_bit_0;
+    }
+    return false;
+}
+
+/*
+ * Lay out into *node the node at bit start on the way to prefix, from the
+ * tree. With old, the node it replaces after a change of the route
+ * route/depth_len: the children of slots the change cannot reach are kept,
+ * the others laid out again and the blocks left behind retired.
+ * Return -1 once out of memory.
+ */
+static int pt_layout(RouteTreePoptrie *pt, const RouteTreePool *pool, const RouteTreeHeadNode *head_node,
+                    RouteTreeU128 prefix, uint8_t start, const PoptrieNode *old,
+                    RouteTreeU128 route, uint8_t depth_len, PoptrieNode *node)
+{
+    // a change below the node keeps its slots while the one on the way still goes on
+    if (old && depth_len > start + PT_STRIDE) {
+        const uint32_t slot = PT_BITS(route, start, PT_STRIDE);
+        const uint64_t bit = 1ULL << slot;
+        const RouteTreeU128 child_prefix = prefix | ((RouteTreeU128)slot << (128 - PT_STRIDE - start));
+        if ((old->vector & bit) && pt_below(pt, pool, head_node, child_prefix, start + PT_STRIDE)) {
+            const uint32_t n_children = pt_popcount(old->vector);
+            const uint32_t k = pt_popcount(old->vector & (bit - 1));
+
+            *node = *old;
+            node->base1 = pt_alloc(pt, &pt->node_arena, n_children);
+            if (0 == node->base1) {
+                return -1;
+            }
+            memcpy(&pt->nodes[node->base1], &pt->nodes[old->base1], sizeof(PoptrieNode) * n_children);
+            if (pt_layout(pt, pool, head_node, child_prefix, start + PT_STRIDE, &pt->nodes[old->base1 + k],
+                        route, depth_len, &pt->nodes[node->base1 + k])) {
+                return -1;
+            }
+            pt_retire_block(&pt->node_arena, old->base1, n_children);
+            return 0;
+        }
+    }
+
+    PoptrieWindow window;
+    pt_window(pt, pool, head_node, prefix, start, &window);
+
+    int32_t leaves[PT_SLOTS];
+    uint32_t n_leaves = 0;
+    uint64_t leafvec = 0;
+    uint32_t i;
+    for (i = 0; i < PT_SLOTS; ++i) {
+        // a slot going on to a child does not break a run
+        if (!(window.vector >> i & 0x1) && (0 == n_leaves || leaves[n_leaves - 1] != window.leaf[i])) {
+            leafvec |= 1ULL << i;
+            leaves[n_leaves++] = window.leaf[i];
+        }
+    }
+
+    node->vector = window.vector;
+    node->leafvec = leafvec;
+    if (old && old->leafvec == leafvec && 0 == memcmp(&pt->leaves[old->base0], leaves, sizeof(leaves[0]) * n_leaves)) {
+        node->base0 = old->base0;
+    }
+    else {
+        node->base0 = 0;
+        if (n_leaves) {
+            node->base0 = pt_alloc(pt, &pt->leaf_arena, n_leaves);
+            if (0 == node->base0) {
+                return -1;
+            }
+            memcpy(&pt->leaves[node->base0], leaves, sizeof(leaves[0]) * n_leaves);
+        }
+        if (old && old->leafvec) {
+            pt_retire_block(&pt->leaf_arena, old->base0, pt_popcount(old->leafvec));
+        }
+    }
+
+    const uint32_t n_children = pt_popcount(window.vector);
+    node->base1 = 0;
+    if (n_children) {
+        node->base1 = pt_alloc(pt, &pt->node_arena, n_children);
+        if (0 == node->base1) {
+            return -1;
+        }
+    }
+
+    // slots the change reaches: the one it goes on below, or those it covers
+    uint64_t reach = 0;
+    if (old) {
+        if (depth_len > start + PT_STRIDE) {
+            reach = 1ULL << PT_BITS(route, start, PT_STRIDE);
+        }
+        else {
+            const uint8_t shift = start + PT_STRIDE - depth_len;
+            reach = ((1ULL << (1U << shift)) - 1) << (PT_BITS(route, start, depth_len - start) << shift);
+        }
+    }
+
+    uint64_t vector = window.vector;
+    uint32_t k;
+    for (k = 0; vector; ++k, vector &= vector - 1) {
+        const uint32_t slot = __builtin_ctzll(vector);
+        const uint64_t bit = 1ULL << slot;
+        const RouteTreeU128 child_prefix = prefix | ((RouteTreeU128)slot << (128 - PT_STRIDE - start));
+        const PoptrieNode *old_child = NULL;
+        if (old && (old->vector & bit)) {
+            old_child = &pt->nodes[old->base1 + pt_popcount(old->vector & (bit - 1))];
+        }
+
+        PoptrieNode *child = &pt->nodes[node->base1 + k];
+        if (old_child && !(reach & bit)) {
+            *child = *old_child;
+        }
+        else if (old_child && depth_len > start + PT_STRIDE) {
+            if (pt_layout(pt, pool, head_node, child_prefix, start + PT_STRIDE, old_child, route, depth_len, child)) {
+                return -1;
+            }
+        }
+        else {
+            // the leaves pushed down change, or there was no child
+            if (old_child) {
+                pt_retire(pt, old_child);
+            }
+            if (pt_layout(pt, pool, head_node, child_prefix, start + PT_STRIDE, NULL, 0, 0, child)) {
+                return -1;
+            }
+        }
+    }
+
+    if (old && old->vector) {
+        // children gone with the change
+        for (vector = old->vector & ~window.vector; vector; vector &= vector - 1) {
+            const uint64_t bit = vector & -vector;
+            pt_retire(pt, &pt->nodes[old->base1 + pt_popcount(old->vector & (bit - 1))]);
+        }
+        pt_retire_block(&pt->node_arena, old->base1, pt_popcount(old->vector));
+    }
+
+    return 0;
+}
+
+/*
+ * Lay out the path to route/depth_len (CPU order) again and swap the root.
+ * Running out of memory drops the copy from the head.
+ */
+static void pt_update(RouteTreePoptrie *pt, const RouteTreePool *pool, RouteTreeHeadNode *head_node,
+                    RouteTreeU128 route, uint8_t depth_len)
+{
+    // the default route is not pushed down
+    if (0 == depth_len || pt->failed) {
+        return;
+    }
+
+    const uint32_t old_root = pt->root;
+    const uint32_t root = pt_alloc(pt, &pt->node_arena, 1);
+    if (0 == root
+            || pt_layout(pt, pool, head_node, 0, 0, &pt->nodes[old_root], route, depth_len, &pt->nodes[root])) {
+        pt->failed = true;
+        RCU_STORE(head_node->poptrie, NULL);
+        return;
+    }
+
+    RCU_STORE(pt->root, root);
+    pt_retire_block(&pt->node_arena, old_root, 1);
+}
+
+static int pt_build(const RouteTreePool *pool, RouteTreeHeadNode *head_node, void * const poptrie_ptr,
+                    const size_t n_nodes, const size_t n_leaves, uint8_t width)
+{
+    if (head_node->poptrie || n_nodes < 2 || n_nodes > UINT32_MAX || n_leaves < 4 || n_leaves > UINT32_MAX) {
+        return -1;
+    }
+
+    RouteTreePoptrie *pt = poptrie_ptr;
+    memset(pt, 0, sizeof(*pt));
+    pt->width = width;
+
+    uintptr_t ptr = (uintptr_t)poptrie_ptr + ALIGN_UP(sizeof(RouteTreePoptrie), 64);
+    pt->nodes = (PoptrieNode *)ptr;
+    ptr += ALIGN_UP(sizeof(PoptrieNode) * n_nodes, 64);
+    pt->leaves = (int32_t *)ptr;
+    ptr += ALIGN_UP(sizeof(int32_t) * n_leaves, 64);
+    pt_arena_init(&pt->node_arena, n_nodes, 0, (uint32_t *)ptr);
+    ptr += sizeof(uint32_t) * n_nodes;
+    // leaf blocks hold 2 leaves at least
+    pt_arena_init(&pt->leaf_arena, n_leaves, 1, (uint32_t *)ptr);
+
+    pt->root = pt_alloc(pt, &pt->node_arena, 1);
+    if (0 == pt->root || pt_layout(pt, pool, head_node, 0, 0, NULL, 0, 0, &pt->nodes[pt->root])) {
+        return -1;
+    }
+
+    RCU_STORE(head_node->poptrie, (void *)pt);
+
+    return 0;
+}
+
+static inline __attribute__((always_inline)) int _poptrie_lookup_v4(const RouteTreePoptrie *pt,
+                                                                const RouteTreeHeadNode *head_node_v4,
+                                                                uint32_t ipv4,
+                                                                uint32_t *next_hop)
+{
+    // address bits from the top of a u64, so a shift takes the 6 of a step
+    const uint64_t bits = (uint64_t)ipv4 << 32;
+    const PoptrieNode *node = &pt->nodes[RCU_LOAD(pt->root)];
+    uint8_t bit_offset = 0;
+    uint64_t bit;
+
+    while (true) {
+        bit = 1ULL << ((bits << bit_offset) >> (64 - PT_STRIDE));
+        if (!(node->vector & bit)) {
+            break;
+        }
+        node = &pt->nodes[node->base1 + pt_popcount(node->vector & (bit - 1))];
+        bit_offset += PT_STRIDE;
+    }
+
+    int32_t leaf = pt->leaves[node->base0 + pt_popcount(node->leafvec & ((bit << 1) - 1)) - 1];
+    if (leaf < 0) {
+        leaf = RCU_LOAD(head_node_v4->default_next_hop);
+        if (leaf < 0) {
+            return -1;
+        }
+    }
+    *next_hop = leaf;
+    return 0;
+}
+
+static inline __attribute__((always_inline)) int _poptrie_lookup_v6(const RouteTreePoptrie *pt,
+                                                                const RouteTreeHeadNode *head_node_v6,
+                                                                RouteTreeU128 ipv6,
+                                                                uint32_t *next_hop)
+{
+    const PoptrieNode *node = &pt->nodes[RCU_LOAD(pt->root)];
+    uint8_t bit_offset = 0;
+    uint64_t bit;
+
+    while (true) {
+        bit = 1ULL << PT_BITS(ipv6, bit_offset, PT_STRIDE);
+        if (!(node->vector & bit)) {
+            break;
+        }
+        node = &pt->nodes[node->base1 + pt_popcount(node->vector & (bit - 1))];
+        bit_offset += PT_STRIDE;
+    }
+
+    int32_t leaf = pt->leaves[node->base0 + pt_popcount(node->leafvec & ((bit << 1) - 1)) - 1];
+    if (leaf < 0) {
+        leaf = RCU_LOAD(head_node_v6->default_next_hop);
+        if (leaf < 0) {
+            return -1;
+        }
+    }
+    *next_hop = leaf;
+    return 0;
+}
+
+static POPCNT_TARGET int _poptrie_lookup_v4_popcnt(const RouteTreePoptrie *pt, const RouteTreeHeadNode *head_node_v4,
+                                                uint32_t ipv4, uint32_t *next_hop)
+{
+    return _poptrie_lookup_v4(pt, head_node_v4, ipv4, next_hop);
+}
+
+static POPCNT_TARGET int _poptrie_lookup_v6_popcnt(const RouteTreePoptrie *pt, const RouteTreeHeadNode *head_node_v6,
+                                                RouteTreeU128 ipv6, uint32_t *next_hop)
+{
+    return _poptrie_lookup_v6(pt, head_node_v6, ipv6, next_hop);
+}
+
+
+// Internal hooks:
+
+
+void route_tree_poptrie_update_v4(void *poptrie, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                uint32_t ipv4, uint8_t depth_len)
+{
+    pt_update(poptrie, pool, head_node_v4, (RouteTreeU128)ipv4 << 96, depth_len);
+}
+
+void route_tree_poptrie_update_v6(void *poptrie, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                const RouteTreeIPV6 *ipv6, uint8_t depth_len)
+{
+    pt_update(poptrie, pool, head_node_v6, ipv6_to_u128(ipv6), depth_len);
+}
+
+void route_tree_poptrie_reclaim(void *poptrie)
+{
+    pt_reclaim(poptrie, true);
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_get_memory_footprint_poptrie(const size_t n_nodes, const size_t n_leaves)
+{
+    return ALIGN_UP(sizeof(RouteTreePoptrie), 64)
+            + ALIGN_UP(sizeof(PoptrieNode) * n_nodes, 64)
+            + ALIGN_UP(sizeof(int32_t) * n_leaves, 64)
+            // free and limbo list links
+            + sizeof(uint32_t) * (n_nodes + n_leaves / 2);
+}
+
+int compressed_route_tree_build_v4_poptrie(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v4,
+                                        void * const poptrie_ptr, const size_t n_nodes, const size_t n_leaves)
+{
+    return pt_build(pool, head_node_v4, poptrie_ptr, n_nodes, n_leaves, 32);
+}
+
+int compressed_route_tree_build_v6_poptrie(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                        void * const poptrie_ptr, const size_t n_nodes, const size_t n_leaves)
+{
+    return pt_build(pool, head_node_v6, poptrie_ptr, n_nodes, n_leaves, 128);
+}
+
+void compressed_route_tree_release_v4_poptrie(RouteTreeHeadNode *head_node_v4)
+{
+    RCU_STORE(head_node_v4->poptrie, NULL);
+}
+
+void compressed_route_tree_release_v6_poptrie(RouteTreeHeadNode *head_node_v6)
+{
+    RCU_STORE(head_node_v6->poptrie, NULL);
+}
+
+void compressed_route_tree_poptrie_get_usage(const RouteTreeHeadNode *head_node, size_t *n_nodes, size_t *n_leaves)
+{
+    const RouteTreePoptrie *pt = head_node->poptrie;
+
+    *n_nodes = pt ? pt->node_arena.next_unit : 0;
+    *n_leaves = pt ? pt->leaf_arena.next_unit : 0;
+}
+
+int compressed_route_tree_lookup_v4_poptrie(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                                        uint32_t be_ipv4, uint32_t *next_hop)
+{
+    const RouteTreePoptrie *pt = RCU_LOAD(head_node_v4->poptrie);
+
+    if (NULL == pt) {
+        return compressed_route_tree_lookup_v4(pool, head_node_v4, be_ipv4, next_hop);
+    }
+    if (poptrie_popcnt) {
+        return _poptrie_lookup_v4_popcnt(pt, head_node_v4, ntohl(be_ipv4), next_hop);
+    }
+    return _poptrie_lookup_v4(pt, head_node_v4, ntohl(be_ipv4), next_hop);
+}
+
+int compressed_route_tree_lookup_v6_poptrie(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                                        const uint8_t *be_ipv6_u8ptr, uint32_t *next_hop)
+{
+    const RouteTreePoptrie *pt = RCU_LOAD(head_node_v6->poptrie);
+
+    if (NULL == pt) {
+        return compressed_route_tree_lookup_v6(pool, head_node_v6, be_ipv6_u8ptr, next_hop);
+    }
+
+    uint64_t be_u64[2];
+    memcpy(be_u64, be_ipv6_u8ptr, sizeof(be_u64));
+    const RouteTreeU128 ipv6 = ((RouteTreeU128)be64toh(be_u64[0]) << 64) | be64toh(be_u64[1]);
+    if (poptrie_popcnt) {
+        return _poptrie_lookup_v6_popcnt(pt, head_node_v6, ipv6, next_hop);
+    }
+    return _poptrie_lookup_v6(pt, head_node_v6, ipv6, next_hop);
+}
@@ -0,0 +1,216 @@
+#include "route_tree_internal.h"
+
+/*
+ * Replicated table: the writer applies every add/del to the primary first
+ * and, once it has succeeded there, to each replica in turn. A replica
+ * starts as a copy of the primary pool and heads and goes through the same
+ * add/del paths, so it holds the same routes; the nodes it is made of come
+ * from its own pool, in memory bound to its node.
+ * A replica the writer could not update has lost track of the primary, it
+ * is detached: readers of its node go back to the primary and its memory
+ * is kept until release.
+ */
+
+
+static void replica_detach(RouteTreeReplica *replica)
+{
+    RCU_STORE(replica->attached, false);
+}
+
+static inline const RouteTreeReplica *replica_attached(const RouteTreeReplicated *replicated, int replica_id)
+{
+    if (replica_id < 0 || (size_t)replica_id >= replicated->n_replicas) {
+        return NULL;
+    }
+
+    const RouteTreeReplica *replica = &replicated->replicas[replica_id];
+    return RCU_LOAD(replica->attached) ? replica : NULL;
+}
+
+
+// Public API:
+
+
+int compressed_route_tree_replicated_init(RouteTreeReplicated *replicated, RouteTreePool *pool,
+                                    RouteTreeHeadNode *head_node_v4, RouteTreeHeadNode *head_node_v6,
+                                    const int *numa_nodes, const size_t n_numa_nodes, const unsigned int mem_flags)
+{
+    size_t i;
+
+    if (n_numa_nodes > ROUTE_TREE_MAX_REPLICAS) {
+        return -1;
+    }
+
+    memset(replicated, 0, sizeof(*replicated));
+    replicated->pool = pool;
+    replicated->head_node_v4 = head_node_v4;
+    replicated->head_node_v6 = head_node_v6;
+
+    for (i = 0; i < n_numa_nodes; ++i) {
+        RouteTreeReplica *replica = &replicated->replicas[i];
+
+        if (compressed_route_tree_replicate_pool(pool, &replica->pool, &replica->mem, numa_nodes[i], mem_flags)) {
+            compressed_route_tree_replicated_release(replicated);
+            return -1;
+        }
+        replicated->n_replicas = i + 1;
+
+        // lookup engines are built on the replica heads by the caller, with memory of their node
+        if (head_node_v4) {
+            replica->head_node_v4 = *head_node_v4;
+            replica->head_node_v4.fast_v4 = NULL;
+            replica->head_node_v4.lc_v4 = NULL;
+            replica->head_node_v4.poptrie = NULL;
+            replica->head_node_v4.bsl_v6 = NULL;
+            replica->head_node_v4.v6_64 = NULL;
+            replica->head_node_v4.aggregate = NULL;
+        }
+        else {
+            compressed_route_tree_reset_head(&replica->head_node_v4);
+        }
+        if (head_node_v6) {
+            replica->head_node_v6 = *head_node_v6;
+            replica->head_node_v6.fast_v4 = NULL;
+            replica->head_node_v6.lc_v4 = NULL;
+            replica->head_node_v6.poptrie = NULL;
+            replica->head_node_v6.bsl_v6 = NULL;
+            replica->head_node_v6.v6_64 = NULL;
+            replica->head_node_v6.aggregate = NULL;
+        }
+        else {
+            compressed_route_tree_reset_head(&replica->head_node_v6);
+        }
+        replica->numa_node = numa_nodes[i];
+        replica->attached = true;
+    }
+
+    return 0;
+}
+
+void compressed_route_tree_replicated_release(RouteTreeReplicated *replicated)
+{
+    size_t i;
+
+    for (i = 0; i < replicated->n_replicas; ++i) {
+        RouteTreeReplica *replica = &replicated->replicas[i];
+        replica->attached = false;
+        compressed_route_tree_mem_free(&replica->mem);
+    }
+    replicated->n_replicas = 0;
+}
+
+int compressed_route_tree_replicated_local(const RouteTreeReplicated *replicated, const int numa_node)
+{
+    size_t i;
+
+    for (i = 0; i < replicated->n_replicas; ++i) {
+        if (replicated->replicas[i].numa_node == numa_node) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+int compressed_route_tree_replicated_add_v4(RouteTreeReplicated *replicated, uint32_t be_ipv4, uint8_t depth_len, uint32_t next_hop)
+{
+    size_t i;
+
+    if (NULL == replicated->head_node_v4
+            || compressed_route_tree_add_v4(replicated->pool, replicated->head_node_v4, be_ipv4, depth_len, next_hop)) {
+        return -1;
+    }
+
+    for (i = 0; i < replicated->n_replicas; ++i) {
+        RouteTreeReplica *replica = &replicated->replicas[i];
+        if (replica->attached
+                && compressed_route_tree_add_v4(&replica->pool, &replica->head_node_v4, be_ipv4, depth_len, next_hop)) {
+            replica_detach(replica);
+        }
+    }
+    return 0;
+}
+
+int compressed_route_tree_replicated_add_v6(RouteTreeReplicated *replicated, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t next_hop)
+{
+    size_t i;
+
+    if (NULL == replicated->head_node_v6
+            || compressed_route_tree_add_v6(replicated->pool, replicated->head_node_v6, be_ipv6_u8ptr, depth_len, next_hop)) {
+        return -1;
+    }
+
+    for (i = 0; i < replicated->n_replicas; ++i) {
+        RouteTreeReplica *replica = &replicated->replicas[i];
+        if (replica->attached
+                && compressed_route_tree_add_v6(&replica->pool, &replica->head_node_v6, be_ipv6_u8ptr, depth_len, next_hop)) {
+            replica_detach(replica);
+        }
+    }
+    return 0;
+}
+
+int compressed_route_tree_replicated_del_v4(RouteTreeReplicated *replicated, uint32_t be_ipv4, uint8_t depth_len)
+{
+    size_t i;
+
+    if (NULL == replicated->head_node_v4
+            || compressed_route_tree_del_v4(replicated->pool, replicated->head_node_v4, be_ipv4, depth_len)) {
+        return -1;
+    }
+
+    for (i = 0; i < replicated->n_replicas; ++i) {
+        RouteTreeReplica *replica = &replicated->replicas[i];
+        if (replica->attached
+                && compressed_route_tree_del_v4(&replica->pool, &replica->head_node_v4, be_ipv4, depth_len)) {
+            replica_detach(replica);
+        }
+    }
+    return 0;
+}
+
+int compressed_route_tree_replicated_del_v6(RouteTreeReplicated *replicated, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len)
+{
+    size_t i;
+
+    if (NULL == replicated->head_node_v6
+            || compressed_route_tree_del_v6(replicated->pool, replicated->head_node_v6, be_ipv6_u8ptr, depth_len)) {
+        return -1;
+    }
+
+    for (i = 0; i < replicated->n_replicas; ++i) {
+        RouteTreeReplica *replica = &replicated->replicas[i];
+        if (replica->attached
+                && compressed_route_tree_del_v6(&replica->pool, &replica->head_node_v6, be_ipv6_u8ptr, depth_len)) {
+            replica_detach(replica);
+        }
+    }
+    return 0;
+}
+
+int compressed_route_tree_replicated_lookup_v4(const RouteTreeReplicated *replicated, const int replica_id,
+                                        uint32_t be_ipv4, uint32_t *next_hop)
+{
+    const RouteTreeReplica *replica = replica_attached(replicated, replica_id);
+
+    if (replica) {
+        return compressed_route_tree_lookup_v4(&replica->pool, &replica->head_node_v4, be_ipv4, next_hop);
+    }
+    if (NULL == replicated->head_node_v4) {
+        return -1;
+    }
+    return compressed_route_tree_lookup_v4(replicated->pool, replicated->head_node_v4, be_ipv4, next_hop);
+}
+
+int compressed_route_tree_replicated_lookup_v6(const RouteTreeReplicated *replicated, const int replica_id,
+                                        const uint8_t *be_ipv6_u8ptr, uint32_t *next_hop)
+{
+    const RouteTreeReplica *replica = replica_attached(replicated, replica_id);
+
+    if (replica) {
+        return compressed_route_tree_lookup_v6(&replica->pool, &replica->head_node_v6, be_ipv6_u8ptr, next_hop);
+    }
+    if (NULL == replicated->head_node_v6) {
+        return -1;
+    }
+    return compressed_route_tree_lookup_v6(replicated->pool, replicated->head_node_v6, be_ipv6_u8ptr, next_hop);
+}
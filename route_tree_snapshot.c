@@ -0,0 +1,388 @@
+#include "route_tree_internal.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Binary snapshot of a node pool and the heads using it.
+ *
+ * Nodes link to each other by index, so the node arrays are written as
+ * they are in memory and used in place after a restore: loading is a mmap
+ * plus a validation walk, no route is added again. The nodes the walk does
+ * not reach are the free ones.
+ *
+ * File layout, every section aligned to SNAPSHOT_ALIGN:
+ *   RouteTreeSnapshotHeader
+ *   RouteTreeSnapshotHead[n_heads_v4 + n_heads_v6]
+ *   v4 nodes[v4_nodes_pool_total]
+ *   v6 nodes[v6_nodes_pool_total]
+ * The file is only read back by the same build on the same architecture,
+ * node sizes and a byte order marker are checked.
+ */
+
+#define SNAPSHOT_MAGIC 0x50414e5345455254ULL    // "TREESNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGN 64
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t v4_node_size;
+    uint32_t v6_node_size;
+    uint32_t n_heads_v4;
+    uint32_t n_heads_v6;
+
+    uint64_t v4_nodes_pool_total;
+    uint64_t v6_nodes_pool_total;
+
+    // from the start of the file
+    uint64_t v4_offset;
+    uint64_t v6_offset;
+    uint64_t file_size;
+} RouteTreeSnapshotHeader;
+
+typedef struct {
+    int32_t default_next_hop;
+    uint32_t first_bit_0;
+    uint32_t first_bit_1;
+    uint32_t reserved;
+    uint64_t total_nodes;
+    uint64_t total_routes;
+    uint64_t add_count;
+    uint64_t del_count;
+} RouteTreeSnapshotHead;
+
+static size_t snapshot_pool_size_v4(uint64_t total)
+{
+    return sizeof(RouteTreeNodeV4) * total;
+}
+
+static size_t snapshot_pool_size_v6(uint64_t total)
+{
+    return sizeof(RouteTreeNodeV6) * total;
+}
+
+static void snapshot_layout(RouteTreeSnapshotHeader *header)
+{
+    const size_t heads_size = sizeof(RouteTreeSnapshotHead) * (header->n_heads_v4 + header->n_heads_v6);
+
+    header->v4_offset = ALIGN_UP(ALIGN_UP(sizeof(*header), SNAPSHOT_ALIGN) + heads_size, SNAPSHOT_ALIGN);
+    header->v6_offset = ALIGN_UP(header->v4_offset + snapshot_pool_size_v4(header->v4_nodes_pool_total), SNAPSHOT_ALIGN);
+    header->file_size = header->v6_offset + snapshot_pool_size_v6(header->v6_nodes_pool_total);
+}
+
+static int snapshot_write(FILE *fp, const void *data, size_t size, size_t *offset)
+{
+    if (size && 1 != fwrite(data, size, 1, fp)) {
+        return -1;
+    }
+    *offset += size;
+
+    return 0;
+}
+
+static int snapshot_pad(FILE *fp, size_t *offset)
+{
+    static const uint8_t zero[SNAPSHOT_ALIGN];
+
+    return snapshot_write(fp, zero, ALIGN_UP(*offset, SNAPSHOT_ALIGN) - *offset, offset);
+}
+
+static int snapshot_write_heads(FILE *fp, const RouteTreeHeadNode *head_nodes, size_t n_heads, size_t *offset)
+{
+    size_t i;
+    for (i = 0; i < n_heads; ++i) {
+        const RouteTreeSnapshotHead head = {
+            .default_next_hop = head_nodes[i].default_next_hop,
+            .first_bit_0 = head_nodes[i].first_bit_0,
+            .first_bit_1 = head_nodes[i].first_bit_1,
+            .total_nodes = head_nodes[i].total_nodes,
+            .total_routes = head_nodes[i].total_routes,
+            .add_count = head_nodes[i].add_count,
+            .del_count = head_nodes[i].del_count,
+        };
+        if (snapshot_write(fp, &head, sizeof(head), offset)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void snapshot_read_heads(const RouteTreeSnapshotHead *snapshot_heads, RouteTreeHeadNode *head_nodes, size_t n_heads)
+{
+    size_t i;
+    for (i = 0; i < n_heads; ++i) {
+        compressed_route_tree_reset_head(&head_nodes[i]);
+        head_nodes[i].default_next_hop = snapshot_heads[i].default_next_hop;
+        head_nodes[i].first_bit_0 = snapshot_heads[i].first_bit_0;
+        head_nodes[i].first_bit_1 = snapshot_heads[i].first_bit_1;
+        head_nodes[i].total_nodes = snapshot_heads[i].total_nodes;
+        head_nodes[i].total_routes = snapshot_heads[i].total_routes;
+        head_nodes[i].add_count = snapshot_heads[i].add_count;
+        head_nodes[i].del_count = snapshot_heads[i].del_count;
+        route_tree_bump_generation(&head_nodes[i]);
+    }
+}
+
+/*
+ * Every node reachable from a head must be in range, used once, and fit the
+ * address length; the others make the free list of the pool. seen has one
+ * bit per node index.
+ */
+static inline int snapshot_mark(uint8_t *seen, uint32_t index)
+{
+    if (seen[index / 8] & (1U << (index % 8))) {
+        return -1;
+    }
+    seen[index / 8] |= 1U << (index % 8);
+
+    return 0;
+}
+
+static int _snapshot_check_v4(const RouteTreePool *pool, uint8_t *seen, uint32_t index, uint32_t bit_offset, size_t *n_nodes)
+{
+    if (0 == index || index >= pool->v4_nodes_pool_total || snapshot_mark(seen, index)) {
+        return -1;
+    }
+
+    const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(pool, index);
+    bit_offset += NODE_KEY_BIT_LEN(node_v4);
+    if (0 == NODE_KEY_BIT_LEN(node_v4) || bit_offset > 32) {
+        return -1;
+    }
+    (*n_nodes)++;
+
+    if (node_v4->next_bit_0 && _snapshot_check_v4(pool, seen, node_v4->next_bit_0, bit_offset, n_nodes)) {
+        return -1;
+    }
+    if (node_v4->next_bit_1 && _snapshot_check_v4(pool, seen, node_v4->next_bit_1, bit_offset, n_nodes)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _snapshot_check_v6(const RouteTreePool *pool, uint8_t *seen, uint32_t index, uint32_t bit_offset, size_t *n_nodes)
+{
+    if (0 == index || index >= pool->v6_nodes_pool_total || snapshot_mark(seen, index)) {
+        return -1;
+    }
+
+    const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(pool, index);
+    bit_offset += NODE_KEY_BIT_LEN(node_v6);
+    if (0 == NODE_KEY_BIT_LEN(node_v6) || bit_offset > 128) {
+        return -1;
+    }
+    (*n_nodes)++;
+
+    if (node_v6->next_bit_0 && _snapshot_check_v6(pool, seen, node_v6->next_bit_0, bit_offset, n_nodes)) {
+        return -1;
+    }
+    if (node_v6->next_bit_1 && _snapshot_check_v6(pool, seen, node_v6->next_bit_1, bit_offset, n_nodes)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int snapshot_check_v4(RouteTreePool *pool, const RouteTreeHeadNode *head_nodes, size_t n_heads)
+{
+    int ret = -1;
+    uint8_t *seen = calloc(pool->v4_nodes_pool_total / 8 + 1, 1);
+    if (NULL == seen) {
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < n_heads; ++i) {
+        size_t n_nodes = 0;
+        if (head_nodes[i].first_bit_0 && _snapshot_check_v4(pool, seen, head_nodes[i].first_bit_0, 0, &n_nodes)) {
+            goto ret;
+        }
+        if (head_nodes[i].first_bit_1 && _snapshot_check_v4(pool, seen, head_nodes[i].first_bit_1, 0, &n_nodes)) {
+            goto ret;
+        }
+        if (n_nodes != head_nodes[i].total_nodes) {
+            goto ret;
+        }
+    }
+
+    route_tree_pool_set_used_v4(pool, seen);
+    ret = 0;
+
+ret:
+    free(seen);
+    return ret;
+}
+
+static int snapshot_check_v6(RouteTreePool *pool, const RouteTreeHeadNode *head_nodes, size_t n_heads)
+{
+    int ret = -1;
+    uint8_t *seen = calloc(pool->v6_nodes_pool_total / 8 + 1, 1);
+    if (NULL == seen) {
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < n_heads; ++i) {
+        size_t n_nodes = 0;
+        if (head_nodes[i].first_bit_0 && _snapshot_check_v6(pool, seen, head_nodes[i].first_bit_0, 0, &n_nodes)) {
+            goto ret;
+        }
+        if (head_nodes[i].first_bit_1 && _snapshot_check_v6(pool, seen, head_nodes[i].first_bit_1, 0, &n_nodes)) {
+            goto ret;
+        }
+        if (n_nodes != head_nodes[i].total_nodes) {
+            goto ret;
+        }
+    }
+
+    route_tree_pool_set_used_v6(pool, seen);
+    ret = 0;
+
+ret:
+    free(seen);
+    return ret;
+}
+
+
+// Public API:
+
+
+int compressed_route_tree_save(const RouteTreePool *pool,
+                            const RouteTreeHeadNode *head_nodes_v4, size_t n_heads_v4,
+                            const RouteTreeHeadNode *head_nodes_v6, size_t n_heads_v6,
+                            const char *path)
+{
+    RouteTreeSnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .byte_order = 0x01020304,
+        .v4_node_size = sizeof(RouteTreeNodeV4),
+        .v6_node_size = sizeof(RouteTreeNodeV6),
+        .n_heads_v4 = n_heads_v4,
+        .n_heads_v6 = n_heads_v6,
+        // nodes still waiting for a grace period are free in the snapshot
+        .v4_nodes_pool_total = pool->v4_nodes_pool_total,
+        .v6_nodes_pool_total = pool->v6_nodes_pool_total,
+    };
+    snapshot_layout(&header);
+
+    FILE *fp = fopen(path, "wb");
+    if (NULL == fp) {
+        return -1;
+    }
+
+    size_t offset = 0;
+    int ret = -1;
+    if (snapshot_write(fp, &header, sizeof(header), &offset)
+            || snapshot_pad(fp, &offset)
+            || snapshot_write_heads(fp, head_nodes_v4, n_heads_v4, &offset)
+            || snapshot_write_heads(fp, head_nodes_v6, n_heads_v6, &offset)
+            || snapshot_pad(fp, &offset)
+            || snapshot_write(fp, pool->v4_nodes, sizeof(RouteTreeNodeV4) * pool->v4_nodes_pool_total, &offset)
+            || snapshot_pad(fp, &offset)
+            || snapshot_write(fp, pool->v6_nodes, sizeof(RouteTreeNodeV6) * pool->v6_nodes_pool_total, &offset)) {
+        goto ret;
+    }
+    if (offset != header.file_size) {
+        goto ret;
+    }
+    ret = 0;
+
+ret:
+    if (fclose(fp)) {
+        ret = -1;
+    }
+    if (ret) {
+        unlink(path);
+    }
+    return ret;
+}
+
+int compressed_route_tree_load_mmap(RouteTreePool *pool,
+                                RouteTreeHeadNode *head_nodes_v4, size_t n_heads_v4,
+                                RouteTreeHeadNode *head_nodes_v6, size_t n_heads_v6,
+                                const char *path,
+                                void **snapshot_ptr,
+                                size_t *snapshot_size)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(RouteTreeSnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    const size_t size = st.st_size;
+    // private mapping: the restored table can still be updated, the file is not
+    void *snapshot = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == snapshot) {
+        return -1;
+    }
+
+    const RouteTreeSnapshotHeader *header = snapshot;
+    RouteTreeSnapshotHeader layout = *header;
+    if (header->magic != SNAPSHOT_MAGIC
+            || header->version != SNAPSHOT_VERSION
+            || header->byte_order != 0x01020304
+            || header->v4_node_size != sizeof(RouteTreeNodeV4)
+            || header->v6_node_size != sizeof(RouteTreeNodeV6)
+            || header->n_heads_v4 != n_heads_v4
+            || header->n_heads_v6 != n_heads_v6
+            || header->v4_nodes_pool_total > UINT32_MAX
+            || header->v6_nodes_pool_total > UINT32_MAX) {
+        goto err;
+    }
+    snapshot_layout(&layout);
+    if (layout.v4_offset != header->v4_offset
+            || layout.v6_offset != header->v6_offset
+            || layout.file_size != header->file_size
+            || header->file_size != size) {
+        goto err;
+    }
+
+    RouteTreePool loaded;
+    loaded.v4_nodes = (RouteTreeNodeV4 *)((uint8_t *)snapshot + header->v4_offset);
+    loaded.v4_nodes_pool_total = header->v4_nodes_pool_total;
+    loaded.v6_nodes = (RouteTreeNodeV6 *)((uint8_t *)snapshot + header->v6_offset);
+    loaded.v6_nodes_pool_total = header->v6_nodes_pool_total;
+    loaded.v4_nodes_pool_max = 0;
+    loaded.v6_nodes_pool_max = 0;
+
+    const RouteTreeSnapshotHead *snapshot_heads =
+                (const RouteTreeSnapshotHead *)((uint8_t *)snapshot + ALIGN_UP(sizeof(*header), SNAPSHOT_ALIGN));
+    snapshot_read_heads(snapshot_heads, head_nodes_v4, n_heads_v4);
+    snapshot_read_heads(snapshot_heads + n_heads_v4, head_nodes_v6, n_heads_v6);
+
+    if (snapshot_check_v4(&loaded, head_nodes_v4, n_heads_v4)
+            || snapshot_check_v6(&loaded, head_nodes_v6, n_heads_v6)) {
+        size_t i;
+        for (i = 0; i < n_heads_v4; ++i) {
+            compressed_route_tree_reset_head(&head_nodes_v4[i]);
+        }
+        for (i = 0; i < n_heads_v6; ++i) {
+            compressed_route_tree_reset_head(&head_nodes_v6[i]);
+        }
+        goto err;
+    }
+
+    *pool = loaded;
+    *snapshot_ptr = snapshot;
+    *snapshot_size = size;
+    return 0;
+
+err:
+    munmap(snapshot, size);
+    return -1;
+}
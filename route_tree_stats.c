@@ -0,0 +1,148 @@
+#include "route_tree_internal.h"
+
+/*
+ * Lookup counters: a thread takes a slot of stats_slots on its first lookup
+ * and only ever writes to it, so counting is a plain increment in a cache
+ * line of its own. Threads past the last slot count in a thread-local slot
+ * nobody reads.
+ */
+#ifdef ROUTE_TREE_STATS
+static RouteTreeStatsSlot stats_slots[ROUTE_TREE_STATS_MAX_THREADS];
+static uint32_t stats_slots_used;
+static __thread RouteTreeStatsSlot stats_slot_overflow;
+
+__thread RouteTreeStatsSlot *route_tree_stats_slot;
+#endif
+
+
+static void _depth_stats_v4(const RouteTreePool *pool, uint32_t index, uint32_t depth, uint64_t *depth_count)
+{
+    const RouteTreeNodeV4 *node_v4 = route_tree_node_v4(pool, index);
+
+    depth++;
+    if (NODE_NEXT_HOP(node_v4) >= 0) {
+        depth_count[depth]++;
+    }
+    if (node_v4->next_bit_0) {
+        _depth_stats_v4(pool, node_v4->next_bit_0, depth, depth_count);
+    }
+    if (node_v4->next_bit_1) {
+        _depth_stats_v4(pool, node_v4->next_bit_1, depth, depth_count);
+    }
+}
+
+static void _depth_stats_v6(const RouteTreePool *pool, uint32_t index, uint32_t depth, uint64_t *depth_count)
+{
+    const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(pool, index);
+
+    depth++;
+    if (NODE_NEXT_HOP(node_v6) >= 0) {
+        depth_count[depth]++;
+    }
+    if (node_v6->next_bit_0) {
+        _depth_stats_v6(pool, node_v6->next_bit_0, depth, depth_count);
+    }
+    if (node_v6->next_bit_1) {
+        _depth_stats_v6(pool, node_v6->next_bit_1, depth, depth_count);
+    }
+}
+
+#ifdef ROUTE_TREE_STATS
+static void _sum_lookup_stats(RouteTreeLookupStats *sum, const RouteTreeLookupStats *stats)
+{
+    uint32_t i;
+
+    sum->lookups += __atomic_load_n(&stats->lookups, __ATOMIC_RELAXED);
+    sum->hits += __atomic_load_n(&stats->hits, __ATOMIC_RELAXED);
+    sum->default_hits += __atomic_load_n(&stats->default_hits, __ATOMIC_RELAXED);
+    sum->misses += __atomic_load_n(&stats->misses, __ATOMIC_RELAXED);
+    for (i = 0; i < ROUTE_TREE_STATS_MAX_VISITED; ++i) {
+        sum->visited[i] += __atomic_load_n(&stats->visited[i], __ATOMIC_RELAXED);
+    }
+}
+#endif
+
+
+// Internal hooks:
+
+
+#ifdef ROUTE_TREE_STATS
+RouteTreeStatsSlot *route_tree_stats_claim_slot(void)
+{
+    const uint32_t slot = __atomic_fetch_add(&stats_slots_used, 1, __ATOMIC_RELAXED);
+    route_tree_stats_slot = slot < ROUTE_TREE_STATS_MAX_THREADS ? &stats_slots[slot] : &stats_slot_overflow;
+
+    return route_tree_stats_slot;
+}
+#endif
+
+
+// Public API:
+
+
+int compressed_route_tree_get_lookup_stats_v4(RouteTreeLookupStats *stats)
+{
+#ifdef ROUTE_TREE_STATS
+    const uint32_t used = __atomic_load_n(&stats_slots_used, __ATOMIC_RELAXED);
+    uint32_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < used && i < ROUTE_TREE_STATS_MAX_THREADS; ++i) {
+        _sum_lookup_stats(stats, &stats_slots[i].v4);
+    }
+    return 0;
+#else
+    (void)stats;
+    return -1;
+#endif
+}
+
+int compressed_route_tree_get_lookup_stats_v6(RouteTreeLookupStats *stats)
+{
+#ifdef ROUTE_TREE_STATS
+    const uint32_t used = __atomic_load_n(&stats_slots_used, __ATOMIC_RELAXED);
+    uint32_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < used && i < ROUTE_TREE_STATS_MAX_THREADS; ++i) {
+        _sum_lookup_stats(stats, &stats_slots[i].v6);
+    }
+    return 0;
+#else
+    (void)stats;
+    return -1;
+#endif
+}
+
+void compressed_route_tree_reset_lookup_stats(void)
+{
+#ifdef ROUTE_TREE_STATS
+    memset(stats_slots, 0, sizeof(stats_slots));
+#endif
+}
+
+void compressed_route_tree_get_depth_stats_v4(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v4,
+                                        uint64_t depth[ROUTE_TREE_STATS_MAX_VISITED])
+{
+    memset(depth, 0, sizeof(*depth) * ROUTE_TREE_STATS_MAX_VISITED);
+
+    if (head_node_v4->first_bit_0) {
+        _depth_stats_v4(pool, head_node_v4->first_bit_0, 0, depth);
+    }
+    if (head_node_v4->first_bit_1) {
+        _depth_stats_v4(pool, head_node_v4->first_bit_1, 0, depth);
+    }
+}
+
+void compressed_route_tree_get_depth_stats_v6(const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                                        uint64_t depth[ROUTE_TREE_STATS_MAX_VISITED])
+{
+    memset(depth, 0, sizeof(*depth) * ROUTE_TREE_STATS_MAX_VISITED);
+
+    if (head_node_v6->first_bit_0) {
+        _depth_stats_v6(pool, head_node_v6->first_bit_0, 0, depth);
+    }
+    if (head_node_v6->first_bit_1) {
+        _depth_stats_v6(pool, head_node_v6->first_bit_1, 0, depth);
+    }
+}
@@ -0,0 +1,402 @@
+#include "route_tree_internal.h"
+
+/*
+ * IPv6 copy of the tree cut at the /64 boundary, for tables whose routes
+ * are nearly all /64 or shorter.
+ *
+ * The copy has the nodes of the tree, on the upper 64 bits of the address
+ * only: a 64-bit key, so a lookup walks it with the single word shifts and
+ * xors of the v4 tree, and 16-byte nodes instead of 32. A node of the tree
+ * crossing bit 64, or ending there with nodes below, becomes a node ending
+ * at bit 64 marked V64_LONG: routes longer than /64 lie below it and a
+ * lookup reaching it walks the tree instead, the tree being the secondary
+ * structure of the few longer routes.
+ *
+ * The two children of a node sit side by side in a pair, found by one
+ * index; a slot of a pair not holding a node has info 0. Nodes reachable by
+ * readers never change: an update copies the pairs on the path to its
+ * prefix, taking the nodes of the tree there and the nodes of the copy off
+ * it, swaps the root and puts the old pairs no longer linked in limbo until
+ * the readers are done with them.
+ */
+
+// key_bit_len of a node is at most 64, the high bit of its byte flags it
+#define V64_LONG 0x80U
+#define V64_INFO_KEY_BIT_LEN(info) ((uint8_t)((info) & 0x7f))
+#define V64_INFO(key_bit_len, next_hop, long_routes) (NODE_INFO(key_bit_len, next_hop) | ((long_routes) ? V64_LONG : 0))
+// pairs whose nodes are linked by the new path, the most an update may keep
+#define V64_MAX_KEPT 512
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct {
+    // left aligned, bits past key_bit_len 0
+    uint64_t key;
+    // pair of the children, 0 if none
+    uint32_t children;
+    uint32_t info;
+} V64Node;
+
+typedef struct {
+    V64Node slot[2];
+} V64Pair;
+
+typedef struct route_tree_v6_64_s {
+    V64Pair *pairs;
+    uint32_t n_pairs;
+    // pair of the nodes of first bit 0 and 1, 0 if none
+    uint32_t root;
+
+    // writer only
+    uint32_t next_pair;
+    uint32_t n_used;
+    // stack of free pair index
+    uint32_t *free;
+    uint32_t n_free;
+    // released pair index, the waiting ones first then the pending ones
+    uint32_t *limbo;
+    uint32_t limbo_waiting;
+    uint32_t limbo_pending;
+    uint64_t limbo_epoch;
+    // old pairs the update links again
+    uint32_t kept[V64_MAX_KEPT];
+    uint32_t n_kept;
+
+    // set by a full copy during an update
+    bool failed;
+} RouteTreeV6Upper;
+
+// upper half of the prefix an update changes, cut to len, at most 64
+typedef struct {
+    uint64_t prefix;
+    uint8_t len;
+} V64Change;
+
+
+static void v64_reclaim(RouteTreeV6Upper *v64)
+{
+    if (v64->limbo_waiting) {
+        if (!route_tree_rcu_grace_period_done(v64->limbo_epoch)) {
+            return;
+        }
+
+        uint32_t i;
+        for (i = 0; i < v64->limbo_waiting; ++i) {
+            v64->free[v64->n_free++] = v64->limbo[i];
+        }
+        memmove(v64->limbo, &v64->limbo[v64->limbo_waiting], sizeof(*v64->limbo) * v64->limbo_pending);
+        v64->limbo_waiting = 0;
+    }
+
+    if (v64->limbo_pending) {
+        v64->limbo_waiting = v64->limbo_pending;
+        v64->limbo_pending = 0;
+        v64->limbo_epoch = route_tree_rcu_start_grace_period();
+    }
+}
+
+static uint32_t v64_alloc(RouteTreeV6Upper *v64)
+{
+    uint32_t pair = 0;
+
+    // the second reclaim frees the pending pairs the first one started waiting
+    if (0 == v64->n_free && v64->next_pair == v64->n_pairs) {
+        v64_reclaim(v64);
+        if (0 == v64->n_free) {
+            v64_reclaim(v64);
+        }
+    }
+
+    if (v64->n_free) {
+        pair = v64->free[--v64->n_free];
+    }
+    else if (v64->next_pair < v64->n_pairs) {
+        pair = v64->next_pair++;
+    }
+    else {
+        v64->failed = true;
+        return 0;
+    }
+
+    memset(&v64->pairs[pair], 0, sizeof(V64Pair));
+    v64->n_used++;
+    return pair;
+}
+
+static void v64_keep(RouteTreeV6Upper *v64, uint32_t pair)
+{
+    if (0 == pair) {
+        return;
+    }
+    if (v64->n_kept == V64_MAX_KEPT) {
+        v64->failed = true;
+        return;
+    }
+    v64->kept[v64->n_kept++] = pair;
+}
+
+static bool v64_kept(const RouteTreeV6Upper *v64, uint32_t pair)
+{
+    uint32_t i;
+    for (i = 0; i < v64->n_kept; ++i) {
+        if (v64->kept[i] == pair) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// old pairs below pair the new copy does not link, to limbo
+static void v64_drop(RouteTreeV6Upper *v64, uint32_t pair)
+{
+    if (0 == pair || v64_kept(v64, pair)) {
+        return;
+    }
+
+    v64->limbo[v64->limbo_waiting + v64->limbo_pending++] = pair;
+    v64->n_used--;
+
+    uint8_t i;
+    for (i = 0; i < 2; ++i) {
+        const V64Node *node = &v64->pairs[pair].slot[i];
+        if (node->info) {
+            v64_drop(v64, node->children);
+        }
+    }
+}
+
+/*
+ * Node of the copy covering bit target of key, walking down from the node
+ * of pair at bit_offset along key; NULL if the walk leaves key first.
+ * *node_pair and *node_offset tell where the node is.
+ */
+static const V64Node *v64_find(const RouteTreeV6Upper *v64, uint32_t pair, uint8_t bit_offset,
+                            uint64_t key, uint8_t target, uint32_t *node_pair, uint8_t *node_offset)
+{
+    while (pair) {
+        const V64Node *node = &v64->pairs[pair].slot[(key << bit_offset) >> 63];
+        const uint8_t key_bit_len = V64_INFO_KEY_BIT_LEN(node->info);
+        if (0 == key_bit_len) {
+            return NULL;
+        }
+
+        const uint64_t diff = (key << bit_offset) ^ node->key;
+        if (bit_offset + key_bit_len > target) {
+            const uint8_t match_len = target - bit_offset;
+            if (match_len && diff >> (64 - match_len)) {
+                return NULL;
+            }
+            *node_pair = pair;
+            *node_offset = bit_offset;
+            return node;
+        }
+        if (diff >> (64 - key_bit_len)) {
+            return NULL;
+        }
+        bit_offset += key_bit_len;
+        pair = node->children;
+    }
+    return NULL;
+}
+
+/*
+ * Write to out the node of the copy for the tree node at index, starting at
+ * bit_offset below prefix. A node of the old copy in the same place is taken
+ * with its children when the change does not go through it and it is the
+ * same; (hint_pair, hint_offset) is a place of the old copy above it.
+ */
+static void v64_copy(RouteTreeV6Upper *v64, const RouteTreePool *pool, V64Node *out, uint32_t index,
+                    RouteTreeU128 prefix, uint8_t bit_offset, uint32_t hint_pair, uint8_t hint_offset,
+                    const V64Change *change)
+{
+    const RouteTreeNodeV6 *node_v6 = route_tree_node_v6(pool, index);
+    const uint8_t end = bit_offset + NODE_KEY_BIT_LEN(node_v6);
+    const uint8_t cut_end = end < 64 ? end : 64;
+    const uint8_t key_bit_len = cut_end - bit_offset;
+    const bool has_children = node_v6->next_bit_0 || node_v6->next_bit_1;
+
+    prefix |= ipv6_to_u128(&node_v6->key) >> bit_offset;
+    const uint64_t prefix_hi = (uint64_t)(prefix >> 64);
+    const uint64_t key = (prefix_hi << bit_offset) & (~0ULL << (64 - key_bit_len));
+    const uint32_t info = V64_INFO(key_bit_len, end <= 64 ? NODE_NEXT_HOP(node_v6) : -1,
+                                end > 64 || (64 == end && has_children));
+
+    const uint8_t match_len = cut_end < change->len ? cut_end : change->len;
+    const bool on_path = bit_offset < change->len && 0 == (prefix_hi ^ change->prefix) >> (64 - match_len);
+
+    uint32_t old_pair = 0;
+    uint8_t old_offset = 0;
+    const V64Node *old = v64_find(v64, hint_pair, hint_offset, prefix_hi, bit_offset, &old_pair, &old_offset);
+    if (old) {
+        const uint8_t skip = bit_offset - old_offset;
+        if (!on_path && V64_INFO_KEY_BIT_LEN(old->info) - skip == key_bit_len && old->key << skip == key
+                && (old->info & ~0x7fU) == (info & ~0x7fU)) {
+            out->key = key;
+            out->children = old->children;
+            out->info = info;
+            v64_keep(v64, old->children);
+            return;
+        }
+        hint_pair = old_pair;
+        hint_offset = old_offset;
+    }
+
+    out->key = key;
+    out->children = 0;
+    out->info = info;
+    if (end >= 64 || !has_children) {
+        return;
+    }
+
+    const uint32_t pair = v64_alloc(v64);
+    if (0 == pair) {
+        return;
+    }
+    if (node_v6->next_bit_0) {
+        v64_copy(v64, pool, &v64->pairs[pair].slot[0], node_v6->next_bit_0, prefix, end, hint_pair, hint_offset, change);
+    }
+    if (node_v6->next_bit_1 && !v64->failed) {
+        v64_copy(v64, pool, &v64->pairs[pair].slot[1], node_v6->next_bit_1, prefix, end, hint_pair, hint_offset, change);
+    }
+    out->children = pair;
+}
+
+// copy the tree again along change, the rest from the old copy, and swap the root
+static int v64_sync(RouteTreeV6Upper *v64, const RouteTreePool *pool, const RouteTreeHeadNode *head_node_v6,
+                    const V64Change *change)
+{
+    const uint32_t old_root = v64->root;
+    uint32_t root = 0;
+
+    v64->n_kept = 0;
+    if (head_node_v6->first_bit_0 || head_node_v6->first_bit_1) {
+        root = v64_alloc(v64);
+        if (0 == root) {
+            return -1;
+        }
+        if (head_node_v6->first_bit_0) {
+            v64_copy(v64, pool, &v64->pairs[root].slot[0], head_node_v6->first_bit_0, 0, 0, old_root, 0, change);
+        }
+        if (head_node_v6->first_bit_1 && !v64->failed) {
+            v64_copy(v64, pool, &v64->pairs[root].slot[1], head_node_v6->first_bit_1, 0, 0, old_root, 0, change);
+        }
+        if (v64->failed) {
+            return -1;
+        }
+    }
+
+    RCU_STORE(v64->root, root);
+    v64_drop(v64, old_root);
+
+    return 0;
+}
+
+
+// Internal hooks:
+
+
+int route_tree_v6_64_lookup(const void *v6_64, const RouteTreeIPV6 *ipv6, uint32_t *next_hop, uint32_t *n_visited)
+{
+    const RouteTreeV6Upper *v64 = v6_64;
+    const uint64_t addr = ipv6->u64[1];
+    uint32_t pair = RCU_LOAD(v64->root);
+    uint8_t bit_offset = 0;
+    int32_t bmp = -1;
+
+    // a node ending at bit 64 has no children, so bit_offset stays below 64 here
+    while (pair) {
+        const V64Node *node = &v64->pairs[pair].slot[(addr << bit_offset) >> 63];
+        const uint32_t info = node->info;
+        const uint8_t key_bit_len = V64_INFO_KEY_BIT_LEN(info);
+
+        (*n_visited)++;
+        if (0 == key_bit_len || ((addr << bit_offset) ^ node->key) >> (64 - key_bit_len)) {
+            break;
+        }
+        if (info & V64_LONG) {
+            return 1;
+        }
+        if (INFO_NEXT_HOP(info) >= 0) {
+            bmp = INFO_NEXT_HOP(info);
+        }
+        bit_offset += key_bit_len;
+        pair = RCU_LOAD(node->children);
+    }
+
+    if (bmp < 0) {
+        return -1;
+    }
+    *next_hop = bmp;
+    return 0;
+}
+
+void route_tree_v6_64_update(void *v6_64, const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                            const RouteTreeIPV6 *ipv6, uint8_t depth_len)
+{
+    RouteTreeV6Upper *v64 = v6_64;
+    V64Change change;
+
+    // the default route stays on the head
+    if (0 == depth_len || v64->failed) {
+        return;
+    }
+
+    change.len = depth_len < 64 ? depth_len : 64;
+    change.prefix = ipv6->u64[1] & (~0ULL << (64 - change.len));
+    if (v64_sync(v64, pool, head_node_v6, &change)) {
+        v64->failed = true;
+        RCU_STORE(head_node_v6->v6_64, NULL);
+    }
+}
+
+void route_tree_v6_64_reclaim(void *v6_64)
+{
+    v64_reclaim(v6_64);
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_get_memory_footprint_v6_64(const size_t n_pairs)
+{
+    return ALIGN_UP(sizeof(RouteTreeV6Upper), 64) + ALIGN_UP(sizeof(V64Pair) * n_pairs, 64) + sizeof(uint32_t) * n_pairs * 2;
+}
+
+int compressed_route_tree_build_v6_64(const RouteTreePool *pool, RouteTreeHeadNode *head_node_v6,
+                                    void * const v6_64_ptr, const size_t n_pairs)
+{
+    if (head_node_v6->v6_64 || n_pairs < 2 || n_pairs > UINT32_MAX) {
+        return -1;
+    }
+
+    RouteTreeV6Upper *v64 = v6_64_ptr;
+    memset(v64, 0, sizeof(*v64));
+    v64->pairs = (V64Pair *)((uintptr_t)v6_64_ptr + ALIGN_UP(sizeof(RouteTreeV6Upper), 64));
+    v64->n_pairs = n_pairs;
+    // pair 0 is no pair
+    v64->next_pair = 1;
+    v64->free = (uint32_t *)((uintptr_t)v64->pairs + ALIGN_UP(sizeof(V64Pair) * n_pairs, 64));
+    v64->limbo = v64->free + n_pairs;
+
+    // no change, no old copy: every node comes from the tree
+    const V64Change change = {0, 0};
+    if (v64_sync(v64, pool, head_node_v6, &change)) {
+        return -1;
+    }
+
+    RCU_STORE(head_node_v6->v6_64, (void *)v64);
+
+    return 0;
+}
+
+void compressed_route_tree_release_v6_64(RouteTreeHeadNode *head_node_v6)
+{
+    RCU_STORE(head_node_v6->v6_64, NULL);
+}
+
+size_t compressed_route_tree_v6_64_used_pair_count(const RouteTreeHeadNode *head_node_v6)
+{
+    const RouteTreeV6Upper *v64 = head_node_v6->v6_64;
+    return v64 ? v64->n_used : 0;
+}
@@ -0,0 +1,222 @@
+#include "route_tree_internal.h"
+
+/*
+ * VRF table: slot vrf_id of the array holds the v4 and v6 heads of the VRF,
+ * each slot on its own cache lines so VRFs updated by different writers do
+ * not share one. Slots of VRFs not created keep empty heads, lookups go
+ * through them without checking whether the VRF is active.
+ */
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+
+static inline const RouteTreeVrf *vrf_slot(const RouteTreeVrfTable *table, uint32_t vrf_id)
+{
+    return vrf_id < table->max_vrfs ? &table->vrfs[vrf_id] : NULL;
+}
+
+static inline RouteTreeVrf *vrf_active(RouteTreeVrfTable *table, uint32_t vrf_id)
+{
+    if (vrf_id >= table->max_vrfs || !table->vrfs[vrf_id].active) {
+        return NULL;
+    }
+    return &table->vrfs[vrf_id];
+}
+
+
+// Public API:
+
+
+size_t compressed_route_tree_vrf_get_memory_footprint(const size_t max_vrfs)
+{
+    // room to align the slots on a cache line
+    return 64 + sizeof(RouteTreeVrf) * max_vrfs;
+}
+
+int compressed_route_tree_vrf_init(RouteTreeVrfTable *table, RouteTreePool *pool, void * const vrfs_ptr, const size_t max_vrfs)
+{
+    size_t i;
+
+    if (0 == max_vrfs || max_vrfs > UINT32_MAX) {
+        return -1;
+    }
+
+    table->pool = pool;
+    table->vrfs = (RouteTreeVrf *)ALIGN_UP((uintptr_t)vrfs_ptr, 64);
+    table->max_vrfs = max_vrfs;
+    table->n_vrfs = 0;
+
+    for (i = 0; i < max_vrfs; ++i) {
+        RouteTreeVrf *vrf = &table->vrfs[i];
+        memset(vrf, 0, sizeof(*vrf));
+        compressed_route_tree_reset_head(&vrf->head_node_v4);
+        compressed_route_tree_reset_head(&vrf->head_node_v6);
+    }
+
+    return 0;
+}
+
+int compressed_route_tree_vrf_create(RouteTreeVrfTable *table, uint32_t vrf_id)
+{
+    if (vrf_id >= table->max_vrfs || table->vrfs[vrf_id].active) {
+        return -1;
+    }
+
+    RouteTreeVrf *vrf = &table->vrfs[vrf_id];
+    compressed_route_tree_reset_head(&vrf->head_node_v4);
+    compressed_route_tree_reset_head(&vrf->head_node_v6);
+    vrf->active = true;
+    table->n_vrfs++;
+
+    return 0;
+}
+
+int compressed_route_tree_vrf_destroy(RouteTreeVrfTable *table, uint32_t vrf_id)
+{
+    RouteTreeVrf *vrf = vrf_active(table, vrf_id);
+
+    if (NULL == vrf) {
+        return -1;
+    }
+
+    // the heads are emptied before their nodes go back to the pool
+    compressed_route_tree_iterate_v4(table->pool, &vrf->head_node_v4, false, true);
+    compressed_route_tree_iterate_v6(table->pool, &vrf->head_node_v6, false, true);
+    vrf->active = false;
+    table->n_vrfs--;
+
+    return 0;
+}
+
+RouteTreeHeadNode *compressed_route_tree_vrf_head_v4(RouteTreeVrfTable *table, uint32_t vrf_id)
+{
+    RouteTreeVrf *vrf = vrf_active(table, vrf_id);
+    return vrf ? &vrf->head_node_v4 : NULL;
+}
+
+RouteTreeHeadNode *compressed_route_tree_vrf_head_v6(RouteTreeVrfTable *table, uint32_t vrf_id)
+{
+    RouteTreeVrf *vrf = vrf_active(table, vrf_id);
+    return vrf ? &vrf->head_node_v6 : NULL;
+}
+
+int compressed_route_tree_vrf_get_usage(const RouteTreeVrfTable *table, uint32_t vrf_id, RouteTreeVrfUsage *usage)
+{
+    const RouteTreeVrf *vrf = vrf_slot(table, vrf_id);
+
+    if (NULL == vrf || !vrf->active) {
+        return -1;
+    }
+
+    usage->routes_v4 = vrf->head_node_v4.total_routes;
+    usage->routes_v6 = vrf->head_node_v6.total_routes;
+    usage->nodes_v4 = vrf->head_node_v4.total_nodes;
+    usage->nodes_v6 = vrf->head_node_v6.total_nodes;
+    usage->memory = sizeof(RouteTreeNodeV4) * usage->nodes_v4
+                    + sizeof(RouteTreeNodeV6) * usage->nodes_v6
+                    + sizeof(*vrf);
+
+    return 0;
+}
+
+int compressed_route_tree_vrf_add_v4(RouteTreeVrfTable *table, uint32_t vrf_id, uint32_t be_ipv4, uint8_t depth_len, uint32_t next_hop)
+{
+    RouteTreeVrf *vrf = vrf_active(table, vrf_id);
+
+    if (NULL == vrf) {
+        return -1;
+    }
+    return compressed_route_tree_add_v4(table->pool, &vrf->head_node_v4, be_ipv4, depth_len, next_hop);
+}
+
+int compressed_route_tree_vrf_add_v6(RouteTreeVrfTable *table, uint32_t vrf_id, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len, uint32_t next_hop)
+{
+    RouteTreeVrf *vrf = vrf_active(table, vrf_id);
+
+    if (NULL == vrf) {
+        return -1;
+    }
+    return compressed_route_tree_add_v6(table->pool, &vrf->head_node_v6, be_ipv6_u8ptr, depth_len, next_hop);
+}
+
+int compressed_route_tree_vrf_del_v4(RouteTreeVrfTable *table, uint32_t vrf_id, uint32_t be_ipv4, uint8_t depth_len)
+{
+    RouteTreeVrf *vrf = vrf_active(table, vrf_id);
+
+    if (NULL == vrf) {
+        return -1;
+    }
+    return compressed_route_tree_del_v4(table->pool, &vrf->head_node_v4, be_ipv4, depth_len);
+}
+
+int compressed_route_tree_vrf_del_v6(RouteTreeVrfTable *table, uint32_t vrf_id, const uint8_t *be_ipv6_u8ptr, uint8_t depth_len)
+{
+    RouteTreeVrf *vrf = vrf_active(table, vrf_id);
+
+    if (NULL == vrf) {
+        return -1;
+    }
+    return compressed_route_tree_del_v6(table->pool, &vrf->head_node_v6, be_ipv6_u8ptr, depth_len);
+}
+
+int compressed_route_tree_vrf_lookup_v4(const RouteTreeVrfTable *table, uint32_t vrf_id, uint32_t be_ipv4, uint32_t *next_hop)
+{
+    const RouteTreeVrf *vrf = vrf_slot(table, vrf_id);
+
+    if (NULL == vrf) {
+        return -1;
+    }
+    return compressed_route_tree_lookup_v4(table->pool, &vrf->head_node_v4, be_ipv4, next_hop);
+}
+
+int compressed_route_tree_vrf_lookup_v6(const RouteTreeVrfTable *table, uint32_t vrf_id, const uint8_t *be_ipv6_u8ptr, uint32_t *next_hop)
+{
+    const RouteTreeVrf *vrf = vrf_slot(table, vrf_id);
+
+    if (NULL == vrf) {
+        return -1;
+    }
+    return compressed_route_tree_lookup_v6(table->pool, &vrf->head_node_v6, be_ipv6_u8ptr, next_hop);
+}
+
+size_t compressed_route_tree_vrf_lookup_bulk_v4(const RouteTreeVrfTable *table, const uint32_t *vrf_ids,
+                                            const uint32_t *be_ipv4, size_t n,
+                                            uint32_t *next_hop, uint64_t *hit_mask)
+{
+    const RouteTreeHeadNode *head_nodes[64];
+    size_t hits = 0;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < n; i += 64) {
+        const size_t lanes = (n - i) < 64 ? (n - i) : 64;
+        for (j = 0; j < lanes; ++j) {
+            const RouteTreeVrf *vrf = vrf_slot(table, vrf_ids[i + j]);
+            head_nodes[j] = vrf ? &vrf->head_node_v4 : NULL;
+        }
+        hits += route_tree_lookup_bulk_heads_v4(table->pool, head_nodes, &be_ipv4[i], lanes, &next_hop[i], &hit_mask[i / 64]);
+    }
+
+    return hits;
+}
+
+size_t compressed_route_tree_vrf_lookup_bulk_v6(const RouteTreeVrfTable *table, const uint32_t *vrf_ids,
+                                            const uint8_t * const *be_ipv6_u8ptr, size_t n,
+                                            uint32_t *next_hop, uint64_t *hit_mask)
+{
+    const RouteTreeHeadNode *head_nodes[64];
+    size_t hits = 0;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < n; i += 64) {
+        const size_t lanes = (n - i) < 64 ? (n - i) : 64;
+        for (j = 0; j < lanes; ++j) {
+            const RouteTreeVrf *vrf = vrf_slot(table, vrf_ids[i + j]);
+            head_nodes[j] = vrf ? &vrf->head_node_v6 : NULL;
+        }
+        hits += route_tree_lookup_bulk_heads_v6(table->pool, head_nodes, &be_ipv6_u8ptr[i], lanes, &next_hop[i], &hit_mask[i / 64]);
+    }
+
+    return hits;
+}